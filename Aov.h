@@ -0,0 +1,176 @@
+/* KwanTrace - C++ Ray Tracing Library
+Copyright (C) 2021 by kwan3217
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef KWANTRACE_AOV_H
+#define KWANTRACE_AOV_H
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+namespace kwantrace {
+  /** Arbitrary output variables of a render: what the camera ray of each pixel hit, and how long it took,
+   * filled in by Scene::render(AovFrame&) in the same pass as the image, rather than by rendering again
+   * with debugging shaders. Each variable is a plane of its own, rows top to bottom.
+   *
+   *     AovFrame aovs(width,height);
+   *     auto pixbuf=scene.render(aovs);
+   *     aovs.write("layers.exr");
+   *     aovs.writeHeatmap("cost.png");
+   *
+   * The cost of a pixel is the time spent tracing and shading its camera ray, including every shadow,
+   * reflected, and refracted ray it spawns, in ticks of the processor timestamp counter, or nanoseconds on processors
+   * which don't have one. The counter is read twice per pixel, which costs far less than tracing the ray. The cost
+   * is only comparable between pixels of the same render, and is noisy from pixel to pixel, but shows at a glance
+   * which objects and shaders the render spends its time on, especially as a heatmap.
+   */
+  class AovFrame {
+  private:
+    int _width;  ///< Width in pixels
+    int _height; ///< Height in pixels
+  public:
+    std::vector<float> color;          ///< Color of the camera ray, not clamped or tone mapped, three per pixel
+    std::vector<float> depth;          ///< Distance along the camera ray to the hit, or infinity if the ray missed
+    std::vector<float> normal;         ///< World space surface normal at the hit, on the side facing the camera, three per pixel, or zero if the ray missed
+    std::vector<float> albedo;         ///< Pigment color at the hit before shading, three per pixel, or zero if the ray missed or the surface has no pigment
+    std::vector<uint32_t> objectId;    ///< One more than the index of the top level object hit, in the order added to the scene, or zero if the ray missed
+    std::vector<uint32_t> primitiveId; ///< One more than the index of the Primitive hit, in the order of Renderable::collectPrimitives(), or zero if the ray missed
+    std::vector<float> cost;           ///< Time spent on the pixel, see ticks()
+    /** Construct a frame with every pixel missed
+     * @param Lwidth Width in pixels
+     * @param Lheight Height in pixels
+     */
+    AovFrame(int Lwidth, int Lheight):_width(Lwidth),_height(Lheight) {
+      size_t n=size_t(_width)*_height;
+      color.resize(3*n);
+      depth.resize(n);
+      normal.resize(3*n);
+      albedo.resize(3*n);
+      objectId.resize(n);
+      primitiveId.resize(n);
+      cost.resize(n);
+      clear();
+    }
+    int width() const {return _width;}   ///< Get width @return Width in pixels
+    int height() const {return _height;} ///< Get height @return Height in pixels
+    /** Mark every pixel as missed, with no cost */
+    void clear() {
+      std::fill(color.begin(),color.end(),0.0f);
+      std::fill(depth.begin(),depth.end(),std::numeric_limits<float>::infinity());
+      std::fill(normal.begin(),normal.end(),0.0f);
+      std::fill(albedo.begin(),albedo.end(),0.0f);
+      std::fill(objectId.begin(),objectId.end(),0u);
+      std::fill(primitiveId.begin(),primitiveId.end(),0u);
+      std::fill(cost.begin(),cost.end(),0.0f);
+    }
+    /** Read the clock used for cost
+     * @return Processor timestamp counter on x86, or nanoseconds of the steady clock elsewhere
+     */
+    static uint64_t ticks() {
+#if defined(__x86_64__) || defined(__i386__)
+      return __rdtsc();
+#else
+      return uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+#endif
+    }
+    /** Store the variables of one pixel
+     * @param col Column
+     * @param row Row
+     * @param Lcolor Color of the camera ray
+     * @param guide Features of the surface hit, from Scene::renderCameraRay()
+     * @param LobjectId Object ID, or zero for a miss
+     * @param LprimitiveId Primitive ID, or zero for a miss
+     * @param Lcost Time spent on the pixel, in ticks()
+     */
+    void set(int col, int row, const RayColor& Lcolor, const GuideSample& guide, uint32_t LobjectId, uint32_t LprimitiveId, uint64_t Lcost) {
+      size_t i=size_t(row)*_width+col;
+      for(int c=0;c<3;c++) {
+        color[3*i+c]=float(Lcolor[c]);
+        normal[3*i+c]=float(guide.normal[c]);
+        albedo[3*i+c]=float(guide.albedo[c]);
+      }
+      depth[i]=LprimitiveId?float(guide.depth):std::numeric_limits<float>::infinity();
+      objectId[i]=LobjectId;
+      primitiveId[i]=LprimitiveId;
+      cost[i]=float(Lcost);
+    }
+    /** Convert the cost to a false color image, running from black for the cheapest pixels through blue, red,
+     * and yellow to white for the most expensive. The scale is set by the 99th percentile of cost rather than the
+     * highest, so that a few slow pixels don't leave the rest of the image black.
+     * @return Pixels, three 8-bit channels each, rows top to bottom
+     */
+    std::vector<uint8_t> heatmap() const {
+      std::vector<uint8_t> result(cost.size()*3);
+      if(cost.empty()) return result;
+      std::vector<float> sorted(cost);
+      size_t k=std::min(sorted.size()-1,sorted.size()*99/100);
+      std::nth_element(sorted.begin(),sorted.begin()+k,sorted.end());
+      float scale=sorted[k]>0?sorted[k]:1.0f;
+      static const float ramp[5][3]={{0,0,0},{0,0,1},{1,0,0},{1,1,0},{1,1,1}};
+      for(size_t i=0;i<cost.size();i++) {
+        float v=std::clamp(cost[i]/scale,0.0f,1.0f)*4;
+        int j=std::min(int(v),3);
+        float f=v-j;
+        for(int c=0;c<3;c++) result[3*i+c]=uint8_t((ramp[j][c]*(1-f)+ramp[j+1][c]*f)*255+0.5f);
+      }
+      return result;
+    }
+    /** Write the cost heatmap to an image file
+     * @param filename Name of file, with the format picked from the extension, see ImageFile
+     * @param threads Number of threads to compress with, or 0 to use all hardware threads
+     */
+    void writeHeatmap(const std::string& filename, int threads=0) const {
+      std::vector<uint8_t> pixels=heatmap();
+      ImageFile::write(filename,_width,_height,3,Observer<uint8_t>(pixels.data()),threads);
+    }
+    /** Write every variable as a layer of one OpenEXR file. The color is channels `R`, `G`, and `B`, so
+     * it is what a viewer shows first, and the rest are `Z` for depth, `N.X`, `N.Y`, and `N.Z` for the normal,
+     * `albedo.R`, `albedo.G`, and `albedo.B`, `id.object` and `id.primitive` as 32-bit integers, and `cost`.
+     * Depth and cost are full 32-bit floats, the rest half floats.
+     * @param filename Name of file
+     * @param threads Number of threads to compress with, or 0 to use all hardware threads
+     */
+    void write(const std::string& filename, int threads=0) const {
+      using Type=ExrChannel::Type;
+      std::vector<ExrChannel> channels;
+      auto plane=[&](const std::string& name, Type type, Observer<float> values, size_t stride) {
+        channels.push_back({name,type,values,nullptr,stride});
+      };
+      for(int c=0;c<3;c++) {
+        plane(std::string(1,"RGB"[c]),Type::Half,color.data()+c,3);
+        plane(std::string("N.")+"XYZ"[c],Type::Half,normal.data()+c,3);
+        plane(std::string("albedo.")+"RGB"[c],Type::Half,albedo.data()+c,3);
+      }
+      plane("Z",Type::Float,depth.data(),1);
+      plane("cost",Type::Float,cost.data(),1);
+      channels.push_back({"id.object",Type::Uint,nullptr,objectId.data(),1});
+      channels.push_back({"id.primitive",Type::Uint,nullptr,primitiveId.data(),1});
+      ImageFile::writeEXR(filename,_width,_height,channels,threads);
+    }
+  };
+}
+
+#endif //KWANTRACE_AOV_H
@@ -0,0 +1,405 @@
+/* KwanTrace - C++ Ray Tracing Library
+Copyright (C) 2021 by kwan3217
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef KWANTRACE_AREALIGHT_H
+#define KWANTRACE_AREALIGHT_H
+
+#include <random>
+
+namespace kwantrace {
+  /** Light with a size, which casts soft shadows. This is like the POV-Ray `area_light`. The
+   * surface of the light is covered with a size by size grid of sample points, each jittered
+   * within its own cell, and the visible amount is the fraction of sample points that can be seen.
+   *
+   * With adaptive sampling on, only the four corners of the grid are tested at first. If they
+   * all agree, the point is taken to be either fully lit or fully shadowed, and the other points
+   * aren't tested. Otherwise the grid is split into four quarters, and each quarter is tested the
+   * same way, sharing the rays on their common corners, down to single cells. So
+   * rays are only spent in the penumbra, and everywhere else costs four shadow rays.
+   * In fully shadowed regions, most of those are caught by the last-occluder cache, see Light::blocked().
+   * Grid sizes of \f$2^n+1\f$ split most evenly.
+   *
+   * As with POV-Ray, adaptive sampling can miss a shadow which is small enough to fall between
+   * the corners. Turn it off if that matters.
+   *
+   * The light is still treated as a point at location for the purpose of shading, so
+   * only the shadow is soft.
+   */
+  class AreaLight: public Light {
+  private:
+    /** Get the visibility of one grid point, casting its ray if it hasn't been already
+     * @param blocker All objects in a scene that might block this light
+     * @param r0 Point being lit
+     * @param memo Visibility of each grid point already tested, -1 if not tested yet
+     * @param i Grid column
+     * @param j Grid row
+     * @param time Time within the shutter interval to test at
+     * @return 1 if the grid point is visible, 0 if not
+     */
+    int visible(const Renderable& blocker, const Position& r0, std::vector<int8_t>& memo, int i, int j, double time) {
+      int8_t& result=memo[size_t(j)*size+i];
+      if(result<0) {
+        thread_local std::minstd_rand rng;
+        std::uniform_real_distribution<double> uniform(-0.5,0.5);
+        double du=jitter?uniform(rng):0, dv=jitter?uniform(rng):0;
+        Position p=samplePoint((i+0.5+du)/size,(j+0.5+dv)/size,r0);
+        result=blocked(blocker,Ray(r0,Direction(p-r0),time)+initialDist)?0:1;
+      }
+      return result;
+    }
+    /** Find the visible fraction of a rectangle of the grid, refining where the corners disagree
+     * @param blocker All objects in a scene that might block this light
+     * @param r0 Point being lit
+     * @param memo Visibility of each grid point already tested
+     * @param i0 Left column
+     * @param j0 Top row
+     * @param i1 Right column, inclusive
+     * @param j1 Bottom row, inclusive
+     * @param time Time within the shutter interval to test at
+     * @return Visible fraction of this part of the grid
+     */
+    double region(const Renderable& blocker, const Position& r0, std::vector<int8_t>& memo, int i0, int j0, int i1, int j1, double time) {
+      int a=visible(blocker,r0,memo,i0,j0,time), b=visible(blocker,r0,memo,i1,j0,time);
+      int c=visible(blocker,r0,memo,i0,j1,time), d=visible(blocker,r0,memo,i1,j1,time);
+      if((a==b && b==c && c==d) || (i1-i0<=1 && j1-j0<=1)) return (a+b+c+d)/4.0;
+      int im=(i0+i1)/2, jm=(j0+j1)/2;
+      if(i1-i0<=1) return (region(blocker,r0,memo,i0,j0,i1,jm,time)+region(blocker,r0,memo,i0,jm,i1,j1,time))/2;
+      if(j1-j0<=1) return (region(blocker,r0,memo,i0,j0,im,j1,time)+region(blocker,r0,memo,im,j0,i1,j1,time))/2;
+      return (region(blocker,r0,memo,i0,j0,im,jm,time)+region(blocker,r0,memo,im,j0,i1,jm,time)+
+              region(blocker,r0,memo,i0,jm,im,j1,time)+region(blocker,r0,memo,im,jm,i1,j1,time))/4;
+    }
+  protected:
+    /** Map a point in the unit square to a point on the surface of the light
+     * @param u Horizontal coordinate, from 0 to 1
+     * @param v Vertical coordinate, from 0 to 1
+     * @param r0 Point being lit, for lights whose visible shape depends on where they are seen from
+     * @return Point on the light in world coordinates
+     */
+    virtual Position samplePoint(double u, double v, const Position& r0) const=0;
+    /** Map a point in the unit square to a point in the unit disc, keeping areas in proportion
+     * so that stratified samples in the square stay stratified in the disc. This is the concentric
+     * map of Shirley and Chiu.
+     * @param u Horizontal coordinate, from 0 to 1
+     * @param v Vertical coordinate, from 0 to 1
+     * @return Point in the unit disc, as x and y
+     */
+    static Eigen::Vector2d concentricDisc(double u, double v) {
+      double a=2*u-1, b=2*v-1;
+      if(a==0 && b==0) return Eigen::Vector2d::Zero();
+      double r, phi;
+      if(std::abs(a)>std::abs(b)) {
+        r=a;
+        phi=(pi/4)*(b/a);
+      } else {
+        r=b;
+        phi=(pi/2)-(pi/4)*(a/b);
+      }
+      return Eigen::Vector2d(r*std::cos(phi),r*std::sin(phi));
+    }
+    /** Find two unit vectors perpendicular to a direction and each other
+     * @param[in] n Direction, must be normalized
+     * @param[out] a First perpendicular
+     * @param[out] b Second perpendicular
+     */
+    static void basis(const Eigen::Vector3d& n, Eigen::Vector3d& a, Eigen::Vector3d& b) {
+      a=(std::abs(n.x())<0.9?Eigen::Vector3d::UnitX():Eigen::Vector3d::UnitY()).cross(n).normalized();
+      b=n.cross(a);
+    }
+    /** Convert a probability density over the area of a flat light to one over solid angle
+     * as seen from a point
+     * @param area Area of the light
+     * @param n Normal of the light
+     * @param dir Unit vector from the point to the light
+     * @param dist Distance from the point to the light
+     * @return Probability density in solid angle, or 0 if the light is seen exactly edge-on
+     */
+    static double areaToSolidAngle(double area, const Eigen::Vector3d& n, const Direction& dir, double dist) {
+      double cosLight=std::abs(n.dot(dir));
+      if(cosLight<=0) return 0;
+      return dist*dist/(area*cosLight);
+    }
+  public:
+    int size;           ///< Number of sample points along each side of the grid
+    bool adaptive=true; ///< If true, only test grid points where the shadow edge is. If false, test them all.
+    bool jitter=true;   ///< If true, each sample point is moved randomly within its grid cell
+    /** Construct an area light
+     * @param Llocation Center of light
+     * @param Lcolor Color of light
+     * @param Lsize Number of sample points along each side of the grid
+     */
+    AreaLight(const Position& Llocation, const ObjectColor& Lcolor, int Lsize):Light(Llocation,Lcolor),size(std::max(Lsize,1)) {}
+    /** Construct an area light with one sample point, for reading from a scene file */
+    AreaLight():size(1) {}
+    /** \copydoc Light::write() */
+    virtual void write(SceneWriter& out) const override {
+      Light::write(out);
+      out.put(int32_t(size));
+      out.put(adaptive);
+      out.put(jitter);
+    }
+    /** \copydoc Light::read() */
+    virtual void read(SceneReader& in) override {
+      Light::read(in);
+      int32_t Lsize;
+      in.get(Lsize);
+      size=std::max(int(Lsize),1);
+      in.get(adaptive);
+      in.get(jitter);
+    }
+    /** Calculate the amount of this light which is visible, as the fraction of sample points
+     * on the light which are not blocked.
+     * @param blocker All objects in a scene that might block this light
+     * @param r Ray from intersection point to light center, as from rayTo()
+     * @return Fraction of this light seen at the original point
+     */
+    virtual double amountVisible(const Renderable& blocker, const Ray& r) override {
+      Position r0=r(-initialDist);
+      thread_local std::vector<int8_t> memo;
+      memo.assign(size_t(size)*size,-1);
+      if(adaptive) return region(blocker,r0,memo,0,0,size-1,size-1,r.time);
+      int total=0;
+      for(int j=0;j<size;j++) for(int i=0;i<size;i++) total+=visible(blocker,r0,memo,i,j,r.time);
+      return double(total)/(size*size);
+    }
+    /** Intersect a ray with the surface of the light. This is used by the PathTracer, where
+     * an area light is a surface which glows with a radiance equal to its color and can be
+     * hit by rays bouncing around the scene. Flat lights glow from both sides.
+     * @param[in] ray Ray in world space
+     * @param[out] t Ray parameter of the nearest hit with t>0, if any
+     * @return True if the ray hits the light
+     */
+    virtual bool intersectSurface(const Ray& ray, double& t) const=0;
+    /** Pick a random direction from a point towards the light, for the PathTracer.
+     * @param[in] r0 Point being lit
+     * @param[in] u Uniform random number from 0 to 1
+     * @param[in] v Another uniform random number from 0 to 1
+     * @param[out] dir Unit vector towards the picked point on the light
+     * @param[out] dist Distance to the picked point
+     * @return Probability density of picking this direction, over solid angle. Zero if no direction could be picked.
+     */
+    virtual double sampleDirection(const Position& r0, double u, double v, Direction& dir, double& dist) const=0;
+    /** Find the probability density that sampleDirection() would pick a given direction, for weighting
+     * a ray which hit the light some other way.
+     * @param r0 Point the ray started from
+     * @param dir Unit vector of ray
+     * @param dist Distance along the ray to where it hit the light
+     * @return Probability density over solid angle
+     */
+    virtual double pdfDirection(const Position& r0, const Direction& dir, double dist) const=0;
+  };
+
+  /** Rectangular area light, like POV-Ray `area_light <axis1>, <axis2>, size, size` */
+  class RectangleLight: public AreaLight {
+  protected:
+    /** \copydoc AreaLight::samplePoint() */
+    virtual Position samplePoint(double u, double v, const Position&) const override {
+      return Position(location+(u-0.5)*axis1+(v-0.5)*axis2);
+    }
+  public:
+    Direction axis1; ///< Vector along one full side of the rectangle
+    Direction axis2; ///< Vector along the other full side of the rectangle
+    /** Construct a rectangular light
+     * @param Llocation Center of rectangle
+     * @param Lcolor Color of light
+     * @param Laxis1 Vector along one full side of the rectangle
+     * @param Laxis2 Vector along the other full side of the rectangle
+     * @param Lsize Number of sample points along each side of the grid
+     */
+    RectangleLight(const Position& Llocation, const ObjectColor& Lcolor, const Direction& Laxis1, const Direction& Laxis2, int Lsize=9):
+      AreaLight(Llocation,Lcolor,Lsize),axis1(Laxis1),axis2(Laxis2) {}
+    /** Construct a rectangular light of no size, for reading from a scene file */
+    RectangleLight():axis1(0,0,0),axis2(0,0,0) {}
+    /** \copydoc Light::write() */
+    virtual void write(SceneWriter& out) const override {
+      AreaLight::write(out);
+      out.put(axis1);
+      out.put(axis2);
+    }
+    /** \copydoc Light::read() */
+    virtual void read(SceneReader& in) override {
+      AreaLight::read(in);
+      in.get(axis1);
+      in.get(axis2);
+    }
+    /** \copydoc AreaLight::intersectSurface() */
+    virtual bool intersectSurface(const Ray& ray, double& t) const override {
+      Eigen::Vector3d n=axis1.cross(axis2);
+      double denom=n.dot(ray.v);
+      if(denom==0) return false;
+      t=n.dot(location-ray.r0)/denom;
+      if(t<=0) return false;
+      Eigen::Vector3d d=ray(t)-location;
+      return std::abs(d.dot(axis1))<=axis1.squaredNorm()/2 && std::abs(d.dot(axis2))<=axis2.squaredNorm()/2;
+    }
+    /** \copydoc AreaLight::sampleDirection() */
+    virtual double sampleDirection(const Position& r0, double u, double v, Direction& dir, double& dist) const override {
+      Eigen::Vector3d d=samplePoint(u,v,r0)-r0;
+      dist=d.norm();
+      dir=Direction(d/dist);
+      return pdfDirection(r0,dir,dist);
+    }
+    /** \copydoc AreaLight::pdfDirection() */
+    virtual double pdfDirection(const Position&, const Direction& dir, double dist) const override {
+      Eigen::Vector3d n=axis1.cross(axis2);
+      return areaToSolidAngle(n.norm(),n.normalized(),dir,dist);
+    }
+  };
+
+  /** Flat circular area light */
+  class DiscLight: public AreaLight {
+  private:
+    Eigen::Vector3d a; ///< Unit vector in the plane of the disc
+    Eigen::Vector3d b; ///< Unit vector in the plane of the disc, perpendicular to a
+  protected:
+    /** \copydoc AreaLight::samplePoint() */
+    virtual Position samplePoint(double u, double v, const Position&) const override {
+      Eigen::Vector2d d=radius*concentricDisc(u,v);
+      return Position(location+d.x()*a+d.y()*b);
+    }
+  public:
+    double radius; ///< Radius of the disc
+    /** Construct a disc light
+     * @param Llocation Center of disc
+     * @param Lcolor Color of light
+     * @param Lnormal Vector perpendicular to the disc, need not be normalized
+     * @param Lradius Radius of the disc
+     * @param Lsize Number of sample points along each side of the grid
+     */
+    DiscLight(const Position& Llocation, const ObjectColor& Lcolor, const Direction& Lnormal, double Lradius, int Lsize=9):
+      AreaLight(Llocation,Lcolor,Lsize),radius(Lradius) {
+      basis(Lnormal.normalized(),a,b);
+    }
+    /** Construct a disc light of no size, for reading from a scene file */
+    DiscLight():a(Eigen::Vector3d::UnitX()),b(Eigen::Vector3d::UnitY()),radius(0) {}
+    /** \copydoc Light::write() */
+    virtual void write(SceneWriter& out) const override {
+      AreaLight::write(out);
+      out.put(a);
+      out.put(b);
+      out.put(radius);
+    }
+    /** \copydoc Light::read() */
+    virtual void read(SceneReader& in) override {
+      AreaLight::read(in);
+      in.get(a);
+      in.get(b);
+      in.get(radius);
+    }
+    /** \copydoc AreaLight::intersectSurface() */
+    virtual bool intersectSurface(const Ray& ray, double& t) const override {
+      Eigen::Vector3d n=a.cross(b);
+      double denom=n.dot(ray.v);
+      if(denom==0) return false;
+      t=n.dot(location-ray.r0)/denom;
+      return t>0 && (ray(t)-location).squaredNorm()<=radius*radius;
+    }
+    /** \copydoc AreaLight::sampleDirection() */
+    virtual double sampleDirection(const Position& r0, double u, double v, Direction& dir, double& dist) const override {
+      Eigen::Vector3d d=samplePoint(u,v,r0)-r0;
+      dist=d.norm();
+      dir=Direction(d/dist);
+      return pdfDirection(r0,dir,dist);
+    }
+    /** \copydoc AreaLight::pdfDirection() */
+    virtual double pdfDirection(const Position&, const Direction& dir, double dist) const override {
+      return areaToSolidAngle(pi*radius*radius,a.cross(b),dir,dist);
+    }
+  };
+
+  /** Spherical area light. From any point outside it, a sphere looks like a disc facing
+   * that point, so it is sampled as a disc of the same radius perpendicular to the line
+   * to its center. This is exact for distant points, and close enough for near ones.
+   */
+  class SphereLight: public AreaLight {
+  protected:
+    /** \copydoc AreaLight::samplePoint() */
+    virtual Position samplePoint(double u, double v, const Position& r0) const override {
+      Eigen::Vector3d a, b;
+      basis((location-r0).normalized(),a,b);
+      Eigen::Vector2d d=radius*concentricDisc(u,v);
+      return Position(location+d.x()*a+d.y()*b);
+    }
+  public:
+    double radius; ///< Radius of the sphere
+    /** Construct a sphere light
+     * @param Llocation Center of sphere
+     * @param Lcolor Color of light
+     * @param Lradius Radius of the sphere
+     * @param Lsize Number of sample points along each side of the grid
+     */
+    SphereLight(const Position& Llocation, const ObjectColor& Lcolor, double Lradius, int Lsize=9):
+      AreaLight(Llocation,Lcolor,Lsize),radius(Lradius) {}
+    /** Construct a spherical light of no size, for reading from a scene file */
+    SphereLight():radius(0) {}
+    /** \copydoc Light::write() */
+    virtual void write(SceneWriter& out) const override {
+      AreaLight::write(out);
+      out.put(radius);
+    }
+    /** \copydoc Light::read() */
+    virtual void read(SceneReader& in) override {
+      AreaLight::read(in);
+      in.get(radius);
+    }
+    /** \copydoc AreaLight::intersectSurface() */
+    virtual bool intersectSurface(const Ray& ray, double& t) const override {
+      Eigen::Vector3d oc=ray.r0-location;
+      double a=ray.v.squaredNorm();
+      double b=oc.dot(ray.v);
+      double c=oc.squaredNorm()-radius*radius;
+      double d=b*b-a*c;
+      if(d<0) return false;
+      double sq=std::sqrt(d);
+      t=(-b-sq)/a;
+      if(t<=0) t=(-b+sq)/a;
+      return t>0;
+    }
+    /** \copydoc AreaLight::sampleDirection()
+     *
+     * The sphere is sampled over the cone of directions that it fills as seen from the point,
+     * which is exact for a sphere at any distance. Points inside the sphere can't be sampled.
+     */
+    virtual double sampleDirection(const Position& r0, double u, double v, Direction& dir, double& dist) const override {
+      Eigen::Vector3d toCenter=location-r0;
+      double d2=toCenter.squaredNorm();
+      if(d2<=radius*radius) return 0;
+      double cosMax=std::sqrt(1-radius*radius/d2);
+      double cosTheta=1-u*(1-cosMax);
+      double sinTheta=std::sqrt(std::max(0.0,1-cosTheta*cosTheta));
+      double phi=2*pi*v;
+      Eigen::Vector3d w=toCenter/std::sqrt(d2), a, b;
+      basis(w,a,b);
+      dir=Direction(cosTheta*w+sinTheta*(std::cos(phi)*a+std::sin(phi)*b));
+      //Distance to the near side of the sphere along this direction
+      double proj=toCenter.dot(dir);
+      dist=proj-std::sqrt(std::max(0.0,radius*radius-(d2-proj*proj)));
+      return 1/(2*pi*(1-cosMax));
+    }
+    /** \copydoc AreaLight::pdfDirection() */
+    virtual double pdfDirection(const Position& r0, const Direction&, double) const override {
+      double d2=(location-r0).squaredNorm();
+      if(d2<=radius*radius) return 0;
+      return 1/(2*pi*(1-std::sqrt(1-radius*radius/d2)));
+    }
+  };
+  inline const bool rectangleLightRegistered=SceneTypes::add<RectangleLight>("RectangleLight"); ///< Lets rectangular lights be saved in scene files
+  inline const bool discLightRegistered=SceneTypes::add<DiscLight>("DiscLight"); ///< Lets disc lights be saved in scene files
+  inline const bool sphereLightRegistered=SceneTypes::add<SphereLight>("SphereLight"); ///< Lets spherical lights be saved in scene files
+}
+
+#endif //KWANTRACE_AREALIGHT_H
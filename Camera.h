@@ -41,13 +41,47 @@ namespace kwantrace {
     /** Create a ray in world space. This is done by
      * having a subclass create a ray in local space, then using
      * \f$[\mathbf{M}_{rb}]\f$ to transform the ray to world space.
+     * If the camera has keyframes, it is transformed with MwbAt() the time of the ray, so the camera
+     * moves over the shutter interval just like any other object.
      *
      * @param x horizontal camera plane coordinate, from -0.5 on the left to 0.5 on the right
      * @param y vertical camera plane coordinate, from -0.5 on top to 0.5 on bottom.
-     * @return Ray in world coordinates
+     * @param time Time within the shutter interval, from 0 at shutter open to 1 at shutter close
+     * @return Ray in world coordinates, at the given time
      */
-    Ray project(double x, double y) const {
-      return Mwb * projectLocal(x, y);
+    Ray project(double x, double y, double time=0) const {
+      Ray result=MwbAt(time) * projectLocal(x, y);
+      result.time=time;
+      return result;
+    }
+    /** Create a row of rays in world space at time zero, evenly spaced in x. This is the same as calling
+     * project() for each ray, but subclasses can override it to do much less work per ray.
+     *
+     * @param x Horizontal camera plane coordinate of first ray
+     * @param y Vertical camera plane coordinate of all rays
+     * @param dx Spacing between rays in horizontal camera plane coordinate
+     * @param count Number of rays
+     * @param batch Batch to write rays to. It is made bigger if needed.
+     * @param offset Index in batch to write first ray to
+     */
+    virtual void projectBatch(double x, double y, double dx, int count, RayBatch& batch, size_t offset=0) const {
+      if(batch.size()<offset+count) batch.resize(offset+count);
+      for(int i=0;i<count;i++) batch.set(offset+i,project(x+dx*i,y));
+    }
+    /** Create a tile of rays in world space at time zero, on an evenly spaced grid. Rays are stored
+     * row by row, so ray (col,row) is at index row*cols+col.
+     *
+     * @param x Horizontal camera plane coordinate of top left ray
+     * @param y Vertical camera plane coordinate of top left ray
+     * @param dx Spacing between columns in horizontal camera plane coordinate
+     * @param dy Spacing between rows in vertical camera plane coordinate
+     * @param cols Number of columns
+     * @param rows Number of rows
+     * @param batch Batch to write rays to. It is resized to hold exactly the tile.
+     */
+    void projectTile(double x, double y, double dx, double dy, int cols, int rows, RayBatch& batch) const {
+      batch.resize(size_t(cols)*rows);
+      for(int row=0;row<rows;row++) projectBatch(x,y+dy*row,dx,cols,batch,size_t(row)*cols);
     }
   };
 }
@@ -0,0 +1,258 @@
+/* KwanTrace - C++ Ray Tracing Library
+Copyright (C) 2021 by kwan3217
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef KWANTRACE_CHECKPOINT_H
+#define KWANTRACE_CHECKPOINT_H
+
+#include <algorithm>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+namespace kwantrace {
+  /** Append-only record of which units of work are finished, such as the tiles of an image or the frames of
+   * an animation, so that a render which is killed can pick up where it left off. The journal starts with a key,
+   * usually a Fingerprint of the scene, and the number of units. If an existing journal has a different key
+   * or number of units, it belongs to some other render, and is started over.
+   *
+   * Each finished unit is appended as its own small record and flushed at once, so killing the process at any point
+   * loses at most the unit in progress. A record cut off partway by the kill is ignored on the next run and
+   * trimmed off the end of the file, so that the records appended after it stay aligned.
+   * All methods may be called from any thread.
+   */
+  class RenderJournal {
+  private:
+    std::string filename;       ///< Name of journal file
+    uint64_t key;               ///< Fingerprint of the render, written at the start of the journal
+    std::ofstream out;          ///< Journal file, open for appending records
+    std::vector<bool> finished; ///< Whether each unit is finished
+    size_t finishedCount=0;     ///< Number of units finished
+    bool _resumed=false;        ///< True if finished units were read from an existing journal
+    mutable std::mutex mutex;   ///< Guards everything above
+    /** Write a new journal with no units finished, replacing any journal already in the file
+     * @throws std::runtime_error if the journal can't be written
+     */
+    void start() {
+      out.open(filename,std::ios::binary|std::ios::trunc);
+      out.write("KWJRN001",8);
+      uint64_t header[2]={key,finished.size()};
+      out.write(reinterpret_cast<const char*>(header),sizeof(header));
+      out.flush();
+      if(!out) throw std::runtime_error("Can't write render journal "+filename);
+    }
+  public:
+    /** Open a journal, reading the finished units from it if it belongs to the same render
+     * @param Lfilename Name of journal file
+     * @param Lkey Fingerprint of the render. A journal written with any other key is started over.
+     * @param units Number of units of work
+     * @throws std::runtime_error if the journal can't be written
+     */
+    RenderJournal(const std::string& Lfilename, uint64_t Lkey, size_t units):filename(Lfilename),key(Lkey),finished(units,false) {
+      std::ifstream in(filename,std::ios::binary);
+      char magic[8];
+      uint64_t header[2];
+      if(in.read(magic,8) && std::string(magic,8)=="KWJRN001" && in.read(reinterpret_cast<char*>(header),sizeof(header)) &&
+         header[0]==key && header[1]==units) {
+        uint64_t record[2];
+        std::uintmax_t whole=8+sizeof(header);
+        while(in.read(reinterpret_cast<char*>(record),sizeof(record))) {
+          whole+=sizeof(record);
+          //Each record holds the unit and its complement, so that garbage isn't taken for a finished unit
+          if(record[0]<units && record[1]==~record[0] && !finished[record[0]]) {
+            finished[record[0]]=true;
+            finishedCount++;
+          }
+        }
+        _resumed=true;
+        in.close();
+        std::error_code error;
+        if(std::filesystem::file_size(filename,error)!=whole) std::filesystem::resize_file(filename,whole,error);
+        if(error) throw std::runtime_error("Can't write render journal "+filename+": "+error.message());
+        out.open(filename,std::ios::binary|std::ios::app);
+        if(!out) throw std::runtime_error("Can't write render journal "+filename);
+      } else {
+        in.close();
+        start();
+      }
+    }
+    /** Check if there was a journal for this render already
+     * @return True if the journal existed and belonged to this render, even if no units were finished in it */
+    bool resumed() const {
+      std::lock_guard<std::mutex> lock(mutex);
+      return _resumed;
+    }
+    /** Check if a unit is finished
+     * @param unit Index of unit
+     * @return True if the unit was marked finished, in this run or an earlier one */
+    bool done(size_t unit) const {
+      std::lock_guard<std::mutex> lock(mutex);
+      return finished.at(unit);
+    }
+    /** Count finished units
+     * @return Number of units marked finished, in this run or an earlier one */
+    size_t count() const {
+      std::lock_guard<std::mutex> lock(mutex);
+      return finishedCount;
+    }
+    /** Record that a unit is finished. Only call this once everything the unit produced is safely written.
+     * @param unit Index of unit
+     * @throws std::runtime_error if the journal can't be written
+     */
+    void mark(size_t unit) {
+      std::lock_guard<std::mutex> lock(mutex);
+      if(finished.at(unit)) return;
+      uint64_t record[2]={unit,~uint64_t(unit)};
+      out.write(reinterpret_cast<const char*>(record),sizeof(record));
+      out.flush();
+      if(!out) throw std::runtime_error("Can't write render journal "+filename);
+      finished[unit]=true;
+      finishedCount++;
+    }
+    /** Start the journal over with no units finished, such as when what the finished units produced was lost
+     * @throws std::runtime_error if the journal can't be written
+     */
+    void restart() {
+      std::lock_guard<std::mutex> lock(mutex);
+      out.close();
+      std::fill(finished.begin(),finished.end(),false);
+      finishedCount=0;
+      _resumed=false;
+      start();
+    }
+    /** Close the journal and delete its file, once the render is finished and its output is saved */
+    void remove() {
+      std::lock_guard<std::mutex> lock(mutex);
+      out.close();
+      std::remove(filename.c_str());
+    }
+  };
+
+  /** Checkpoint of an image being rendered tile by tile. Finished tiles are written into a partial image
+   * file, `checkpoint.partial`, which holds the raw pixels of the whole image, and then recorded in a
+   * RenderJournal, `checkpoint.journal`. Tiles which aren't finished are just never read back, so the partial
+   * image doesn't need to be filled in first. See Scene::render(int,int,const std::string&,int).
+   */
+  class TileCheckpoint {
+  private:
+    int width;         ///< Width of image in pixels
+    int height;        ///< Height of image in pixels
+    int tileSize;      ///< Width and height of each tile in pixels
+    int tilesX;        ///< Number of tiles across the image
+    size_t pixelBytes; ///< Size of one pixel in bytes
+    std::string partialName; ///< Name of partial image file
+    std::fstream partial;    ///< Partial image file
+    RenderJournal journal;   ///< Which tiles are finished
+    /** Find the byte offset of a pixel in the partial image @param col Column @param row Row @return Offset in bytes */
+    std::streamoff offset(int col, int row) const {return std::streamoff((size_t(row)*width+col)*pixelBytes);}
+    /** Start over with no tiles finished and an empty partial image
+     * @throws std::runtime_error if the checkpoint files can't be written
+     */
+    void startOver() {
+      journal.restart();
+      partial.close();
+      partial.clear();
+      partial.open(partialName,std::ios::in|std::ios::out|std::ios::binary|std::ios::trunc);
+      if(!partial) throw std::runtime_error("Can't write partial image "+partialName);
+    }
+  public:
+    /** Open a checkpoint, resuming it if it belongs to the same render
+     * @param checkpoint Name of checkpoint, to which `.journal` and `.partial` are added to make the file names
+     * @param Lwidth Width of image in pixels
+     * @param Lheight Height of image in pixels
+     * @param LtileSize Width and height of each tile in pixels
+     * @param LpixelBytes Size of one pixel in bytes
+     * @param key Fingerprint of the scene, which is combined with the size of the image and tiles
+     * @throws std::runtime_error if the checkpoint files can't be written
+     */
+    TileCheckpoint(const std::string& checkpoint, int Lwidth, int Lheight, int LtileSize, size_t LpixelBytes, uint64_t key):
+      width(Lwidth),height(Lheight),tileSize(std::max(LtileSize,1)),tilesX((width+tileSize-1)/tileSize),pixelBytes(LpixelBytes),
+      partialName(checkpoint+".partial"),
+      journal(checkpoint+".journal",[&]{Fingerprint f;f.add(key);f.add(width);f.add(height);f.add(tileSize);f.add(pixelBytes);return f.value();}(),
+              size_t(tilesX)*((height+tileSize-1)/tileSize)) {
+      if(journal.resumed()) partial.open(partialName,std::ios::in|std::ios::out|std::ios::binary);
+      //A new journal starts with an empty partial image. So does an old one whose partial image is gone, since its finished tiles are lost.
+      if(!partial.is_open()) startOver();
+    }
+    size_t tiles() const {return size_t(tilesX)*((height+tileSize-1)/tileSize);} ///< Get number of tiles @return number of tiles
+    size_t finished() const {return journal.count();} ///< Count finished tiles @return number of tiles finished, in this run or an earlier one
+    bool done(size_t tile) const {return journal.done(tile);} ///< Check if a tile is finished @param tile Index of tile @return true if the tile is finished
+    /** Find the pixels covered by a tile. Tiles on the right and bottom edges may be smaller than the rest.
+     * @param[in] tile Index of tile, in rows of tiles from top left
+     * @param[out] col0 Leftmost column in tile
+     * @param[out] row0 Top row in tile
+     * @param[out] cols Number of columns in tile
+     * @param[out] rows Number of rows in tile
+     */
+    void rect(size_t tile, int& col0, int& row0, int& cols, int& rows) const {
+      col0=int(tile%tilesX)*tileSize;
+      row0=int(tile/tilesX)*tileSize;
+      cols=std::min(tileSize,width-col0);
+      rows=std::min(tileSize,height-row0);
+    }
+    /** Copy every finished tile from the partial image into a pixel buffer. If the partial image is too short to
+     * hold every tile the journal says is finished, such as if it was cut short or replaced, the checkpoint is
+     * started over with no tiles finished, rather than failing the same way on every run.
+     * @param pixbuf Pixel buffer the size of the image
+     * @throws std::runtime_error if the checkpoint has to be started over, and its files can't be written
+     */
+    template<int pixdepth, typename pixtype>
+    void load(PixelBuffer<pixdepth,pixtype>& pixbuf) {
+      for(size_t tile=0;tile<tiles();tile++) if(done(tile)) {
+        int col0, row0, cols, rows;
+        rect(tile,col0,row0,cols,rows);
+        for(int row=row0;row<row0+rows;row++) {
+          partial.seekg(offset(col0,row));
+          partial.read(reinterpret_cast<char*>(&pixbuf(col0,row,0)),std::streamsize(cols*pixelBytes));
+        }
+      }
+      if(!partial) startOver();
+    }
+    /** Write a finished tile to the partial image, then record it in the journal
+     * @param pixbuf Pixel buffer holding the tile
+     * @param tile Index of tile
+     * @throws std::runtime_error if the tile can't be written
+     */
+    template<int pixdepth, typename pixtype>
+    void save(const PixelBuffer<pixdepth,pixtype>& pixbuf, size_t tile) {
+      TraceScope span("save tile","io","tile",int64_t(tile));
+      int col0, row0, cols, rows;
+      rect(tile,col0,row0,cols,rows);
+      for(int row=row0;row<row0+rows;row++) {
+        partial.seekp(offset(col0,row));
+        partial.write(reinterpret_cast<const char*>(pixbuf.get()+(size_t(row)*width+col0)*pixdepth),std::streamsize(cols*pixelBytes));
+      }
+      partial.flush();
+      if(!partial) throw std::runtime_error("Can't write partial image "+partialName);
+      journal.mark(tile);
+    }
+    /** Delete the files of a checkpoint, once the image is saved. Don't call this while a TileCheckpoint is open on them.
+     * @param checkpoint Name of checkpoint, as passed to the constructor
+     */
+    static void discard(const std::string& checkpoint) {
+      std::remove((checkpoint+".partial").c_str());
+      std::remove((checkpoint+".journal").c_str());
+    }
+  };
+}
+
+#endif //KWANTRACE_CHECKPOINT_H
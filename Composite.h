@@ -17,12 +17,30 @@ namespace kwantrace {
   class Composite : public Renderable {
   protected:
     RenderableList children; ///< List of child objects
+    bool bounded=false;      ///< True if all children are bounded, so that bound is valid. Only valid after prepareRender()
+    Position boundCenter;    ///< Center of sphere around all children, including anywhere they move during the shutter interval
+    double boundRadius=0;    ///< Radius of sphere around all children
+    /** Check if a ray could hit any of the children, by intersecting it with the bounding sphere
+     * @param ray Ray in world space
+     * @return False if the ray certainly misses all children
+     */
+    bool mayHit(const Ray& ray) const {
+      if(!bounded) return true;
+      Eigen::Vector3d d=boundCenter-ray.r0;
+      double vv=ray.v.squaredNorm();
+      double s=d.dot(ray.v);
+      double r2=boundRadius*boundRadius*(1+1e-9);
+      //Ray starts inside, or passes within the radius somewhere ahead of the start
+      return d.squaredNorm()<=r2 || (s>0 && d.squaredNorm()-s*s/vv<=r2);
+    }
   public:
     /** \copydoc Renderable::prepareRender()
      *
      * This method, in addition to calling the superclass, also
      * sets the parent of each child to this, and calls the
-     * prepareRender() method of the child.
+     * prepareRender() method of the child. Once the children are
+     * prepared, it finds the sphere around them which intersect() uses
+     * to skip rays which can't hit any of them.
      */
     virtual void prepareRender() override {
       Renderable::prepareRender();
@@ -30,6 +48,7 @@ namespace kwantrace {
         child->setParent(this);
         child->prepareRender();
       }
+      bounded=sphereAround(boundCenter,boundRadius);
     }
 
     /**Add a child to this composite. The input is passed right back out
@@ -45,19 +64,22 @@ namespace kwantrace {
       children.push_back(child);
       return child;
     }
+    /** Get the children, such as to number the objects of a scene @return List of child objects */
+    const RenderableList& getChildren() const {return children;}
 
-    /**Add a child to this composite. The input is passed right back out
-     * so that you can construct a child, add it to its parent, and get
-     * a handle to it, all in one line:
+    /**Construct a child in place and add it to this composite. The child is
+     * allocated from the same memory resource as this composite (see Transformable::make()),
+     * so a whole tree built this way lives in the scene arena:
      *
-     *      auto child=parent.add(std::make_shared<ChildType>(..child constructor arguments..));
+     *      auto child=parent.add<ChildType>(..child constructor arguments..);
      *
-     * @param child A pointer to a child object
-     * @return The pointer is returned as-is.
+     * @tparam T Type of child to construct
+     * @param args Arguments forwarded to the child constructor
+     * @return Pointer to the new child
      */
     template<typename T, typename ... Args>
     std::shared_ptr<T> add(Args&&... args) {
-      auto result=std::make_shared<T>(std::forward<T>(args)...);
+      auto result=make<T>(std::forward<Args>(args)...);
       add(std::shared_ptr<Renderable>(result));
       return result;
     }
@@ -75,6 +97,54 @@ namespace kwantrace {
         child->add(transform);
       }
     }
+    /** \copydoc Renderable::collectPrimitives() */
+    virtual void collectPrimitives(std::vector<Observer<Primitive>>& list) const override {
+      for (auto &&child:children) {
+        child->collectPrimitives(list);
+      }
+    }
+    /** Find a sphere around the bounding spheres of all the children
+     * @param[out] center Center of sphere
+     * @param[out] radius Radius of sphere
+     * @return True if all children are bounded and there is at least one
+     */
+    bool sphereAround(Position& center, double& radius) const {
+      bool first=true;
+      for (auto &&child:children) {
+        Position c;
+        double r;
+        if(!child->boundingSphere(c,r)) return false;
+        if(first) {
+          center=c;
+          radius=r;
+          first=false;
+          continue;
+        }
+        mergeSphere(center,radius,c,r);
+      }
+      return !first;
+    }
+    /** \copydoc Renderable::boundingSphere()
+     *
+     * This is a sphere around the bounding spheres of all the children, so it is
+     * only bounded if all of them are. It is found at prepareRender().
+     */
+    virtual bool boundingSphere(Position& center, double& radius) const override {
+      if(!bounded) return false;
+      center=boundCenter;
+      radius=boundRadius;
+      return true;
+    }
+    /** \copydoc Renderable::write() */
+    virtual void write(SceneWriter& out) const override {
+      Renderable::write(out);
+      out.objects(children);
+    }
+    /** \copydoc Renderable::read() */
+    virtual void read(SceneReader& in) override {
+      Renderable::read(in);
+      in.objects(children);
+    }
   };
 
   /** Represents a Constructive Solid Geometry (CSG) union. As is implied by union,
@@ -93,6 +163,7 @@ namespace kwantrace {
     virtual Observer<Primitive> intersect(const Ray &ray, double &t) const override {
       const Primitive *result=nullptr;
       t = std::numeric_limits<double>::infinity();
+      if (!mayHit(ray)) return result;
       for (auto &&child:children) {
         double this_t;
         const Primitive *this_result = child->intersect(ray, this_t);
@@ -103,6 +174,36 @@ namespace kwantrace {
       }
       return result;
     };
+    /** \copydoc Renderable::intersectBatch()
+     *
+     * Each child lowers t and hit in turn, so the nearest hit is the same as from intersect(). Rays
+     * which miss the bounding sphere are left out of the batch passed to the children.
+     */
+    virtual void intersectBatch(const RayBatch& rays, double* t, Observer<Primitive>* hit) const override {
+      std::vector<size_t> index;
+      if(bounded) {
+        for(size_t i=0;i<rays.size();i++) if(mayHit(rays[i])) index.push_back(i);
+        if(index.empty()) return;
+      }
+      if(index.empty() || index.size()==rays.size()) {
+        for (auto &&child:children) child->intersectBatch(rays,t,hit);
+        return;
+      }
+      RayBatch subset;
+      subset.resize(index.size());
+      std::vector<double> subsetT(index.size());
+      std::vector<Observer<Primitive>> subsetHit(index.size());
+      for(size_t j=0;j<index.size();j++) {
+        subset.set(j,rays[index[j]]);
+        subsetT[j]=t[index[j]];
+        subsetHit[j]=hit[index[j]];
+      }
+      for (auto &&child:children) child->intersectBatch(subset,subsetT.data(),subsetHit.data());
+      for(size_t j=0;j<index.size();j++) {
+        t[index[j]]=subsetT[j];
+        hit[index[j]]=subsetHit[j];
+      }
+    }
 
     virtual bool inside(const Position &r) const override {
       bool result = false;
@@ -127,6 +228,7 @@ namespace kwantrace {
     virtual Observer<Primitive> intersect(const Ray &ray, double &t) const override {
       const Primitive *result=nullptr;
       t = std::numeric_limits<double>::infinity();
+      if (!mayHit(ray)) return result;
       for (auto &&child:children) {
         double this_t;
         const Primitive *this_result = child->intersect(ray, this_t);
@@ -146,7 +248,8 @@ namespace kwantrace {
       return result;
     };
   };
-
+  inline const bool unionRegistered=SceneTypes::add<Union>("Union"); ///< Lets unions be saved in scene files
+  inline const bool intersectionRegistered=SceneTypes::add<Intersection>("Intersection"); ///< Lets intersections be saved in scene files
 }
 
 #endif //KWANTRACE_COMPOSITE_H
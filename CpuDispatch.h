@@ -0,0 +1,171 @@
+/* KwanTrace - C++ Ray Tracing Library
+Copyright (C) 2021 by kwan3217
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef KWANTRACE_CPUDISPATCH_H
+#define KWANTRACE_CPUDISPATCH_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <string>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+/** Defined to 1 if kernels can be compiled for several instruction set levels, and picked when run */
+#define KWANTRACE_DISPATCH 1
+/** Mark a kernel lambda passed to CpuDispatch::run(), so that it is compiled into each level rather than called */
+#define KWANTRACE_KERNEL __attribute__((always_inline))
+#if defined(__clang__)
+#define KWANTRACE_NO_CONTRACT
+#else
+/** Keep multiplies and adds from being fused at levels which have FMA instructions */
+#define KWANTRACE_NO_CONTRACT ,optimize("fp-contract=off")
+#endif
+#else
+#define KWANTRACE_DISPATCH 0
+#define KWANTRACE_KERNEL
+#endif
+
+namespace kwantrace {
+  /** Instruction set levels which kernels are compiled for. Each level includes everything in the levels before it. */
+  enum class IsaLevel {
+    Baseline, ///< Whatever the whole program is compiled for, which is SSE2 for a default x86-64 build
+    SSE4,     ///< SSE4.2, with 128-bit vectors
+    AVX2,     ///< AVX2, with 256-bit vectors
+    AVX512    ///< AVX-512 F, BW, and VL, with 512-bit vectors
+  };
+
+  /** Picks the instruction set level of hot loops when the program runs, so that one binary built for the
+   * lowest target still uses the vector units of newer hosts.
+   *
+   * A kernel is a lambda marked with KWANTRACE_KERNEL and passed to run(). It is compiled once for each level,
+   * and run() calls the copy for the active level, which is the highest level the host supports, as found by
+   * CPUID. The level can be lowered for benchmarking by setting the environment variable `KWANTRACE_ISA` to
+   * `baseline`, `sse4`, `avx2`, or `avx512`, or by calling force(). It can never be raised above what the host
+   * supports, since that would stop the program with an illegal instruction.
+   *
+   *     CpuDispatch::run([&]() KWANTRACE_KERNEL {
+   *       for(int i=0;i<n;i++) out[i]=in[i]*scale;
+   *     });
+   *
+   * FMA isn't enabled at any level, and AVX-512, which has its own, is compiled without fusing multiplies and adds,
+   * so with GCC each level gives the same answer to the bit. The vectorization itself is up to the compiler, so a kernel should be written as loops over arrays
+   * with no calls, such as ToneMap::apply(). A call to sqrt() is a call too, since it has to be able to set errno, so
+   * Sphere::intersectLocalBatch() takes its square roots in a loop of their own. Calling a kernel costs more than the
+   * work of one ray or pixel, and keeps it from being inlined into the caller, so kernels should work on a whole row
+   * of pixels or RayBatch at once.
+   *
+   * On compilers or processors other than GCC or Clang on x86, there is only the baseline level.
+   */
+  class CpuDispatch {
+  private:
+    /** Find the highest level the host supports @return Level */
+    static IsaLevel detect() {
+#if KWANTRACE_DISPATCH
+      __builtin_cpu_init();
+      if(__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512vl")) return IsaLevel::AVX512;
+      if(__builtin_cpu_supports("avx2")) return IsaLevel::AVX2;
+      if(__builtin_cpu_supports("sse4.2")) return IsaLevel::SSE4;
+#endif
+      return IsaLevel::Baseline;
+    }
+    /** Get the level in use, set from the environment the first time @return Level, as an int */
+    static std::atomic<int>& level() {
+      static std::atomic<int> _level{[] {
+        IsaLevel result=supported();
+        const char* env=std::getenv("KWANTRACE_ISA");
+        IsaLevel requested;
+        if(env && parse(env,requested)) result=std::min(result,requested);
+        return int(result);
+      }()};
+      return _level;
+    }
+#if KWANTRACE_DISPATCH
+    /** Run a kernel compiled for SSE4.2 @param kernel Kernel */
+    template<typename Kernel> __attribute__((target("sse4.2")))
+    static void runSSE4(Kernel& kernel) {kernel();}
+    /** Run a kernel compiled for AVX2 @param kernel Kernel */
+    template<typename Kernel> __attribute__((target("avx2")))
+    static void runAVX2(Kernel& kernel) {kernel();}
+    /** Run a kernel compiled for AVX-512 @param kernel Kernel */
+    template<typename Kernel> __attribute__((target("avx512f,avx512bw,avx512vl,prefer-vector-width=512") KWANTRACE_NO_CONTRACT))
+    static void runAVX512(Kernel& kernel) {kernel();}
+#endif
+  public:
+    /** Get the highest level the host supports. This is found once. @return Level */
+    static IsaLevel supported() {
+      static const IsaLevel _supported=detect();
+      return _supported;
+    }
+    /** Get the level kernels are run at @return Level */
+    static IsaLevel active() {return IsaLevel(level().load(std::memory_order_relaxed));}
+    /** Run kernels at a given level, or the highest the host supports if that is lower. Don't call this while
+     * rendering, or a kernel might be split between levels.
+     * @param Llevel Level to use
+     */
+    static void force(IsaLevel Llevel) {level()=int(std::min(Llevel,supported()));}
+    /** Get the name of a level, as used in `KWANTRACE_ISA`
+     * @param Llevel Level
+     * @return Name
+     */
+    static const char* name(IsaLevel Llevel) {
+      switch(Llevel) {
+        case IsaLevel::SSE4:   return "sse4";
+        case IsaLevel::AVX2:   return "avx2";
+        case IsaLevel::AVX512: return "avx512";
+        default:               return "baseline";
+      }
+    }
+    /** Find a level by name
+     * @param[in] s Name, as from name()
+     * @param[out] Llevel Level, if found
+     * @return True if the name is a level
+     */
+    static bool parse(const std::string& s, IsaLevel& Llevel) {
+      for(IsaLevel l:{IsaLevel::Baseline,IsaLevel::SSE4,IsaLevel::AVX2,IsaLevel::AVX512}) if(s==name(l)) {
+        Llevel=l;
+        return true;
+      }
+      return false;
+    }
+    /** Describe which kernels are in use, such as `avx2 (host supports avx512)`
+     * @return Description
+     */
+    static std::string report() {
+      std::string result=name(active());
+      if(active()!=supported()) result+=std::string(" (host supports ")+name(supported())+")";
+      return result;
+    }
+    /** Run a kernel at the active level
+     * @param kernel Lambda marked with KWANTRACE_KERNEL, which takes no arguments
+     */
+    template<typename Kernel>
+    static void run(Kernel&& kernel) {
+#if KWANTRACE_DISPATCH
+      switch(active()) {
+        case IsaLevel::AVX512: runAVX512(kernel); return;
+        case IsaLevel::AVX2:   runAVX2(kernel);   return;
+        case IsaLevel::SSE4:   runSSE4(kernel);   return;
+        default: break;
+      }
+#endif
+      kernel();
+    }
+  };
+}
+
+#endif //KWANTRACE_CPUDISPATCH_H
@@ -0,0 +1,274 @@
+/* KwanTrace - C++ Ray Tracing Library
+Copyright (C) 2021 by kwan3217
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef KWANTRACE_DENOISER_H
+#define KWANTRACE_DENOISER_H
+
+#include <array>
+#include <atomic>
+#include <thread>
+
+namespace kwantrace {
+  /** Edge-aware filter which takes the noise out of a render with few samples per pixel. This is
+   * the edge-avoiding à-trous wavelet filter of [Dammertz et al. 2010](https://doi.org/10.2312/EGGH/HPG10/067-075),
+   * with the variance-guided color weight of [Schied et al. 2017](https://doi.org/10.1145/3105762.3105770).
+   *
+   * Each iteration blurs the image with a 5x5 B-spline kernel whose taps are spread twice as far apart
+   * as in the iteration before, so five iterations cover a 61 pixel wide area for the cost of 125 taps per pixel. Each
+   * tap is weighted down where the neighbor differs from the pixel being filtered in:
+   *
+   *    * Normal, so that edges and creases of the geometry stay sharp.
+   *    * Depth, relative to the change in depth that the slope of the surface at the pixel predicts, so that objects
+   *      don't bleed into what is behind them, but a floor seen at a low angle is still smoothed.
+   *    * Luminance, relative to the standard deviation of the noise at the pixel, so that real detail
+   *      such as shadow edges stays while noise is smoothed away. The variance is tracked through the iterations,
+   *      so the filter gets more careful as the noise goes down, and blurred over 3x3 pixels before each one, since an
+   *      estimate from so few samples is itself noisy.
+   *
+   * Only the light reflected by surfaces is filtered. The light seen directly, such as the color of an AreaLight, is
+   * taken out first and put back after, so that a bright light doesn't bleed into the surfaces around it. What is left
+   * is filtered as the sum of the light reflected over the sum of the albedo of the surfaces which reflected it. This
+   * is the light falling on the surfaces, which is smooth even where they are textured, and a pixel only partly
+   * covered by a surface counts for that much less. After filtering, it is multiplied by the albedo of the pixel.
+   *
+   * At the edge of a light seen directly, a few samples can't tell how much of the pixel the light covers, and a pixel
+   * whose samples all missed it looks just like one the light doesn't cover. Since the light is so much brighter
+   * than what is around it, these pixels can hold most of the error of the image, and no filter can fix them. So the
+   * light seen directly and the albedo which are put back come from guide(), which Scene::refineGuides() sharpens with extra camera
+   * rays along these edges. Texture detail finer than a pixel is still only as sharp as the samples found it.
+   *
+   * The guides come from the AccumulationFrame, which is filled by Scene::renderProgressive(). Use it like this:
+   *
+   *      AccumulationFrame frame(width,height);
+   *      scene.renderProgressive(pathTracer,frame,4);
+   *      scene.refineGuides(pathTracer,frame);
+   *      Denoiser denoiser;
+   *      auto pixbuf=scene.resolve(denoiser.denoise(frame));
+   *
+   * The image is kept as separate planes of floats, and each thread filters whole rows, running over each
+   * tap with an inner loop along the row which the compiler can vectorize.
+   */
+  class Denoiser {
+  private:
+    /** One channel of an image, rows contiguous */
+    typedef std::vector<float> Plane;
+    /** Find the luminance of the light falling on the surfaces seen by a pixel, which is the light they reflect
+     * divided by their albedo
+     * @param color Planes of light reflected
+     * @param albedo Planes of albedo
+     * @param p Index of pixel
+     * @return Luminance, or zero if the pixel sees no surface */
+    static double irradiance(const std::array<Plane,3>& color, const std::array<Plane,3>& albedo, size_t p) {
+      RayColor result=RayColor::Zero();
+      for(int i=0;i<3;i++) if(albedo[i][p]>0) result[i]=color[i][p]/albedo[i][p];
+      return AccumulationFrame::luminance(result);
+    }
+    /** Run a function on each row of an image, spread over threads
+     * @param height Number of rows
+     * @param f Function to call with each row index
+     */
+    template<typename F>
+    void forEachRow(int height, F f) const {
+      std::atomic<int> nextRow{0};
+      auto worker=[&] {
+        for(int row=nextRow++;row<height;row=nextRow++) f(row);
+      };
+      int n=threads>0?threads:std::max(1,int(std::thread::hardware_concurrency()));
+      std::vector<std::thread> pool;
+      for(int i=1;i<n;i++) pool.emplace_back(worker);
+      worker();
+      for(auto&& thread:pool) thread.join();
+    }
+  public:
+    int iterations=5;        ///< Number of à-trous iterations. Each doubles the spacing of the kernel taps.
+    double sigmaColor=4;     ///< Difference in luminance, in standard deviations of the noise, at which neighbors are weighted down by 1/e
+    double sigmaNormal=0.25; ///< Distance between unit normals at which neighbors are weighted down by 1/e
+    double sigmaDepth=1;     ///< Difference in depth, relative to what the depth gradient at the pixel predicts for the neighbor, at which neighbors are weighted down by 1/e
+    int threads=0;           ///< Number of threads to filter with, or 0 to use all hardware threads
+    /** Denoise a frame
+     * @param frame Frame to denoise. It should have been filled with guides, such as by Scene::renderProgressive(),
+     *        and may have had them sharpened by Scene::refineGuides().
+     * @return New frame with one pass holding the denoised image, and the same guides as the input
+     */
+    AccumulationFrame denoise(const AccumulationFrame& frame) const {
+      TraceScope span("denoise","render");
+      int width=frame.width(), height=frame.height();
+      size_t size=size_t(width)*height;
+      std::array<Plane,3> color, albedo, normal, nextColor, nextAlbedo;
+      Plane depth(size), hit(size), variance(size), nextVariance(size), slopeX(size), slopeY(size);
+      for(int i=0;i<3;i++) {
+        color[i].resize(size);
+        albedo[i].resize(size);
+        normal[i].resize(size);
+        nextColor[i].resize(size);
+        nextAlbedo[i].resize(size);
+      }
+      //Split the image into planes. The light seen directly is taken out, leaving only the light reflected by surfaces,
+      //along with the albedo of the surfaces the same samples hit.
+      for(int row=0;row<height;row++) for(int col=0;col<width;col++) {
+        size_t p=size_t(row)*width+col;
+        RayColor c=frame.pixel(col,row);
+        GuideSample samples=frame.sampleGuide(col,row), guide=frame.guide(col,row);
+        hit[p]=guide.depth>0?1.0f:0.0f;
+        depth[p]=float(guide.depth);
+        for(int i=0;i<3;i++) {
+          color[i][p]=float(c[i]-samples.emission[i]);
+          albedo[i][p]=samples.depth>0?std::max(float(samples.albedo[i]),0.01f):0.0f;
+          normal[i][p]=float(guide.normal[i]);
+        }
+        double a=AccumulationFrame::luminance(RayColor(albedo[0][p],albedo[1][p],albedo[2][p]));
+        variance[p]=a>0?float(frame.variance(col,row)/(a*a)):0.0f;
+      }
+      //Slope of depth at each pixel, from whichever neighbor on each axis is closer in depth, so that it doesn't jump at silhouettes
+      forEachRow(height,[&](int row) {
+        for(int col=0;col<width;col++) {
+          size_t p=size_t(row)*width+col;
+          auto slope=[&](bool ok0, size_t q0, bool ok1, size_t q1) {
+            float d0=ok0&&hit[q0]>0?depth[p]-depth[q0]:INFINITY;
+            float d1=ok1&&hit[q1]>0?depth[q1]-depth[p]:INFINITY;
+            float d=std::abs(d0)<std::abs(d1)?d0:d1;
+            return std::isfinite(d)?std::abs(d):0.0f;
+          };
+          slopeX[p]=slope(col>0,p-1,col<width-1,p+1);
+          slopeY[p]=slope(row>0,p-width,row<height-1,p+width);
+        }
+      });
+      //With only one pass there is no variance from the samples, so estimate it from the 3x3 neighborhood instead
+      if(frame.passes()<2) {
+        forEachRow(height,[&](int row) {
+          for(int col=0;col<width;col++) {
+            double sum=0, sum2=0;
+            int n=0;
+            for(int dy=-1;dy<=1;dy++) for(int dx=-1;dx<=1;dx++) {
+              int r=row+dy, c=col+dx;
+              if(r<0 || r>=height || c<0 || c>=width) continue;
+              double l=irradiance(color,albedo,size_t(r)*width+c);
+              sum+=l;
+              sum2+=l*l;
+              n++;
+            }
+            nextVariance[size_t(row)*width+col]=float(std::max(0.0,sum2/n-(sum/n)*(sum/n)));
+          }
+        });
+        std::swap(variance,nextVariance);
+      }
+      static const float kernel[5]={1.0f/16,1.0f/4,3.0f/8,1.0f/4,1.0f/16};
+      const float invNormal=float(1/(sigmaNormal*sigmaNormal));
+      Plane sigma(size), level(size), albedoLevel(size);
+      for(int iteration=0;iteration<iterations;iteration++) {
+        int step=1<<iteration;
+        const float depthScale=float(sigmaDepth);
+        const float colorScale=float(sigmaColor);
+        //The variance of a pixel is itself a noisy estimate, so blur it with a 3x3 Gaussian before using it to
+        //weight the neighbors.
+        forEachRow(height,[&](int row) {
+          for(int col=0;col<width;col++) {
+            size_t p=size_t(row)*width+col;
+            float sum=0, sumK=0;
+            for(int dy=-1;dy<=1;dy++) for(int dx=-1;dx<=1;dx++) {
+              int r=row+dy, c=col+dx;
+              if(r<0 || r>=height || c<0 || c>=width) continue;
+              float k=(dy==0?0.5f:0.25f)*(dx==0?0.5f:0.25f);
+              sum+=k*variance[size_t(r)*width+c];
+              sumK+=k;
+            }
+            sigma[p]=1.0f/(colorScale*std::sqrt(sum/sumK)+1e-4f);
+            level[p]=float(irradiance(color,albedo,p));
+            albedoLevel[p]=float(AccumulationFrame::luminance(RayColor(albedo[0][p],albedo[1][p],albedo[2][p])));
+          }
+        });
+        forEachRow(height,[&](int row) {
+          thread_local std::array<std::vector<float>,3> sumC, sumA;
+          thread_local std::vector<float> sumW, sumWA, sumWV;
+          for(int i=0;i<3;i++) {
+            sumC[i].assign(width,0.0f);
+            sumA[i].assign(width,0.0f);
+          }
+          sumW.assign(width,0.0f); sumWA.assign(width,0.0f); sumWV.assign(width,0.0f);
+          size_t p0=size_t(row)*width;
+          for(int dy=-2;dy<=2;dy++) {
+            int qrow=row+dy*step;
+            if(qrow<0 || qrow>=height) continue;
+            for(int dx=-2;dx<=2;dx++) {
+              int offset=dx*step;
+              int c0=std::max(0,-offset), c1=std::min(width,width-offset);
+              if(c0>=c1) continue;
+              const float k=kernel[dy+2]*kernel[dx+2];
+              size_t q0=size_t(qrow)*width;
+              const float *pl=&level[p0], *ql=&level[q0], *ps=&sigma[p0];
+              const float *qr=&color[0][q0], *qg=&color[1][q0], *qb=&color[2][q0];
+              const float *qar=&albedo[0][q0], *qag=&albedo[1][q0], *qab=&albedo[2][q0], *qa=&albedoLevel[q0];
+              const float *pnx=&normal[0][p0], *pny=&normal[1][p0], *pnz=&normal[2][p0];
+              const float *qnx=&normal[0][q0], *qny=&normal[1][q0], *qnz=&normal[2][q0];
+              const float *pd=&depth[p0], *qd=&depth[q0], *ph=&hit[p0], *qh=&hit[q0], *qv=&variance[q0];
+              const float *psx=&slopeX[p0], *psy=&slopeY[p0];
+              const float ax=float(std::abs(offset)), ay=float(std::abs(dy*step));
+              for(int c=c0;c<c1;c++) {
+                int d=c+offset;
+                float dnx=pnx[c]-qnx[d], dny=pny[c]-qny[d], dnz=pnz[c]-qnz[d];
+                float dd=std::abs(pd[c]-qd[d])/(depthScale*(psx[c]*ax+psy[c]*ay)+1e-3f*pd[c]+1e-6f);
+                float e=std::abs(pl[c]-ql[d])*ps[c]+(dnx*dnx+dny*dny+dnz*dnz)*invNormal+dd;
+                float w=k*std::exp(-e)*(1.0f-std::abs(ph[c]-qh[d]));
+                sumC[0][c]+=w*qr[d];
+                sumC[1][c]+=w*qg[d];
+                sumC[2][c]+=w*qb[d];
+                sumA[0][c]+=w*qar[d];
+                sumA[1][c]+=w*qag[d];
+                sumA[2][c]+=w*qab[d];
+                sumW[c]+=w;
+                sumWA[c]+=w*qa[d];
+                sumWV[c]+=w*w*qa[d]*qa[d]*qv[d];
+              }
+            }
+          }
+          for(int col=0;col<width;col++) {
+            float inv=1.0f/sumW[col];
+            for(int i=0;i<3;i++) {
+              nextColor[i][p0+col]=sumC[i][col]*inv;
+              nextAlbedo[i][p0+col]=sumA[i][col]*inv;
+            }
+            //The filtered light is a mean of the neighbors weighted by their albedo as well, so its variance is too
+            nextVariance[p0+col]=sumWA[col]>0?sumWV[col]/(sumWA[col]*sumWA[col]):0.0f;
+          }
+        });
+        std::swap(color,nextColor);
+        std::swap(albedo,nextAlbedo);
+        std::swap(variance,nextVariance);
+      }
+      //Put the light seen directly back, and multiply the filtered light from the surfaces by their albedo. Both
+      //come from all the guides, which may be sharper than the samples. Where no surface was found to filter,
+      //the light from surfaces is left as it was.
+      AccumulationFrame result(width,height);
+      for(int row=0;row<height;row++) for(int col=0;col<width;col++) {
+        size_t p=size_t(row)*width+col;
+        RayColor c=frame.pixel(col,row);
+        GuideSample samples=frame.sampleGuide(col,row), guide=frame.guide(col,row);
+        RayColor out;
+        for(int i=0;i<3;i++) {
+          double a=guide.depth>0?std::max(guide.albedo[i],0.01):0.0;
+          out[i]=guide.emission[i]+(albedo[i][p]>0?a*color[i][p]/albedo[i][p]:c[i]-samples.emission[i]);
+        }
+        result.add(col,row,out,guide);
+      }
+      result.endPass();
+      return result;
+    }
+  };
+}
+
+#endif //KWANTRACE_DENOISER_H
@@ -20,6 +20,15 @@ namespace kwantrace {
      * @return Value of the field at this point
      */
     virtual OutVector fieldLocal(const Position& r) const =0;
+    /** Calculate the value of the field averaged over a small area around a point. Fields
+     * which can be aliased, such as image maps, use this to filter themselves. The default
+     * implementation ignores the footprint and samples at the point.
+     * @param r Position to evaluate the field at, in local space
+     * @param footprint Approximate width of the area to average over, in local space
+     * @return Value of the field at this point
+     */
+    virtual OutVector fieldLocal(const Position& r, double footprint) const {return fieldLocal(r);}
+    double scaleBw=1; ///< Approximate factor to convert a length from world to local space
   public:
     /** Evaluate the function at a point in world space
      *
@@ -27,6 +36,23 @@ namespace kwantrace {
      * @return value of the field at this point
      */
     OutVector operator()(const Position& r) const {return fieldLocal(Mbw * r);};
+    /** Evaluate the function averaged over a small area around a point in world space
+     *
+     * @param r  Position to evaluate the field at, in world space
+     * @param footprint Approximate width of the area to average over, in world space. This is usually the
+     *   width of the pixel projected onto the surface.
+     * @return value of the field at this point
+     */
+    OutVector operator()(const Position& r, double footprint) const {return fieldLocal(Mbw * r, footprint*scaleBw);};
+    /** \copydoc Transformable::prepareRender()
+     *
+     * This also works out the scale factor to convert footprints to local space
+     * as the cube root of the volume scale of the transformation.
+     */
+    virtual void prepareRender() override {
+      Transformable::prepareRender();
+      scaleBw=std::cbrt(std::abs(Mbw.template block<3,3>(0,0).determinant()));
+    }
     virtual ~Field()=default; ///< Allow subclassing
 
     /** Evaluate the function at a point in world space
@@ -37,6 +63,14 @@ namespace kwantrace {
      * @return value of the field at this point
      */
     OutVector operator()(double x, double y, double z) {return *this(Position(x, y, z));};
+    /** Check if this field has the same value everywhere in space. Users of a constant field
+     * can evaluate it once at prepareRender() time and then skip both the transformation
+     * and the virtual call during the render.
+     *
+     * @param[out] value Value of the field, if it is constant. Unspecified if function returns false.
+     * @return True if the field is constant, false if it varies (or might vary) over space
+     */
+    virtual bool isConstant(OutVector& value) const {return false;}
   };
   /** Typedef Alias */
   typedef Field<5,double> ColorField;
@@ -63,7 +97,23 @@ namespace kwantrace {
      * @param t transmit component of color
      */
     ConstantColor(double r=0, double g=0, double b=0, double f=0, double t=0) {value<< r,g,b,f,t;};
+    /** \copydoc Field::isConstant()
+     *
+     * This field is always constant.
+     */
+    bool isConstant(ObjectColor& Lvalue) const override {Lvalue=value;return true;}
+    /** \copydoc Transformable::write() */
+    virtual void write(SceneWriter& out) const override {
+      ColorField::write(out);
+      out.put(value);
+    }
+    /** \copydoc Transformable::read() */
+    virtual void read(SceneReader& in) override {
+      ColorField::read(in);
+      in.get(value);
+    }
   };
+  inline const bool constantColorRegistered=SceneTypes::add<ConstantColor>("ConstantColor"); ///< Lets constant colors be saved in scene files
 }
 
 #endif //KWANTRACE_FIELD_H
@@ -0,0 +1,291 @@
+/* KwanTrace - C++ Ray Tracing Library
+Copyright (C) 2021 by kwan3217
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef KWANTRACE_FRAMEBUFFER_H
+#define KWANTRACE_FRAMEBUFFER_H
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <limits>
+#include <type_traits>
+#include <vector>
+
+namespace kwantrace {
+  /** Settings for turning high dynamic range linear color into displayable pixels. In order, each
+   * channel is:
+   *
+   *    1. Scaled by 2 to the power of exposure
+   *    2. Compressed into 0-1 by the tone curve
+   *    3. Encoded with the sRGB transfer function, if srgb is set
+   *    4. For integer pixels, scaled to full range with an ordered dither added, and clamped
+   *
+   * The steps run over whole runs of pixels at a time, each as a plain loop over a staging array of floats, which
+   * the compiler vectorizes when optimizing (-O3). The sRGB curve is read from a table of 16384 intervals with linear
+   * interpolation, which is within a quarter of one step of a 16-bit pixel. The error is largest at the knee where
+   * the curve changes from linear to a power, where the slope changes a little.
+   * Floating point pixels skip the clamp and dither, so with Curve::Linear and srgb off they keep the full range
+   * of the frame, for writing to an EXR.
+   */
+  class ToneMap {
+  public:
+    /** Tone curve which maps linear color into the 0-1 range */
+    enum class Curve {
+      Linear,   ///< No compression. Anything over 1 is clipped, as in Scene::render()
+      Reinhard, ///< x/(1+x), which compresses highlights smoothly and never quite reaches white
+      Filmic    ///< Curve fit to the ACES filmic tone curve by Krzysztof Narkowicz, with a toe and a shoulder like film
+    };
+  private:
+    static constexpr int tableSize=16384; ///< Number of intervals in the sRGB table
+    /** Get the table of the sRGB transfer function, with one extra entry at the end so
+     * that interpolation never reads past it
+     * @return Table of encoded values at evenly spaced linear values from 0 to 1 */
+    static const std::array<float,tableSize+2>& srgbTable() {
+      static const std::array<float,tableSize+2> table=[] {
+        std::array<float,tableSize+2> result;
+        for(int i=0;i<=tableSize+1;i++) result[i]=float(encodeSRGB(std::min(1.0,double(i)/tableSize)));
+        return result;
+      }();
+      return table;
+    }
+    /** Get the 8x8 Bayer matrix of ordered dither thresholds, centered in each step
+     * @return Thresholds from 0 to 1, row by row */
+    static const std::array<float,64>& bayer() {
+      static const std::array<float,64> table=[] {
+        std::array<float,64> result;
+        for(int y=0;y<8;y++) for(int x=0;x<8;x++) {
+          int v=0, xc=x^y, yc=y;
+          for(int bit=0;bit<3;bit++) {
+            v=(v<<2)|(((xc>>bit)&1)<<1)|((yc>>bit)&1);
+          }
+          result[y*8+x]=(v+0.5f)/64;
+        }
+        return result;
+      }();
+      return table;
+    }
+  public:
+    double exposure=0; ///< Exposure adjustment in stops. Each +1 doubles the brightness.
+    Curve curve=Curve::Linear; ///< Tone curve
+    bool srgb=true;    ///< If true, encode with the sRGB transfer function, which is what displays and PNG files expect
+    bool dither=true;  ///< If true, add an ordered dither before quantizing to integer pixels, which hides banding in smooth gradients
+    /** Encode a linear value with the sRGB transfer function
+     * @param x Linear value, 0 to 1
+     * @return Encoded value, 0 to 1 */
+    static double encodeSRGB(double x) {
+      return x<=0.0031308?12.92*x:1.055*std::pow(x,1/2.4)-0.055;
+    }
+    /** Convert a run of pixels
+     * @tparam pixdepth Number of channels in each output pixel. With 1, the output is the luminance. With 4, the last channel is opaque alpha.
+     * @tparam pixtype Type of one output channel
+     * @param sum Sum of samples, three channels per pixel
+     * @param count Number of samples in each pixel. Pixels without any are black.
+     * @param n Number of pixels
+     * @param col Column of first pixel, to line up the dither pattern
+     * @param row Row of the pixels
+     * @param out First output pixel. The pixels are written one after another.
+     */
+    template<int pixdepth, typename pixtype>
+    void apply(const float* sum, const float* count, int n, int col, int row, pixtype* out) const {
+      static_assert(pixdepth==1 || pixdepth==3 || pixdepth==4,"ToneMap can only make gray, RGB, or RGBA pixels");
+      //Gray pixels are reduced to luminance first, while the color is still linear, then each step works on one channel per pixel
+      constexpr int channels=pixdepth==1?1:3;
+      const int m=n*channels;
+      thread_local std::vector<float> v, t;
+      v.resize(size_t(m));
+      t.resize(size_t(m));
+      float* w=v.data();
+      float* pt=t.data();
+      //The loops are compiled for each instruction set level, and the one for this host is picked when run
+      CpuDispatch::run([&]() KWANTRACE_KERNEL {
+        //Clamps are written as a quiet compare and select after the arithmetic, rather than std::min() or std::max()
+        //before it, since otherwise the compiler won't vectorize the loop without -ffast-math.
+        //A pixel without samples has a zero sum, so adding a tiny count makes it black without a branch.
+        const float scale=float(std::exp2(exposure));
+        for(int p=0;p<n;p++) pt[p]=scale/(count[p]+1e-20f);
+        for(int p=0;p<n;p++) {
+          float s=pt[p];
+          if constexpr (channels==1) {
+            w[p]=(0.2126f*sum[3*p]+0.7152f*sum[3*p+1]+0.0722f*sum[3*p+2])*s;
+          } else {
+            w[3*p]=sum[3*p]*s;
+            w[3*p+1]=sum[3*p+1]*s;
+            w[3*p+2]=sum[3*p+2]*s;
+          }
+        }
+        switch(curve) {
+          case Curve::Linear:
+            break;
+          case Curve::Reinhard:
+            for(int i=0;i<m;i++) {
+              float y=w[i]/(1.0f+std::abs(w[i]));
+              w[i]=std::isgreater(y,0.0f)?y:0.0f;
+            }
+            break;
+          case Curve::Filmic:
+            //The denominator has no real roots, so this is safe for negative values before they are clamped
+            for(int i=0;i<m;i++) {
+              float x=w[i];
+              float y=(x*(2.51f*x+0.03f))/(x*(2.43f*x+0.59f)+0.14f);
+              y=std::isgreater(y,0.0f)?y:0.0f;
+              w[i]=std::isless(y,1.0f)?y:1.0f;
+            }
+            break;
+        }
+        if(srgb) {
+          const float* table=srgbTable().data();
+          for(int i=0;i<m;i++) {
+            float x=w[i]*tableSize;
+            x=std::isgreater(x,0.0f)?x:0.0f;
+            x=std::isless(x,float(tableSize))?x:float(tableSize);
+            int j=int(x);
+            float f=x-j;
+            w[i]=table[j]+(table[j+1]-table[j])*f;
+          }
+        }
+        if constexpr (!std::is_floating_point_v<pixtype>) {
+          //Truncating after adding a threshold between 0 and 1 rounds up as often as the fraction says, on average
+          const float full=float(std::numeric_limits<pixtype>::max());
+          const float* threshold=bayer().data()+(row&7)*8;
+          for(int p=0;p<n;p++) for(int c=0;c<channels;c++) pt[p*channels+c]=dither?threshold[(col+p)&7]:0.5f;
+          for(int i=0;i<m;i++) {
+            float x=w[i]*full+pt[i];
+            x=std::isgreater(x,0.0f)?x:0.0f;
+            w[i]=std::isless(x,full)?x:full;
+          }
+        }
+        if constexpr (pixdepth==4) {
+          for(int p=0;p<n;p++) {
+            for(int c=0;c<3;c++) out[p*4+c]=pixtype(w[3*p+c]);
+            out[p*4+3]=std::is_floating_point_v<pixtype>?pixtype(1):std::numeric_limits<pixtype>::max();
+          }
+        } else {
+          for(int i=0;i<m;i++) out[i]=pixtype(w[i]);
+        }
+      });
+    }
+  };
+
+  /** High dynamic range frame which collects samples in floating point, so that any number of samples
+   * can be averaged into each pixel, and the image can be exposed and tone mapped after rendering. Fill it with
+   * Scene::render(FrameBuffer&,int), then get pixels with resolve().
+   *
+   * The pixels can be laid out row by row, or in square tiles with the pixels of each tile together.
+   * Scene::render(FrameBuffer&,int) renders a tiled frame one tile at a time, so neighboring rays, which
+   * tend to hit the same objects, write to the same few cache lines.
+   */
+  class FrameBuffer {
+  private:
+    int _width;    ///< Width of frame in pixels
+    int _height;   ///< Height of frame in pixels
+    int _tileSize; ///< Width and height of each tile in pixels, or 0 if rows are contiguous
+    int tilesX;    ///< Number of tiles across the frame, including a partial one at the right edge
+    int _passes=0; ///< Number of complete passes rendered into the frame
+    std::vector<float> sum;   ///< Sum of samples, three channels per pixel
+    std::vector<float> count; ///< Number of samples in each pixel
+  public:
+    /** Construct an empty frame
+     * @param Lwidth Width in pixels
+     * @param Lheight Height in pixels
+     * @param LtileSize Width and height of each tile in pixels, or 0 to store rows contiguously.
+     *   Tiles on the right and bottom edges are padded out to full size.
+     */
+    FrameBuffer(int Lwidth, int Lheight, int LtileSize=0):_width(Lwidth),_height(Lheight),_tileSize(std::max(LtileSize,0)) {
+      size_t pixels;
+      if(_tileSize>0) {
+        tilesX=(_width+_tileSize-1)/_tileSize;
+        int tilesY=(_height+_tileSize-1)/_tileSize;
+        pixels=size_t(tilesX)*tilesY*_tileSize*_tileSize;
+      } else {
+        tilesX=1;
+        pixels=size_t(_width)*_height;
+      }
+      sum.assign(pixels*3,0.0f);
+      count.assign(pixels,0.0f);
+    }
+    int width() const {return _width;}       ///< Get width of frame @return width in pixels
+    int height() const {return _height;}     ///< Get height of frame @return height in pixels
+    int tileSize() const {return _tileSize;} ///< Get size of tiles @return width and height of each tile, or 0 if rows are contiguous
+    int passes() const {return _passes;}     ///< Get number of complete passes @return number of passes
+    void endPass() {_passes++;}              ///< Mark a pass as complete, after every pixel has had a sample added
+    /** Find where a pixel is stored
+     * @param col Column of pixel
+     * @param row Row of pixel
+     * @return Index of pixel in storage
+     */
+    size_t index(int col, int row) const {
+      if(_tileSize==0) return size_t(row)*_width+col;
+      int tx=col/_tileSize, ty=row/_tileSize;
+      return (size_t(ty)*tilesX+tx)*_tileSize*_tileSize+size_t(row-ty*_tileSize)*_tileSize+(col-tx*_tileSize);
+    }
+    /** Add a sample to a pixel. Different threads may add to different pixels at once,
+     * but not to the same pixel.
+     * @param col Column of pixel
+     * @param row Row of pixel
+     * @param color Sample to add
+     * @param weight Weight of sample, usually 1
+     */
+    void add(int col, int row, const RayColor& color, float weight=1.0f) {
+      size_t i=index(col,row);
+      float* p=&sum[i*3];
+      for(int j=0;j<3;j++) p[j]+=float(color[j])*weight;
+      count[i]+=weight;
+    }
+    /** Get the current estimate of a pixel
+     * @param col Column of pixel
+     * @param row Row of pixel
+     * @return Mean of all samples of this pixel, or black if there are none
+     */
+    RayColor pixel(int col, int row) const {
+      size_t i=index(col,row);
+      if(count[i]<=0) return RayColor::Zero();
+      return RayColor(sum[i*3],sum[i*3+1],sum[i*3+2])/count[i];
+    }
+    /** Throw away all samples, for instance after the scene has changed */
+    void clear() {
+      std::fill(sum.begin(),sum.end(),0.0f);
+      std::fill(count.begin(),count.end(),0.0f);
+      _passes=0;
+    }
+    /** Convert the frame to pixels. Each row is converted in runs which are contiguous in storage,
+     * which for a tiled frame is one run per tile.
+     * @tparam pixdepth Number of channels in each pixel, 1, 3, or 4
+     * @tparam pixtype Type of one channel of one pixel
+     * @param toneMap Exposure, tone curve, and encoding to use
+     * @param threads Number of threads to convert with, or 0 to use all hardware threads
+     * @return Pixel buffer
+     */
+    template<int pixdepth=3, typename pixtype=uint8_t>
+    PixelBuffer<pixdepth,pixtype> resolve(const ToneMap& toneMap=ToneMap(), int threads=0) const {
+      TraceScope span("resolve","render");
+      PixelBuffer<pixdepth,pixtype> result(_width,_height);
+      int run=_tileSize>0?_tileSize:_width;
+      forEachParallel(size_t(_height),threads,[&](size_t r) {
+        int row=int(r);
+        for(int col=0;col<_width;col+=run) {
+          int n=std::min(run,_width-col);
+          size_t i=index(col,row);
+          toneMap.apply<pixdepth,pixtype>(&sum[i*3],&count[i],n,col,row,&result(col,row,0));
+        }
+      });
+      return result;
+    }
+  };
+}
+
+#endif //KWANTRACE_FRAMEBUFFER_H
@@ -0,0 +1,455 @@
+/* KwanTrace - C++ Ray Tracing Library
+Copyright (C) 2021 by kwan3217
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef KWANTRACE_IMAGEMAP_H
+#define KWANTRACE_IMAGEMAP_H
+
+#include <atomic>
+#include <cstring>
+#include <fstream>
+#include <list>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace kwantrace {
+  /** One square tile of one mip level of a TiledTexture, as RGBA bytes in row-major order */
+  typedef std::vector<uint8_t> TextureTile;
+
+  /** Fixed-size cache of texture tiles, shared between any number of textures. The
+   * cache is least-recently-used, so textures which are not being looked at don't
+   * take up any memory no matter how large they are on disk.
+   *
+   * The cache is split into shards, each with its own lock, so that threads
+   * looking up different tiles rarely wait on each other. Tiles are handed out
+   * as shared pointers, so a tile evicted while some thread is still reading
+   * it stays alive until that thread is done with it.
+   */
+  class TileCache {
+  public:
+    typedef std::shared_ptr<const TextureTile> TilePtr; ///< Handle to a tile in the cache
+  private:
+    static const constexpr int nShards=16; ///< Number of independently locked parts of the cache
+    /** One independently locked part of the cache */
+    struct Shard {
+      std::mutex lock;                                   ///< Protects everything in this shard
+      std::list<std::pair<uint64_t,TilePtr>> lru;        ///< Tiles in this shard, most recently used first
+      std::unordered_map<uint64_t,std::list<std::pair<uint64_t,TilePtr>>::iterator> index; ///< Find a tile in lru by key
+      size_t bytes=0;                                    ///< Size of all tiles in this shard
+      uint64_t hits=0;                                   ///< Number of lookups that found their tile
+      uint64_t misses=0;                                 ///< Number of lookups that had to load their tile
+    };
+    Shard shards[nShards];        ///< Cache shards
+    std::atomic<size_t> capacity; ///< Maximum total size of all tiles in bytes
+    /** Pick the shard a tile lives in
+     * @param key Tile key
+     * @return Reference to shard
+     */
+    Shard& shard(uint64_t key) {return shards[(key*0x9E3779B97F4A7C15ull)>>60];}
+  public:
+    /** Construct a tile cache
+     * @param Lcapacity Maximum total size of all cached tiles in bytes
+     */
+    explicit TileCache(size_t Lcapacity=size_t(256)<<20):capacity(Lcapacity) {}
+    /** Get the cache that textures use unless told otherwise
+     * @return Reference to the global cache
+     */
+    static TileCache& global() {static TileCache cache; return cache;}
+    /** Change the maximum size of the cache. Tiles are evicted as needed on the next lookups.
+     * @param Lcapacity Maximum total size of all cached tiles in bytes
+     */
+    void setCapacity(size_t Lcapacity) {capacity=Lcapacity;}
+    /** Look up a tile, loading it if it is not in the cache. The load happens outside
+     * of the lock, so a slow disk read doesn't block lookups of other tiles in the shard.
+     *
+     * @tparam Load Type of tile loader
+     * @param key Unique identifier of the tile, across all textures using this cache
+     * @param load Function returning a TilePtr to the tile data, only called if the tile isn't cached
+     * @return Pointer to the tile
+     */
+    template<typename Load>
+    TilePtr get(uint64_t key, Load load) {
+      Shard& s=shard(key);
+      {
+        std::lock_guard<std::mutex> guard(s.lock);
+        auto it=s.index.find(key);
+        if(it!=s.index.end()) {
+          s.lru.splice(s.lru.begin(),s.lru,it->second);
+          s.hits++;
+          return it->second->second;
+        }
+        s.misses++;
+      }
+      TilePtr tile=load();
+      std::lock_guard<std::mutex> guard(s.lock);
+      auto it=s.index.find(key);
+      if(it!=s.index.end()) return it->second->second; //Another thread loaded it while we were
+      s.lru.emplace_front(key,tile);
+      s.index[key]=s.lru.begin();
+      s.bytes+=tile->size();
+      size_t limit=capacity/nShards;
+      while(s.bytes>limit && s.lru.size()>1) {
+        s.bytes-=s.lru.back().second->size();
+        s.index.erase(s.lru.back().first);
+        s.lru.pop_back();
+      }
+      return tile;
+    }
+    /** Get the total size of all tiles in the cache @return Size in bytes */
+    size_t bytes() {size_t result=0;for(auto& s:shards) {std::lock_guard<std::mutex> guard(s.lock);result+=s.bytes;} return result;}
+    /** Get the number of lookups which found their tile in the cache @return number of hits */
+    uint64_t hits() {uint64_t result=0;for(auto& s:shards) {std::lock_guard<std::mutex> guard(s.lock);result+=s.hits;} return result;}
+    /** Get the number of lookups which had to load their tile @return number of misses */
+    uint64_t misses() {uint64_t result=0;for(auto& s:shards) {std::lock_guard<std::mutex> guard(s.lock);result+=s.misses;} return result;}
+  };
+
+  /** Large texture stored on disk as a tiled mip-map, and read on demand through a TileCache.
+   *
+   * The file is memory-mapped, and tiles are copied out of the mapping into the cache
+   * as they are needed. Once a tile is copied, its pages are dropped from the mapping, so
+   * the memory used by the texture is bounded by the size of the cache, not the size
+   * of the file.
+   *
+   * File format, all numbers little-endian:
+   *    * Header: 8 byte magic `KTTEX001`, then uint32 width, height, tile size, and number of levels
+   *    * For each level, finest first: uint32 width, height, tiles across, tiles down, then uint64 file offset of first tile
+   *    * Tile data. Each tile is tile size squared RGBA texels in row-major order, with texels
+   *      past the edge of the level zero-filled. Tiles of a level are in row-major order, and
+   *      each level starts on a page boundary. Since the tile size is a power of two of
+   *      at least 32, each tile is a whole number of pages.
+   *
+   * Use TiledTexture::write() or TiledTexture::convertPPM() to make one of these files.
+   */
+  class TiledTexture {
+  private:
+    /** Description of one mip level */
+    struct Level {
+      uint32_t width;  ///< Width of level in texels
+      uint32_t height; ///< Height of level in texels
+      uint32_t tilesX; ///< Number of tiles across
+      uint32_t tilesY; ///< Number of tiles down
+      uint64_t offset; ///< File offset of first tile
+    };
+    static const constexpr char magic[8]={'K','T','T','E','X','0','0','1'}; ///< File format identifier
+    static const constexpr size_t pageSize=4096; ///< Alignment of levels in the file
+    std::string _filename;     ///< Name of the texture file
+    uint32_t _width;           ///< Width of finest level in texels
+    uint32_t _height;          ///< Height of finest level in texels
+    uint32_t tileSize;         ///< Width and height of a tile in texels
+    std::vector<Level> levels; ///< Mip levels, finest first
+    int fd=-1;                 ///< File descriptor of the texture file
+    uint8_t* map=nullptr;      ///< Memory mapping of the texture file
+    size_t mapSize=0;          ///< Size of the memory mapping
+    uint64_t id;               ///< Identifier of this texture in the tile cache
+    TileCache& cache;          ///< Cache to read tiles through
+    /** Remember the last tile used, since neighboring texels are usually in the same tile */
+    struct TileMemo {
+      uint64_t key=~0ull; ///< Key of remembered tile
+      TileCache::TilePtr tile; ///< Remembered tile
+    };
+    /** Round a file offset up to the next page boundary
+     * @param offset File offset
+     * @return Aligned file offset */
+    static uint64_t align(uint64_t offset) {return (offset+pageSize-1)/pageSize*pageSize;}
+    /** Release the file mapping and descriptor, if any */
+    void unmap() {
+      if(map) munmap(map,mapSize);
+      if(fd>=0) close(fd);
+      map=nullptr;fd=-1;
+    }
+    /** Allocate a new texture identifier for the tile cache @return Unique identifier */
+    static uint64_t nextId() {static std::atomic<uint64_t> counter{0}; return counter++;}
+    /** Copy a tile out of the file mapping, then drop its pages from the mapping
+     * @param level Mip level
+     * @param tx Tile column
+     * @param ty Tile row
+     * @return Pointer to new tile
+     */
+    TileCache::TilePtr load(int level, uint32_t tx, uint32_t ty) const {
+      size_t tileBytes=size_t(tileSize)*tileSize*4;
+      uint8_t* src=map+levels[level].offset+(size_t(ty)*levels[level].tilesX+tx)*tileBytes;
+      auto result=std::make_shared<TextureTile>(src,src+tileBytes);
+      madvise(src,tileBytes,MADV_DONTNEED);
+      return result;
+    }
+    /** Get one texel from a level, wrapping around at the edges
+     * @param level Mip level
+     * @param x Texel column, may be outside the level
+     * @param y Texel row, may be outside the level
+     * @param memo Last tile used
+     * @return RGBA color of texel, each channel from 0 to 1
+     */
+    Eigen::Vector4d texel(int level, int64_t x, int64_t y, TileMemo& memo) const {
+      const Level& L=levels[level];
+      x%=L.width;  if(x<0) x+=L.width;
+      y%=L.height; if(y<0) y+=L.height;
+      uint32_t tx=x/tileSize, ty=y/tileSize;
+      uint64_t key=(id<<40)|(uint64_t(level)<<34)|(uint64_t(ty)<<17)|tx;
+      if(key!=memo.key) {
+        memo.tile=cache.get(key,[&]{return load(level,tx,ty);});
+        memo.key=key;
+      }
+      const uint8_t* p=memo.tile->data()+((y%tileSize)*tileSize+(x%tileSize))*4;
+      return Eigen::Vector4d(p[0],p[1],p[2],p[3])/255.0;
+    }
+    /** Bilinearly interpolate a level
+     * @param level Mip level
+     * @param u Horizontal texture coordinate, 0 at left edge and 1 at right edge
+     * @param v Vertical texture coordinate, 0 at bottom edge and 1 at top edge
+     * @param memo Last tile used
+     * @return RGBA color, each channel from 0 to 1
+     */
+    Eigen::Vector4d bilinear(int level, double u, double v, TileMemo& memo) const {
+      double x=u*levels[level].width-0.5;
+      double y=(1-v)*levels[level].height-0.5;
+      double x0=std::floor(x), y0=std::floor(y);
+      double fx=x-x0, fy=y-y0;
+      auto ix=int64_t(x0), iy=int64_t(y0);
+      return (1-fy)*((1-fx)*texel(level,ix,iy  ,memo)+fx*texel(level,ix+1,iy  ,memo))
+            +   fy *((1-fx)*texel(level,ix,iy+1,memo)+fx*texel(level,ix+1,iy+1,memo));
+    }
+  public:
+    /** Open a tiled texture file
+     * @param filename Name of file written by TiledTexture::write()
+     * @param Lcache Cache to read tiles through
+     * @throws std::runtime_error if the file can't be read, or its header or level table is corrupt
+     */
+    explicit TiledTexture(const std::string& filename, TileCache& Lcache=TileCache::global()):_filename(filename),id(nextId()),cache(Lcache) {
+      fd=open(filename.c_str(),O_RDONLY);
+      if(fd<0) throw std::runtime_error("Can't open texture "+filename);
+      struct stat st;
+      if(fstat(fd,&st)!=0) {close(fd);fd=-1;throw std::runtime_error("Can't open texture "+filename);}
+      mapSize=st.st_size;
+      void* m=mmap(nullptr,mapSize,PROT_READ,MAP_PRIVATE,fd,0);
+      if(m==MAP_FAILED) {close(fd);fd=-1;throw std::runtime_error("Can't map texture "+filename);}
+      map=static_cast<uint8_t*>(m);
+      auto fail=[&](const std::string& why) {
+        unmap();
+        throw std::runtime_error(why+filename);
+      };
+      uint32_t header[4];
+      if(mapSize<sizeof(magic)+sizeof(header) || memcmp(map,magic,sizeof(magic))!=0) fail("Not a tiled texture: ");
+      memcpy(header,map+sizeof(magic),sizeof(header));
+      _width=header[0];_height=header[1];tileSize=header[2];
+      //Same limits as write(), and small enough that a tile's size can't overflow
+      if(tileSize<32 || tileSize>32768 || (tileSize&(tileSize-1))!=0) fail("Bad tile size in texture ");
+      //The tile cache key has 6 bits for the level
+      if(header[3]<1 || header[3]>64) fail("Bad number of levels in texture ");
+      size_t tableEnd=sizeof(magic)+sizeof(header)+size_t(header[3])*sizeof(Level);
+      if(tableEnd>mapSize) fail("Truncated texture ");
+      levels.resize(header[3]);
+      memcpy(levels.data(),map+sizeof(magic)+sizeof(header),levels.size()*sizeof(Level));
+      if(levels[0].width!=_width || levels[0].height!=_height) fail("Bad level size in texture ");
+      uint64_t tileBytes=uint64_t(tileSize)*tileSize*4;
+      for(auto&& L:levels) {
+        if(L.width==0 || L.height==0 || L.tilesX!=(uint64_t(L.width)+tileSize-1)/tileSize || L.tilesY!=(uint64_t(L.height)+tileSize-1)/tileSize) {
+          fail("Bad level size in texture ");
+        }
+        if(L.offset>mapSize || uint64_t(L.tilesX)*L.tilesY>(mapSize-L.offset)/tileBytes) fail("Truncated texture ");
+      }
+    }
+    TiledTexture(const TiledTexture&)=delete; ///< Owns a file mapping, so can't be copied
+    TiledTexture& operator=(const TiledTexture&)=delete; ///< Owns a file mapping, so can't be copied
+    ~TiledTexture() {unmap();}
+    const std::string& filename() const {return _filename;} ///< Get the name of the texture file @return file name
+    int width() const {return _width;}   ///< Get the width of the finest level @return width in texels
+    int height() const {return _height;} ///< Get the height of the finest level @return height in texels
+    int levelCount() const {return levels.size();} ///< Get the number of mip levels @return number of levels
+    /** Sample the texture with trilinear filtering. The mip level is chosen such that
+     * one texel is about the size of the footprint.
+     * @param u Horizontal texture coordinate, 0 at left edge and 1 at right edge. Wraps outside that range.
+     * @param v Vertical texture coordinate, 0 at bottom edge and 1 at top edge. Wraps outside that range.
+     * @param footprint Width of area to average over, in texture coordinates
+     * @return RGBA color, each channel from 0 to 1
+     */
+    Eigen::Vector4d sample(double u, double v, double footprint) const {
+      TileMemo memo;
+      double texels=footprint*std::max(_width,_height);
+      double lod=texels>1?std::log2(texels):0;
+      lod=std::min(lod,double(levels.size()-1));
+      int l0=int(lod);
+      double f=lod-l0;
+      Eigen::Vector4d result=bilinear(l0,u,v,memo);
+      if(f>0 && l0+1<int(levels.size())) {
+        result=(1-f)*result+f*bilinear(l0+1,u,v,memo);
+      }
+      return result;
+    }
+    /** Write a tiled texture file. The mip chain is built by averaging 2x2 blocks
+     * of texels, all the way down to a single texel.
+     *
+     * @param filename Name of file to write
+     * @param width Width of image in pixels
+     * @param height Height of image in pixels
+     * @param channels Number of channels in image, 3 for RGB or 4 for RGBA
+     * @param pixels Image pixels, in row-major order with the top row first
+     * @param tileSize Width and height of a tile, must be a power of two of at least 32
+     */
+    static void write(const std::string& filename, int width, int height, int channels, Observer<uint8_t> pixels, int tileSize=64) {
+      if(tileSize<32 || (tileSize&(tileSize-1))!=0) throw std::invalid_argument("Tile size must be a power of two of at least 32");
+      std::vector<std::vector<uint8_t>> images;
+      std::vector<Level> table;
+      images.emplace_back(size_t(width)*height*4);
+      for(size_t i=0;i<size_t(width)*height;i++) {
+        for(int c=0;c<4;c++) images[0][i*4+c]=c<channels?pixels[i*channels+c]:255;
+      }
+      uint32_t w=width, h=height;
+      while(true) {
+        table.push_back(Level{w,h,(w+tileSize-1)/tileSize,(h+tileSize-1)/tileSize,0});
+        if(w==1 && h==1) break;
+        uint32_t nw=std::max(w/2,1u), nh=std::max(h/2,1u);
+        std::vector<uint8_t> next(size_t(nw)*nh*4);
+        const auto& prev=images.back();
+        for(uint32_t y=0;y<nh;y++) for(uint32_t x=0;x<nw;x++) for(int c=0;c<4;c++) {
+          uint32_t x0=std::min(2*x,w-1),x1=std::min(2*x+1,w-1),y0=std::min(2*y,h-1),y1=std::min(2*y+1,h-1);
+          int sum=prev[(y0*w+x0)*4+c]+prev[(y0*w+x1)*4+c]+prev[(y1*w+x0)*4+c]+prev[(y1*w+x1)*4+c];
+          next[(size_t(y)*nw+x)*4+c]=uint8_t((sum+2)/4);
+        }
+        images.push_back(std::move(next));
+        w=nw;h=nh;
+      }
+      size_t tileBytes=size_t(tileSize)*tileSize*4;
+      uint64_t offset=align(sizeof(magic)+4*sizeof(uint32_t)+table.size()*sizeof(Level));
+      for(auto&& L:table) {
+        L.offset=offset;
+        offset=align(offset+uint64_t(L.tilesX)*L.tilesY*tileBytes);
+      }
+      std::ofstream ouf(filename,std::ios::out|std::ios::binary|std::ios::trunc);
+      if(!ouf) throw std::runtime_error("Can't write texture "+filename);
+      uint32_t header[4]={uint32_t(width),uint32_t(height),uint32_t(tileSize),uint32_t(table.size())};
+      ouf.write(magic,sizeof(magic));
+      ouf.write(reinterpret_cast<const char*>(header),sizeof(header));
+      ouf.write(reinterpret_cast<const char*>(table.data()),table.size()*sizeof(Level));
+      std::vector<uint8_t> tile(tileBytes);
+      for(size_t l=0;l<table.size();l++) {
+        const Level& L=table[l];
+        std::vector<char> pad(L.offset-ouf.tellp(),0);
+        ouf.write(pad.data(),pad.size());
+        for(uint32_t ty=0;ty<L.tilesY;ty++) for(uint32_t tx=0;tx<L.tilesX;tx++) {
+          std::fill(tile.begin(),tile.end(),0);
+          for(uint32_t y=0;y<uint32_t(tileSize) && ty*tileSize+y<L.height;y++) {
+            uint32_t x0=tx*tileSize;
+            uint32_t n=std::min(uint32_t(tileSize),L.width-x0);
+            memcpy(&tile[y*tileSize*4],&images[l][((size_t(ty)*tileSize+y)*L.width+x0)*4],n*4);
+          }
+          ouf.write(reinterpret_cast<const char*>(tile.data()),tileBytes);
+        }
+      }
+      std::vector<char> pad(offset-ouf.tellp(),0);
+      ouf.write(pad.data(),pad.size());
+    }
+    /** Convert a binary (P6) PPM image with 8-bit channels, such as the ones written by the demo program,
+     * into a tiled texture file.
+     * @param ppmFilename Name of PPM file to read
+     * @param filename Name of tiled texture file to write
+     * @param tileSize Width and height of a tile, must be a power of two of at least 32
+     */
+    static void convertPPM(const std::string& ppmFilename, const std::string& filename, int tileSize=64) {
+      std::ifstream inf(ppmFilename,std::ios::in|std::ios::binary);
+      std::string tag;
+      inf>>tag;
+      if(tag!="P6") throw std::runtime_error("Not a binary PPM: "+ppmFilename);
+      int values[3];
+      for(int& value:values) {
+        while(inf>>std::ws && inf.peek()=='#') inf.ignore(std::numeric_limits<std::streamsize>::max(),'\n');
+        inf>>value;
+      }
+      if(!inf || values[2]!=255) throw std::runtime_error("Unsupported PPM: "+ppmFilename);
+      inf.get();
+      std::vector<uint8_t> pixels(size_t(values[0])*values[1]*3);
+      inf.read(reinterpret_cast<char*>(pixels.data()),pixels.size());
+      if(!inf) throw std::runtime_error("Truncated PPM: "+ppmFilename);
+      write(filename,values[0],values[1],3,pixels.data(),tileSize);
+    }
+  };
+
+  /** Pigment which wraps an image around an object, like the POV-Ray `image_map`.
+   * The image is repeated infinitely in both directions. The image alpha channel,
+   * if any, becomes the transmit channel of the color.
+   *
+   * Images are read through TiledTexture, so they may be much larger than memory,
+   * and they are filtered to the size of the pixel footprint passed to Field::operator()(const Position&,double).
+   */
+  class ImageMap: public ColorField {
+  public:
+    /** How to wrap the image around the object */
+    enum class Mapping {
+      Planar,   ///< Image is in the local XY plane, with the bottom left corner at the origin and the top right at (1,1). Like POV-Ray `map_type 0`
+      Spherical ///< Image is wrapped around the local origin, with the same UV coordinates as Sphere::uvLocal(). Like POV-Ray `map_type 1`
+    };
+  private:
+    std::shared_ptr<TiledTexture> texture; ///< Image to map
+    Mapping mapping; ///< How to wrap the image around the object
+    ObjectColor fieldLocal(const Position& r) const override {return fieldLocal(r,0);}
+    /** \copydoc Field::fieldLocal(const Position&,double)
+     *
+     * The footprint is converted into texture coordinates to pick the mip level. For a spherical map,
+     * one unit of texture coordinate is a full circumference of the unit sphere.
+     */
+    ObjectColor fieldLocal(const Position& r, double footprint) const override {
+      Eigen::Vector4d rgba;
+      if(mapping==Mapping::Spherical) {
+        Eigen::Vector2d uv=Sphere::uvLocal(r);
+        rgba=texture->sample(uv.x(),uv.y(),footprint/(2*pi));
+      } else {
+        rgba=texture->sample(r.x(),r.y(),footprint);
+      }
+      ObjectColor result;
+      result<<rgba.head<3>(),0,1-rgba[3];
+      return result;
+    }
+  public:
+    /** Construct an image map pigment
+     * @param Ltexture Image to map. Can be shared between many pigments.
+     * @param Lmapping How to wrap the image around the object
+     */
+    ImageMap(std::shared_ptr<TiledTexture> Ltexture, Mapping Lmapping=Mapping::Planar):texture(Ltexture),mapping(Lmapping) {}
+    /** Construct an image map pigment
+     * @param filename Name of tiled texture file to map, read through the global tile cache
+     * @param Lmapping How to wrap the image around the object
+     */
+    ImageMap(const std::string& filename, Mapping Lmapping=Mapping::Planar):ImageMap(std::make_shared<TiledTexture>(filename),Lmapping) {}
+    /** Construct an image map pigment with no image yet, for reading from a scene file */
+    ImageMap():mapping(Mapping::Planar) {}
+    /** \copydoc Transformable::write()
+     *
+     * Only the name of the texture file is written, not the texels. The file is mapped again when the scene is loaded.
+     */
+    virtual void write(SceneWriter& out) const override {
+      ColorField::write(out);
+      out.put(texture->filename());
+      out.put(mapping);
+    }
+    /** \copydoc Transformable::read() */
+    virtual void read(SceneReader& in) override {
+      ColorField::read(in);
+      std::string filename;
+      in.get(filename);
+      in.get(mapping);
+      texture=std::make_shared<TiledTexture>(filename);
+    }
+  };
+  inline const bool imageMapRegistered=SceneTypes::add<ImageMap>("ImageMap"); ///< Lets image maps be saved in scene files
+}
+
+#endif //KWANTRACE_IMAGEMAP_H
@@ -0,0 +1,891 @@
+/* KwanTrace - C++ Ray Tracing Library
+Copyright (C) 2021 by kwan3217
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef KWANTRACE_IMAGEOUTPUT_H
+#define KWANTRACE_IMAGEOUTPUT_H
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cctype>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+namespace kwantrace {
+  template<int pixdepth, typename pixtype> class PixelBuffer;
+
+  /** Run a function on each of a number of jobs, spread over threads. Jobs are handed out
+   * as threads finish, so uneven jobs still balance.
+   * @param count Number of jobs
+   * @param threads Number of threads to use, or 0 to use all hardware threads
+   * @param f Function to call with each job index
+   */
+  template<typename F>
+  void forEachParallel(size_t count, int threads, F f) {
+    std::atomic<size_t> next{0};
+    auto worker=[&] {
+      for(size_t i=next++;i<count;i=next++) f(i);
+    };
+    size_t n=threads>0?size_t(threads):std::max(1u,std::thread::hardware_concurrency());
+    n=std::min(n,count);
+    std::vector<std::thread> pool;
+    for(size_t i=1;i<n;i++) pool.emplace_back(worker);
+    worker();
+    for(auto&& thread:pool) thread.join();
+  }
+
+  /** Compressor for the deflate format of [RFC 1951](https://www.rfc-editor.org/rfc/rfc1951), which is used inside
+   * both PNG and the ZIP compression of OpenEXR. Matches are found with a hash chain, and each block gets
+   * its own Huffman codes fitted to it.
+   *
+   * Large inputs are cut into fixed-size segments which are compressed on separate threads, like pigz does. Each
+   * segment but the last ends with an empty stored block, so the next starts on a byte boundary and the
+   * pieces can just be appended. Matches don't reach back across a segment boundary, which costs a
+   * little compression. Since the segments don't depend on the number of threads, neither does the output.
+   */
+  class Deflate {
+  private:
+    /** One literal byte or one match from LZ77 */
+    struct Token {
+      uint16_t litlen; ///< Literal byte if dist is 0, otherwise length of match
+      uint16_t dist;   ///< Distance back to the match, or 0 for a literal
+    };
+    /** Writes bits to a byte vector, least significant bit first as deflate wants */
+    struct BitWriter {
+      std::vector<uint8_t>& out; ///< Bytes written so far
+      uint64_t buf=0;            ///< Bits not yet written
+      int count=0;               ///< Number of bits in buf
+      /** Write bits
+       * @param bits Bits to write, first bit in the least significant place
+       * @param n Number of bits to write */
+      void put(uint32_t bits, int n) {
+        buf|=uint64_t(bits)<<count;
+        count+=n;
+        while(count>=8) {
+          out.push_back(uint8_t(buf));
+          buf>>=8;
+          count-=8;
+        }
+      }
+      /** Pad with zero bits to a byte boundary */
+      void align() {
+        if(count>0) out.push_back(uint8_t(buf));
+        buf=0;
+        count=0;
+      }
+    };
+    static constexpr int windowSize=32768;     ///< Farthest back a match can be
+    static constexpr int maxMatch=258;         ///< Longest match
+    static constexpr int hashBits=15;          ///< Size of hash table of three-byte prefixes, as a power of 2
+    static constexpr size_t blockTokens=65536; ///< Number of tokens in each block, each of which gets its own Huffman codes
+    static constexpr uint16_t lengthBase[29]={3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,35,43,51,59,67,83,99,115,131,163,195,227,258};
+    static constexpr uint8_t lengthExtra[29]={0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,3,3,3,3,4,4,4,4,5,5,5,5,0};
+    static constexpr uint16_t distBase[30]={1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577};
+    static constexpr uint8_t distExtra[30]={0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13};
+    /** Find the code for a match length @param length Match length, 3 to 258 @return Index into lengthBase */
+    static int lengthCode(int length) {
+      return int(std::upper_bound(lengthBase,lengthBase+29,length)-lengthBase)-1;
+    }
+    /** Find the code for a match distance @param dist Match distance, 1 to 32768 @return Index into distBase */
+    static int distCode(int dist) {
+      return int(std::upper_bound(distBase,distBase+30,dist)-distBase)-1;
+    }
+    /** Reverse the order of some bits, since Huffman codes are sent most significant bit first
+     * @param code Bits to reverse @param n Number of bits @return Reversed bits */
+    static uint32_t reverse(uint32_t code, int n) {
+      uint32_t result=0;
+      for(int i=0;i<n;i++) {
+        result=(result<<1)|(code&1);
+        code>>=1;
+      }
+      return result;
+    }
+    /** Find Huffman code lengths for symbol frequencies, no longer than a limit. If the ideal code is too
+     * long, the frequencies are flattened until it fits. At least two frequencies must be nonzero.
+     * @param freq Frequency of each symbol
+     * @param limit Longest code allowed
+     * @param[out] lengths Code length of each symbol, 0 for symbols which don't occur
+     */
+    static void codeLengths(const std::vector<uint32_t>& freq, int limit, std::vector<uint8_t>& lengths) {
+      std::vector<uint32_t> f=freq;
+      std::vector<int> symbols;
+      for(size_t i=0;i<f.size();i++) if(f[i]) symbols.push_back(int(i));
+      size_t n=symbols.size();
+      std::vector<int> parent(2*n-1);
+      std::vector<int> depth(2*n-1);
+      while(true) {
+        typedef std::pair<uint64_t,int> Node;
+        std::priority_queue<Node,std::vector<Node>,std::greater<Node>> heap;
+        for(size_t i=0;i<n;i++) heap.push({f[symbols[i]],int(i)});
+        int next=int(n);
+        while(heap.size()>1) {
+          Node a=heap.top(); heap.pop();
+          Node b=heap.top(); heap.pop();
+          parent[a.second]=next;
+          parent[b.second]=next;
+          heap.push({a.first+b.first,next++});
+        }
+        //Parents are always numbered after their children, so walk down from the root
+        int longest=0;
+        depth[next-1]=0;
+        for(int i=next-2;i>=0;i--) {
+          depth[i]=depth[parent[i]]+1;
+          if(i<int(n)) longest=std::max(longest,depth[i]);
+        }
+        if(longest<=limit) break;
+        for(auto& x:f) if(x) x=(x+1)/2;
+      }
+      lengths.assign(f.size(),0);
+      for(size_t i=0;i<n;i++) lengths[symbols[i]]=uint8_t(depth[i]);
+    }
+    /** Make the canonical Huffman codes for code lengths, already bit-reversed for writing
+     * @param lengths Code length of each symbol
+     * @param[out] codes Code of each symbol
+     */
+    static void canonicalCodes(const std::vector<uint8_t>& lengths, std::vector<uint32_t>& codes) {
+      int count[16]={0};
+      for(auto l:lengths) count[l]++;
+      count[0]=0;
+      uint32_t next[16];
+      uint32_t code=0;
+      for(int bits=1;bits<16;bits++) {
+        code=(code+count[bits-1])<<1;
+        next[bits]=code;
+      }
+      codes.assign(lengths.size(),0);
+      for(size_t i=0;i<lengths.size();i++) if(lengths[i]) codes[i]=reverse(next[lengths[i]]++,lengths[i]);
+    }
+    /** Make sure at least two frequencies are nonzero, so that the Huffman code is complete
+     * @param[in,out] freq Frequencies */
+    static void atLeastTwo(std::vector<uint32_t>& freq) {
+      int used=0;
+      for(auto x:freq) if(x) used++;
+      for(size_t i=0;used<2 && i<freq.size();i++) if(!freq[i]) {
+        freq[i]=1;
+        used++;
+      }
+    }
+    /** Find matches in the data with a hash chain, taking the longest match at each point
+     * @param data Data to compress
+     * @param size Number of bytes
+     * @param maxChain Most earlier positions to check for each match
+     * @param[out] tokens Literals and matches
+     */
+    static void lz77(const uint8_t* data, size_t size, int maxChain, std::vector<Token>& tokens) {
+      constexpr uint32_t mask=windowSize-1;
+      std::vector<int32_t> head(size_t(1)<<hashBits,-1);
+      std::vector<int32_t> prev(windowSize,-1);
+      auto hash=[&](size_t i) {
+        uint32_t x=uint32_t(data[i])|uint32_t(data[i+1])<<8|uint32_t(data[i+2])<<16;
+        return (x*2654435761u)>>(32-hashBits);
+      };
+      auto insert=[&](size_t i) {
+        uint32_t h=hash(i);
+        prev[i&mask]=head[h];
+        head[h]=int32_t(i);
+      };
+      tokens.clear();
+      size_t i=0;
+      while(i<size) {
+        int bestLen=0, bestDist=0;
+        if(i+3<=size) {
+          int maxLen=int(std::min<size_t>(maxMatch,size-i));
+          int32_t candidate=head[hash(i)];
+          for(int chain=0;chain<maxChain && candidate>=0 && i-candidate<=size_t(windowSize);chain++) {
+            const uint8_t* a=data+candidate;
+            const uint8_t* b=data+i;
+            if(a[bestLen]==b[bestLen]) {
+              int len=0;
+              while(len<maxLen && a[len]==b[len]) len++;
+              if(len>bestLen) {
+                bestLen=len;
+                bestDist=int(i-candidate);
+                if(len==maxLen) break;
+              }
+            }
+            int32_t next=prev[candidate&mask];
+            if(next>=candidate) break;
+            candidate=next;
+          }
+          insert(i);
+        }
+        if(bestLen>=3) {
+          tokens.push_back({uint16_t(bestLen),uint16_t(bestDist)});
+          for(size_t j=i+1;j<i+bestLen && j+3<=size;j++) insert(j);
+          i+=bestLen;
+        } else {
+          tokens.push_back({data[i],0});
+          i++;
+        }
+      }
+    }
+    /** Write one block with its own Huffman codes
+     * @param tokens Literals and matches in the block
+     * @param count Number of tokens
+     * @param final True if this is the last block of the stream
+     * @param bw Where to write
+     */
+    static void writeBlock(const Token* tokens, size_t count, bool final, BitWriter& bw) {
+      std::vector<uint32_t> litFreq(286,0), distFreq(30,0);
+      for(size_t i=0;i<count;i++) {
+        if(tokens[i].dist) {
+          litFreq[257+lengthCode(tokens[i].litlen)]++;
+          distFreq[distCode(tokens[i].dist)]++;
+        } else {
+          litFreq[tokens[i].litlen]++;
+        }
+      }
+      litFreq[256]=1;
+      atLeastTwo(litFreq);
+      atLeastTwo(distFreq);
+      std::vector<uint8_t> litLen, distLen;
+      codeLengths(litFreq,15,litLen);
+      codeLengths(distFreq,15,distLen);
+      int hlit=286, hdist=30;
+      while(hlit>257 && !litLen[hlit-1]) hlit--;
+      while(hdist>1 && !distLen[hdist-1]) hdist--;
+      //Run-length code the code lengths
+      std::vector<uint8_t> all(litLen.begin(),litLen.begin()+hlit);
+      all.insert(all.end(),distLen.begin(),distLen.begin()+hdist);
+      struct Run {uint8_t symbol, extra, bits;};
+      std::vector<Run> runs;
+      for(size_t i=0;i<all.size();) {
+        uint8_t v=all[i];
+        size_t run=1;
+        while(i+run<all.size() && all[i+run]==v) run++;
+        if(v==0) {
+          while(run>=11) {
+            size_t r=std::min<size_t>(run,138);
+            runs.push_back({18,uint8_t(r-11),7});
+            run-=r;
+            i+=r;
+          }
+          if(run>=3) {
+            runs.push_back({17,uint8_t(run-3),3});
+            i+=run;
+            run=0;
+          }
+        } else {
+          runs.push_back({v,0,0});
+          i++;
+          run--;
+          while(run>=3) {
+            size_t r=std::min<size_t>(run,6);
+            runs.push_back({16,uint8_t(r-3),2});
+            run-=r;
+            i+=r;
+          }
+        }
+        for(;run>0;run--,i++) runs.push_back({v,0,0});
+      }
+      std::vector<uint32_t> clFreq(19,0);
+      for(auto&& r:runs) clFreq[r.symbol]++;
+      atLeastTwo(clFreq);
+      std::vector<uint8_t> clLen;
+      codeLengths(clFreq,7,clLen);
+      static constexpr uint8_t order[19]={16,17,18,0,8,7,9,6,10,5,11,4,12,3,13,2,14,1,15};
+      int hclen=19;
+      while(hclen>4 && !clLen[order[hclen-1]]) hclen--;
+      std::vector<uint32_t> litCode, distCodes, clCode;
+      canonicalCodes(litLen,litCode);
+      canonicalCodes(distLen,distCodes);
+      canonicalCodes(clLen,clCode);
+      bw.put(final?1:0,1);
+      bw.put(2,2);
+      bw.put(hlit-257,5);
+      bw.put(hdist-1,5);
+      bw.put(hclen-4,4);
+      for(int i=0;i<hclen;i++) bw.put(clLen[order[i]],3);
+      for(auto&& r:runs) {
+        bw.put(clCode[r.symbol],clLen[r.symbol]);
+        if(r.bits) bw.put(r.extra,r.bits);
+      }
+      for(size_t i=0;i<count;i++) {
+        const Token& t=tokens[i];
+        if(t.dist) {
+          int lc=lengthCode(t.litlen);
+          bw.put(litCode[257+lc],litLen[257+lc]);
+          if(lengthExtra[lc]) bw.put(t.litlen-lengthBase[lc],lengthExtra[lc]);
+          int dc=distCode(t.dist);
+          bw.put(distCodes[dc],distLen[dc]);
+          if(distExtra[dc]) bw.put(t.dist-distBase[dc],distExtra[dc]);
+        } else {
+          bw.put(litCode[t.litlen],litLen[t.litlen]);
+        }
+      }
+      bw.put(litCode[256],litLen[256]);
+    }
+  public:
+    static constexpr size_t segmentSize=256*1024; ///< Size of the pieces that zlib() compresses on separate threads
+    /** Compress data to raw deflate blocks
+     * @param data Data to compress
+     * @param size Number of bytes
+     * @param final If true, the last block is marked final. If false, the output ends with an
+     *   empty stored block, so that more compressed data can be appended.
+     * @param[in,out] out Compressed data is appended to this
+     * @param maxChain Most earlier positions to check for each match. Higher is slower but smaller.
+     */
+    static void compressRaw(const uint8_t* data, size_t size, bool final, std::vector<uint8_t>& out, int maxChain=16) {
+      std::vector<Token> tokens;
+      lz77(data,size,maxChain,tokens);
+      BitWriter bw{out};
+      size_t begin=0;
+      do {
+        size_t count=std::min(blockTokens,tokens.size()-begin);
+        writeBlock(tokens.data()+begin,count,final && begin+count==tokens.size(),bw);
+        begin+=count;
+      } while(begin<tokens.size());
+      if(!final) {
+        bw.put(0,3);
+        bw.align();
+        out.insert(out.end(),{0x00,0x00,0xFF,0xFF});
+      }
+      bw.align();
+    }
+    /** Compute the Adler-32 checksum used by zlib
+     * @param data Data to check
+     * @param size Number of bytes
+     * @param adler Checksum of any data before this, to continue from
+     * @return Checksum
+     */
+    static uint32_t adler32(const uint8_t* data, size_t size, uint32_t adler=1) {
+      uint32_t a=adler&0xFFFF, b=adler>>16;
+      while(size>0) {
+        size_t n=std::min<size_t>(size,5552);
+        size-=n;
+        for(size_t i=0;i<n;i++) {
+          a+=*data++;
+          b+=a;
+        }
+        a%=65521;
+        b%=65521;
+      }
+      return (b<<16)|a;
+    }
+    /** Compress data to a zlib stream, as used in PNG and EXR
+     * @param data Data to compress
+     * @param size Number of bytes
+     * @param threads Number of threads to compress with, or 0 to use all hardware threads
+     * @return Compressed data
+     */
+    static std::vector<uint8_t> zlib(const uint8_t* data, size_t size, int threads=1) {
+      size_t segments=std::max<size_t>(1,(size+segmentSize-1)/segmentSize);
+      std::vector<std::vector<uint8_t>> pieces(segments);
+      forEachParallel(segments,threads,[&](size_t i) {
+        size_t begin=i*segmentSize;
+        size_t end=std::min(size,begin+segmentSize);
+        compressRaw(data+begin,end-begin,i==segments-1,pieces[i]);
+      });
+      std::vector<uint8_t> result={0x78,0x01};
+      for(auto&& piece:pieces) result.insert(result.end(),piece.begin(),piece.end());
+      uint32_t adler=adler32(data,size);
+      for(int i=3;i>=0;i--) result.push_back(uint8_t(adler>>(8*i)));
+      return result;
+    }
+  };
+
+  /** One named channel of a multi-channel OpenEXR file, see ImageFile::writeEXR(const std::string&,int,int,std::vector<ExrChannel>,int) */
+  struct ExrChannel {
+    /** How each value is stored in the file. The numbers are those OpenEXR uses. */
+    enum class Type {
+      Uint=0, ///< 32-bit unsigned integer, taken from ids, for things like object IDs which mustn't be rounded
+      Half=1, ///< 16-bit float, taken from values, for colors and normals
+      Float=2 ///< 32-bit float, taken from values, for things like depth which need more than 11 bits of precision
+    };
+    std::string name;                ///< Name of channel, such as `R` or `N.X`. The part before the last dot names the layer.
+    Type type=Type::Half;            ///< How each value is stored
+    Observer<float> values=nullptr;  ///< Value of the first pixel, for Half and Float channels
+    Observer<uint32_t> ids=nullptr;  ///< Value of the first pixel, for Uint channels
+    size_t stride=1;                 ///< Number of values from one pixel to the next, such as 3 for one channel of an RGB buffer
+  };
+
+  /** Writers for image files. The format is picked from the extension of the file name:
+   *
+   *    * `.png` -- PNG, compressed with Deflate on several threads. 8-bit buffers are written as 8 bits per channel,
+   *      16-bit buffers as 16 bits, and floating point buffers are clamped to 0-1 and written as 8 bits.
+   *      Each row is filtered with whichever PNG filter makes it smallest, which for smooth renders
+   *      makes a file several times smaller than the raw pixels.
+   *    * `.exr` -- OpenEXR with half-float channels and ZIP compression, for high dynamic range output.
+   *      Floating point buffers are written as is, integer buffers are scaled to 0-1.
+   *    * `.ppm` or `.pgm` -- Uncompressed, as the frames have always been written.
+   *
+   * Buffers with 1, 3, or 4 channels are supported, as gray, RGB, or RGBA. OpenEXR files with any number of
+   * named channels, such as the depth, normals, and IDs of an AovFrame, can be written with
+   * writeEXR(const std::string&,int,int,std::vector<ExrChannel>,int).
+   */
+  class ImageFile {
+  private:
+    /** Compute the CRC-32 used by PNG
+     * @param data Data to check
+     * @param size Number of bytes
+     * @param crc CRC of any data before this, to continue from
+     * @return CRC
+     */
+    static uint32_t crc32(const uint8_t* data, size_t size, uint32_t crc=0) {
+      static const std::array<uint32_t,256> table=[] {
+        std::array<uint32_t,256> result;
+        for(uint32_t n=0;n<256;n++) {
+          uint32_t c=n;
+          for(int k=0;k<8;k++) c=(c&1)?0xEDB88320u^(c>>1):c>>1;
+          result[n]=c;
+        }
+        return result;
+      }();
+      crc=~crc;
+      for(size_t i=0;i<size;i++) crc=table[(crc^data[i])&0xFF]^(crc>>8);
+      return ~crc;
+    }
+    /** Append a big-endian 32-bit integer @param out Buffer to append to @param x Value */
+    static void putBE32(std::vector<uint8_t>& out, uint32_t x) {
+      for(int i=3;i>=0;i--) out.push_back(uint8_t(x>>(8*i)));
+    }
+    /** Append a little-endian integer @tparam T Type of integer @param out Buffer to append to @param x Value */
+    template<typename T>
+    static void putLE(std::vector<uint8_t>& out, T x) {
+      for(size_t i=0;i<sizeof(T);i++) out.push_back(uint8_t(uint64_t(x)>>(8*i)));
+    }
+    /** Append a PNG chunk @param out Buffer to append to @param type Four letter chunk type @param data Chunk contents */
+    static void pngChunk(std::vector<uint8_t>& out, const char* type, const std::vector<uint8_t>& data) {
+      putBE32(out,uint32_t(data.size()));
+      size_t start=out.size();
+      out.insert(out.end(),type,type+4);
+      out.insert(out.end(),data.begin(),data.end());
+      putBE32(out,crc32(out.data()+start,out.size()-start));
+    }
+    /** Convert a channel value to a fraction of full scale @tparam T Type of channel @param v Value @return Value as a double, 0 to 1 for integer types */
+    template<typename T>
+    static double toUnit(T v) {
+      if constexpr (std::is_floating_point_v<T>) return double(v);
+      else return double(v)/std::numeric_limits<T>::max();
+    }
+    /** Write a whole file
+     * @param filename Name of file
+     * @param data Contents of file
+     */
+    static void writeFile(const std::string& filename, const std::vector<uint8_t>& data) {
+      TraceScope span("write file","io","bytes",int64_t(data.size()));
+      std::ofstream ouf(filename,std::ios::binary|std::ios::trunc);
+      ouf.write(reinterpret_cast<const char*>(data.data()),std::streamsize(data.size()));
+      if(!ouf) throw std::runtime_error("Can't write image "+filename);
+    }
+    /** Check that the channel count is one that the formats can hold @param channels Number of channels */
+    static void checkChannels(int channels) {
+      if(channels!=1 && channels!=3 && channels!=4) throw std::runtime_error("Can't write an image with "+std::to_string(channels)+" channels");
+    }
+  public:
+    /** Convert a float to the nearest half-precision float, as used in OpenEXR
+     * @param f Value to convert
+     * @return Bits of the half-precision value
+     */
+    static uint16_t floatToHalf(float f) {
+      uint32_t x;
+      std::memcpy(&x,&f,sizeof(x));
+      uint32_t sign=(x>>16)&0x8000;
+      uint32_t mant=x&0x7FFFFF;
+      int exp=int((x>>23)&0xFF);
+      if(exp==255) return uint16_t(sign|0x7C00|(mant?0x200:0));
+      int e=exp-127+15;
+      if(e>=31) return uint16_t(sign|0x7C00);
+      if(e<=0) {
+        if(e<-10) return uint16_t(sign);
+        mant|=0x800000;
+        int shift=14-e;
+        uint32_t h=mant>>shift, rem=mant&((1u<<shift)-1), halfway=1u<<(shift-1);
+        if(rem>halfway || (rem==halfway && (h&1))) h++;
+        return uint16_t(sign|h);
+      }
+      uint32_t h=(uint32_t(e)<<10)|(mant>>13), rem=mant&0x1FFF;
+      //Rounding may carry into the exponent, which correctly rounds up to the next power of 2 or infinity
+      if(rem>0x1000 || (rem==0x1000 && (h&1))) h++;
+      return uint16_t(sign|h);
+    }
+    /** Write a PNG file
+     * @tparam T Type of one channel
+     * @param filename Name of file
+     * @param width Width in pixels
+     * @param height Height in pixels
+     * @param channels Number of channels in each pixel
+     * @param pixels Pixels, rows top to bottom, channels of each pixel together
+     * @param threads Number of threads to filter and compress with, or 0 to use all hardware threads
+     */
+    template<typename T>
+    static void writePNG(const std::string& filename, int width, int height, int channels, Observer<T> pixels, int threads=0) {
+      checkChannels(channels);
+      constexpr int bytes=std::is_same_v<T,uint16_t>?2:1;
+      const int bpp=channels*bytes;
+      const size_t rowBytes=size_t(width)*bpp;
+      //Convert to big-endian samples
+      std::vector<uint8_t> raw(rowBytes*height);
+      forEachParallel(size_t(height),threads,[&](size_t row) {
+        Observer<T> src=pixels+row*size_t(width)*channels;
+        uint8_t* dst=raw.data()+row*rowBytes;
+        for(size_t i=0;i<size_t(width)*channels;i++) {
+          if constexpr (bytes==2) {
+            dst[2*i]=uint8_t(src[i]>>8);
+            dst[2*i+1]=uint8_t(src[i]);
+          } else if constexpr (std::is_same_v<T,uint8_t>) {
+            dst[i]=src[i];
+          } else {
+            dst[i]=uint8_t(std::clamp(toUnit(src[i]),0.0,1.0)*255+0.5);
+          }
+        }
+      });
+      //Filter each row with whichever filter gives the smallest sum of absolute values
+      std::vector<uint8_t> filtered((rowBytes+1)*height);
+      forEachParallel(size_t(height),threads,[&](size_t row) {
+        const uint8_t* cur=raw.data()+row*rowBytes;
+        const uint8_t* up=row>0?cur-rowBytes:nullptr;
+        thread_local std::array<std::vector<uint8_t>,5> trial;
+        size_t bestSum=SIZE_MAX;
+        int best=0;
+        //Apply one filter to the row, with the prediction from the bytes to the left, above, and above left
+        auto apply=[&](int type, auto predict) {
+          trial[type].resize(rowBytes);
+          uint8_t* t=trial[type].data();
+          size_t sum=0;
+          for(size_t i=0;i<rowBytes;i++) {
+            int a=i>=size_t(bpp)?cur[i-bpp]:0;
+            int b=up?up[i]:0;
+            int c=(up && i>=size_t(bpp))?up[i-bpp]:0;
+            t[i]=uint8_t(cur[i]-predict(a,b,c));
+            sum+=std::abs(int(int8_t(t[i])));
+          }
+          if(sum<bestSum) {
+            bestSum=sum;
+            best=type;
+          }
+        };
+        apply(0,[](int,int,int){return 0;});
+        apply(1,[](int a,int,int){return a;});
+        apply(2,[](int,int b,int){return b;});
+        apply(3,[](int a,int b,int){return (a+b)/2;});
+        apply(4,[](int a,int b,int c){
+          int p=a+b-c, pa=std::abs(p-a), pb=std::abs(p-b), pc=std::abs(p-c);
+          return (pa<=pb && pa<=pc)?a:(pb<=pc?b:c);
+        });
+        uint8_t* dst=filtered.data()+row*(rowBytes+1);
+        dst[0]=uint8_t(best);
+        std::copy(trial[best].begin(),trial[best].end(),dst+1);
+      });
+      static constexpr uint8_t colorType[5]={0,0,0,2,6};
+      std::vector<uint8_t> out={0x89,'P','N','G','\r','\n',0x1A,'\n'};
+      std::vector<uint8_t> ihdr;
+      putBE32(ihdr,uint32_t(width));
+      putBE32(ihdr,uint32_t(height));
+      ihdr.insert(ihdr.end(),{uint8_t(8*bytes),colorType[channels],0,0,0});
+      pngChunk(out,"IHDR",ihdr);
+      pngChunk(out,"IDAT",Deflate::zlib(filtered.data(),filtered.size(),threads));
+      pngChunk(out,"IEND",{});
+      writeFile(filename,out);
+    }
+  private:
+    /** Write an OpenEXR file with ZIP compression. Blocks of 16 rows are compressed on separate threads.
+     * @param filename Name of file
+     * @param width Width in pixels
+     * @param height Height in pixels
+     * @param channels Name and pixel type of each channel, in alphabetical order of name as OpenEXR requires.
+     *   The types are 0 for UINT, 1 for HALF, and 2 for FLOAT.
+     * @param packRow Called as packRow(y,raw) to append row y of every channel in turn to raw, in the order of channels
+     * @param threads Number of threads to compress with, or 0 to use all hardware threads
+     */
+    template<typename F>
+    static void writeEXRBlocks(const std::string& filename, int width, int height, const std::vector<std::pair<std::string,int>>& channels, F packRow, int threads) {
+      std::vector<uint8_t> out={0x76,0x2F,0x31,0x01};
+      putLE<int32_t>(out,2);
+      auto attribute=[&](const char* name, const char* type, const std::vector<uint8_t>& value) {
+        out.insert(out.end(),name,name+strlen(name)+1);
+        out.insert(out.end(),type,type+strlen(type)+1);
+        putLE<int32_t>(out,int32_t(value.size()));
+        out.insert(out.end(),value.begin(),value.end());
+      };
+      std::vector<uint8_t> chlist;
+      size_t pixelBytes=0;
+      for(auto&& [name,type]:channels) {
+        chlist.insert(chlist.end(),name.begin(),name.end());
+        chlist.push_back(0);
+        putLE<int32_t>(chlist,type);
+        chlist.insert(chlist.end(),{0,0,0,0});
+        putLE<int32_t>(chlist,1);
+        putLE<int32_t>(chlist,1);
+        pixelBytes+=type==1?2:4;
+      }
+      chlist.push_back(0);
+      attribute("channels","chlist",chlist);
+      attribute("compression","compression",{3}); //ZIP_COMPRESSION, 16 rows per block
+      std::vector<uint8_t> box;
+      putLE<int32_t>(box,0);
+      putLE<int32_t>(box,0);
+      putLE<int32_t>(box,width-1);
+      putLE<int32_t>(box,height-1);
+      attribute("dataWindow","box2i",box);
+      attribute("displayWindow","box2i",box);
+      attribute("lineOrder","lineOrder",{0});
+      std::vector<uint8_t> one;
+      putLE<uint32_t>(one,0x3F800000); //1.0f
+      attribute("pixelAspectRatio","float",one);
+      attribute("screenWindowCenter","v2f",std::vector<uint8_t>(8,0));
+      attribute("screenWindowWidth","float",one);
+      out.push_back(0);
+      constexpr int blockRows=16;
+      size_t blocks=(height+blockRows-1)/blockRows;
+      std::vector<std::vector<uint8_t>> packed(blocks);
+      forEachParallel(blocks,threads,[&](size_t block) {
+        int y0=int(block)*blockRows, y1=std::min(height,y0+blockRows);
+        std::vector<uint8_t> raw;
+        raw.reserve(size_t(y1-y0)*width*pixelBytes);
+        for(int y=y0;y<y1;y++) packRow(y,raw);
+        //Split the low and high bytes apart, then store the difference of each byte from the one before
+        std::vector<uint8_t> tmp(raw.size());
+        size_t half=(raw.size()+1)/2;
+        for(size_t i=0;i<raw.size();i++) tmp[(i&1)?half+i/2:i/2]=raw[i];
+        for(size_t i=tmp.size()-1;i>0;i--) tmp[i]=uint8_t(int(tmp[i])-int(tmp[i-1])+128+256);
+        std::vector<uint8_t> z=Deflate::zlib(tmp.data(),tmp.size(),1);
+        std::vector<uint8_t>& dst=packed[block];
+        putLE<int32_t>(dst,y0);
+        const std::vector<uint8_t>& data=z.size()<raw.size()?z:raw;
+        putLE<int32_t>(dst,int32_t(data.size()));
+        dst.insert(dst.end(),data.begin(),data.end());
+      });
+      uint64_t offset=out.size()+blocks*sizeof(uint64_t);
+      for(auto&& block:packed) {
+        putLE<uint64_t>(out,offset);
+        offset+=block.size();
+      }
+      for(auto&& block:packed) out.insert(out.end(),block.begin(),block.end());
+      writeFile(filename,out);
+    }
+  public:
+    /** Write an OpenEXR file with half-float channels and ZIP compression. Blocks of 16 rows
+     * are compressed on separate threads.
+     * @tparam T Type of one channel
+     * @param filename Name of file
+     * @param width Width in pixels
+     * @param height Height in pixels
+     * @param channels Number of channels in each pixel
+     * @param pixels Pixels, rows top to bottom, channels of each pixel together
+     * @param threads Number of threads to compress with, or 0 to use all hardware threads
+     */
+    template<typename T>
+    static void writeEXR(const std::string& filename, int width, int height, int channels, Observer<T> pixels, int threads=0) {
+      checkChannels(channels);
+      //Channels are stored in alphabetical order of name
+      static const char* names[5][4]={{},{"Y"},{},{"B","G","R"},{"A","B","G","R"}};
+      static const int source[5][4]={{},{0},{},{2,1,0},{3,2,1,0}};
+      std::vector<std::pair<std::string,int>> chlist;
+      for(int c=0;c<channels;c++) chlist.emplace_back(names[channels][c],1); //HALF
+      writeEXRBlocks(filename,width,height,chlist,[&](int y, std::vector<uint8_t>& raw) {
+        for(int c=0;c<channels;c++) {
+          Observer<T> src=pixels+size_t(y)*width*channels+source[channels][c];
+          for(int x=0;x<width;x++) putLE<uint16_t>(raw,floatToHalf(float(toUnit(src[size_t(x)*channels]))));
+        }
+      },threads);
+    }
+    /** Write an OpenEXR file with any number of named channels, such as the layers of an AovFrame. Channels
+     * named like `N.X` are shown as layer `N` by most programs which read OpenEXR. Channels are sorted by name
+     * in the file, so they can be given in any order.
+     * @param filename Name of file
+     * @param width Width in pixels
+     * @param height Height in pixels
+     * @param channels Channels to write
+     * @param threads Number of threads to compress with, or 0 to use all hardware threads
+     */
+    static void writeEXR(const std::string& filename, int width, int height, std::vector<ExrChannel> channels, int threads=0) {
+      std::sort(channels.begin(),channels.end(),[](const ExrChannel& a, const ExrChannel& b){return a.name<b.name;});
+      std::vector<std::pair<std::string,int>> chlist;
+      for(auto&& channel:channels) chlist.emplace_back(channel.name,int(channel.type));
+      writeEXRBlocks(filename,width,height,chlist,[&](int y, std::vector<uint8_t>& raw) {
+        for(auto&& channel:channels) {
+          size_t i=size_t(y)*width*channel.stride;
+          for(int x=0;x<width;x++,i+=channel.stride) switch(channel.type) {
+            case ExrChannel::Type::Uint:  putLE<uint32_t>(raw,channel.ids[i]); break;
+            case ExrChannel::Type::Half:  putLE<uint16_t>(raw,floatToHalf(channel.values[i])); break;
+            case ExrChannel::Type::Float: {
+              uint32_t bits;
+              std::memcpy(&bits,&channel.values[i],sizeof(bits));
+              putLE<uint32_t>(raw,bits);
+              break;
+            }
+          }
+        }
+      },threads);
+    }
+    /** Write an uncompressed PPM (or PGM for one channel) file. 16-bit buffers are written
+     * with 16 bits per channel, everything else with 8.
+     * @tparam T Type of one channel
+     * @param filename Name of file
+     * @param width Width in pixels
+     * @param height Height in pixels
+     * @param channels Number of channels in each pixel, 1 or 3
+     * @param pixels Pixels, rows top to bottom, channels of each pixel together
+     */
+    template<typename T>
+    static void writePPM(const std::string& filename, int width, int height, int channels, Observer<T> pixels) {
+      if(channels!=1 && channels!=3) throw std::runtime_error("Can't write a PPM with "+std::to_string(channels)+" channels");
+      constexpr bool wide=std::is_same_v<T,uint16_t>;
+      std::string header=std::string(channels==1?"P5":"P6")+"\n"+std::to_string(width)+" "+std::to_string(height)+"\n"+(wide?"65535":"255")+"\n";
+      std::vector<uint8_t> out(header.begin(),header.end());
+      size_t n=size_t(width)*height*channels;
+      for(size_t i=0;i<n;i++) {
+        if constexpr (wide) {
+          out.push_back(uint8_t(pixels[i]>>8));
+          out.push_back(uint8_t(pixels[i]));
+        } else if constexpr (std::is_same_v<T,uint8_t>) {
+          out.push_back(pixels[i]);
+        } else {
+          out.push_back(uint8_t(std::clamp(toUnit(pixels[i]),0.0,1.0)*255+0.5));
+        }
+      }
+      writeFile(filename,out);
+    }
+    /** Write an image file, with the format picked from the extension of the file name
+     * @tparam T Type of one channel
+     * @param filename Name of file, ending in .png, .exr, .ppm, or .pgm
+     * @param width Width in pixels
+     * @param height Height in pixels
+     * @param channels Number of channels in each pixel
+     * @param pixels Pixels, rows top to bottom, channels of each pixel together
+     * @param threads Number of threads to compress with, or 0 to use all hardware threads
+     */
+    template<typename T>
+    static void write(const std::string& filename, int width, int height, int channels, Observer<T> pixels, int threads=0) {
+      TraceScope span("write image","io");
+      std::string ext=filename.substr(std::min(filename.size(),filename.rfind('.')));
+      std::transform(ext.begin(),ext.end(),ext.begin(),[](unsigned char c){return char(std::tolower(c));});
+      if(ext==".png") writePNG(filename,width,height,channels,pixels,threads);
+      else if(ext==".exr") writeEXR(filename,width,height,channels,pixels,threads);
+      else if(ext==".ppm" || ext==".pgm") writePPM(filename,width,height,channels,pixels);
+      else throw std::runtime_error("Don't know how to write image "+filename);
+    }
+  };
+
+  /** Writes images on a background thread, so that the next frame of an animation can be rendered while the
+   * last one is compressed and written. Frames wait in a queue, and if the queue is full, write() waits for
+   * room, so a slow disk can't pile up unlimited frames in memory.
+   *
+   *     ImageWriter writer;
+   *     for(int i=0;i<frames;i++) {
+   *       ...move things...
+   *       writer.write(scene.render(width,height),"Frames/image"+std::to_string(i)+".png");
+   *     }
+   *     writer.flush();
+   *
+   * If writing a frame fails, the exception is thrown from the next call to write() or flush().
+   * The destructor waits for all queued frames to be written.
+   */
+  class ImageWriter {
+  private:
+    std::deque<std::function<void()>> queue; ///< Frames waiting to be written
+    std::mutex mutex;                        ///< Guards everything below
+    std::condition_variable changed;         ///< Signalled whenever the queue or busy changes
+    bool stopping=false;                     ///< Set by the destructor to end the thread once the queue is empty
+    bool busy=false;                         ///< True while the thread is writing a frame
+    std::exception_ptr error;                ///< First failure from writing a frame, not yet thrown
+    size_t capacity;                         ///< Most frames to hold in the queue
+    std::thread thread;                      ///< Background thread which writes the frames
+    /** Body of the background thread */
+    void run() {
+      Timeline::nameThread("image writer");
+      std::unique_lock<std::mutex> lock(mutex);
+      while(true) {
+        changed.wait(lock,[this]{return stopping || !queue.empty();});
+        if(queue.empty()) return;
+        std::function<void()> job=std::move(queue.front());
+        queue.pop_front();
+        busy=true;
+        changed.notify_all();
+        lock.unlock();
+        try {
+          job();
+        } catch(...) {
+          lock.lock();
+          if(!error) error=std::current_exception();
+          lock.unlock();
+        }
+        lock.lock();
+        busy=false;
+        changed.notify_all();
+      }
+    }
+    /** Throw any failure from the background thread. Call with the lock held. */
+    void rethrow() {
+      if(error) {
+        std::exception_ptr e=error;
+        error=nullptr;
+        std::rethrow_exception(e);
+      }
+    }
+  public:
+    int threads=0; ///< Number of threads to compress each image with, or 0 to use all hardware threads
+    /** Construct a writer and start its thread
+     * @param Lcapacity Most frames to hold waiting to be written, not counting the one being written
+     */
+    explicit ImageWriter(size_t Lcapacity=2):capacity(std::max<size_t>(Lcapacity,1)) {
+      thread=std::thread([this]{run();});
+    }
+    ImageWriter(const ImageWriter&)=delete;            ///< Not copyable, since it owns a thread
+    ImageWriter& operator=(const ImageWriter&)=delete; ///< Not copyable, since it owns a thread
+    /** Write all queued frames, then stop the thread. Failures are ignored here; call flush() first to see them. */
+    ~ImageWriter() {
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping=true;
+      }
+      changed.notify_all();
+      thread.join();
+    }
+    /** Queue a frame to be written. The buffer is moved into the queue, so there is no copy.
+     * @param pixbuf Frame to write
+     * @param filename Name of file, with the format picked from the extension as in ImageFile::write()
+     */
+    template<int pixdepth, typename pixtype>
+    void write(PixelBuffer<pixdepth,pixtype>&& pixbuf, const std::string& filename) {
+      auto frame=std::make_shared<PixelBuffer<pixdepth,pixtype>>(std::move(pixbuf));
+      int n=threads;
+      post([frame,filename,n]{frame->write(filename,n);});
+    }
+    /** Queue any job to run on the background thread. Jobs run one at a time in the order they
+     * were queued, so this can be used to write frames to a stream in order. As with write(), this waits
+     * if the queue is full, and throws any failure from an earlier job.
+     * @param job Function to run
+     */
+    void post(std::function<void()> job) {
+      std::unique_lock<std::mutex> lock(mutex);
+      rethrow();
+      changed.wait(lock,[this]{return queue.size()<capacity;});
+      queue.push_back(std::move(job));
+      changed.notify_all();
+    }
+    /** Wait until every queued frame has been written
+     */
+    void flush() {
+      std::unique_lock<std::mutex> lock(mutex);
+      changed.wait(lock,[this]{return queue.empty() && !busy;});
+      rethrow();
+    }
+  };
+}
+
+#endif //KWANTRACE_IMAGEOUTPUT_H
@@ -5,13 +5,94 @@
 #ifndef KWANTRACE_LIGHT_H
 #define KWANTRACE_LIGHT_H
 
+#include <atomic>
+
 namespace kwantrace {
+  /** Counts of shadow tests against one light, see Light::shadowStats() */
+  struct ShadowStats {
+    uint64_t tests=0;     ///< Number of shadow rays tested against this light
+    uint64_t occluded=0;  ///< Number of those rays which were blocked
+    uint64_t cacheHits=0; ///< Number of blocked rays which were caught by the last-occluder cache, without searching the scene
+  };
+
   /** Class describing a light source. This is both a base
    * class, and a concrete implementation of a point light
    * source.
    *
+   * Each light has a shadow cache, like the POV-Ray light buffer. Neighboring
+   * points are usually shadowed by the same object, so the light remembers the
+   * last object which blocked it, and tests that one object first before searching the
+   * whole scene. The cache is per thread, so threads don't fight over it,
+   * and is emptied at each prepareRender().
    */
   class Light {
+  private:
+    /** One entry in the per-thread shadow cache */
+    struct CacheEntry {
+      uint64_t key=0;                       ///< cacheKey of the light this entry belongs to, 0 if unused
+      Observer<Primitive> occluder=nullptr; ///< Last object which blocked the light
+    };
+    static const constexpr size_t cacheSize=1024; ///< Number of entries in each thread's shadow cache. Must be a power of 2.
+    /** Make a fresh cache key. Every call gives a different key, so an entry left over from a
+     * previous render, or from a light which no longer exists, can never be mistaken for a current one.
+     * @return New key, never 0 */
+    static uint64_t newCacheKey() {
+      static std::atomic<uint64_t> next{1};
+      return next.fetch_add(1,std::memory_order_relaxed);
+    }
+    uint64_t cacheKey=newCacheKey(); ///< Key of this light in the shadow cache, renewed by prepareRender()
+    std::atomic<uint64_t> tests{0};     ///< See ShadowStats::tests
+    std::atomic<uint64_t> occluded{0};  ///< See ShadowStats::occluded
+    std::atomic<uint64_t> cacheHits{0}; ///< See ShadowStats::cacheHits
+    /** Get the switch for counting shadow tests, shared by all lights @return Switch */
+    static std::atomic<bool>& statsEnabled() {
+      static std::atomic<bool> _enabled{false};
+      return _enabled;
+    }
+    /** Find this light's last occluder in the cache of the calling thread. Lights share
+     * slots, so an entry for a different light is treated as empty.
+     * @return Reference to the last occluder, nullptr if there isn't one */
+    Observer<Primitive>& lastOccluder() {
+      thread_local std::array<CacheEntry,cacheSize> cache;
+      CacheEntry& entry=cache[cacheKey&(cacheSize-1)];
+      if(entry.key!=cacheKey) {
+        entry.key=cacheKey;
+        entry.occluder=nullptr;
+      }
+      return entry.occluder;
+    }
+  protected:
+    /** Check if a single shadow ray is blocked. Only objects between the start of the ray
+     * and t=1 block it. The last object which blocked this light on this thread is checked first,
+     * and only if it doesn't block this ray is the whole scene searched. If enableShadowStats() is on,
+     * each call counts as one test in shadowStats().
+     * @param blocker All objects in a scene that might block this light
+     * @param r Shadow ray, with t=1 at the point on the light
+     * @return True if the ray is blocked
+     *
+     * \bug The scene search still finds the nearest intersection, rather than doing an
+     * early exit as soon as the ray is blocked by anything.
+     */
+    bool blocked(const Renderable& blocker, const Ray& r) {
+      bool count=statsEnabled().load(std::memory_order_relaxed);
+      if(count) tests.fetch_add(1,std::memory_order_relaxed);
+      Observer<Primitive>& last=lastOccluder();
+      double t;
+      if(last && last->intersect(r,t) && t<1) {
+        if(count) {
+          occluded.fetch_add(1,std::memory_order_relaxed);
+          cacheHits.fetch_add(1,std::memory_order_relaxed);
+        }
+        return true;
+      }
+      Observer<Primitive> occluder=blocker.intersect(r,t);
+      if(occluder && t<1) {
+        last=occluder;
+        if(count) occluded.fetch_add(1,std::memory_order_relaxed);
+        return true;
+      }
+      return false;
+    }
   public:
     static const constexpr double initialDist=1e-6; ///< Yuck! Ugly hack coefficient
     Position location; ///< Position of the light in world coordinates
@@ -21,10 +102,47 @@ namespace kwantrace {
      * @param Lcolor Color of light
      */
     Light(const Position& Llocation, const ObjectColor& Lcolor):location(Llocation),color(Lcolor) {}
+    /** Construct a black light at the origin, for reading from a scene file */
+    Light():location(0,0,0),color(ObjectColor::Zero()) {}
     virtual ~Light()=default; ///< Allow subclasses
+    typedef Light SceneBase; ///< Root of the hierarchy in scene files, see SceneTypes
+    /** Write this light to a scene file @param out Scene file being written */
+    virtual void write(SceneWriter& out) const {
+      out.put(location);
+      out.put(color);
+    }
+    /** Read this light from a scene file @param in Scene file being read */
+    virtual void read(SceneReader& in) {
+      in.get(location);
+      in.get(color);
+    }
 
-    /** Prepare for render. This class doesn't need to do anything. */
-    virtual void prepareRender() {};
+    /** Prepare for render. This empties the shadow cache, since the objects in it might
+     * have moved or been destroyed, and zeroes the shadow statistics. Subclasses that override
+     * this must call it. */
+    virtual void prepareRender() {
+      cacheKey=newCacheKey();
+      resetShadowStats();
+    };
+    /** Turn counting of shadow tests on or off for every light. Counting is off unless turned on, since
+     * every thread adds to the same counters of a light for each shadow ray, which makes the threads fight over
+     * them. With counting off, the shadow ray path only reads this switch.
+     * @param on True to count
+     */
+    static void enableShadowStats(bool on=true) {statsEnabled().store(on,std::memory_order_relaxed);}
+    /** Get the counts of shadow tests against this light since the last prepareRender()
+     * or resetShadowStats(). Tests are only counted while enableShadowStats() is on.
+     * The fraction of blocked rays caught by the cache is cacheHits/occluded.
+     * @return Copy of the counts */
+    ShadowStats shadowStats() const {
+      return ShadowStats{tests.load(std::memory_order_relaxed),occluded.load(std::memory_order_relaxed),cacheHits.load(std::memory_order_relaxed)};
+    }
+    /** Zero the counts of shadow tests against this light */
+    void resetShadowStats() {
+      tests=0;
+      occluded=0;
+      cacheHits=0;
+    }
 
     /** Construct a ray from the given position to the light
      *
@@ -58,14 +176,11 @@ namespace kwantrace {
      * @param r Ray from intersection point to light
      * @return Fraction of this light seen at the original point, IE not blocked.
      *
-     * \bug This currently checks all objects along the ray all the way out
-     * to infinity. We should only check objects out to t=1, and we should do an early
-     * exit if the ray is blocked by anything, rather than try to find the nearest
-     * intersection.
+     * Only objects between the point and the light, IE with t<1, block the light.
+     * See blocked() for details.
      */
     virtual double amountVisible(const Renderable& blocker, const Ray& r) {
-      double t_dontcare;
-      return blocker.intersect(r,t_dontcare)?0.0:1.0;
+      return blocked(blocker,r)?0.0:1.0;
     }
     /** Calculate the amount of this light that is visible. See amountVisible(Renderable&,Ray&) for
      * details.
@@ -77,6 +192,7 @@ namespace kwantrace {
       return amountVisible(blocker,rayTo(r0));
     }
   };
+  inline const bool lightRegistered=SceneTypes::add<Light>("Light"); ///< Lets point lights be saved in scene files
   typedef std::vector<std::shared_ptr<Light>> LightList; ///< Type name alias for a collection of lights
 }
 
@@ -0,0 +1,164 @@
+/* KwanTrace - C++ Ray Tracing Library
+Copyright (C) 2021 by kwan3217
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef KWANTRACE_LIGHTTREE_H
+#define KWANTRACE_LIGHTTREE_H
+
+#include <algorithm>
+#include <numeric>
+
+namespace kwantrace {
+  /** Bounding volume hierarchy over the lights in a scene, used to pick a few lights at each
+   * shading point out of a list which may have thousands in it.
+   *
+   * Each node of the tree holds the bounding box of the lights under it and their total power.
+   * To pick a light for a point, we start at the root and at each node step into one of the two
+   * children at random, with probability proportional to an estimate of how much light that
+   * child sends to the point: its power divided by the squared distance to it. A child which
+   * is entirely behind the surface at the point can't light it, so it is never picked. At the
+   * leaf we have one light, and the product of the probabilities of all the steps is the
+   * probability of picking that light.
+   *
+   * A shader which divides the contribution of each picked light by this probability, and
+   * averages over the picks, gets an unbiased estimate of the sum over all lights, while only
+   * casting one shadow ray per pick. Bright, near lights are picked often and dim, far ones
+   * rarely, so the noise is much lower than picking uniformly. See ShadingContext::lightWeight().
+   */
+  class LightTree {
+  private:
+    /** One node of the tree */
+    struct Node {
+      Eigen::Vector3d lo;   ///< Low corner of bounding box of all lights under this node
+      Eigen::Vector3d hi;   ///< High corner of bounding box of all lights under this node
+      double power=0;       ///< Total power of all lights under this node
+      int32_t child=-1;     ///< Index of first child. The second child immediately follows it. -1 for a leaf
+      int32_t light=-1;     ///< Index of light in the light list, for a leaf. -1 for an interior node
+    };
+    std::vector<Node> nodes; ///< All nodes, root first
+    /** Build a subtree over part of the light order
+     * @param lightList All lights in the scene
+     * @param order Indexes into lightList. This part of it is reordered by the build.
+     * @param begin First entry in order to include
+     * @param end One past last entry in order to include
+     * @param index Index of node to fill. It must already exist in nodes.
+     */
+    void build(const LightList& lightList, std::vector<int32_t>& order, size_t begin, size_t end, size_t index) {
+      Node node;
+      node.lo=Eigen::Vector3d::Constant( std::numeric_limits<double>::infinity());
+      node.hi=Eigen::Vector3d::Constant(-std::numeric_limits<double>::infinity());
+      for(size_t i=begin;i<end;i++) {
+        const Light& light=*lightList[order[i]];
+        node.lo=node.lo.cwiseMin(light.location);
+        node.hi=node.hi.cwiseMax(light.location);
+        node.power+=power(light);
+      }
+      if(end-begin==1) {
+        node.light=order[begin];
+        nodes[index]=node;
+        return;
+      }
+      //Split at the median along the longest axis of the box
+      int axis;
+      (node.hi-node.lo).maxCoeff(&axis);
+      size_t mid=(begin+end)/2;
+      std::nth_element(order.begin()+begin,order.begin()+mid,order.begin()+end,[&](int32_t a, int32_t b) {
+        return lightList[a]->location[axis]<lightList[b]->location[axis];
+      });
+      node.child=int32_t(nodes.size());
+      nodes.resize(nodes.size()+2);
+      nodes[index]=node;
+      build(lightList,order,begin,mid,node.child);
+      build(lightList,order,mid,end,node.child+1);
+    }
+    /** Estimate how much light a node sends to a point
+     * @param node Node to check
+     * @param r Point being shaded
+     * @param n Surface normal at the point
+     * @return Importance of this node, zero if none of its lights can reach the point
+     */
+    static double importance(const Node& node, const Position& r, const Direction& n) {
+      Eigen::Vector3d center=(node.lo+node.hi)/2;
+      Eigen::Vector3d halfSize=(node.hi-node.lo)/2;
+      //Greatest height of any corner of the box above the tangent plane
+      if(n.dot(center-r)+n.cwiseAbs().dot(halfSize)<=0) return 0;
+      //Don't let the distance get smaller than the box, or a point near a big cluster
+      //would always be sent to whichever half happened to have its center closest
+      double dist2=std::max((center-r).squaredNorm(),halfSize.squaredNorm());
+      return node.power/std::max(dist2,1e-12);
+    }
+  public:
+    /** Measure the power of a light, used to weight how often it is picked
+     * @param light Light to measure
+     * @return Mean of the red, green, and blue components of the light color
+     */
+    static double power(const Light& light) {
+      return std::max(light.color.head<3>().mean(),0.0);
+    }
+    /** Build the tree. Call this after all lights are in their final position, such as from
+     * Scene::prepareRender(). It takes O(n log n) time in the number of lights.
+     * @param lightList All lights in the scene
+     */
+    void build(const LightList& lightList) {
+      TraceScope span("light tree","build","lights",int64_t(lightList.size()));
+      nodes.clear();
+      if(lightList.empty()) return;
+      std::vector<int32_t> order(lightList.size());
+      std::iota(order.begin(),order.end(),0);
+      nodes.reserve(2*lightList.size()-1);
+      nodes.resize(1);
+      build(lightList,order,0,order.size(),0);
+    }
+    /** Check if the tree has any lights in it @return True if there are no lights */
+    bool empty() const {return nodes.empty();}
+    /** Pick a light at random, weighted by how much it is likely to contribute to a point.
+     * @param[in] r Point being shaded
+     * @param[in] n Surface normal at the point
+     * @param[in] u Uniform random number from 0 to 1
+     * @param[out] pdf Probability that this light was picked
+     * @return Index of picked light in the light list the tree was built from, or -1 if no light can reach the point
+     */
+    int sample(const Position& r, const Direction& n, double u, double& pdf) const {
+      pdf=1;
+      if(nodes.empty()) return -1;
+      const Node* node=&nodes[0];
+      if(importance(*node,r,n)<=0) return -1;
+      while(node->child>=0) {
+        const Node& a=nodes[node->child];
+        const Node& b=nodes[node->child+1];
+        double ia=importance(a,r,n);
+        double ib=importance(b,r,n);
+        if(ia+ib<=0) return -1;
+        double pa=ia/(ia+ib);
+        //Reuse the random number for the next level by stretching whichever part of it we picked back to 0..1
+        if(u<pa) {
+          u=u/pa;
+          pdf*=pa;
+          node=&a;
+        } else {
+          u=(u-pa)/(1-pa);
+          pdf*=1-pa;
+          node=&b;
+        }
+        u=std::min(u,std::nextafter(1.0,0.0));
+      }
+      return node->light;
+    }
+  };
+}
+
+#endif //KWANTRACE_LIGHTTREE_H
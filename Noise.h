@@ -0,0 +1,198 @@
+/* KwanTrace - C++ Ray Tracing Library
+Copyright (C) 2021 by kwan3217
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef KWANTRACE_NOISE_H
+#define KWANTRACE_NOISE_H
+
+#include <array>
+#include "CpuDispatch.h"
+#if KWANTRACE_DISPATCH
+#include <immintrin.h>
+/** Compile a function or lambda for AVX2, whatever the whole program is compiled for */
+#define KWANTRACE_AVX2 __attribute__((target("avx2")))
+#endif
+
+namespace kwantrace {
+  /** Gradient noise, as in Ken Perlin's [Improved Noise](https://mrl.cs.nyu.edu/~perlin/noise/).
+   * This is a smooth pseudo-random scalar field, which is zero at every integer lattice point
+   * and varies between about -1 and 1 in between. It is the basis of all of the procedural
+   * patterns in Pattern.h.
+   *
+   * The hot kernel is noise4(), which evaluates four points at once. It is compiled for AVX2 as well as for the
+   * baseline, and when CpuDispatch allows AVX2, it does all four points in one pass with 256-bit vectors, using
+   * gathers for the permutation table lookups. Otherwise it just calls noise() four times. Both paths give the same
+   * answer to the bit, since AVX2 doesn't include FMA.
+   */
+  class Noise {
+  private:
+    /** Permutation table, repeated twice so that indexes up to 511 don't need to wrap
+     * @return Reference to table */
+    static const std::array<int32_t,512>& perm() {
+      static const std::array<int32_t,512> table=[] {
+        std::array<int32_t,512> result{};
+        for(int i=0;i<256;i++) result[i]=i;
+        uint32_t seed=0x4B57414E; //Fixed seed, so patterns are the same every run
+        for(int i=255;i>0;i--) {
+          seed=seed*1664525u+1013904223u;
+          std::swap(result[i],result[(seed>>8)%(i+1)]);
+        }
+        for(int i=0;i<256;i++) result[i+256]=result[i];
+        return result;
+      }();
+      return table;
+    }
+    /** Smoothstep-like interpolation weight, with zero first and second derivatives at 0 and 1
+     * @param t Fractional position in lattice cell
+     * @return Interpolation weight */
+    static double fade(double t) {return t*t*t*(t*(t*6-15)+10);}
+    /** Linear interpolation @param t weight @param a value at t=0 @param b value at t=1 @return interpolated value */
+    static double lerp(double t, double a, double b) {return a+t*(b-a);}
+    /** Dot product of a pseudo-random gradient with the offset from a lattice point
+     * @param h Hash of lattice point, which picks one of 12 gradients
+     * @param x X offset from lattice point
+     * @param y Y offset from lattice point
+     * @param z Z offset from lattice point
+     * @return Dot product */
+    static double grad(int h, double x, double y, double z) {
+      h&=15;
+      double u=h<8?x:y;
+      double v=h<4?y:(h==12||h==14?x:z);
+      return ((h&1)?-u:u)+((h&2)?-v:v);
+    }
+#if KWANTRACE_DISPATCH
+    /** Widen a mask of four 32-bit lanes to four 64-bit lanes @param m Mask @return Mask of doubles */
+    KWANTRACE_AVX2 static __m256d mask(__m128i m) {return _mm256_castsi256_pd(_mm256_cvtepi32_epi64(m));}
+    /** Vector version of grad(), see there for details */
+    KWANTRACE_AVX2 static __m256d grad(__m128i h, __m256d x, __m256d y, __m256d z) {
+      const __m256d sign=_mm256_set1_pd(-0.0);
+      h=_mm_and_si128(h,_mm_set1_epi32(15));
+      __m256d lt8=mask(_mm_cmplt_epi32(h,_mm_set1_epi32(8)));
+      __m256d lt4=mask(_mm_cmplt_epi32(h,_mm_set1_epi32(4)));
+      __m256d is12or14=mask(_mm_or_si128(_mm_cmpeq_epi32(h,_mm_set1_epi32(12)),_mm_cmpeq_epi32(h,_mm_set1_epi32(14))));
+      __m256d u=_mm256_blendv_pd(y,x,lt8);
+      __m256d v=_mm256_blendv_pd(_mm256_blendv_pd(z,x,is12or14),y,lt4);
+      __m256d flipU=mask(_mm_cmpeq_epi32(_mm_and_si128(h,_mm_set1_epi32(1)),_mm_set1_epi32(1)));
+      __m256d flipV=mask(_mm_cmpeq_epi32(_mm_and_si128(h,_mm_set1_epi32(2)),_mm_set1_epi32(2)));
+      u=_mm256_xor_pd(u,_mm256_and_pd(flipU,sign));
+      v=_mm256_xor_pd(v,_mm256_and_pd(flipV,sign));
+      return _mm256_add_pd(u,v);
+    }
+    /** Vector version of fade(), see there for details */
+    KWANTRACE_AVX2 static __m256d fade(__m256d t) {
+      __m256d r=_mm256_sub_pd(_mm256_mul_pd(t,_mm256_set1_pd(6)),_mm256_set1_pd(15));
+      r=_mm256_add_pd(_mm256_mul_pd(t,r),_mm256_set1_pd(10));
+      return _mm256_mul_pd(_mm256_mul_pd(_mm256_mul_pd(t,t),t),r);
+    }
+    /** Vector version of lerp(), see there for details */
+    KWANTRACE_AVX2 static __m256d lerp(__m256d t, __m256d a, __m256d b) {return _mm256_add_pd(a,_mm256_mul_pd(t,_mm256_sub_pd(b,a)));}
+    /** AVX2 version of noise4(), see there for details */
+    KWANTRACE_AVX2 static void noise4AVX2(const double* x, const double* y, const double* z, double* result) {
+      const int32_t* p=perm().data();
+      const __m256d one=_mm256_set1_pd(1.0);
+      const __m128i m255=_mm_set1_epi32(255);
+      const __m128i i1=_mm_set1_epi32(1);
+      __m256d vx=_mm256_loadu_pd(x), vy=_mm256_loadu_pd(y), vz=_mm256_loadu_pd(z);
+      __m256d fx=_mm256_floor_pd(vx), fy=_mm256_floor_pd(vy), fz=_mm256_floor_pd(vz);
+      //Wrap to 0..255 in floating point first, so that large coordinates don't overflow the 32-bit conversion
+      auto wrap=[&](__m256d f) KWANTRACE_AVX2 {
+        const __m256d n=_mm256_set1_pd(256.0);
+        __m256d w=_mm256_sub_pd(f,_mm256_mul_pd(n,_mm256_floor_pd(_mm256_div_pd(f,n))));
+        return _mm_and_si128(_mm256_cvtpd_epi32(w),m255);
+      };
+      __m128i X=wrap(fx), Y=wrap(fy), Z=wrap(fz);
+      vx=_mm256_sub_pd(vx,fx); vy=_mm256_sub_pd(vy,fy); vz=_mm256_sub_pd(vz,fz);
+      __m256d u=fade(vx), v=fade(vy), w=fade(vz);
+      auto gather=[&](__m128i i) KWANTRACE_AVX2 {return _mm_i32gather_epi32(p,i,4);};
+      __m128i A =_mm_add_epi32(gather(X),Y);
+      __m128i AA=_mm_add_epi32(gather(A),Z),             AB=_mm_add_epi32(gather(_mm_add_epi32(A,i1)),Z);
+      __m128i B =_mm_add_epi32(gather(_mm_add_epi32(X,i1)),Y);
+      __m128i BA=_mm_add_epi32(gather(B),Z),             BB=_mm_add_epi32(gather(_mm_add_epi32(B,i1)),Z);
+      __m256d x1=_mm256_sub_pd(vx,one), y1=_mm256_sub_pd(vy,one), z1=_mm256_sub_pd(vz,one);
+      __m256d r=lerp(w,lerp(v,lerp(u,grad(gather(AA),vx,vy,vz),grad(gather(BA),x1,vy,vz)),
+                              lerp(u,grad(gather(AB),vx,y1,vz),grad(gather(BB),x1,y1,vz))),
+                       lerp(v,lerp(u,grad(gather(_mm_add_epi32(AA,i1)),vx,vy,z1),grad(gather(_mm_add_epi32(BA,i1)),x1,vy,z1)),
+                              lerp(u,grad(gather(_mm_add_epi32(AB,i1)),vx,y1,z1),grad(gather(_mm_add_epi32(BB,i1)),x1,y1,z1))));
+      _mm256_storeu_pd(result,r);
+    }
+#endif
+  public:
+    /** Evaluate noise at a point
+     * @param x X coordinate
+     * @param y Y coordinate
+     * @param z Z coordinate
+     * @return Noise value, roughly from -1 to 1
+     */
+    static double noise(double x, double y, double z) {
+      const auto& p=perm();
+      double fx=std::floor(x), fy=std::floor(y), fz=std::floor(z);
+      int X=int(int64_t(fx)&255), Y=int(int64_t(fy)&255), Z=int(int64_t(fz)&255);
+      x-=fx; y-=fy; z-=fz;
+      double u=fade(x), v=fade(y), w=fade(z);
+      int A=p[X]+Y, AA=p[A]+Z, AB=p[A+1]+Z;
+      int B=p[X+1]+Y, BA=p[B]+Z, BB=p[B+1]+Z;
+      return lerp(w,lerp(v,lerp(u,grad(p[AA  ],x  ,y  ,z  ),grad(p[BA  ],x-1,y  ,z  )),
+                           lerp(u,grad(p[AB  ],x  ,y-1,z  ),grad(p[BB  ],x-1,y-1,z  ))),
+                    lerp(v,lerp(u,grad(p[AA+1],x  ,y  ,z-1),grad(p[BA+1],x-1,y  ,z-1)),
+                           lerp(u,grad(p[AB+1],x  ,y-1,z-1),grad(p[BB+1],x-1,y-1,z-1))));
+    }
+    /** Evaluate noise at a point @param r Point @return Noise value, roughly from -1 to 1 */
+    static double noise(const Eigen::Vector3d& r) {return noise(r.x(),r.y(),r.z());}
+    /** Evaluate noise at four points at once
+     * @param[in] x X coordinates of the points
+     * @param[in] y Y coordinates of the points
+     * @param[in] z Z coordinates of the points
+     * @param[out] result Noise values at the points
+     */
+    static void noise4(const double* x, const double* y, const double* z, double* result) {
+#if KWANTRACE_DISPATCH
+      if(CpuDispatch::active()>=IsaLevel::AVX2) {
+        noise4AVX2(x,y,z,result);
+        return;
+      }
+#endif
+      for(int i=0;i<4;i++) result[i]=noise(x[i],y[i],z[i]);
+    }
+    /** Fractal sum of the absolute value of noise over several octaves, like the POV-Ray turbulence.
+     * Each octave has lambda times the frequency and omega times the amplitude of the previous one.
+     * The octaves are independent of each other, so they are evaluated four at a time with noise4().
+     *
+     * @param r Point to evaluate at
+     * @param octaves Number of octaves
+     * @param omega Amplitude ratio between successive octaves
+     * @param lambda Frequency ratio between successive octaves
+     * @return Turbulence value, zero or greater
+     */
+    static double turbulence(const Eigen::Vector3d& r, int octaves=6, double omega=0.5, double lambda=2.0) {
+      double result=0;
+      double freq=1, amp=1;
+      for(int i=0;i<octaves;i+=4) {
+        alignas(32) double x[4], y[4], z[4], n[4], a[4];
+        for(int j=0;j<4;j++) {
+          x[j]=r.x()*freq; y[j]=r.y()*freq; z[j]=r.z()*freq;
+          a[j]=(i+j<octaves)?amp:0;
+          freq*=lambda; amp*=omega;
+        }
+        noise4(x,y,z,n);
+        for(int j=0;j<4;j++) result+=a[j]*std::abs(n[j]);
+      }
+      return result;
+    }
+  };
+}
+
+#endif //KWANTRACE_NOISE_H
@@ -0,0 +1,483 @@
+/* KwanTrace - C++ Ray Tracing Library
+Copyright (C) 2021 by kwan3217
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef KWANTRACE_PATHTRACER_H
+#define KWANTRACE_PATHTRACER_H
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+namespace kwantrace {
+  /** Features of the first surface a camera ray hits, used to guide a Denoiser */
+  struct GuideSample {
+    RayColor albedo=RayColor::Zero();  ///< Pigment color of the surface, or black if the ray missed or the surface has no pigment
+    Direction normal=Direction(0,0,0); ///< Surface normal, on the side facing the camera, or zero if the ray missed
+    double depth=0;                    ///< Distance from the camera to the surface, or zero if the ray missed. Averaged over a pixel, the mean over the rays which hit a surface.
+    RayColor emission=RayColor::Zero();///< Light seen directly, if the ray hit the surface of a light first, such as an AreaLight, or black if not. Averaged over a pixel, the part of its color which comes straight from lights.
+  };
+
+  /** Floating-point image which sums samples over many passes. Each pass adds one sample
+   * to every pixel, and the image at any time is the sum divided by the number of passes,
+   * so it gets steadily less noisy as passes are added.
+   *
+   * Along with the color, the frame sums the square of the luminance of each sample, so that
+   * the variance of each pixel is known, and the GuideSample of each sample, if given. These
+   * are what a Denoiser needs. Extra guides can be added without a sample, from camera rays which aren't traced
+   * any further, to sharpen the guides where they change within a pixel.
+   */
+  class AccumulationFrame {
+  private:
+    int _width;               ///< Width of frame in pixels
+    int _height;              ///< Height of frame in pixels
+    int _passes=0;            ///< Number of complete passes summed into the frame
+    std::vector<float> sum;   ///< Sum of samples, three channels per pixel, rows contiguous
+    std::vector<float> sumSq; ///< Sum of squared luminance of samples, one channel per pixel
+    std::vector<float> guides;///< Sum of guides of samples, eleven channels per pixel: albedo, normal, depth, emission, and the number which hit a surface
+    std::vector<float> extra; ///< Sum of guides added without a sample, in the same eleven channels as guides, then the number of them
+    /** Add a guide to a sum
+     * @param g Eleven channels of the sum
+     * @param guide Guide to add */
+    static void addTo(float* g, const GuideSample& guide) {
+      for(int j=0;j<3;j++) g[j]+=float(guide.albedo[j]);
+      for(int j=0;j<3;j++) g[3+j]+=float(guide.normal[j]);
+      g[6]+=float(guide.depth);
+      for(int j=0;j<3;j++) g[7+j]+=float(guide.emission[j]);
+      if(guide.depth>0) g[10]+=1;
+    }
+    /** Find the mean of one or two sums of guides
+     * @param g Eleven channels of a sum
+     * @param e Eleven channels of another sum to add to it, or nullptr
+     * @param n Number of guides in the sums
+     * @return Mean guide, with the normal normalized unless it is zero, or an empty guide if n is zero */
+    static GuideSample mean(const float* g, const float* e, double n) {
+      GuideSample result;
+      if(n<=0) return result;
+      double s[11];
+      for(int j=0;j<11;j++) s[j]=g[j]+(e?e[j]:0.0f);
+      result.albedo=RayColor(s[0],s[1],s[2])/n;
+      Eigen::Vector3d normal(s[3],s[4],s[5]);
+      if(normal.squaredNorm()>0) result.normal=Direction(normal.normalized());
+      if(s[10]>0) result.depth=s[6]/s[10];
+      result.emission=RayColor(s[7],s[8],s[9])/n;
+      return result;
+    }
+  public:
+    /** Construct an empty frame
+     * @param Lwidth Width in pixels
+     * @param Lheight Height in pixels */
+    AccumulationFrame(int Lwidth, int Lheight):_width(Lwidth),_height(Lheight),sum(size_t(Lwidth)*Lheight*3,0.0f),
+                                               sumSq(size_t(Lwidth)*Lheight,0.0f),guides(size_t(Lwidth)*Lheight*11,0.0f),
+                                               extra(size_t(Lwidth)*Lheight*12,0.0f) {}
+    int width() const {return _width;}   ///< Get width of frame @return width in pixels
+    int height() const {return _height;} ///< Get height of frame @return height in pixels
+    int passes() const {return _passes;} ///< Get number of complete passes @return number of passes
+    /** Find the luminance of a color, with Rec. 709 weights
+     * @param color Linear color
+     * @return Luminance */
+    static double luminance(const RayColor& color) {
+      return 0.2126*color[0]+0.7152*color[1]+0.0722*color[2];
+    }
+    /** Add a sample to a pixel. Different threads may add to different pixels at once,
+     * but not to the same pixel.
+     * @param col Column of pixel
+     * @param row Row of pixel
+     * @param color Sample to add */
+    void add(int col, int row, const RayColor& color) {
+      size_t i=size_t(row)*_width+col;
+      float* p=&sum[i*3];
+      for(int j=0;j<3;j++) p[j]+=float(color[j]);
+      sumSq[i]+=float(luminance(color)*luminance(color));
+    }
+    /** Add a sample to a pixel, along with the features of the surface it hit.
+     * @param col Column of pixel
+     * @param row Row of pixel
+     * @param color Sample to add
+     * @param guide Features of the first surface hit by the sample */
+    void add(int col, int row, const RayColor& color, const GuideSample& guide) {
+      add(col,row,color);
+      addTo(&guides[(size_t(row)*_width+col)*11],guide);
+    }
+    /** Add the features seen by a camera ray which isn't traced any further. These only go into guide(), not
+     * pixel() or sampleGuide(), and are much cheaper than a sample. As with add(), different threads may add to
+     * different pixels at once.
+     * @param col Column of pixel
+     * @param row Row of pixel
+     * @param guide Features of the first surface hit by the ray */
+    void addGuide(int col, int row, const GuideSample& guide) {
+      float* g=&extra[(size_t(row)*_width+col)*12];
+      addTo(g,guide);
+      g[11]+=1;
+    }
+    /** Mark a pass as complete, after every pixel has had one sample added */
+    void endPass() {_passes++;}
+    /** Get the current estimate of a pixel
+     * @param col Column of pixel
+     * @param row Row of pixel
+     * @return Mean of all samples of this pixel, or black if there have been no passes */
+    RayColor pixel(int col, int row) const {
+      if(_passes==0) return RayColor::Zero();
+      const float* p=&sum[(size_t(row)*_width+col)*3];
+      return RayColor(p[0],p[1],p[2])/_passes;
+    }
+    /** Get the variance of the luminance of the current estimate of a pixel. This is the variance of one sample
+     * divided by the number of passes, so it shrinks as passes are added.
+     * @param col Column of pixel
+     * @param row Row of pixel
+     * @return Variance of the mean, or zero if there have been fewer than two passes */
+    double variance(int col, int row) const {
+      if(_passes<2) return 0;
+      size_t i=size_t(row)*_width+col;
+      double mean=luminance(pixel(col,row));
+      return std::max(0.0,(sumSq[i]/_passes-mean*mean)/(_passes-1));
+    }
+    /** Get the mean features of the surfaces seen by the samples of a pixel. These match pixel(), since
+     * they come from the same camera rays.
+     * @param col Column of pixel
+     * @param row Row of pixel
+     * @return Mean of the guides of all samples of this pixel. The normal is normalized, unless it is zero. */
+    GuideSample sampleGuide(int col, int row) const {
+      return mean(&guides[(size_t(row)*_width+col)*11],nullptr,_passes);
+    }
+    /** Get the mean features of the surfaces seen by a pixel, including those added with addGuide()
+     * @param col Column of pixel
+     * @param row Row of pixel
+     * @return Mean of the guides of all samples and all added guides of this pixel. The normal is normalized, unless it is zero. */
+    GuideSample guide(int col, int row) const {
+      const float* e=&extra[(size_t(row)*_width+col)*12];
+      return mean(&guides[(size_t(row)*_width+col)*11],e,_passes+e[11]);
+    }
+    /** Throw away all samples, for instance after the scene has changed */
+    void clear() {
+      std::fill(sum.begin(),sum.end(),0.0f);
+      std::fill(sumSq.begin(),sumSq.end(),0.0f);
+      std::fill(guides.begin(),guides.end(),0.0f);
+      std::fill(extra.begin(),extra.end(),0.0f);
+      _passes=0;
+    }
+  };
+
+  /** Progressive Monte Carlo path tracer. This is an alternative to the Shader model for
+   * finding the color of a camera ray, which follows light as it bounces diffusely from
+   * surface to surface, and so includes indirect lighting and color bleeding, which the
+   * shaders don't. Use it through Scene::renderProgressive().
+   *
+   * Surfaces are Lambertian, with the pigment color as albedo. Object shaders aren't used,
+   * and objects without a pigment absorb everything. At each bounce:
+   *
+   *    * Every light is sampled directly (next-event estimation). Point lights follow the
+   *      same rules as in DiffuseShader, so a diffuse path tracer render with only point lights
+   *      and no bounces matches a render with DiffuseShader.
+   *    * Area lights are surfaces, glowing with a radiance equal to their color. They are
+   *      sampled directly with AreaLight::sampleDirection(), and can also be hit by a bounce
+   *      ray. Each way of finding the light is weighted with the power heuristic of multiple
+   *      importance sampling, so whichever way is less noisy for a given point dominates.
+   *    * A new direction is picked with a cosine-weighted distribution.
+   *    * After rouletteDepth bounces, paths are randomly stopped with a probability based on
+   *      how much they can still contribute, and the survivors are scaled up to compensate.
+   *
+   * Each pass traces one path per pixel and adds it to an AccumulationFrame. Rows are handed out
+   * to threads as they finish, and each pixel is only ever written by one thread, so there is no locking
+   * on the frame. Random numbers are seeded from the pixel and pass, so the result doesn't
+   * depend on the number of threads. Each path also gets a random time within the shutter interval,
+   * so moving objects are motion blurred as the passes add up.
+   */
+  class PathTracer {
+  private:
+    /** Small, fast random number generator, seeded separately for each pixel in each pass.
+     * This is the SplitMix64 generator. */
+    class Random {
+    private:
+      uint64_t state; ///< Current state
+    public:
+      /** Seed the generator @param seed Seed */
+      explicit Random(uint64_t seed):state(seed) {}
+      /** Get the next random number @return Uniform random number from 0 up to but not including 1 */
+      double operator()() {
+        uint64_t z=(state+=0x9E3779B97F4A7C15ull);
+        z=(z^(z>>30))*0xBF58476D1CE4E5B9ull;
+        z=(z^(z>>27))*0x94D049BB133111EBull;
+        z^=z>>31;
+        return double(z>>11)*(1.0/9007199254740992.0);
+      }
+    };
+    std::vector<size_t> pointLights;          ///< Indexes of lights sampled as points, from the last prepareRender()
+    std::vector<Observer<AreaLight>> emitters; ///< Lights which are surfaces, from the last prepareRender()
+    uint64_t totalSamples=0;   ///< Samples traced in all passes since prepareRender()
+    double totalSeconds=0;     ///< Time spent tracing all passes since prepareRender()
+    double lastRate=0;         ///< Samples per second in the most recent pass
+    /** Weight one of two sampling strategies by the power heuristic
+     * @param a Probability density of the strategy being weighted
+     * @param b Probability density of the other strategy
+     * @return Weight of strategy a */
+    static double powerHeuristic(double a, double b) {
+      return a*a/(a*a+b*b);
+    }
+    /** Find the nearest area light hit by a ray
+     * @param[in] ray Ray in world space
+     * @param[in,out] t On input, the nearest hit found so far. On output, the nearest light hit, if any is closer.
+     * @return Light that was hit, or nullptr if no light is closer than t
+     */
+    Observer<AreaLight> hitEmitter(const Ray& ray, double& t) const {
+      Observer<AreaLight> result=nullptr;
+      for(auto&& emitter:emitters) {
+        double this_t;
+        if(emitter->intersectSurface(ray,this_t) && this_t<t) {
+          t=this_t;
+          result=emitter;
+        }
+      }
+      return result;
+    }
+    /** Find the features of the first surface a camera ray hits, without tracing it any further
+     * @param ray Camera ray
+     * @param scene All objects in the scene
+     * @return Features of the first surface hit, or of the light if the ray hits one first
+     */
+    GuideSample firstHit(const Ray& ray, const Renderable& scene) const {
+      GuideSample result;
+      double t;
+      Observer<Primitive> object=scene.intersect(ray,t);
+      if(!object) t=std::numeric_limits<double>::infinity();
+      if(Observer<AreaLight> emitter=hitEmitter(ray,t)) {
+        result.emission=emitter->color.head<3>();
+      } else if(object) {
+        Position r=ray(t);
+        ObjectColor color;
+        if(object->evalPigment(r,color,0,ray.time)) result.albedo=color.head<3>();
+        result.normal=object->normal(r,ray.time);
+        if(result.normal.dot(ray.v)>0) result.normal=Direction(-result.normal);
+        result.depth=t*ray.v.norm();
+      }
+      return result;
+    }
+    /** Sample all lights directly from a point on a surface
+     * @param scene All objects in the scene
+     * @param lightList All lights in the scene
+     * @param r Point on surface
+     * @param n Surface normal, facing the side the path arrived from
+     * @param albedo Reflectance of the surface
+     * @param time Time within the shutter interval of the path
+     * @param rng Random number generator
+     * @return Light reflected towards the previous point on the path
+     */
+    RayColor directLight(const Renderable& scene, const LightList& lightList, const Position& r, const Direction& n, const RayColor& albedo, double time, Random& rng) const {
+      RayColor result=RayColor::Zero();
+      for(size_t i:pointLights) {
+        Light& light=*lightList[i];
+        Ray ray=light.rayTo(r);
+        ray.time=time;
+        double cosTheta=n.dot(ray.v.normalized());
+        if(cosTheta<=0) continue;
+        double visible=light.amountVisible(scene,ray);
+        if(visible>0) result+=(visible*cosTheta*albedo.array()*light.color.head<3>().array()).matrix();
+      }
+      for(auto&& emitter:emitters) {
+        Direction dir;
+        double dist;
+        double lightPdf=emitter->sampleDirection(r,rng(),rng(),dir,dist);
+        if(lightPdf<=0) continue;
+        double cosTheta=n.dot(dir);
+        if(cosTheta<=0) continue;
+        double t;
+        if(scene.intersect(Ray(r,Direction(dir*dist),time)+Light::initialDist,t) && t<1) continue;
+        double bsdfPdf=cosTheta/pi;
+        double weight=powerHeuristic(lightPdf,bsdfPdf);
+        result+=(weight*cosTheta/(pi*lightPdf)*albedo.array()*emitter->color.head<3>().array()).matrix();
+      }
+      return result;
+    }
+  public:
+    int maxDepth=8;      ///< Most bounces to follow on any path
+    int rouletteDepth=3; ///< Number of bounces before paths can be randomly stopped
+    int threads=0;       ///< Number of threads to trace with, or 0 to use all hardware threads
+    /** Prepare for rendering. This sorts the scene lights into point lights and area lights,
+     * and zeroes the statistics. Call this after Scene::prepareRender(), as
+     * Scene::renderProgressive() does.
+     * @param lightList All lights in the scene
+     */
+    void prepareRender(const LightList& lightList) {
+      pointLights.clear();
+      emitters.clear();
+      for(size_t i=0;i<lightList.size();i++) {
+        if(auto area=dynamic_cast<Observer<AreaLight>>(lightList[i].get())) {
+          emitters.push_back(area);
+        } else {
+          pointLights.push_back(i);
+        }
+      }
+      totalSamples=0;
+      totalSeconds=0;
+      lastRate=0;
+    }
+    /** Trace one path
+     * @param ray Camera ray
+     * @param scene All objects in the scene
+     * @param lightList All lights in the scene, the same as passed to prepareRender()
+     * @param rng Random number generator
+     * @param guide If not nullptr, filled in with the features of the first surface hit
+     * @return Light arriving along the ray
+     */
+    RayColor radiance(Ray ray, const Renderable& scene, const LightList& lightList, Random& rng, GuideSample* guide=nullptr) const {
+      RayColor result=RayColor::Zero();
+      RayColor throughput=RayColor::Ones();
+      double bsdfPdf=0;     //Probability density of the bounce that made the current ray, 0 for the camera ray
+      Position from;        //Start of the current ray, before it was moved off the surface
+      for(int depth=0;depth<=maxDepth;depth++) {
+        double t;
+        Observer<Primitive> object=scene.intersect(ray,t);
+        if(!object) t=std::numeric_limits<double>::infinity();
+        if(Observer<AreaLight> emitter=hitEmitter(ray,t)) {
+          double weight=1;
+          if(bsdfPdf>0) {
+            Direction dir=static_cast<Direction>(ray.v.normalized());
+            double dist=(ray(t)-from).norm();
+            weight=powerHeuristic(bsdfPdf,emitter->pdfDirection(from,dir,dist));
+          }
+          result+=weight*(throughput.array()*emitter->color.head<3>().array()).matrix();
+          if(depth==0 && guide) guide->emission=emitter->color.head<3>();
+          break;
+        }
+        if(!object) break;
+        Position r=ray(t);
+        ObjectColor color;
+        bool hasColor=object->evalPigment(r,color,0,ray.time);
+        Direction n=object->normal(r,ray.time);
+        if(n.dot(ray.v)>0) n=Direction(-n);
+        if(depth==0 && guide) {
+          guide->albedo=hasColor?RayColor(color.head<3>()):RayColor::Zero();
+          guide->normal=n;
+          guide->depth=t*ray.v.norm();
+        }
+        if(!hasColor) break;
+        RayColor albedo=color.head<3>().cwiseMax(0.0).cwiseMin(1.0);
+        result+=(throughput.array()*directLight(scene,lightList,r,n,albedo,ray.time,rng).array()).matrix();
+        if(depth>=rouletteDepth) {
+          double survive=std::min(0.95,(throughput.array()*albedo.array()).maxCoeff());
+          if(rng()>=survive) break;
+          throughput/=survive;
+        }
+        //Cosine-weighted bounce. The Lambertian BRDF times the cosine over this probability
+        //density is just the albedo.
+        double u=rng(), v=rng();
+        double sinTheta=std::sqrt(u), cosTheta=std::sqrt(1-u), phi=2*pi*v;
+        Eigen::Vector3d a=(std::abs(n.x())<0.9?Eigen::Vector3d::UnitX():Eigen::Vector3d::UnitY()).cross(n).normalized();
+        Eigen::Vector3d b=n.cross(a);
+        Direction dir=Direction(cosTheta*n+sinTheta*(std::cos(phi)*a+std::sin(phi)*b));
+        throughput=(throughput.array()*albedo.array()).matrix();
+        bsdfPdf=cosTheta/pi;
+        from=r;
+        ray=Ray(r,dir,ray.time)+Light::initialDist;
+      }
+      return result;
+    }
+    /** Trace one pass, adding one path per pixel to a frame
+     * @param camera Camera to trace from
+     * @param scene All objects in the scene
+     * @param lightList All lights in the scene, the same as passed to prepareRender()
+     * @param frame Frame to add to
+     */
+    void renderPass(const Camera& camera, const Renderable& scene, const LightList& lightList, AccumulationFrame& frame) {
+      TraceScope span("path tracing pass","render","pass",frame.passes());
+      auto start=std::chrono::steady_clock::now();
+      int width=frame.width(), height=frame.height();
+      uint64_t pass=uint64_t(frame.passes());
+      std::atomic<int> nextRow{0};
+      auto worker=[&] {
+        for(int row=nextRow++;row<height;row=nextRow++) {
+          TraceScope rowSpan("row","render","row",row);
+          for(int col=0;col<width;col++) {
+            Random rng(((pass*uint64_t(height)+row)*uint64_t(width)+col)*0x2545F4914F6CDD1Dull);
+            double x=(col+rng())/width-0.5;
+            double y=(row+rng())/height-0.5;
+            GuideSample guide;
+            Ray ray=camera.project(x,y,rng());
+            RayColor color=radiance(ray,scene,lightList,rng,&guide);
+            frame.add(col,row,color,guide);
+          }
+        }
+      };
+      int n=threads>0?threads:std::max(1,int(std::thread::hardware_concurrency()));
+      std::vector<std::thread> pool;
+      for(int i=1;i<n;i++) pool.emplace_back(worker);
+      worker();
+      for(auto&& thread:pool) thread.join();
+      frame.endPass();
+      double seconds=std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+      uint64_t samples=uint64_t(width)*height;
+      totalSamples+=samples;
+      totalSeconds+=seconds;
+      lastRate=seconds>0?samples/seconds:0;
+    }
+    /** Sharpen the guides of a frame at the edges of lights seen directly. A pixel there is partly covered by the
+     * light, and with only a few samples, how much is very uncertain. Since the light is so much brighter than
+     * what is around it, this is the noisiest part of the image, and no filter can tell a pixel whose samples all
+     * missed the light from one the light doesn't cover. So this adds the guides of extra camera rays to each pixel
+     * within two pixels of where the light seen by its samples changes, which the Denoiser uses to find how much
+     * of the pixel the light covers. These rays stop at the first surface, so they cost much less than samples,
+     * and there are only a few pixels along the edges of lights. Use it through Scene::refineGuides().
+     * @param camera Camera to trace from
+     * @param scene All objects in the scene
+     * @param frame Frame to add guides to, after its passes
+     * @param rays Number of rays for each pixel. These are spread over a square grid within the pixel, so this is
+     *        rounded down to a square number.
+     */
+    void refineGuides(const Camera& camera, const Renderable& scene, AccumulationFrame& frame, int rays) const {
+      TraceScope span("refine guides","render");
+      int width=frame.width(), height=frame.height();
+      int grid=int(std::sqrt(double(std::max(rays,0))));
+      if(grid<1 || frame.passes()==0) return;
+      std::vector<double> seen(size_t(width)*height);
+      for(int row=0;row<height;row++) for(int col=0;col<width;col++) {
+        seen[size_t(row)*width+col]=AccumulationFrame::luminance(frame.sampleGuide(col,row).emission);
+      }
+      std::atomic<int> nextRow{0};
+      auto worker=[&] {
+        for(int row=nextRow++;row<height;row=nextRow++) {
+          for(int col=0;col<width;col++) {
+            double lo=INFINITY, hi=-INFINITY;
+            for(int r=std::max(0,row-2);r<=std::min(height-1,row+2);r++) {
+              for(int c=std::max(0,col-2);c<=std::min(width-1,col+2);c++) {
+                lo=std::min(lo,seen[size_t(r)*width+c]);
+                hi=std::max(hi,seen[size_t(r)*width+c]);
+              }
+            }
+            if(!(hi>lo)) continue;
+            Random rng((uint64_t(row)*uint64_t(width)+col)*0x2545F4914F6CDD1Dull^0xD1B54A32D192ED03ull);
+            for(int i=0;i<grid;i++) for(int j=0;j<grid;j++) {
+              double x=(col+(j+rng())/grid)/width-0.5;
+              double y=(row+(i+rng())/grid)/height-0.5;
+              frame.addGuide(col,row,firstHit(camera.project(x,y,rng()),scene));
+            }
+          }
+        }
+      };
+      int n=threads>0?threads:std::max(1,int(std::thread::hardware_concurrency()));
+      std::vector<std::thread> pool;
+      for(int i=1;i<n;i++) pool.emplace_back(worker);
+      worker();
+      for(auto&& thread:pool) thread.join();
+    }
+    /** Get the speed of the most recent pass @return Paths traced per second */
+    double samplesPerSecond() const {return lastRate;}
+    /** Get the average speed of all passes since prepareRender() @return Paths traced per second */
+    double averageSamplesPerSecond() const {return totalSeconds>0?totalSamples/totalSeconds:0;}
+  };
+}
+
+#endif //KWANTRACE_PATHTRACER_H
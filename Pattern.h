@@ -0,0 +1,302 @@
+/* KwanTrace - C++ Ray Tracing Library
+Copyright (C) 2021 by kwan3217
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef KWANTRACE_PATTERN_H
+#define KWANTRACE_PATTERN_H
+
+#include <algorithm>
+#include "Noise.h"
+
+namespace kwantrace {
+  /** Map from a scalar pattern value to a color, like the POV-Ray `color_map`. The
+   * map is a list of entries, each a value and a color. Between entries, the color is
+   * linearly interpolated. Below the first entry or above the last, the color is that
+   * of the nearest entry.
+   */
+  class ColorMap {
+  private:
+    std::vector<std::pair<double,ObjectColor>> entries; ///< Map entries, sorted by value
+  public:
+    /** Construct a color map that runs from black at 0 to white at 1 */
+    ColorMap() {
+      ObjectColor black, white;
+      black<<0,0,0,0,0;
+      white<<1,1,1,0,0;
+      add(0,black);
+      add(1,white);
+    }
+    /** Remove all entries from the map */
+    void clear() {entries.clear();}
+    /** Add an entry to the map
+     * @param value Pattern value
+     * @param color Color at this value
+     */
+    void add(double value, const ObjectColor& color) {
+      auto it=std::upper_bound(entries.begin(),entries.end(),value,[](double v, const auto& e){return v<e.first;});
+      entries.insert(it,{value,color});
+    }
+    /** Look up a color in the map
+     * @param value Pattern value
+     * @return Interpolated color
+     */
+    ObjectColor operator()(double value) const {
+      if(entries.empty()) return ObjectColor::Zero();
+      if(value<=entries.front().first) return entries.front().second;
+      if(value>=entries.back().first) return entries.back().second;
+      auto hi=std::upper_bound(entries.begin(),entries.end(),value,[](double v, const auto& e){return v<e.first;});
+      auto lo=hi-1;
+      double f=(value-lo->first)/(hi->first-lo->first);
+      return (1-f)*lo->second+f*hi->second;
+    }
+    /** Write the map to a scene file @param out Scene file being written */
+    void write(SceneWriter& out) const {
+      out.put(uint64_t(entries.size()));
+      for(auto&& [value,color]:entries) {
+        out.put(value);
+        out.put(color);
+      }
+    }
+    /** Read the map from a scene file, replacing all entries @param in Scene file being read */
+    void read(SceneReader& in) {
+      uint64_t n;
+      in.get(n);
+      clear();
+      for(uint64_t i=0;i<n;i++) {
+        double value;
+        ObjectColor color;
+        in.get(value);
+        in.get(color);
+        add(value,color);
+      }
+    }
+  };
+
+  /** Pigment defined by a scalar pattern run through a ColorMap, like POV-Ray pattern pigments.
+   * Subclasses only need to implement pattern().
+   *
+   * Expensive patterns can be baked. When a bake is requested with bake(), prepareRender() fills
+   * a regular lattice of pattern values over a box in local space, and the pigment is then
+   * evaluated with a trilinear lookup anywhere inside the box. Points outside the box are still
+   * evaluated directly. The lattice is in local space, so it stays valid when the pigment or its
+   * object is transformed, and is only refilled after bake() or invalidateBake() is called.
+   * Detail finer than the lattice spacing is lost, so pick the resolution to suit the closest
+   * view of the object.
+   *
+   * A baked lattice is saved in scene files. When the scene is loaded, the lattice is used straight out of
+   * the mapping of the file, so it is neither baked again nor copied.
+   */
+  class PatternPigment: public ColorField {
+  private:
+    ColorMap colorMap;           ///< Map from pattern value to color
+    int bakeResolution=0;        ///< Number of lattice points along each axis, or 0 to not bake
+    Eigen::Vector3d bakeLo;      ///< Low corner of baked box in local space
+    Eigen::Vector3d bakeHi;      ///< High corner of baked box in local space
+    Eigen::Vector3d bakeScale;   ///< Lattice cells per local unit along each axis
+    std::vector<float> latticeStorage; ///< Baked pattern values, if baked by this object rather than loaded from a scene file
+    const float* lattice=nullptr;      ///< Baked pattern values, x varying fastest, or nullptr if not baked yet
+    std::shared_ptr<const void> latticeOwner; ///< Keeps the scene file the lattice is in mapped, if it was loaded from one
+    /** Throw away the lattice */
+    void clearLattice() {
+      latticeStorage.clear();
+      lattice=nullptr;
+      latticeOwner.reset();
+    }
+    /** Calculate the pattern value at a point, with a trilinear lookup into the lattice if possible
+     * @param r Point in local space
+     * @return Pattern value
+     */
+    double value(const Position& r) const {
+      if(!lattice) return pattern(r);
+      Eigen::Vector3d g=(r-bakeLo).cwiseProduct(bakeScale);
+      int n=bakeResolution;
+      if((g.array()<0).any() || (g.array()>n-1).any()) return pattern(r);
+      int ix=std::min(int(g.x()),n-2), iy=std::min(int(g.y()),n-2), iz=std::min(int(g.z()),n-2);
+      double fx=g.x()-ix, fy=g.y()-iy, fz=g.z()-iz;
+      auto at=[&](int x, int y, int z){return double(lattice[(size_t(z)*n+y)*n+x]);};
+      auto lerp=[](double t, double a, double b){return a+t*(b-a);};
+      return lerp(fz,lerp(fy,lerp(fx,at(ix,iy  ,iz  ),at(ix+1,iy  ,iz  )),
+                             lerp(fx,at(ix,iy+1,iz  ),at(ix+1,iy+1,iz  ))),
+                     lerp(fy,lerp(fx,at(ix,iy  ,iz+1),at(ix+1,iy  ,iz+1)),
+                             lerp(fx,at(ix,iy+1,iz+1),at(ix+1,iy+1,iz+1))));
+    }
+    ObjectColor fieldLocal(const Position& r) const override {return colorMap(value(r));}
+  protected:
+    /** Calculate the pattern at a point
+     * @param r Point in local space
+     * @return Pattern value, usually between 0 and 1
+     */
+    virtual double pattern(const Position& r) const=0;
+  public:
+    /** Get the color map, so that it can be changed
+     * @return Reference to color map */
+    ColorMap& getColorMap() {return colorMap;}
+    /** Request that the pattern be baked into a lattice at the next prepareRender()
+     * @param lo Low corner of box to bake, in local space
+     * @param hi High corner of box to bake, in local space
+     * @param resolution Number of lattice points along each axis. Memory use is four bytes times the cube of this.
+     */
+    void bake(const Position& lo, const Position& hi, int resolution) {
+      bakeLo=lo;
+      bakeHi=hi;
+      bakeResolution=resolution<2?0:resolution;
+      clearLattice();
+    }
+    /** Throw away the baked lattice, so that it is refilled at the next prepareRender(). Call
+     * this if the parameters of the pattern have been changed. */
+    void invalidateBake() {clearLattice();}
+    /** \copydoc Field::prepareRender()
+     *
+     * This also fills the lattice, if a bake has been requested and the lattice isn't already filled.
+     */
+    virtual void prepareRender() override {
+      ColorField::prepareRender();
+      if(bakeResolution>0 && !lattice) {
+        TraceScope span("bake pattern","build","resolution",bakeResolution);
+        int n=bakeResolution;
+        bakeScale=Eigen::Vector3d::Constant(n-1).cwiseQuotient(bakeHi-bakeLo);
+        Eigen::Vector3d step=(bakeHi-bakeLo)/(n-1);
+        latticeStorage.resize(size_t(n)*n*n);
+        for(int z=0;z<n;z++) for(int y=0;y<n;y++) for(int x=0;x<n;x++) {
+          latticeStorage[(size_t(z)*n+y)*n+x]=float(pattern(Position(bakeLo+step.cwiseProduct(Eigen::Vector3d(x,y,z)))));
+        }
+        lattice=latticeStorage.data();
+      }
+    }
+    /** \copydoc Transformable::write() */
+    virtual void write(SceneWriter& out) const override {
+      ColorField::write(out);
+      colorMap.write(out);
+      out.put(int32_t(bakeResolution));
+      out.put(bakeLo);
+      out.put(bakeHi);
+      out.put(bakeScale);
+      int n=lattice?bakeResolution:0;
+      out.array(lattice,size_t(n)*n*n);
+    }
+    /** \copydoc Transformable::read() */
+    virtual void read(SceneReader& in) override {
+      ColorField::read(in);
+      colorMap.read(in);
+      int32_t resolution;
+      in.get(resolution);
+      bakeResolution=resolution<2?0:resolution;
+      in.get(bakeLo);
+      in.get(bakeHi);
+      in.get(bakeScale);
+      clearLattice();
+      size_t count;
+      const float* data=in.array<float>(count);
+      if(count>0) {
+        int n=bakeResolution;
+        if(count!=size_t(n)*n*n) throw std::runtime_error("Baked pattern in scene file is the wrong size");
+        lattice=data;
+        latticeOwner=in.owner();
+      }
+    }
+  };
+
+  /** Plain noise pattern, like the POV-Ray `bozo` or `noise` pattern. The pattern is
+   * smooth and random, and varies over a scale of about one unit. */
+  class NoisePigment: public PatternPigment {
+  protected:
+    /** \copydoc PatternPigment::pattern()
+     * This is noise rescaled to run from 0 to 1. */
+    double pattern(const Position& r) const override {
+      return std::clamp(0.5+0.5*Noise::noise(r),0.0,1.0);
+    }
+  };
+  inline const bool noisePigmentRegistered=SceneTypes::add<NoisePigment>("NoisePigment"); ///< Lets noise pigments be saved in scene files
+
+  /** Turbulence pattern. This is fractal noise, with detail at many scales. */
+  class TurbulencePigment: public PatternPigment {
+  public:
+    int octaves=6;      ///< Number of octaves of noise, like POV-Ray `octaves`
+    double omega=0.5;   ///< Amplitude ratio between octaves, like POV-Ray `omega`
+    double lambda=2.0;  ///< Frequency ratio between octaves, like POV-Ray `lambda`
+  protected:
+    /** \copydoc PatternPigment::pattern()
+     * This is the turbulence, clamped to run from 0 to 1. */
+    double pattern(const Position& r) const override {
+      return std::clamp(Noise::turbulence(r,octaves,omega,lambda),0.0,1.0);
+    }
+  public:
+    /** \copydoc PatternPigment::write() */
+    virtual void write(SceneWriter& out) const override {
+      PatternPigment::write(out);
+      out.put(int32_t(octaves));
+      out.put(omega);
+      out.put(lambda);
+    }
+    /** \copydoc PatternPigment::read() */
+    virtual void read(SceneReader& in) override {
+      PatternPigment::read(in);
+      int32_t Loctaves;
+      in.get(Loctaves);
+      octaves=Loctaves;
+      in.get(omega);
+      in.get(lambda);
+    }
+  };
+  inline const bool turbulencePigmentRegistered=SceneTypes::add<TurbulencePigment>("TurbulencePigment"); ///< Lets turbulence pigments be saved in scene files
+
+  /** Granite pattern, like POV-Ray `granite`. This is fractal noise with high-frequency
+   * detail and sharp creases, which looks like granite with a suitable color map. */
+  class GranitePigment: public PatternPigment {
+  protected:
+    /** \copydoc PatternPigment::pattern()
+     * Six octaves of noise starting at four times the base frequency, the same as POV-Ray. */
+    double pattern(const Position& r) const override {
+      return std::clamp(0.5*Noise::turbulence(4*r,6),0.0,1.0);
+    }
+  };
+  inline const bool granitePigmentRegistered=SceneTypes::add<GranitePigment>("GranitePigment"); ///< Lets granite pigments be saved in scene files
+
+  /** Marble pattern, like POV-Ray `marble`. This is a series of bands perpendicular to
+   * the local X axis, with a triangle wave so each band ramps up and back down, disturbed
+   * by turbulence to make veins. */
+  class MarblePigment: public PatternPigment {
+  public:
+    double turbulence=1.0; ///< Amount of turbulence, zero for straight bands
+    int octaves=6;         ///< Number of octaves of turbulence
+  protected:
+    /** \copydoc PatternPigment::pattern() */
+    double pattern(const Position& r) const override {
+      double v=r.x()+turbulence*Noise::turbulence(r,octaves);
+      v-=std::floor(v);
+      return v<0.5?2*v:2-2*v;
+    }
+  public:
+    /** \copydoc PatternPigment::write() */
+    virtual void write(SceneWriter& out) const override {
+      PatternPigment::write(out);
+      out.put(turbulence);
+      out.put(int32_t(octaves));
+    }
+    /** \copydoc PatternPigment::read() */
+    virtual void read(SceneReader& in) override {
+      PatternPigment::read(in);
+      in.get(turbulence);
+      int32_t Loctaves;
+      in.get(Loctaves);
+      octaves=Loctaves;
+    }
+  };
+  inline const bool marblePigmentRegistered=SceneTypes::add<MarblePigment>("MarblePigment"); ///< Lets marble pigments be saved in scene files
+}
+
+#endif //KWANTRACE_PATTERN_H
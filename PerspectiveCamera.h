@@ -64,6 +64,11 @@ namespace kwantrace {
    *
    */
   class PerspectiveCamera : public Camera {
+  private:
+    Position originWorld;       ///< Location of camera in world space, only valid after prepareRender()
+    Direction rightWorld;       ///< Right vector in world space, only valid after prepareRender()
+    Direction downWorld;        ///< Down vector in world space, only valid after prepareRender()
+    Direction directionWorld;   ///< Direction vector in world space, only valid after prepareRender()
   public:
     Direction right;     ///<Right-pointing basis vector in image plane
     Direction down;      ///<Down-pointing basis vector in image plane
@@ -174,6 +179,56 @@ namespace kwantrace {
             direction(Ldirection) {
 
     };
+    /** \copydoc Transformable::prepareRender()
+     *
+     * This also transforms the camera vectors to world space, for projectBatch(). They are transformed as
+     * at time zero, the same as project() does for rays at time zero, even if the camera moves.
+     */
+    virtual void prepareRender() override {
+      Camera::prepareRender();
+      Eigen::Matrix4d M=MwbAt(0);
+      originWorld=M*Position(0,0,0);
+      rightWorld=M*right;
+      downWorld=M*down;
+      directionWorld=M*direction;
+    }
+    /** \copydoc Transformable::write() */
+    virtual void write(SceneWriter& out) const override {
+      Camera::write(out);
+      out.put(right);
+      out.put(down);
+      out.put(direction);
+    }
+    /** \copydoc Transformable::read() */
+    virtual void read(SceneReader& in) override {
+      Camera::read(in);
+      in.get(right);
+      in.get(down);
+      in.get(direction);
+    }
+    /** \copydoc Camera::projectBatch()
+     *
+     * Every ray starts at the camera location, and the direction is linear in x, so each ray
+     * in the row is the first one plus a multiple of a fixed step, which is a CpuDispatch kernel.
+     * Only valid after prepareRender().
+     */
+    virtual void projectBatch(double x, double y, double dx, int count, RayBatch& batch, size_t offset=0) const override {
+      if(batch.size()<offset+count) batch.resize(offset+count);
+      const Eigen::Vector3d v=directionWorld+rightWorld*x+downWorld*y;
+      const Eigen::Vector3d step=rightWorld*dx;
+      const Eigen::Vector3d r0=originWorld;
+      auto kernel=[&](double* __restrict x0, double* __restrict y0, double* __restrict z0,
+                      double* __restrict vx, double* __restrict vy, double* __restrict vz) KWANTRACE_KERNEL {
+        for(int i=0;i<count;i++) {
+          x0[i]=r0.x(); y0[i]=r0.y(); z0[i]=r0.z();
+          vx[i]=v.x()+step.x()*i; vy[i]=v.y()+step.y()*i; vz[i]=v.z()+step.z()*i;
+        }
+      };
+      CpuDispatch::run([&]() KWANTRACE_KERNEL {
+        kernel(batch.x0.data()+offset,batch.y0.data()+offset,batch.z0.data()+offset,
+               batch.vx.data()+offset,batch.vy.data()+offset,batch.vz.data()+offset);
+      });
+    }
   protected:
     /** Project the ray. Once we have figured out the camera vectors,
      * very little computation is required to actually figure the ray
@@ -189,6 +244,7 @@ namespace kwantrace {
       return result;
     }
   };
+  inline const bool perspectiveCameraRegistered=SceneTypes::add<PerspectiveCamera>("PerspectiveCamera"); ///< Lets perspective cameras be saved in scene files
 }
 
 #endif //KWANTRACE_PERSPECTIVECAMERA_H
@@ -0,0 +1,439 @@
+/* KwanTrace - C++ Ray Tracing Library
+Copyright (C) 2021 by kwan3217
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef KWANTRACE_PHOTON_H
+#define KWANTRACE_PHOTON_H
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <random>
+#include <thread>
+
+namespace kwantrace {
+  /** One bundle of light stored in a PhotonMap. This is kept small, in single precision,
+   * so that the map stays in cache during a lookup. */
+  struct Photon {
+    Eigen::Vector3f r;     ///< Position where the photon landed
+    Eigen::Vector3f power; ///< Power carried by the photon, per channel
+    Eigen::Vector3f d;     ///< Direction the photon was travelling when it landed, normalized
+    uint8_t axis=0;        ///< Axis this photon splits its kd-tree node on
+  };
+
+  /** Photon map for caustics, after [Jensen 1996](https://doi.org/10.1007/978-3-7091-7484-5_3).
+   *
+   * Light focused by mirrors and lenses is hard to find by tracing rays backwards from the camera,
+   * since a shadow ray from a point under a glass sphere goes straight to the light and is
+   * blocked by the sphere. Instead, build() traces photons forward from each light towards every
+   * object whose shader is specular (see Shader::isSpecular()), follows them through the specular
+   * lobes of the shaders they hit, and stores them where they land on the first surface
+   * which isn't specular. A CausticShader then estimates the irradiance at a point from the
+   * nearest photons.
+   *
+   * Only light that has been through at least one specular bounce is stored, since direct light
+   * is already handled by DiffuseShader. Photons are only aimed at objects which have a
+   * bounding sphere (see Renderable::boundingSphere()).
+   *
+   * Photon power follows the same convention as DiffuseShader, where light doesn't fall off with
+   * distance. A photon is given the power which makes the irradiance at its first hit match what
+   * DiffuseShader would see there, so caustics are as bright as the direct light which makes them.
+   *
+   * Emission is split into chunks which are handed out to threads, each chunk with its own photon list and
+   * random numbers, so the map doesn't depend on the number of threads.
+   * The photons are then stored in a left-balanced kd-tree in heap order, which needs no pointers and is
+   * built in parallel.
+   *
+   * Since the map only depends on the scene, the map for a scene which hasn't changed can be kept between runs
+   * by setting cacheDirectory. The tree is then stored in a StructureCache, keyed by a fingerprint of the scene as it would be
+   * written to a scene file, and later builds of the same scene map it back in rather than tracing again.
+   */
+  class PhotonMap {
+  private:
+    std::vector<Photon> photonStorage;      ///< Photons in heap order, if built by this map rather than loaded from the cache
+    const Photon* photons=nullptr;          ///< Photons in heap order. The children of photon i are 2i+1 and 2i+2.
+    size_t photonCount=0;                   ///< Number of photons
+    std::shared_ptr<const void> photonOwner; ///< Keeps the cache entry the photons are in mapped, if they were loaded from one
+    /** Something photons are aimed at */
+    struct Target {
+      Position center; ///< Center of bounding sphere
+      double radius;   ///< Radius of bounding sphere
+    };
+    /** Find the number of nodes in the left subtree of a left-balanced tree
+     * @param n Number of nodes in the whole tree
+     * @return Number of nodes in the left subtree of the root
+     */
+    static size_t leftSize(size_t n) {
+      if(n<2) return 0;
+      int h=std::bit_width(n)-1;      //Number of full levels
+      size_t half=size_t(1)<<(h-1);   //Width of the bottom level of the left subtree
+      size_t bottom=n-((size_t(1)<<h)-1);
+      return half-1+std::min(bottom,half);
+    }
+    /** Build part of the kd-tree
+     * @param begin First photon of the part, in any order. This part is reordered by the build.
+     * @param end One past the last photon of the part
+     * @param index Heap index of the node to fill
+     * @param heap Output tree, already sized to the number of photons
+     * @param depth Number of levels which may still be built on new threads
+     */
+    static void balance(Photon* begin, Photon* end, size_t index, std::vector<Photon>& heap, int depth) {
+      size_t n=end-begin;
+      if(n==0) return;
+      Eigen::Vector3f lo=begin->r, hi=begin->r;
+      for(Photon* p=begin;p<end;p++) {
+        lo=lo.cwiseMin(p->r);
+        hi=hi.cwiseMax(p->r);
+      }
+      int axis;
+      (hi-lo).maxCoeff(&axis);
+      Photon* median=begin+leftSize(n);
+      std::nth_element(begin,median,end,[axis](const Photon& a, const Photon& b){return a.r[axis]<b.r[axis];});
+      heap[index]=*median;
+      heap[index].axis=uint8_t(axis);
+      if(depth>0) {
+        std::thread left(balance,begin,median,2*index+1,std::ref(heap),depth-1);
+        balance(median+1,end,2*index+2,heap,depth-1);
+        left.join();
+      } else {
+        balance(begin,median,2*index+1,heap,0);
+        balance(median+1,end,2*index+2,heap,0);
+      }
+    }
+    /** Find the nearest photons to a point
+     * @param[in] index Heap index of node to search
+     * @param[in] r Point to search around
+     * @param[in] k Maximum number of photons to find
+     * @param[in,out] heap Max-heap of squared distance and index of the nearest photons found so far
+     * @param[in,out] maxDist2 Squared search radius. Once k photons are found, this shrinks to the farthest of them.
+     */
+    void locate(size_t index, const Eigen::Vector3f& r, size_t k, std::vector<std::pair<float,uint32_t>>& heap, float& maxDist2) const {
+      const Photon& p=photons[index];
+      size_t left=2*index+1;
+      if(left<photonCount) {
+        float delta=r[p.axis]-p.r[p.axis];
+        size_t near=delta<0?left:left+1;
+        size_t far=delta<0?left+1:left;
+        if(near<photonCount) locate(near,r,k,heap,maxDist2);
+        if(far<photonCount && delta*delta<maxDist2) locate(far,r,k,heap,maxDist2);
+      }
+      float dist2=(p.r-r).squaredNorm();
+      if(dist2>=maxDist2) return;
+      heap.emplace_back(dist2,uint32_t(index));
+      std::push_heap(heap.begin(),heap.end());
+      if(heap.size()>k) {
+        std::pop_heap(heap.begin(),heap.end());
+        heap.pop_back();
+      }
+      if(heap.size()==k) maxDist2=heap.front().first;
+    }
+    /** Hash everything the map is built from, for its key in the cache. The number of threads isn't
+     * included, since it doesn't change the map.
+     * @param[in] scene All objects in the scene
+     * @param[in] lightList All lights in the scene
+     * @param[in] sceneShader Shader for objects that don't have their own
+     * @param[out] key Hash
+     * @return True if hashed, false if something in the scene is of a class which can't be saved in a scene file
+     */
+    bool cacheKey(const Renderable& scene, const LightList& lightList, Observer<Shader> sceneShader, uint64_t& key) const {
+      try {
+        SceneWriter out;
+        out.put(buildVersion);
+        out.put(uint64_t(sizeof(Photon)));
+        out.put(int32_t(photonsPerLight));
+        out.put(int32_t(maxBounces));
+        out.put(SceneTypes::name(typeid(scene)));
+        scene.write(out);
+        out.objects(lightList);
+        out.put(sceneShader?SceneTypes::name(typeid(*sceneShader)):std::string());
+        if(sceneShader) sceneShader->write(out);
+        key=out.fingerprint();
+        return true;
+      } catch(std::runtime_error&) {
+        return false;
+      }
+    }
+    /** Follow one photon through the scene, and store it if it lands after a specular bounce
+     * @param ray Ray to follow, with a normalized direction
+     * @param power Power of the photon per unit of squared distance to its first hit
+     * @param scene All objects in the scene
+     * @param sceneShader Shader for objects that don't have their own
+     * @param rng Random number generator
+     * @param out List to store photons in
+     */
+    void trace(Ray ray, RayColor power, const Renderable& scene, Observer<Shader> sceneShader, std::minstd_rand& rng, std::vector<Photon>& out) const {
+      std::uniform_real_distribution<double> uniform(0,1);
+      std::vector<SpecularLobe> lobes;
+      for(int bounce=0;bounce<=maxBounces;bounce++) {
+        double t;
+        Observer<Primitive> object=scene.intersect(ray,t);
+        if(!object) return;
+        if(bounce==0) power*=t*t;
+        Position r=ray(t);
+        Observer<Shader> shader=object->getShader();
+        if(!shader) shader=sceneShader;
+        ObjectColor objectColor;
+        bool hasColor=object->evalPigment(r,objectColor,0,ray.time);
+        if(!shader || !shader->isSpecular()) {
+          if(bounce>0 && hasColor) {
+            out.push_back({r.cast<float>(),power.cast<float>(),ray.v.cast<float>()});
+          }
+          return;
+        }
+        lobes.clear();
+        shader->specularLobes(static_cast<Direction>(ray.v),object->normal(r,ray.time),hasColor?&objectColor:nullptr,lobes);
+        //Pick one lobe with probability in proportion to how much it passes on, and absorb the
+        //photon with the rest of the probability if the lobes pass on less than all of it.
+        double total=0;
+        for(auto&& lobe:lobes) total+=lobe.weight.maxCoeff();
+        if(total<=0) return;
+        double u=uniform(rng)*std::max(total,1.0);
+        Observer<SpecularLobe> picked=nullptr;
+        for(auto&& lobe:lobes) {
+          u-=lobe.weight.maxCoeff();
+          if(u<0) {
+            picked=&lobe;
+            break;
+          }
+        }
+        if(!picked) return;
+        double p=picked->weight.maxCoeff()/std::max(total,1.0);
+        power=(power.array()*picked->weight.array()).matrix()/p;
+        ray=Ray(r,picked->d,ray.time)+Light::initialDist;
+      }
+    }
+  public:
+    int photonsPerLight=100000; ///< Number of photons to emit from each light
+    int maxBounces=8;           ///< Greatest number of specular bounces to follow a photon through
+    int threads=0;              ///< Number of threads to emit and build with, or 0 to use all hardware threads
+    std::string cacheDirectory; ///< Directory to keep built maps in between runs, see StructureCache, or empty to always build
+    static const constexpr uint32_t buildVersion=1; ///< Version of build(), part of the cache key so that maps built by older code aren't used
+    typedef PhotonMap SceneBase; ///< Root of the hierarchy in scene files, see SceneTypes
+    /** Write the settings of this map to a scene file. The photons aren't written, since the
+     * map is built again each time the scene is prepared.
+     * @param out Scene file being written
+     */
+    void write(SceneWriter& out) const {
+      out.put(int32_t(photonsPerLight));
+      out.put(int32_t(maxBounces));
+      out.put(int32_t(threads));
+    }
+    /** Read the settings of this map from a scene file @param in Scene file being read */
+    void read(SceneReader& in) {
+      int32_t v;
+      in.get(v);
+      photonsPerLight=v;
+      in.get(v);
+      maxBounces=v;
+      in.get(v);
+      threads=v;
+    }
+    /** Emit photons and build the map. Call this after the scene is prepared, such as from
+     * Scene::prepareRender(). Any photons from a previous build are thrown away.
+     *
+     * Each light is treated as a point at its location. Its photons are shared among the targets in
+     * proportion to the solid angle each covers as seen from the light, and each is sent in a
+     * uniformly random direction within the cone around its target. Each photon is also sent at a random time
+     * within the shutter interval, so caustics from moving objects are blurred along with them.
+     *
+     * If cacheDirectory is set and the cache has a map for this scene, it is used instead, and nothing is traced. Otherwise,
+     * the new map is stored in the cache. Image textures are hashed by file name, so after editing a texture in
+     * place, delete the cache.
+     *
+     * @param scene All objects in the scene
+     * @param lightList All lights in the scene
+     * @param sceneShader Shader for objects that don't have their own
+     */
+    void build(const Renderable& scene, const LightList& lightList, Observer<Shader> sceneShader) {
+      TraceScope span("photon map","build","photonsPerLight",photonsPerLight);
+      photonStorage.clear();
+      photons=nullptr;
+      photonCount=0;
+      photonOwner.reset();
+      std::vector<Observer<Primitive>> primitives;
+      scene.collectPrimitives(primitives);
+      std::vector<Target> targets;
+      for(auto&& primitive:primitives) {
+        Observer<Shader> shader=primitive->getShader();
+        if(!shader) shader=sceneShader;
+        Target target;
+        if(shader && shader->isSpecular() && primitive->boundingSphere(target.center,target.radius)) targets.push_back(target);
+      }
+      if(targets.empty() || photonsPerLight<=0) return;
+      uint64_t key;
+      bool cached=!cacheDirectory.empty() && cacheKey(scene,lightList,sceneShader,key);
+      if(cached) {
+        StructureCache cache(cacheDirectory);
+        const Photon* data;
+        size_t n;
+        std::shared_ptr<const void> owner;
+        if(cache.load("photons",key,data,n,owner) && std::all_of(data,data+n,[](const Photon& p){return p.axis<3;})) {
+          photons=data;
+          photonCount=n;
+          photonOwner=owner;
+          return;
+        }
+      }
+      //Split the photons of each light and target into fixed chunks, each with its own seed and
+      //output list, so that the result is the same no matter which thread traces which chunk.
+      struct Chunk {
+        Observer<Light> light; ///< Light to emit from
+        size_t target;         ///< Index of target to aim at
+        double omega;          ///< Solid angle of cone around target, as seen from light
+        int count;             ///< Number of photons aimed at this target from this light
+        int begin;             ///< First photon of this chunk
+        int end;               ///< One past last photon of this chunk
+      };
+      const int chunkSize=4096;
+      std::vector<Chunk> chunks;
+      for(auto&& light:lightList) {
+        std::vector<double> omega(targets.size());
+        double totalOmega=0;
+        for(size_t j=0;j<targets.size();j++) {
+          double dist=(targets[j].center-light->location).norm();
+          double cosAlpha=dist>targets[j].radius?std::sqrt(1-std::pow(targets[j].radius/dist,2)):-1;
+          omega[j]=2*pi*(1-cosAlpha);
+          totalOmega+=omega[j];
+        }
+        //Every target too small or far to see from this light, so there is nothing to aim at
+        if(!(totalOmega>0)) continue;
+        for(size_t j=0;j<targets.size();j++) {
+          int count=int(photonsPerLight*omega[j]/totalOmega);
+          for(int begin=0;begin<count;begin+=chunkSize) {
+            chunks.push_back({light.get(),j,omega[j],count,begin,std::min(count,begin+chunkSize)});
+          }
+        }
+      }
+      std::vector<std::vector<Photon>> found(chunks.size());
+      std::atomic<size_t> nextChunk{0};
+      auto worker=[&] {
+        std::uniform_real_distribution<double> uniform(0,1);
+        for(size_t i=nextChunk++;i<chunks.size();i=nextChunk++) {
+          const Chunk& chunk=chunks[i];
+          const Target& target=targets[chunk.target];
+          Direction w=static_cast<Direction>((target.center-chunk.light->location).normalized());
+          Eigen::Vector3d a=(std::abs(w.x())<0.9?Eigen::Vector3d::UnitX():Eigen::Vector3d::UnitY()).cross(w).normalized();
+          Eigen::Vector3d b=w.cross(a);
+          double cosAlpha=1-chunk.omega/(2*pi);
+          RayColor power=chunk.light->color.head<3>()*chunk.omega/chunk.count;
+          std::minstd_rand rng(uint32_t(i+1));
+          for(int k=chunk.begin;k<chunk.end;k++) {
+            double cosTheta=1-uniform(rng)*(1-cosAlpha);
+            double sinTheta=std::sqrt(std::max(0.0,1-cosTheta*cosTheta));
+            double phi=2*pi*uniform(rng);
+            Direction d=Direction(cosTheta*w+sinTheta*(std::cos(phi)*a+std::sin(phi)*b));
+            trace(Ray(chunk.light->location,d,uniform(rng))+Light::initialDist,power,scene,sceneShader,rng,found[i]);
+          }
+        }
+      };
+      int n=threads>0?threads:std::max(1,int(std::thread::hardware_concurrency()));
+      std::vector<std::thread> pool;
+      for(int i=1;i<n;i++) pool.emplace_back(worker);
+      worker();
+      for(auto&& thread:pool) thread.join();
+      std::vector<Photon> all;
+      for(auto&& list:found) all.insert(all.end(),list.begin(),list.end());
+      photonStorage.resize(all.size());
+      balance(all.data(),all.data()+all.size(),0,photonStorage,std::bit_width(unsigned(n))-1);
+      photons=photonStorage.data();
+      photonCount=photonStorage.size();
+      if(cached) StructureCache(cacheDirectory).store("photons",key,photons,photonCount);
+    }
+    /** Get the number of photons stored @return Number of photons */
+    size_t size() const {return photonCount;}
+    /** Check if there are any photons @return True if there are none */
+    bool empty() const {return photonCount==0;}
+    /** Estimate the irradiance at a point from the nearest photons. This is the total power of the
+     * photons arriving at the front of the surface, over the area of the disc which holds them.
+     * @param r Point to estimate at
+     * @param n Surface normal at the point, on the side being lit
+     * @param k Number of photons to gather
+     * @param maxRadius Largest distance to gather photons from
+     * @return Irradiance per channel
+     */
+    RayColor irradiance(const Position& r, const Direction& n, size_t k, double maxRadius) const {
+      if(photonCount==0 || k==0) return RayColor::Zero();
+      thread_local std::vector<std::pair<float,uint32_t>> heap;
+      heap.clear();
+      float maxDist2=float(maxRadius*maxRadius);
+      Eigen::Vector3f rf=r.cast<float>();
+      locate(0,rf,k,heap,maxDist2);
+      if(heap.empty()) return RayColor::Zero();
+      Eigen::Vector3f nf=n.cast<float>();
+      Eigen::Vector3f total=Eigen::Vector3f::Zero();
+      for(auto&& [dist2,index]:heap) {
+        const Photon& p=photons[index];
+        if(p.d.dot(nf)<0) total+=p.power;
+      }
+      return total.cast<double>()/(pi*maxDist2);
+    }
+  };
+
+  /** Shader which adds caustics from a PhotonMap. Add this to a CompositeShader along with
+   * the DiffuseShader of any surface which should catch caustics.
+   *
+   *      scene.photonMap=std::make_shared<PhotonMap>();
+   *      floor->setShader(std::make_shared<CompositeShader>(
+   *        std::make_shared<DiffuseShader>(),
+   *        std::make_shared<CausticShader>(scene.photonMap)
+   *      ));
+   */
+  class CausticShader:public Shader {
+  private:
+    std::shared_ptr<PhotonMap> map; ///< Photon map to look up
+  public:
+    size_t gather=100;        ///< Number of photons to gather at each point
+    double gatherRadius=0.25; ///< Largest distance to gather photons from
+    /** Construct a caustic shader
+     * @param Lmap Photon map to look up. Build it with PhotonMap::build(), or let the scene build it by setting Scene::photonMap.
+     */
+    CausticShader(std::shared_ptr<PhotonMap> Lmap=nullptr):map(Lmap) {}
+    /** \copydoc Shader::write()
+     *
+     * The map is written as a reference, so that it is still the same map as Scene::photonMap when loaded.
+     */
+    virtual void write(SceneWriter& out) const override {
+      out.object(map);
+      out.put(uint64_t(gather));
+      out.put(gatherRadius);
+    }
+    /** \copydoc Shader::read() */
+    virtual void read(SceneReader& in) override {
+      in.object(map);
+      uint64_t Lgather;
+      in.get(Lgather);
+      gather=Lgather;
+      in.get(gatherRadius);
+    }
+    /** \copydoc Shader::shade()
+     *
+     * Caustic light is treated like direct light, so the result is the albedo times the irradiance from
+     * the photon map.
+     */
+    virtual RayColor shade(const ShadingContext& context) const override {
+      if(!map || !context.objectColor) return RayColor::Zero();
+      Direction n=context.n;
+      if(n.dot(context.v)>0) n=static_cast<Direction>(-n);
+      RayColor E=map->irradiance(context.r,n,gather,gatherRadius);
+      return (context.objectColor->head<3>().array()*E.array()).matrix();
+    }
+  };
+  inline const bool photonMapRegistered=SceneTypes::add<PhotonMap>("PhotonMap"); ///< Lets photon maps be saved in scene files
+  inline const bool causticShaderRegistered=SceneTypes::add<CausticShader>("CausticShader"); ///< Lets caustic shaders be saved in scene files
+}
+
+#endif //KWANTRACE_PHOTON_H
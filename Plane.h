@@ -65,6 +65,7 @@ namespace kwantrace {
       return rLocal.z() < 0;
     }
   };
+  inline const bool planeRegistered=SceneTypes::add<Plane>("Plane"); ///< Lets planes be saved in scene files
 
 }
 
@@ -0,0 +1,390 @@
+/* KwanTrace - C++ Ray Tracing Library
+Copyright (C) 2021 by kwan3217
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef KWANTRACE_RADIOSITY_H
+#define KWANTRACE_RADIOSITY_H
+
+#include <fstream>
+#include <shared_mutex>
+#include <string>
+
+namespace kwantrace {
+  /** One sample of indirect irradiance, as computed by RadiosityShader */
+  struct IrradianceRecord {
+    Position r;            ///< Position the sample was taken at
+    Direction n;           ///< Surface normal at the sample, on the side the sample was taken from
+    RayColor E;            ///< Irradiance at the sample
+    double R;              ///< Harmonic mean distance to the surfaces seen from the sample, which sets how far the record can be reused
+    Eigen::Matrix3d gradR; ///< Rotational gradient of irradiance. Column c is the gradient of color channel c.
+    Eigen::Matrix3d gradT; ///< Translational gradient of irradiance. Column c is the gradient of color channel c.
+  };
+
+  /** Cache of indirect irradiance samples, with interpolation between them, after
+   * [Ward, Rubinstein, and Clear 1988](https://doi.org/10.1145/378456.378490) and the
+   * gradients of [Ward and Heckbert 1992](https://doi.org/10.2312/EGWR/EGWR92/085-098). This is
+   * the same scheme as POV-Ray radiosity.
+   *
+   * Each record is valid over a neighborhood whose size is its harmonic mean distance R times
+   * errorBound. A point can use a record if the weight
+   *
+   * \f$w_i=\frac{1}{\frac{|\vec{r}-\vec{r}_i|}{R_i}+\sqrt{1-\hat{n}\cdot\hat{n}_i}}\f$
+   *
+   * is greater than 1/errorBound, and the irradiance there is the weighted average of the usable
+   * records, each extrapolated from its own position and normal by its gradients.
+   *
+   * Records are kept in an octree. Each record goes in the smallest node which is at least as big as the
+   * neighborhood the record is valid over, so a lookup only needs to check the nodes which
+   * contain the point, plus a margin of half their size. The octree grows outward as records
+   * are added outside it, so it doesn't need to know the size of the scene in advance.
+   *
+   * The cache may be used from many threads at once. Lookups share a lock, and adding a record takes
+   * it exclusively. Records are added much less often than they are looked up.
+   *
+   * The cache is never emptied automatically, so that it can be kept from frame to frame of an
+   * animation where the geometry doesn't change. Call clear() if it does.
+   */
+  class IrradianceCache {
+  private:
+    /** Node of the octree */
+    struct Node {
+      Eigen::Vector3d center;                      ///< Center of the box covered by this node
+      double half;                                 ///< Half the width of the box covered by this node
+      std::vector<IrradianceRecord> records;       ///< Records whose neighborhood fits in this node but not in a child
+      std::array<std::unique_ptr<Node>,8> children; ///< Children, or nullptr if there are no records under that child
+    };
+    std::unique_ptr<Node> root;        ///< Root of the octree, nullptr if there are no records
+    size_t count=0;                    ///< Number of records in the cache
+    mutable std::shared_mutex mutex;   ///< Shared by lookups, exclusive while adding
+    /** Find which child of a node contains a point
+     * @param node Node to check
+     * @param p Point, which should be inside node
+     * @return Child index, with bit 0 set for +x, bit 1 for +y, and bit 2 for +z */
+    static int octant(const Node& node, const Eigen::Vector3d& p) {
+      return (p.x()>=node.center.x()?1:0)|(p.y()>=node.center.y()?2:0)|(p.z()>=node.center.z()?4:0);
+    }
+    /** Get the center of a child of a node
+     * @param node Parent node
+     * @param i Child index, see octant()
+     * @return Center of child */
+    static Eigen::Vector3d childCenter(const Node& node, int i) {
+      double h=node.half/2;
+      return node.center+Eigen::Vector3d((i&1)?h:-h,(i&2)?h:-h,(i&4)?h:-h);
+    }
+    /** Check if a point is in the box of a node, expanded by a margin
+     * @param center Center of box
+     * @param half Half width of box, plus margin
+     * @param p Point to check
+     * @return True if inside */
+    static bool contains(const Eigen::Vector3d& center, double half, const Eigen::Vector3d& p) {
+      return (p-center).cwiseAbs().maxCoeff()<=half;
+    }
+    /** Add up the weighted, extrapolated irradiance of the usable records in a subtree
+     * @param node Root of subtree
+     * @param r Point being looked up
+     * @param n Normal at point
+     * @param sum Sum of weighted irradiance, added to
+     * @param weight Sum of weights, added to
+     */
+    void gather(const Node& node, const Position& r, const Direction& n, RayColor& sum, double& weight) const {
+      for(auto&& rec:node.records) {
+        Eigen::Vector3d d=r-rec.r;
+        double dist=d.norm();
+        double w=1.0/(dist/rec.R+std::sqrt(std::max(0.0,1.0-n.dot(rec.n)))+1e-12);
+        if(w<=1.0/errorBound) continue;
+        //Reject records in front of the point, which may see surfaces that the point can't
+        if(d.dot(rec.n+n)/2<-0.05*rec.R) continue;
+        RayColor E=rec.E+rec.gradR.transpose()*(rec.n.cross(n))+rec.gradT.transpose()*d;
+        sum+=w*E.cwiseMax(0.0);
+        weight+=w;
+      }
+      for(int i=0;i<8;i++) {
+        if(node.children[i] && contains(node.children[i]->center,2*node.children[i]->half,r)) {
+          gather(*node.children[i],r,n,sum,weight);
+        }
+      }
+    }
+    /** Add a record, with the lock already held @param rec Record to add */
+    void addLocked(const IrradianceRecord& rec) {
+      double radius=errorBound*rec.R;
+      if(!root) {
+        root=std::make_unique<Node>();
+        root->center=rec.r;
+        root->half=std::max(radius,1.0);
+      }
+      //Grow the tree outward until the root covers the record
+      while(!contains(root->center,root->half,rec.r) || root->half<radius) {
+        auto newRoot=std::make_unique<Node>();
+        Eigen::Vector3d dir=(rec.r-root->center);
+        newRoot->half=root->half*2;
+        newRoot->center=root->center+root->half*Eigen::Vector3d(dir.x()>=0?1:-1,dir.y()>=0?1:-1,dir.z()>=0?1:-1);
+        int i=octant(*newRoot,root->center);
+        newRoot->children[i]=std::move(root);
+        root=std::move(newRoot);
+      }
+      //Go down to the smallest node that is still at least as big as the record neighborhood
+      Node* node=root.get();
+      while(node->half/2>=radius) {
+        int i=octant(*node,rec.r);
+        if(!node->children[i]) {
+          node->children[i]=std::make_unique<Node>();
+          node->children[i]->center=childCenter(*node,i);
+          node->children[i]->half=node->half/2;
+        }
+        node=node->children[i].get();
+      }
+      node->records.push_back(rec);
+      count++;
+    }
+    /** Call a function on every record in a subtree
+     * @param node Root of subtree
+     * @param f Function to call */
+    template<typename F>
+    static void forEach(const Node& node, F&& f) {
+      for(auto&& rec:node.records) f(rec);
+      for(auto&& child:node.children) if(child) forEach(*child,f);
+    }
+  public:
+    double errorBound=0.3; ///< Largest allowed error, as a fraction. Smaller is more accurate, with more records.
+    /** Interpolate irradiance from the cache
+     * @param[in] r Point to look up
+     * @param[in] n Normal at point, on the side the lookup is for
+     * @param[out] E Interpolated irradiance, unchanged if there are no usable records
+     * @return True if there were usable records
+     */
+    bool lookup(const Position& r, const Direction& n, RayColor& E) const {
+      std::shared_lock lock(mutex);
+      if(!root) return false;
+      RayColor sum=RayColor::Zero();
+      double weight=0;
+      if(contains(root->center,2*root->half,r)) gather(*root,r,n,sum,weight);
+      if(weight<=0) return false;
+      E=sum/weight;
+      return true;
+    }
+    /** Add a record to the cache @param rec Record to add */
+    void add(const IrradianceRecord& rec) {
+      std::unique_lock lock(mutex);
+      addLocked(rec);
+    }
+    /** Get the number of records @return Number of records in the cache */
+    size_t size() const {
+      std::shared_lock lock(mutex);
+      return count;
+    }
+    /** Remove all records, for instance when the geometry of the scene has changed */
+    void clear() {
+      std::unique_lock lock(mutex);
+      root.reset();
+      count=0;
+    }
+    /** Save all records to a file, so that they can be loaded by a later run, like the
+     * POV-Ray radiosity `save_file`.
+     * @param filename Name of file to write
+     * @throws std::runtime_error if the file couldn't be written
+     */
+    void save(const std::string& filename) const {
+      std::shared_lock lock(mutex);
+      std::ofstream out(filename,std::ios::binary);
+      if(!out) throw std::runtime_error("Can't write irradiance cache "+filename);
+      out.write("KWIRR001",8);
+      uint64_t n=count;
+      out.write(reinterpret_cast<const char*>(&n),sizeof(n));
+      if(root) forEach(*root,[&](const IrradianceRecord& rec) {
+        double buf[28];
+        Eigen::Map<Eigen::Vector3d>(buf+0)=rec.r;
+        Eigen::Map<Eigen::Vector3d>(buf+3)=rec.n;
+        Eigen::Map<Eigen::Vector3d>(buf+6)=rec.E;
+        buf[9]=rec.R;
+        Eigen::Map<Eigen::Matrix3d>(buf+10)=rec.gradR;
+        Eigen::Map<Eigen::Matrix3d>(buf+19)=rec.gradT;
+        out.write(reinterpret_cast<const char*>(buf),sizeof(buf));
+      });
+      if(!out) throw std::runtime_error("Can't write irradiance cache "+filename);
+    }
+    /** Add all records from a file written by save(), like the POV-Ray radiosity `load_file`.
+     * @param filename Name of file to read
+     * @throws std::runtime_error if the file couldn't be read or isn't an irradiance cache
+     */
+    void load(const std::string& filename) {
+      std::ifstream in(filename,std::ios::binary);
+      char magic[8];
+      uint64_t n;
+      if(!in.read(magic,8) || std::string(magic,8)!="KWIRR001" || !in.read(reinterpret_cast<char*>(&n),sizeof(n))) {
+        throw std::runtime_error("Not an irradiance cache: "+filename);
+      }
+      std::unique_lock lock(mutex);
+      for(uint64_t i=0;i<n;i++) {
+        double buf[28];
+        if(!in.read(reinterpret_cast<char*>(buf),sizeof(buf))) throw std::runtime_error("Truncated irradiance cache: "+filename);
+        IrradianceRecord rec;
+        rec.r=Position(Eigen::Map<Eigen::Vector3d>(buf+0));
+        rec.n=Direction(Eigen::Map<Eigen::Vector3d>(buf+3));
+        rec.E=Eigen::Map<Eigen::Vector3d>(buf+6);
+        rec.R=buf[9];
+        rec.gradR=Eigen::Map<Eigen::Matrix3d>(buf+10);
+        rec.gradT=Eigen::Map<Eigen::Matrix3d>(buf+19);
+        addLocked(rec);
+      }
+    }
+  };
+
+  /** Shader for indirect diffuse light, like POV-Ray radiosity. This is intended to replace
+   * the AmbientShader in a stack, so that instead of a constant ambient, surfaces are lit by
+   * light bouncing off of other surfaces.
+   *
+   * Gathering indirect light at a point takes many rays, so it is only done at some points, and
+   * stored in an IrradianceCache. Everywhere else, the irradiance is interpolated from nearby
+   * records. The rays gathered for a record are stratified over the hemisphere, and the
+   * gradients of the irradiance are worked out from the same rays, which lets the interpolation
+   * follow the change in light between records rather than just blending them.
+   *
+   * Gather rays are traced through the scene like any other secondary ray, so they are shaded by
+   * the full shader of whatever they hit, including this one. To keep this from multiplying without
+   * bound, new records are only gathered at trace levels up to recursionLimit. Deeper than
+   * that, the shader uses whatever is already in the cache, and nothing if there is nothing.
+   *
+   * To keep the cache from being filled in scanline order, which makes visible artifacts, use
+   * Scene::pretrace() at one or more low resolutions before the final render. The cache is shared
+   * and kept between renders, so it can be passed to the shader in the next frame of an
+   * animation.
+   */
+  class RadiosityShader: public Shader {
+  private:
+    std::shared_ptr<IrradianceCache> cache; ///< Cache of irradiance records
+    /** Gather a new irradiance record
+     * @param context Description of the hit
+     * @param n Normal at the hit, on the side the ray came from
+     * @return New record
+     */
+    IrradianceRecord gather(const ShadingContext& context, const Direction& n) const {
+      int M=std::max(2,int(std::round(std::sqrt(samples/pi))));
+      int N=std::max(3,int(std::round(pi*M)));
+      thread_local std::minstd_rand rng;
+      std::uniform_real_distribution<double> uniform(0,1);
+      Eigen::Vector3d a=(std::abs(n.x())<0.9?Eigen::Vector3d::UnitX():Eigen::Vector3d::UnitY()).cross(n).normalized();
+      Eigen::Vector3d b=n.cross(a);
+      std::vector<RayColor> L(size_t(M)*N);
+      std::vector<double> dist(size_t(M)*N);
+      std::vector<double> sinTheta(size_t(M)*N);
+      double invDist=0;
+      RayColor sum=RayColor::Zero();
+      double coefficient=context.objectColor?context.objectColor->head<3>().maxCoeff():1.0;
+      for(int j=0;j<M;j++) for(int k=0;k<N;k++) {
+        //Cosine-weighted stratum: sin^2(theta) runs evenly from j/M to (j+1)/M
+        double s=std::sqrt((j+uniform(rng))/M);
+        double c=std::sqrt(1-s*s);
+        double phi=2*pi*(k+uniform(rng))/N;
+        Direction dir=Direction(c*n+s*(std::cos(phi)*a+std::sin(phi)*b));
+        size_t i=size_t(j)*N+k;
+        L[i]=context.trace.spawn(Ray(context.r,dir)+Light::initialDist,coefficient,&dist[i]);
+        sinTheta[i]=s;
+        invDist+=1/dist[i];
+        sum+=L[i];
+      }
+      IrradianceRecord rec;
+      rec.r=context.r;
+      rec.n=n;
+      rec.E=pi*sum/(M*N);
+      rec.R=std::clamp(invDist>0?(M*N)/invDist:maxRadius,minRadius,maxRadius);
+      rec.gradR.setZero();
+      rec.gradT.setZero();
+      for(int k=0;k<N;k++) {
+        double phiK=2*pi*(k+0.5)/N;
+        double phiKMinus=2*pi*k/N;
+        Eigen::Vector3d uK=std::cos(phiK)*a+std::sin(phiK)*b;
+        Eigen::Vector3d vK=-std::sin(phiK)*a+std::cos(phiK)*b;
+        Eigen::Vector3d vKMinus=-std::sin(phiKMinus)*a+std::cos(phiKMinus)*b;
+        RayColor rotSum=RayColor::Zero();
+        for(int j=0;j<M;j++) {
+          size_t i=size_t(j)*N+k;
+          double s=sinTheta[i];
+          rotSum-=(s/std::sqrt(std::max(1e-12,1-s*s)))*L[i];
+          //Change across the boundary with the previous stratum in theta
+          if(j>0) {
+            double sMinus=std::sqrt(double(j)/M);
+            double cMinus2=1-sMinus*sMinus;
+            double d=std::min(dist[i],dist[i-N]);
+            rec.gradT+=uK*((2*pi/N)*sMinus*cMinus2/d*(L[i]-L[i-N])).transpose();
+          }
+          //Change across the boundary with the previous stratum in phi
+          size_t iPrev=size_t(j)*N+(k+N-1)%N;
+          double cLo=std::sqrt(1-double(j)/M), cHi=std::sqrt(1-double(j+1)/M);
+          double d=std::min(dist[i],dist[iPrev]);
+          rec.gradT+=vKMinus*((cLo-cHi)/(std::max(s,1e-6)*d)*(L[i]-L[iPrev])).transpose();
+        }
+        rec.gradR+=vK*(pi/(M*N)*rotSum).transpose();
+      }
+      //Rays which escape to infinity make the translational gradient meaningless
+      if(!rec.gradT.allFinite()) rec.gradT.setZero();
+      return rec;
+    }
+  public:
+    int samples=100;       ///< Number of rays to gather for each record, like POV-Ray `count`
+    int recursionLimit=1;  ///< Deepest trace level at which new records are gathered, like POV-Ray `recursion_limit`
+    double minRadius=0.01; ///< Smallest harmonic mean distance a record can have, which keeps records in corners from being too dense
+    double maxRadius=10;   ///< Largest harmonic mean distance a record can have, which keeps open areas from being too sparse
+    /** Construct a radiosity shader
+     * @param Lcache Cache to keep records in. Pass the same cache to the shader in the next frame
+     *        of an animation to keep the records from this frame. If nullptr, a new cache is created.
+     */
+    explicit RadiosityShader(std::shared_ptr<IrradianceCache> Lcache=nullptr):
+      cache(Lcache?Lcache:std::make_shared<IrradianceCache>()) {}
+    /** Get the cache, to save, load, clear, or share it @return Pointer to cache */
+    std::shared_ptr<IrradianceCache> getCache() const {return cache;}
+    /** \copydoc Shader::write()
+     *
+     * The records in the cache aren't written. Use IrradianceCache::save() for those.
+     */
+    virtual void write(SceneWriter& out) const override {
+      out.put(int32_t(samples));
+      out.put(int32_t(recursionLimit));
+      out.put(minRadius);
+      out.put(maxRadius);
+    }
+    /** \copydoc Shader::read() */
+    virtual void read(SceneReader& in) override {
+      int32_t v;
+      in.get(v);
+      samples=v;
+      in.get(v);
+      recursionLimit=v;
+      in.get(minRadius);
+      in.get(maxRadius);
+    }
+    /** \copydoc Shader::shade()
+     *
+     * This looks up the irradiance in the cache, gathering a new record if there are no
+     * usable ones, then scales it by the color of the object.
+     */
+    virtual RayColor shade(const ShadingContext& context) const override {
+      if(!context.objectColor) return RayColor::Zero();
+      Direction n=context.n.dot(context.v)>0?Direction(-context.n):context.n;
+      RayColor E;
+      if(!cache->lookup(context.r,n,E)) {
+        if(context.trace.level>recursionLimit) return RayColor::Zero();
+        IrradianceRecord rec=gather(context,n);
+        cache->add(rec);
+        E=rec.E;
+      }
+      return (context.objectColor->head<3>().array()*E.array()/pi).matrix();
+    }
+  };
+  inline const bool radiosityShaderRegistered=SceneTypes::add<RadiosityShader>("RadiosityShader"); ///< Lets radiosity shaders be saved in scene files
+}
+
+#endif //KWANTRACE_RADIOSITY_H
@@ -5,6 +5,9 @@
 #ifndef KWANTRACE_RAY_H
 #define KWANTRACE_RAY_H
 
+#include <vector>
+#include "CpuDispatch.h"
+
 namespace kwantrace {
   /** A mathematical ray, starting at an initial point \f$\vec{r}_0\f$ and continuing in direction
    * \f$\vec{v}\f$. This can be used as a vector function of a single parameter \f$\vec{r}(t)=\vec{r}_0+\vec{v}t\f$.
@@ -23,11 +26,16 @@ namespace kwantrace {
    * The ray does support a couple of operators, to handle evaluating the ray at a given parameter,
    * transforming with a matrix, and advancing the ray (generating a new ray which starts at a given parameter
    * from the old ray).
+   *
+   * For motion blur, a ray also carries the time within the shutter interval at which it
+   * samples the scene. All of the operators keep the time, so rays derived from a camera ray
+   * by transforming or advancing it see the scene at the same instant.
    */
   class Ray {
   public:
     Position r0; ///< Ray initial point
     Direction v; ///< Ray direction
+    double time=0; ///< Time within the shutter interval, from 0 at shutter open to 1 at shutter close
 
     /** Construct an array from the given initial position and direction
      *
@@ -35,6 +43,13 @@ namespace kwantrace {
      * @param Lv direction
      */
     Ray(Position Lr0, Direction Lv) : r0(Lr0), v(Lv) {};
+    /** Construct a ray at a given time
+     *
+     * @param Lr0 Initial point
+     * @param Lv direction
+     * @param Ltime Time within the shutter interval
+     */
+    Ray(Position Lr0, Direction Lv, double Ltime) : r0(Lr0), v(Lv), time(Ltime) {};
     /** Construct a ray
      *
      * @param x0 initial x coordinate
@@ -81,7 +96,7 @@ namespace kwantrace {
      * @param t Parameter to evaluate the ray at
      * @return Point on ray at given parameter
      */
-    Position operator()(double t) {
+    Position operator()(double t) const {
       return static_cast<Eigen::Vector3d>(r0 + v * t);
     }
 
@@ -125,5 +140,64 @@ namespace kwantrace {
 
   };
 
+  /** Block of rays, stored as structure-of-arrays so that code tracing many rays at once can
+   * load the same component of several rays with one vector load. See Camera::projectBatch()
+   * and Renderable::intersectBatch(). All of the rays are at time zero.
+   */
+  struct RayBatch {
+    std::vector<double> x0; ///< X component of initial point of each ray
+    std::vector<double> y0; ///< Y component of initial point of each ray
+    std::vector<double> z0; ///< Z component of initial point of each ray
+    std::vector<double> vx; ///< X component of direction of each ray
+    std::vector<double> vy; ///< Y component of direction of each ray
+    std::vector<double> vz; ///< Z component of direction of each ray
+    /** Get the number of rays @return Number of rays */
+    size_t size() const {return vx.size();}
+    /** Change the number of rays @param n New number of rays */
+    void resize(size_t n) {
+      for(auto* component:{&x0,&y0,&z0,&vx,&vy,&vz}) component->resize(n);
+    }
+    /** Store a ray
+     * @param i Index of ray
+     * @param ray Ray to store
+     */
+    void set(size_t i, const Ray& ray) {
+      x0[i]=ray.r0.x(); y0[i]=ray.r0.y(); z0[i]=ray.r0.z();
+      vx[i]=ray.v.x();  vy[i]=ray.v.y();  vz[i]=ray.v.z();
+    }
+    /** Get a ray @param i Index of ray @return Copy of ray */
+    Ray operator[](size_t i) const {
+      return Ray(x0[i],y0[i],z0[i],vx[i],vy[i],vz[i]);
+    }
+    /** Transform every ray with a matrix, as one CpuDispatch kernel over the whole batch. This is the same
+     * as Ray::operator*=() on each ray, with the sums in the same order as Eigen does them, so the rays
+     * are the same to the bit.
+     * @param M Matrix to transform with
+     * @param[out] out Batch to write the transformed rays to, which is resized to match. It must not be this batch.
+     */
+    void transform(const Eigen::Matrix4d& M, RayBatch& out) const {
+      out.resize(size());
+      Eigen::Matrix4d m=M;
+      //Restrict parameters tell the compiler that the batches don't overlap, so that it vectorizes without checking.
+      //As in extend(), the last column is multiplied by w=1 for positions, and w=0 for directions.
+      auto kernel=[&m](size_t n, const double* __restrict x, const double* __restrict y, const double* __restrict z,
+                       const double* __restrict dx, const double* __restrict dy, const double* __restrict dz,
+                       double* __restrict ox, double* __restrict oy, double* __restrict oz,
+                       double* __restrict odx, double* __restrict ody, double* __restrict odz) KWANTRACE_KERNEL {
+        for(size_t i=0;i<n;i++) {
+          ox[i]=m(0,0)*x[i]+m(0,1)*y[i]+m(0,2)*z[i]+m(0,3)*1.0;
+          oy[i]=m(1,0)*x[i]+m(1,1)*y[i]+m(1,2)*z[i]+m(1,3)*1.0;
+          oz[i]=m(2,0)*x[i]+m(2,1)*y[i]+m(2,2)*z[i]+m(2,3)*1.0;
+          odx[i]=m(0,0)*dx[i]+m(0,1)*dy[i]+m(0,2)*dz[i]+m(0,3)*0.0;
+          ody[i]=m(1,0)*dx[i]+m(1,1)*dy[i]+m(1,2)*dz[i]+m(1,3)*0.0;
+          odz[i]=m(2,0)*dx[i]+m(2,1)*dy[i]+m(2,2)*dz[i]+m(2,3)*0.0;
+        }
+      };
+      CpuDispatch::run([&]() KWANTRACE_KERNEL {
+        kernel(size(),x0.data(),y0.data(),z0.data(),vx.data(),vy.data(),vz.data(),
+               out.x0.data(),out.y0.data(),out.z0.data(),out.vx.data(),out.vy.data(),out.vz.data());
+      });
+    }
+  };
 }
 #endif //KWANTRACE_RAY_H
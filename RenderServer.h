@@ -0,0 +1,419 @@
+/* KwanTrace - C++ Ray Tracing Library
+Copyright (C) 2021 by kwan3217
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef KWANTRACE_RENDERSERVER_H
+#define KWANTRACE_RENDERSERVER_H
+
+#include <chrono>
+#include <cerrno>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace kwantrace {
+  /** Connection over a Unix domain socket which sends and receives lines of text and blocks of bytes,
+   * shared by RenderServer and RenderClient */
+  class SocketStream {
+  private:
+    int fd;             ///< Socket, or -1 if closed
+    std::string buffer; ///< Bytes received but not yet used
+    /** Receive more bytes into the buffer
+     * @return False if the other end closed the connection */
+    bool fill() {
+      char chunk[65536];
+      ssize_t n;
+      do n=::recv(fd,chunk,sizeof(chunk),0); while(n<0 && errno==EINTR);
+      if(n<=0) return false;
+      buffer.append(chunk,size_t(n));
+      return true;
+    }
+  public:
+    /** Take over an open socket @param Lfd Socket, which is closed when this is destroyed */
+    explicit SocketStream(int Lfd):fd(Lfd) {}
+    SocketStream(const SocketStream&)=delete;            ///< Not copyable, since it owns the socket
+    SocketStream& operator=(const SocketStream&)=delete; ///< Not copyable, since it owns the socket
+    ~SocketStream() {if(fd>=0) ::close(fd);}             ///< Close the socket
+    /** Receive one line
+     * @param[out] line Line, without the newline
+     * @return False if the other end closed the connection first */
+    bool readLine(std::string& line) {
+      size_t end;
+      while((end=buffer.find('\n'))==std::string::npos) if(!fill()) return false;
+      line=buffer.substr(0,end);
+      buffer.erase(0,end+1);
+      return true;
+    }
+    /** Receive an exact number of bytes
+     * @param data Where to put them
+     * @param size Number of bytes
+     * @return False if the other end closed the connection first */
+    bool readBytes(void* data, size_t size) {
+      char* out=static_cast<char*>(data);
+      while(size>0) {
+        if(buffer.empty() && !fill()) return false;
+        size_t n=std::min(size,buffer.size());
+        std::memcpy(out,buffer.data(),n);
+        buffer.erase(0,n);
+        out+=n;
+        size-=n;
+      }
+      return true;
+    }
+    /** Send bytes. A closed connection is reported as an exception rather than a SIGPIPE,
+     * so that a client going away can't kill the server.
+     * @param data First byte
+     * @param size Number of bytes
+     * @throws std::runtime_error if the bytes couldn't be sent
+     */
+    void write(const void* data, size_t size) {
+      const char* p=static_cast<const char*>(data);
+      while(size>0) {
+        ssize_t n=::send(fd,p,size,MSG_NOSIGNAL);
+        if(n<0 && errno==EINTR) continue;
+        if(n<=0) throw std::runtime_error("Connection closed");
+        p+=n;
+        size-=size_t(n);
+      }
+    }
+    /** Send a line @param line Line, to which a newline is added */
+    void writeLine(const std::string& line) {
+      std::string l=line+"\n";
+      write(l.data(),l.size());
+    }
+  };
+
+  /** Long-running render process which keeps a scene prepared in memory, and renders it on request from
+   * other processes over a Unix domain socket. This saves each frame of an interactive tool from starting a process,
+   * building the scene, and preparing all of it. Instead, a client changes just a few named parameters, and
+   * the server prepares only what those parameters affect, with Scene::render(int,int,SceneChange).
+   *
+   * The program which builds the scene exposes the parameters a client may change, then runs the server:
+   *
+   *     RenderServer<> server(scene,"/tmp/kwantrace.sock");
+   *     server.expose("spin",spinRotation);                          //a RotateScalar, set in radians
+   *     server.expose("cameraAt",lookat,SceneChange::Camera);        //a LocationLookat, set with 6 numbers
+   *     server.run();
+   *
+   * The protocol is lines of text, each answered with a line starting with `ok` or `error`:
+   *
+   *   * `list` -- answers with the names of the parameters, and how many numbers each takes
+   *   * `set NAME V1 V2...` -- sets a parameter
+   *   * `render WIDTH HEIGHT` -- renders an image of at most setMaxPixels() pixels, and answers `ok WIDTH HEIGHT CHANNELS BYTES MILLISECONDS`, followed by
+   *     BYTES bytes of raw pixels, as in PixelBuffer
+   *   * `render WIDTH HEIGHT SHMNAME` -- renders into the POSIX shared memory object SHMNAME instead, creating it if
+   *     needed, and answers the same without the pixels following. A client which renders into the same object each
+   *     frame avoids copying the pixels through the socket at all.
+   *   * `quit` -- ends the connection
+   *   * `shutdown` -- ends the connection and stops the server
+   *
+   * Clients are served one at a time, in the order they connect. A RenderClient speaks the protocol.
+   * @tparam pixdepth Number of channels in the pixels of the scene
+   * @tparam pixtype Type of one channel
+   */
+  template<int pixdepth=3, typename pixtype=uint8_t>
+  class RenderServer {
+  private:
+    /** A value which clients can set */
+    struct Parameter {
+      size_t count;      ///< Number of numbers it takes
+      SceneChange change;///< What has to be prepared again after it is set
+      std::function<void(const std::vector<double>&)> set; ///< Function which sets it
+    };
+    Scene<pixdepth,pixtype>& scene;              ///< Scene being served
+    std::string path;                            ///< Path of the socket
+    int listener=-1;                             ///< Socket which accepts connections
+    std::map<std::string,Parameter> parameters;  ///< Parameters which clients can set, by name
+    SceneChange pending=SceneChange::Everything; ///< What has changed since the scene was last prepared
+    bool stopping=false;                         ///< Set by the shutdown command
+    size_t maxPixels=size_t(1)<<26;              ///< Largest image a client may ask for, in pixels
+    /** Shared memory a client asked for, kept mapped between frames */
+    struct SharedImage {
+      std::string name;    ///< Name of the shared memory object
+      void* data=nullptr;  ///< Mapping of the object
+      size_t size=0;       ///< Size of mapping in bytes
+    } shared;
+    /** Unmap any shared memory */
+    void unmapShared() {
+      if(shared.data) ::munmap(shared.data,shared.size);
+      shared=SharedImage();
+    }
+    /** Get a mapping of a shared memory object of the given size, reusing the last one if it matches
+     * @param name Name of the object
+     * @param size Size in bytes
+     * @return Mapping
+     * @throws std::runtime_error if the object can't be made or mapped
+     */
+    void* mapShared(const std::string& name, size_t size) {
+      if(shared.data && shared.name==name && shared.size==size) return shared.data;
+      unmapShared();
+      int fd=::shm_open(name.c_str(),O_RDWR|O_CREAT,0600);
+      if(fd<0) throw std::runtime_error("Can't open shared memory "+name);
+      void* data=::ftruncate(fd,off_t(size))==0?::mmap(nullptr,size,PROT_READ|PROT_WRITE,MAP_SHARED,fd,0):MAP_FAILED;
+      ::close(fd);
+      if(data==MAP_FAILED) throw std::runtime_error("Can't map shared memory "+name);
+      shared.name=name;
+      shared.data=data;
+      shared.size=size;
+      return data;
+    }
+    /** Carry out one command
+     * @param command Line from the client
+     * @param stream Connection to the client, for sending pixels
+     * @return False if the connection should be closed
+     * @throws std::exception if the command is bad or fails, with a message for the client
+     */
+    bool handle(const std::string& command, SocketStream& stream) {
+      std::istringstream in(command);
+      std::string verb;
+      in>>verb;
+      if(verb=="list") {
+        std::string reply="ok";
+        for(auto&& [name,parameter]:parameters) reply+=" "+name+" "+std::to_string(parameter.count);
+        stream.writeLine(reply);
+      } else if(verb=="set") {
+        std::string name;
+        in>>name;
+        auto it=parameters.find(name);
+        if(it==parameters.end()) throw std::runtime_error("no parameter "+name);
+        std::vector<double> values;
+        double v;
+        while(in>>v) values.push_back(v);
+        if(!in.eof() || values.size()!=it->second.count) {
+          throw std::runtime_error(name+" takes "+std::to_string(it->second.count)+" numbers");
+        }
+        it->second.set(values);
+        pending=std::max(pending,it->second.change);
+        stream.writeLine("ok");
+      } else if(verb=="render") {
+        int width=0, height=0;
+        std::string shm;
+        in>>width>>height>>shm;
+        if(width<=0 || height<=0 || size_t(width)*height>maxPixels) throw std::runtime_error("bad image size");
+        auto start=std::chrono::steady_clock::now();
+        auto pixbuf=scene.render(width,height,pending);
+        pending=SceneChange::Nothing;
+        double ms=std::chrono::duration<double,std::milli>(std::chrono::steady_clock::now()-start).count();
+        size_t bytes=size_t(width)*height*pixdepth*sizeof(pixtype);
+        std::ostringstream reply;
+        reply<<"ok "<<width<<" "<<height<<" "<<pixdepth<<" "<<bytes<<" "<<ms;
+        if(shm.empty()) {
+          stream.writeLine(reply.str());
+          stream.write(pixbuf.get(),bytes);
+        } else {
+          std::memcpy(mapShared(shm,bytes),pixbuf.get(),bytes);
+          stream.writeLine(reply.str());
+        }
+      } else if(verb=="quit") {
+        stream.writeLine("ok");
+        return false;
+      } else if(verb=="shutdown") {
+        stream.writeLine("ok");
+        stopping=true;
+        return false;
+      } else {
+        throw std::runtime_error("unknown command "+verb);
+      }
+      return true;
+    }
+  public:
+    /** Make a server and start listening. Any old socket file at the path is replaced.
+     * @param Lscene Scene to serve. It must outlive the server.
+     * @param Lpath Path of the socket
+     * @throws std::runtime_error if the socket can't be made
+     */
+    RenderServer(Scene<pixdepth,pixtype>& Lscene, const std::string& Lpath):scene(Lscene),path(Lpath) {
+      sockaddr_un addr{};
+      if(path.size()>=sizeof(addr.sun_path)) throw std::runtime_error("Socket path is too long: "+path);
+      addr.sun_family=AF_UNIX;
+      std::strcpy(addr.sun_path,path.c_str());
+      ::unlink(path.c_str());
+      listener=::socket(AF_UNIX,SOCK_STREAM,0);
+      if(listener<0 || ::bind(listener,reinterpret_cast<sockaddr*>(&addr),sizeof(addr))<0 || ::listen(listener,8)<0) {
+        if(listener>=0) ::close(listener);
+        throw std::runtime_error("Can't listen on "+path);
+      }
+    }
+    RenderServer(const RenderServer&)=delete;            ///< Not copyable, since it owns the socket
+    RenderServer& operator=(const RenderServer&)=delete; ///< Not copyable, since it owns the socket
+    /** Stop listening and remove the socket file */
+    ~RenderServer() {
+      unmapShared();
+      ::close(listener);
+      ::unlink(path.c_str());
+    }
+    /** Limit the size of image clients may render. Larger requests are answered with an error, rather than
+     * trying to allocate the image.
+     * @param LmaxPixels Most pixels in one image, width times height. The default is 2^26, or 8192x8192.
+     */
+    void setMaxPixels(size_t LmaxPixels) {maxPixels=LmaxPixels;}
+    /** Let clients set a value through a function
+     * @param name Name clients use
+     * @param count Number of numbers it takes
+     * @param set Function which sets it
+     * @param change What has to be prepared again after it is set
+     */
+    void expose(const std::string& name, size_t count, std::function<void(const std::vector<double>&)> set, SceneChange change=SceneChange::Objects) {
+      parameters[name]=Parameter{count,change,std::move(set)};
+    }
+    /** Let clients set the parameter of a transformation, such as the angle of a RotateScalar in radians
+     * @param name Name clients use
+     * @param transformation Transformation to set
+     * @param change What has to be prepared again after it is set. Use SceneChange::Camera if the transformation is part of the camera.
+     */
+    void expose(const std::string& name, std::shared_ptr<ScalarTransformation> transformation, SceneChange change=SceneChange::Objects) {
+      expose(name,1,[transformation](const std::vector<double>& v){transformation->set(v[0]);},change);
+    }
+    /** Let clients set the vector parameter of a transformation, such as a Translation
+     * @param name Name clients use
+     * @param transformation Transformation to set
+     * @param change What has to be prepared again after it is set. Use SceneChange::Camera if the transformation is part of the camera.
+     */
+    void expose(const std::string& name, std::shared_ptr<VectorTransformation> transformation, SceneChange change=SceneChange::Objects) {
+      expose(name,3,[transformation](const std::vector<double>& v){transformation->setV(Eigen::Vector3d(v[0],v[1],v[2]));},change);
+    }
+    /** Let clients set the location and look-at point of a LocationLookat, as six numbers
+     * @param name Name clients use
+     * @param transformation Transformation to set
+     * @param change What has to be prepared again after it is set. Use SceneChange::Camera if the transformation is part of the camera.
+     */
+    void expose(const std::string& name, std::shared_ptr<LocationLookat> transformation, SceneChange change=SceneChange::Objects) {
+      expose(name,6,[transformation](const std::vector<double>& v) {
+        transformation->setLocation(Position(v[0],v[1],v[2]));
+        transformation->setLook_at(Position(v[3],v[4],v[5]));
+      },change);
+    }
+    /** Serve clients until one sends `shutdown` */
+    void run() {
+      stopping=false;
+      while(!stopping) {
+        int fd=::accept(listener,nullptr,nullptr);
+        if(fd<0) {
+          if(errno==EINTR) continue;
+          throw std::runtime_error("Can't accept connections on "+path);
+        }
+        SocketStream stream(fd);
+        std::string command;
+        try {
+          bool open=true;
+          while(open && stream.readLine(command)) {
+            try {
+              open=handle(command,stream);
+            } catch(std::exception& e) {
+              stream.writeLine(std::string("error ")+e.what());
+            }
+          }
+        } catch(std::exception&) {
+          //The client went away in the middle of a reply. Just wait for the next one.
+        }
+      }
+    }
+  };
+
+  /** Client for a RenderServer
+   * @tparam pixdepth Number of channels in the pixels of the scene the server has
+   * @tparam pixtype Type of one channel
+   */
+  template<int pixdepth=3, typename pixtype=uint8_t>
+  class RenderClient {
+  private:
+    std::unique_ptr<SocketStream> stream; ///< Connection to the server
+    /** Send a command and check the answer
+     * @param command Command line
+     * @return Rest of the answer after `ok`
+     * @throws std::runtime_error with the message from the server if the answer is an error
+     */
+    std::string request(const std::string& command) {
+      stream->writeLine(command);
+      std::string reply;
+      if(!stream->readLine(reply)) throw std::runtime_error("Render server closed the connection");
+      if(reply.compare(0,2,"ok")!=0) throw std::runtime_error("Render server: "+reply);
+      return reply.size()>3?reply.substr(3):"";
+    }
+  public:
+    double lastRenderMs=0; ///< Time the server took for the last render, including preparing the scene
+    /** Connect to a server
+     * @param path Path of the socket of the server
+     * @throws std::runtime_error if the server can't be reached
+     */
+    explicit RenderClient(const std::string& path) {
+      sockaddr_un addr{};
+      if(path.size()>=sizeof(addr.sun_path)) throw std::runtime_error("Socket path is too long: "+path);
+      addr.sun_family=AF_UNIX;
+      std::strcpy(addr.sun_path,path.c_str());
+      int fd=::socket(AF_UNIX,SOCK_STREAM,0);
+      if(fd<0 || ::connect(fd,reinterpret_cast<sockaddr*>(&addr),sizeof(addr))<0) {
+        if(fd>=0) ::close(fd);
+        throw std::runtime_error("Can't connect to render server "+path);
+      }
+      stream=std::make_unique<SocketStream>(fd);
+    }
+    /** Set a parameter the server exposes
+     * @param name Name of parameter
+     * @param values Numbers to set it to
+     */
+    void set(const std::string& name, const std::vector<double>& values) {
+      std::ostringstream command;
+      command.precision(17);
+      command<<"set "<<name;
+      for(double v:values) command<<" "<<v;
+      request(command.str());
+    }
+    /** Render a frame and receive the pixels through the socket
+     * @param width Width in pixels
+     * @param height Height in pixels
+     * @return Pixel buffer
+     */
+    PixelBuffer<pixdepth,pixtype> render(int width, int height) {
+      std::istringstream reply(request("render "+std::to_string(width)+" "+std::to_string(height)));
+      int w, h, channels;
+      size_t bytes;
+      reply>>w>>h>>channels>>bytes>>lastRenderMs;
+      if(w!=width || h!=height || channels!=pixdepth || bytes!=size_t(width)*height*pixdepth*sizeof(pixtype)) {
+        throw std::runtime_error("Render server sent a different kind of image");
+      }
+      PixelBuffer<pixdepth,pixtype> pixbuf(width,height);
+      if(!stream->readBytes(&pixbuf(0,0,0),bytes)) throw std::runtime_error("Render server closed the connection");
+      return pixbuf;
+    }
+    /** Render a frame into a POSIX shared memory object, which the server creates if needed. Map it with
+     * `shm_open()` and `mmap()` to read the pixels.
+     * @param width Width in pixels
+     * @param height Height in pixels
+     * @param shm Name of shared memory object, starting with a slash
+     */
+    void render(int width, int height, const std::string& shm) {
+      std::istringstream reply(request("render "+std::to_string(width)+" "+std::to_string(height)+" "+shm));
+      int w, h, channels;
+      size_t bytes;
+      reply>>w>>h>>channels>>bytes>>lastRenderMs;
+    }
+    /** Stop the server */
+    void shutdown() {request("shutdown");}
+  };
+}
+
+#endif //KWANTRACE_RENDERSERVER_H
@@ -5,13 +5,16 @@
 #ifndef KWANTRACE_RENDERABLE_H
 #define KWANTRACE_RENDERABLE_H
 
+#include <limits>
 #include <memory>
+#include <vector>
 #include "Transformable.h"
 #include "Ray.h"
 #include "Field.h"
 
 namespace kwantrace {
   class Primitive;
+  class Shader;
   /**
    * Superclass for Primitive and Composite. This is able to be intersected and has an inside, but does not have a normal.
    * It has a pigment since it is needed both for Primitive, and for Composite as the default pigment.
@@ -20,6 +23,35 @@ namespace kwantrace {
   protected:
     std::shared_ptr<ColorField> pigment; ///< Pointer to pigment for this object, or nullptr if there isn't one
     Observer<Renderable> parent=nullptr; ///< Used to find parent object to inherit default properties from
+    bool hasPigment=false;                      ///< True if this object or any ancestor has a pigment. Only valid after prepareRender()
+    Observer<ColorField> variablePigment=nullptr; ///< Effective pigment if it varies over space, nullptr otherwise. Only valid after prepareRender()
+    ObjectColor constantPigment;                ///< Effective pigment color if it is constant over space. Only valid after prepareRender()
+    std::shared_ptr<Shader> shader;             ///< Pointer to shader for this object, or nullptr to inherit one
+    Observer<Shader> effectiveShader=nullptr;   ///< Shader from this object or its nearest ancestor with one, or nullptr to use the scene shader. Only valid after prepareRender()
+    /** Call Shader::prepareRender() on the shader of this object. This is defined in
+     * Shader.h, since Shader is only forward-declared here. */
+    void prepareShader();
+    /** Find the pigment and shader which apply to this object, either its own or the nearest
+     * one inherited from its ancestors. Constant pigments are folded into a plain
+     * color so that they don't need to be evaluated during the render at all.
+     *
+     * The parent must already have been prepared, which is the case when this
+     * is called from Composite::prepareRender().
+     */
+    void resolveInherited() {
+      effectiveShader=shader?shader.get():(parent?parent->effectiveShader:nullptr);
+      if(pigment) {
+        hasPigment=true;
+        variablePigment=pigment->isConstant(constantPigment)?nullptr:pigment.get();
+      } else if(parent) {
+        hasPigment=parent->hasPigment;
+        variablePigment=parent->variablePigment;
+        constantPigment=parent->constantPigment;
+      } else {
+        hasPigment=false;
+        variablePigment=nullptr;
+      }
+    }
   public:
     /** Set a pointer to the parent object. Intended to be used by the
      * prepareRender of container Renderable objects.
@@ -37,12 +69,60 @@ namespace kwantrace {
      *                         Output parameter t is unspecified if function returns false
      */
     virtual Observer<Primitive> intersect(const Ray &ray,double& t) const=0;
+    /** Intersect a batch of rays with this Renderable, in world space, keeping the nearest hit of each ray.
+     * This gives the same answer as intersect() on each ray, which is what this does unless overridden.
+     * Union and Primitive override it to work on the whole batch at once.
+     *
+     * @param[in] rays Rays in world space
+     * @param[in,out] t Ray parameter of the nearest hit so far of each ray, or infinity if none. Lowered
+     *   for each ray which hits this object nearer.
+     * @param[in,out] hit Primitive of the nearest hit so far of each ray, set wherever t is lowered
+     */
+    virtual void intersectBatch(const RayBatch& rays, double* t, Observer<Primitive>* hit) const {
+      for(size_t i=0;i<rays.size();i++) {
+        double this_t;
+        Observer<Primitive> this_result=intersect(rays[i],this_t);
+        if(this_result && this_t<t[i]) {
+          t[i]=this_t;
+          hit[i]=this_result;
+        }
+      }
+    }
     /** Determine if the given point is inside the Renderable
      * @return True if point is inside, false if not.
      */
     virtual bool inside(
       const Position &r ///< Point to check for insideness
     ) const=0;
+    /** Find a sphere in world space which encloses this object. Only valid after prepareRender().
+     * @param[out] center Center of sphere
+     * @param[out] radius Radius of sphere
+     * @return True if the object is bounded, false if it is infinite or the bound isn't known
+     */
+    virtual bool boundingSphere(Position& center, double& radius) const {return false;}
+    /** Grow a sphere just enough to enclose another one
+     * @param[in,out] center Center of sphere to grow
+     * @param[in,out] radius Radius of sphere to grow
+     * @param c Center of sphere to enclose
+     * @param r Radius of sphere to enclose
+     */
+    static void mergeSphere(Position& center, double& radius, const Position& c, double r) {
+      double d=(c-center).norm();
+      if(d+r<=radius) return;
+      if(d+radius<=r) {
+        center=c;
+        radius=r;
+        return;
+      }
+      double newRadius=(d+r+radius)/2;
+      center=Position(center+(c-center)*((newRadius-radius)/d));
+      radius=newRadius;
+    }
+    /** Add every Primitive in this Renderable to a list, for code that needs to look at
+     * each piece of geometry in a scene separately.
+     * @param[in,out] list List to add to
+     */
+    virtual void collectPrimitives(std::vector<Observer<Primitive>>& list) const=0;
     /** Set the pigment. If a nullptr is passed, the existing pigment is removed
      * and the Renderable is treated as having no pigment.
      * @param Lpigment Pigment to use. May be a nullptr.
@@ -50,22 +130,73 @@ namespace kwantrace {
     void setPigment(std::shared_ptr<ColorField> Lpigment) {
       pigment = Lpigment;
     }
-    /** Evaluate the intrinsic color of this object at a point
+    /** Construct a pigment from the same memory resource as this object and set it.
+     *
+     *      object->setPigment<ConstantColor>(1,0,0);
+     *
+     * @tparam T Type of pigment to construct
+     * @param args Arguments forwarded to the pigment constructor
+     * @return Pointer to the new pigment
+     */
+    template<typename T, typename ... Args>
+    std::shared_ptr<T> setPigment(Args&&... args) {
+      auto result=make<T>(std::forward<Args>(args)...);
+      setPigment(std::shared_ptr<ColorField>(result));
+      return result;
+    }
+    /** Set the shader for this object and its children. This overrides the scene
+     * shader, so that for instance only some objects are reflective. If a nullptr
+     * is passed, the object inherits the shader of its parent, or the scene.
+     * @param Lshader Shader to use. May be a nullptr.
+     */
+    void setShader(std::shared_ptr<Shader> Lshader) {
+      shader = Lshader;
+    }
+    /** Construct a shader from the same memory resource as this object and set it.
+     * @tparam T Type of shader to construct
+     * @param args Arguments forwarded to the shader constructor
+     * @return Pointer to the new shader
+     */
+    template<typename T, typename ... Args>
+    std::shared_ptr<T> setShader(Args&&... args) {
+      auto result=make<T>(std::forward<Args>(args)...);
+      setShader(std::shared_ptr<Shader>(result));
+      return result;
+    }
+    /** Get the shader which applies to this object
+     * @return Shader of this object or its nearest ancestor, or nullptr if the scene shader should be used.
+     *   Only valid after prepareRender()
+     */
+    Observer<Shader> getShader() const {return effectiveShader;}
+    /** Evaluate the intrinsic color of this object at a point. This uses the pigment
+     * resolved at prepareRender(), so it doesn't have to climb the parent chain, and
+     * a constant pigment is just a copy.
+     *
+     * If the object moves, the point is first carried back to where it was at shutter open,
+     * so that the pigment moves with the object.
      * @return True if color is evaluated, false if not
      */
-    virtual bool evalPigment(
-      const Position& r, ///< Position to evaluate the color at
-      ObjectColor& color ///< Color at this point, if any. Unspecified if function returns false.
+    bool evalPigment(
+      const Position& r,   ///< Position to evaluate the color at
+      ObjectColor& color,  ///< Color at this point, if any. Unspecified if function returns false.
+      double footprint=0,  ///< Width of the area around the point that the color should be averaged over, in world space
+      double time=0        ///< Time within the shutter interval that the point was hit at
     ) const {
-      if(pigment) {
-        color=(*pigment)(r);
-        return true;
-      } else if(parent) {
-        return parent->evalPigment(r,color);
+      if(!hasPigment) return false;
+      if(!variablePigment) {
+        color=constantPigment;
+      } else if(moving()) {
+        color=(*variablePigment)(Position(Mwb*(MbwAt(time)*r)),footprint);
       } else {
-        return false;
+        color=(*variablePigment)(r,footprint);
       }
+      return true;
     }
+    /** Check if the pigment varies over space. If it doesn't, there is no point in
+     * working out a footprint to pass to evalPigment().
+     * @return True if the effective pigment varies over space. Only valid after prepareRender()
+     */
+    bool hasVariablePigment() const {return variablePigment!=nullptr;}
     /** Add a transformation to this Renderable. Also adds the transformation
      * to the Renderable object's pigment, if any
      */
@@ -80,14 +211,34 @@ namespace kwantrace {
     /**Prepare an object for rendering. This must be called
      * between any change to the object and rendering the object
      *
-     * \internal This calls the overridden method, and calls
-     * ColorField::prepareRender() on the associated pigment if any.
+     * \internal This calls the overridden method, calls
+     * ColorField::prepareRender() on the associated pigment if any,
+     * then resolves the effective pigment and shader with resolveInherited().
      */
     virtual void prepareRender() override {
       Transformable::prepareRender();
       if(pigment) {
         pigment->prepareRender();
       }
+      if(shader) {
+        prepareShader();
+      }
+      resolveInherited();
+    }
+    /** \copydoc Transformable::write()
+     *
+     * The pigment and shader are written as references, so that one shared between objects stays shared.
+     */
+    virtual void write(SceneWriter& out) const override {
+      Transformable::write(out);
+      out.object(pigment);
+      out.object(shader);
+    }
+    /** \copydoc Transformable::read() */
+    virtual void read(SceneReader& in) override {
+      Transformable::read(in);
+      in.object(pigment);
+      in.object(shader);
     }
   };
 
@@ -217,6 +368,18 @@ namespace kwantrace {
      * leave the partial computation in `t`.
      */
     virtual bool intersectLocal(const Ray &rayLocal, double& t) const=0;
+    /** Intersect a batch of rays with this primitive, in object local space. This gives the same answer as
+     * intersectLocal() on each ray, which is what this does unless overridden. Override it with a CpuDispatch
+     * kernel which works on all of the rays at once, as Sphere does.
+     *
+     * @param[in] raysLocal Rays in object local space
+     * @param[out] t Ray parameter of the hit of each ray, or infinity if it misses
+     */
+    virtual void intersectLocalBatch(const RayBatch& raysLocal, double* t) const {
+      for(size_t i=0;i<raysLocal.size();i++) {
+        if(!intersectLocal(raysLocal[i],t[i])) t[i]=std::numeric_limits<double>::infinity();
+      }
+    }
     /** Generate the normal vector to an object at a point.
      *
      * @param[in]  rLocal point on surface of object, already transformed into local object space
@@ -248,12 +411,29 @@ namespace kwantrace {
     bool inside_out=false;
     virtual ~Primitive() {};
     virtual Observer<Primitive> intersect(const Ray &ray, double& t) const override {
-      if (intersectLocal(Mbw * ray, t)) {
+      if (intersectLocal((moving()?MbwAt(ray.time):Mbw) * ray, t)) {
         return this;
       } else {
         return nullptr;
       }
     };
+    /** \copydoc Renderable::intersectBatch()
+     *
+     * The whole batch is transformed to object local space with one kernel, then passed to intersectLocalBatch().
+     */
+    virtual void intersectBatch(const RayBatch& rays, double* t, Observer<Primitive>* hit) const override {
+      thread_local RayBatch raysLocal;
+      thread_local std::vector<double> tLocal;
+      rays.transform(moving()?MbwAt(0):Mbw,raysLocal);
+      tLocal.resize(rays.size());
+      intersectLocalBatch(raysLocal,tLocal.data());
+      for(size_t i=0;i<rays.size();i++) {
+        if(tLocal[i]<t[i]) {
+          t[i]=tLocal[i];
+          hit[i]=this;
+        }
+      }
+    }
     /** Calculate the surface normal at a given point in world coordinates.
      * This transforms the point to body coordinates, calls the descendant's
      * Primitive::normalLocal() to get the normal in body coordinates, then transforms
@@ -337,10 +517,17 @@ namespace kwantrace {
      *  we will make sure to return a unit normal.
      *
      *  Also, if the primitive is inside out, we will reverse the direction of the normal.
+     *
+     *  If the primitive moves, the matrices for the time the point was hit at are used instead.
      * @param r point in world coordinates at which to calculate the normal
+     * @param time Time within the shutter interval that the point was hit at
      * @return Unit normal vector in world coordinates
      */
-    virtual Direction normal(const Position &r) const {
+    virtual Direction normal(const Position &r, double time=0) const {
+      if(moving()) {
+        Eigen::Matrix4d MbwT=MbwAt(time);
+        return (Direction) ((inside_out ? -1 : 1) * (Eigen::Matrix4d(MbwT.transpose()) * normalLocal(MbwT * r)).normalized());
+      }
       return (Direction) ((inside_out ? -1 : 1) * (MwbN * normalLocal(Mbw * r)).normalized());
     }
     /** Calculate if a point is inside the primitive. This transforms
@@ -356,6 +543,20 @@ namespace kwantrace {
     virtual bool inside(const Position &r) const override {
       return inside_out ^ insideLocal(Mbw * r);
     }
+    /** \copydoc Renderable::collectPrimitives() */
+    virtual void collectPrimitives(std::vector<Observer<Primitive>>& list) const override {
+      list.push_back(this);
+    }
+    /** \copydoc Renderable::write() */
+    virtual void write(SceneWriter& out) const override {
+      Renderable::write(out);
+      out.put(inside_out);
+    }
+    /** \copydoc Renderable::read() */
+    virtual void read(SceneReader& in) override {
+      Renderable::read(in);
+      in.get(inside_out);
+    }
   };
 
 }
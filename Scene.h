@@ -56,8 +56,35 @@ namespace kwantrace {
     pixtype& operator()(int col, int row, int channel) {
       return _buf[((row*_width)+col)*pixdepth+channel];
     }
+    /** Flatten coordinates of a pixel buffer
+     *
+     * @param[in] col Column index
+     * @param[in] row Row index
+     * @param[in] channel Channel index
+     * @return Value of the correct cell of the pixel buffer
+     */
+    pixtype operator()(int col, int row, int channel) const {
+      return _buf[((row*_width)+col)*pixdepth+channel];
+    }
+
+    Observer<pixtype> get() const {return _buf.get();} ///< Get a pointer to the pixels @return pointer to the pixels
+    /** Write the pixels to an image file on this thread. To write on a background thread
+     * while the next frame renders, use an ImageWriter instead.
+     * @param filename Name of file, with the format picked from the extension, see ImageFile
+     * @param threads Number of threads to compress with, or 0 to use all hardware threads
+     */
+    void write(const std::string& filename, int threads=0) const {
+      ImageFile::write(filename,_width,_height,pixdepth,get(),threads);
+    }
+  };
 
-    Observer<pixtype> get() {return _buf.get();} ///< Get a pointer to the pixels @return pointer to the pixels
+  /** What has changed in a scene since it was last prepared, for Scene::render(int,int,SceneChange). Each
+   * includes the ones before it. */
+  enum class SceneChange {
+    Nothing,    ///< Render again as it is, for instance at a different size
+    Camera,     ///< Only the camera moved, so only it is prepared again
+    Objects,    ///< Objects moved or changed, so everything but the light tree is prepared again
+    Everything  ///< Anything, including the lights, could have changed, so everything is prepared, as in render(int,int)
   };
 
   /** Manager for the whole rendering process. Your code is responsible
@@ -88,21 +115,33 @@ namespace kwantrace {
    * @tparam pixtype Type of one channel of one pixel
    */
   template<int pixdepth=3, typename pixtype=uint8_t>
-  class Scene {
+  class Scene: public Tracer {
   private:
+    /** Memory resource for everything created through the scene. This is declared first
+     * so that it is destroyed last, after every object in the scene has let go of it. Nothing
+     * is given back to the system until the scene itself is destroyed, at which point
+     * the whole arena is released at once.
+     */
+    std::pmr::monotonic_buffer_resource arena;
     Union objects;          ///< All objects in the scene
     LightList lightList;    ///< All lights in the scene
     std::shared_ptr<Shader> shader; ///< Shader to use
     std::shared_ptr<Camera> camera; ///< Camera to use
+    double pixelSpacing=0;  ///< Horizontal distance between pixel centers in camera plane space, set by render()
+    LightTree lightTree;    ///< Hierarchy over lightList, only built if lightPicks is nonzero
     virtual void prepareRender() {
+      TraceScope span("prepareRender","scene");
       objects.prepareRender();
       for(auto&& light:lightList) light->prepareRender();
+      if(lightPicks>0) lightTree.build(lightList);
       shader->prepareRender();
       camera->prepareRender();
+      if(photonMap) photonMap->build(objects,lightList,shader.get());
     }
     /** Render a scene into a given pixelbuf. This covers converting a pixel coordinate
-     * to a coordinate in the normalized image plane, then calls renderPixel to actually
-     * do the work.
+     * to a coordinate in the normalized image plane, then calls shadeCameraRay() to actually
+     * do the work. The camera rays of each row are made all at once with Camera::projectBatch(),
+     * intersected all at once with intersectCameraBatch(), and stored all at once with recordRow().
      *
      * If you wanted to add multithreading, this is the place to do it. All methods
      * are intended to be thread safe by only using const methods on the scene and
@@ -114,64 +153,231 @@ namespace kwantrace {
      *    a 2D row-major array (IE rows are contiguous in memory)
      */
     virtual void render(int width, int height, PixelBuffer<pixdepth,pixtype>& pixbuf) {
+      pixelSpacing=1.0/width;
+      RayBatch batch;
+      std::vector<double> t;
+      std::vector<Observer<Primitive>> hit;
+      std::vector<RayColor> colors(width);
       for (int row = 0; row < height; row++) {
+        TraceScope span("row","render","row",row);
         double y = (double(row) + 0.5) / height-0.5;
+        camera->projectBatch(0.5/width-0.5, y, pixelSpacing, width, batch);
+        intersectCameraBatch(batch, t, hit);
         for (int col = 0; col < width; col++) {
           double x = (double(col) + 0.5) / width - 0.5;
-          renderPixel(x, y, col, row, pixbuf);
+          colors[col]=shadeCameraRay(batch[col], x, y, t[col], hit[col]);
         }
+        recordRow(pixbuf, 0, row, width, colors.data());
       }
     }
+    /** Intersect a batch of camera rays with the scene, all at once with Renderable::intersectBatch().
+     * This finds the same hits as intersecting each ray on its own.
+     * @param batch Camera rays
+     * @param[out] t Ray parameter of the hit of each ray, resized to match the batch
+     * @param[out] hit Primitive hit by each ray, or nullptr if it misses, resized to match the batch
+     */
+    void intersectCameraBatch(const RayBatch& batch, std::vector<double>& t, std::vector<Observer<Primitive>>& hit) const {
+      t.assign(batch.size(),std::numeric_limits<double>::infinity());
+      hit.assign(batch.size(),nullptr);
+      objects.intersectBatch(batch,t.data(),hit.data());
+    }
     /**
      * Render a single camera ray. This creates a ray, checks it for intersections against the scene,
      * and runs the shader on the correct intersection (which might itself spawn rays)
+     * @param ray Camera ray through this point, from Camera::project() or Camera::projectBatch()
      * @param x horizontal coordinate in camera plane space
      * @param y vertical coordinate in camera plane space
+     * @param guide If not nullptr, filled in with the features of the surface the ray hits, for a Denoiser
+     * @param hit If not nullptr, set to the primitive the ray hits, or nullptr if it misses
      * @return Color of this ray
      */
-    RayColor renderCameraRay(double x, double y) {
-      Ray ray = camera->project(x, y);
+    RayColor renderCameraRay(const Ray& ray, double x, double y, GuideSample* guide=nullptr, Observer<Primitive>* hit=nullptr) {
       double t;
       Observer<Primitive> finalObject=objects.intersect(ray, t);
+      if(hit) *hit=finalObject;
+      return shadeCameraRay(ray, x, y, t, finalObject, guide);
+    }
+    /**
+     * Shade a camera ray which has already been intersected with the scene, such as by intersectCameraBatch().
+     * @param ray Camera ray through this point
+     * @param x horizontal coordinate in camera plane space
+     * @param y vertical coordinate in camera plane space
+     * @param t Ray parameter of the hit
+     * @param finalObject Primitive the ray hits, or nullptr if it misses
+     * @param guide If not nullptr, filled in with the features of the surface the ray hits, for a Denoiser
+     * @return Color of this ray
+     */
+    RayColor shadeCameraRay(const Ray& ray, double x, double y, double t, Observer<Primitive> finalObject, GuideSample* guide=nullptr) {
       RayColor color;
       if(finalObject) {
-        Position r = ray(t);
-        color = shader->shade(*finalObject, objects, lightList, r, ray.v.normalized(), finalObject->normal(r));
+        color = shadeHit(ray, t, *finalObject, TraceState{*this,1,1.0,ray.time}, footprint(ray,x,y,t,*finalObject));
+        if(guide) {
+          Position r=ray(t);
+          ObjectColor objectColor;
+          guide->albedo=finalObject->evalPigment(r,objectColor,0,ray.time)?RayColor(objectColor.head<3>()):RayColor::Zero();
+          guide->normal=finalObject->normal(r,ray.time);
+          if(guide->normal.dot(ray.v)>0) guide->normal=static_cast<Direction>(-guide->normal);
+          guide->depth=t*ray.v.norm();
+        }
       } else {
         color=RayColor(0,0,0);
+        if(guide) *guide=GuideSample();
       }
       return color;
     }
-    void recordPixel(
+    /**
+     * Render a single camera ray, projecting it from the camera first.
+     * @param x horizontal coordinate in camera plane space
+     * @param y vertical coordinate in camera plane space
+     * @param guide If not nullptr, filled in with the features of the surface the ray hits, for a Denoiser
+     * @return Color of this ray
+     */
+    RayColor renderCameraRay(double x, double y, GuideSample* guide=nullptr) {
+      return renderCameraRay(camera->project(x, y), x, y, guide);
+    }
+    /** Shade the point where a ray hits an object. This evaluates the pigment once, then runs
+     * the shader of the object if it has one, or the scene shader if not.
+     * @param ray Ray which hit the object
+     * @param t Ray parameter of hit
+     * @param object Object which was hit
+     * @param state Trace level and weight of the ray
+     * @param footprint Width of the ray at the hit, for filtering the pigment
+     * @return Color of the ray
+     */
+    RayColor shadeHit(const Ray& ray, double t, const Primitive& object, const TraceState& state, double footprint) const {
+      Position r = ray(t);
+      ObjectColor objectColor;
+      bool hasColor=object.evalPigment(r,objectColor,footprint,ray.time);
+      Observer<Shader> objectShader=object.getShader();
+      if(!objectShader) objectShader=shader.get();
+      ShadingContext context(object, objects, lightList, r, static_cast<Direction>(ray.v.normalized()), object.normal(r,ray.time), hasColor?&objectColor:nullptr, state,
+                             lightPicks>0?&lightTree:nullptr, lightPicks);
+      return objectShader->shade(context);
+    }
+    /** Estimate the width of a pixel where a camera ray hits a surface. This is the
+     * distance between the hit point and the point at the same parameter on the ray
+     * through the neighboring pixel. It doesn't account for the surface being tilted,
+     * but it is good enough to pick a level of detail for a texture.
+     * @param ray Camera ray
+     * @param x horizontal coordinate in camera plane space
+     * @param y vertical coordinate in camera plane space
+     * @param t Ray parameter of hit
+     * @param object Object that was hit
+     * @return Width of pixel at hit in world space, or zero if the object pigment doesn't need it
+     */
+    double footprint(const Ray& ray, double x, double y, double t, const Renderable& object) const {
+      if(!object.hasVariablePigment()) return 0;
+      return t*(camera->project(x+pixelSpacing,y,ray.time).v-ray.v).norm();
+    }
+    /** Store a run of pixels of one row into the pixel buffer, clamping each color to 0-1 and scaling it to the
+     * full range of pixtype. This is a CpuDispatch kernel. The clamp is done with quiet compares before scaling, as in
+     * VideoStream, so that the loop vectorizes, and gives the same pixels as clamping after.
+     */
+    void recordRow(
             PixelBuffer<pixdepth,pixtype>& pixbuf, ///<[in] pixel buffer to render into
-            int col,                               ///<[in] column in pixel buffer
+            int col0,                              ///<[in] column of first pixel in pixel buffer
             int row,                               ///<[in] row in pixel buffer
-            RayColor color) {
-      for(int i=0;i<pixdepth;i++) {
-        if(color[i]<=0) {
-          pixbuf(col, row, i)=0;
-        } else if (color[i]>=1.0) {
-          pixbuf(col, row, i)=std::numeric_limits<pixtype>::max();
-        } else {
-          pixbuf(col, row, i)=pixtype(color[i] * std::numeric_limits<pixtype>::max());
+            int count,                             ///<[in] number of pixels
+            const RayColor* colors) {              ///<[in] color of each pixel
+      const double full=double(std::numeric_limits<pixtype>::max());
+      auto kernel=[&](const double* __restrict in, pixtype* __restrict out) KWANTRACE_KERNEL {
+        for(int p=0;p<count;p++) for(int c=0;c<pixdepth;c++) {
+          double v=in[p*3+c];
+          v=std::isgreater(v,0.0)?v:0.0;
+          v=std::isless(v,1.0)?v:1.0;
+          out[p*pixdepth+c]=pixtype(v*full);
         }
-      }
+      };
+      CpuDispatch::run([&]() KWANTRACE_KERNEL {kernel(colors->data(),&pixbuf(col0,row,0));});
     }
-    /** Render a pixel. This renders a ray, then stores the resulting color value into the pixel buffer. This
-     * is the correct function to override to do such things as anti-aliasing -- call renderCameraRay multiple
-     * times with slightly different values, and combine the results.
-     *
+    /** Write everything in the scene to a writer, for save() and fingerprint()
+     * @param out Writer
      */
-    void renderPixel(
-      double x,                             ///<[in] horizontal coordinate on the camera plane, intended to run from (-0.5,0.5)
-      double y,                             ///<[in] horizontal coordinate on the camera plane, *also* intended to run from (-0.5,0.5)
-      int col,                              ///<[in] column in pixel buffer
-      int row,                              ///<[in] row in pixel buffer
-      PixelBuffer<pixdepth,pixtype>& pixbuf ///<[in] pixel buffer to render into
-    ) {
-      recordPixel(pixbuf, col, row, renderCameraRay(x,y));
+    void write(SceneWriter& out) const {
+      out.object(camera);
+      out.object(shader);
+      out.objects(lightList);
+      objects.write(out);
+      out.put(uint64_t(lightPicks));
+      out.object(photonMap);
+      out.put(toneMap.exposure);
+      out.put(toneMap.curve);
+      out.put(toneMap.srgb);
+      out.put(toneMap.dither);
     }
   public:
+    /** Number of lights to pick at each shading point, or 0 to use every light. For scenes with many
+     * lights, set this to a small number such as 4 or 8. Each hit then casts at most this many
+     * shadow rays, with the lights picked from a LightTree so that near, bright lights are picked
+     * more often. The result is noisier than using every light, but correct on average.
+     */
+    size_t lightPicks=0;
+    /** Photon map for caustics, or nullptr for none. If set, it is rebuilt each time the scene is
+     * prepared for rendering. Share it with a CausticShader to see the caustics.
+     */
+    std::shared_ptr<PhotonMap> photonMap;
+    /** Exposure, tone curve, and encoding used by resolve(const FrameBuffer&,int) */
+    ToneMap toneMap;
+    /** Construct a scene. Objects, transformations, and pigments created through
+     * Scene::make(), Scene::add(Args&&...), Composite::add(Args&&...), Renderable::setPigment(Args&&...)
+     * and the Transformable convenience functions such as Transformable::translate() are
+     * allocated from an arena owned by the scene, rather than one by one from the heap.
+     *
+     * Handles to these objects are still ordinary shared pointers, but they must not outlive
+     * the scene. The arena is not thread-safe, so build the scene from one thread.
+     *
+     * @param arenaSize Size of the first block of the arena in bytes. The arena grows as needed,
+     *   but if you know roughly how big your scene will be, this saves a few allocations.
+     */
+    Scene(size_t arenaSize=1<<16):arena(arenaSize) {
+      objects.setArena(&arena);
+    }
+    Scene(const Scene&)=delete; ///< Scenes own their arena, so they can't be copied
+    Scene& operator=(const Scene&)=delete; ///< Scenes own their arena, so they can't be copied
+    virtual ~Scene()=default; ///< Allow subclasses
+    /** Create an object in the scene arena without adding it to the scene. This is useful
+     * for building a Composite which will be added to the scene later:
+     *
+     *      auto group=scene.make<Union>();
+     *      group->add<Sphere>();
+     *      scene.add(group);
+     *
+     * @tparam T Type of object to create
+     * @param args Arguments forwarded to the constructor
+     * @return Pointer to the new object
+     */
+    template<typename T, typename ... Args>
+    std::shared_ptr<T> make(Args&&... args) {
+      return objects.make<T>(std::forward<Args>(args)...);
+    }
+    /** Create an object or light in the scene arena and add it to the scene.
+     *
+     *      auto sphere=scene.add<Sphere>();
+     *
+     * @tparam T Type of object or light to create
+     * @param args Arguments forwarded to the constructor
+     * @return Pointer to the new object
+     */
+    template<typename T, typename ... Args>
+    std::shared_ptr<T> add(Args&&... args) {
+      auto result=make<T>(std::forward<Args>(args)...);
+      add(std::shared_ptr<std::conditional_t<std::is_base_of_v<Light,T>,Light,Renderable>>(result));
+      return result;
+    }
+    /** Create a camera or shader in the scene arena and set it as the scene camera or shader.
+     *
+     *      auto camera=scene.set<PerspectiveCamera>(width,height);
+     *
+     * @tparam T Type of camera or shader to create
+     * @param args Arguments forwarded to the constructor
+     * @return Pointer to the new object
+     */
+    template<typename T, typename ... Args>
+    std::shared_ptr<T> set(Args&&... args) {
+      auto result=make<T>(std::forward<Args>(args)...);
+      set(std::shared_ptr<std::conditional_t<std::is_base_of_v<Camera,T>,Camera,Shader>>(result));
+      return result;
+    }
     /** Add an object to the scene. This just forwards the object to
      * the underlying Union member field representing the scene.
      * @param object Pointer to object to add
@@ -205,25 +411,408 @@ namespace kwantrace {
       shader=Lshader;
       return shader;
     }
-    /** Render the scene. This function creates a pixbuf of the appropriate size and
-     * delegates actual rendering to render(int,int,PixelBuffer)
+    /** Render the scene. This function prepares the scene for rendering, creates a pixbuf of the
+     * appropriate size and delegates actual rendering to render(int,int,PixelBuffer)
      * @param width Width of image in pixels
      * @param height Height of image in pixels
      * @return Pixel buffer
      */
     PixelBuffer<pixdepth,pixtype> render(int width, int height) {
+      prepareRender();
       auto pixbuf = PixelBuffer<pixdepth,pixtype>(width,height);
       render(width, height, pixbuf);
       return pixbuf;
     }
+    /** Render the scene, and fill in its arbitrary output variables in the same pass. This traces the same
+     * rays as render(int,int), so the image is the same, but also records the depth, normal, pigment, and
+     * IDs of what each camera ray hits, and how long each pixel took, for compositing or for finding where a slow
+     * render spends its time.
+     *
+     * Objects are numbered in the order they were added to the scene, and primitives in the order of
+     * Renderable::collectPrimitives(), both from one, so the IDs of a scene stay the same from frame to frame.
+     * @param aovs Frame to fill in, which also sets the size of the image
+     * @return Pixel buffer
+     */
+    PixelBuffer<pixdepth,pixtype> render(AovFrame& aovs) {
+      prepareRender();
+      int width=aovs.width(), height=aovs.height();
+      auto pixbuf = PixelBuffer<pixdepth,pixtype>(width,height);
+      std::unordered_map<Observer<Primitive>,std::pair<uint32_t,uint32_t>> ids;
+      std::vector<Observer<Primitive>> primitives;
+      uint32_t object=0;
+      for(auto&& child:objects.getChildren()) {
+        object++;
+        size_t first=primitives.size();
+        child->collectPrimitives(primitives);
+        for(size_t i=first;i<primitives.size();i++) ids.emplace(primitives[i],std::make_pair(object,uint32_t(i+1)));
+      }
+      pixelSpacing=1.0/width;
+      RayBatch batch;
+      std::vector<RayColor> colors(width);
+      for (int row = 0; row < height; row++) {
+        TraceScope span("row","render","row",row);
+        double y = (double(row) + 0.5) / height-0.5;
+        camera->projectBatch(0.5/width-0.5, y, pixelSpacing, width, batch);
+        for (int col = 0; col < width; col++) {
+          double x = (double(col) + 0.5) / width - 0.5;
+          GuideSample guide;
+          Observer<Primitive> hit;
+          //Each ray is intersected on its own, rather than with intersectCameraBatch(), so that its cost includes the intersection
+          uint64_t begin=AovFrame::ticks();
+          colors[col]=renderCameraRay(batch[col], x, y, &guide, &hit);
+          uint64_t cost=AovFrame::ticks()-begin;
+          auto id=hit?ids.find(hit):ids.end();
+          aovs.set(col, row, colors[col], guide, id==ids.end()?0:id->second.first, id==ids.end()?0:id->second.second, cost);
+        }
+        recordRow(pixbuf, 0, row, width, colors.data());
+      }
+      return pixbuf;
+    }
+    /** Render the scene again, preparing only what has changed since it was last prepared. This is for
+     * interactive use, such as by a RenderServer, where the scene is prepared once and then only a few things change
+     * between frames. Moving just the camera skips preparing the objects, rebuilding the photon map, and
+     * clearing the caches of the shaders, such as an IrradianceCache, which don't depend on the view.
+     * @param width Width of image in pixels
+     * @param height Height of image in pixels
+     * @param change What has changed since the scene was last prepared
+     * @return Pixel buffer
+     */
+    PixelBuffer<pixdepth,pixtype> render(int width, int height, SceneChange change) {
+      {
+        TraceScope span("prepare changes","scene","change",int64_t(change));
+        switch(change) {
+          case SceneChange::Nothing:
+            break;
+          case SceneChange::Camera:
+            camera->prepareRender();
+            break;
+          case SceneChange::Objects:
+            objects.prepareRender();
+            for(auto&& light:lightList) light->prepareRender();
+            shader->prepareRender();
+            camera->prepareRender();
+            if(photonMap) photonMap->build(objects,lightList,shader.get());
+            break;
+          case SceneChange::Everything:
+            prepareRender();
+            break;
+        }
+      }
+      auto pixbuf = PixelBuffer<pixdepth,pixtype>(width,height);
+      render(width, height, pixbuf);
+      return pixbuf;
+    }
+    /** Save the scene to a file, so that another process can load it without running the code that built it.
+     * The scene is prepared first, and each object is saved with its combined transformation rather than its list
+     * of transformations. The objects, pigments, lights, camera, shaders, and settings are saved, along with baked
+     * pattern lattices, but not caches such as the photon map or an IrradianceCache. Every class in the scene must be
+     * registered with SceneTypes. See SceneReader for the layout of the file.
+     * @param filename Name of file to write
+     * @throws std::runtime_error if the file can't be written, or an object is of an unregistered class
+     */
+    void save(const std::string& filename) {
+      prepareRender();
+      TraceScope span("save scene","io");
+      SceneWriter out;
+      write(out);
+      out.save(filename);
+    }
+    /** Replace everything in the scene with a scene saved by save(). The loaded objects are created in the arena of
+     * this scene, and baked pattern lattices are used straight out of the file, which stays mapped for as long as
+     * they are in use. The file is mapped read-only and shared, so many processes which load the same file share one
+     * copy of them. Handles to objects in the scene from before the load no longer refer to anything in it.
+     * @param filename Name of file written by save()
+     * @throws std::runtime_error if the file can't be read, is corrupt, or has an object of an unregistered class.
+     *   The scene is unchanged in that case.
+     */
+    void load(const std::string& filename) {
+      TraceScope span("load scene","io");
+      SceneReader in(filename,&arena);
+      std::shared_ptr<Camera> Lcamera;
+      std::shared_ptr<Shader> Lshader;
+      LightList LlightList;
+      Union Lobjects;
+      Lobjects.setArena(&arena);
+      uint64_t LlightPicks;
+      std::shared_ptr<PhotonMap> LphotonMap;
+      ToneMap LtoneMap;
+      in.object(Lcamera);
+      in.object(Lshader);
+      in.objects(LlightList);
+      Lobjects.read(in);
+      in.get(LlightPicks);
+      in.object(LphotonMap);
+      in.get(LtoneMap.exposure);
+      in.get(LtoneMap.curve);
+      in.get(LtoneMap.srgb);
+      in.get(LtoneMap.dither);
+      if(!Lcamera || !Lshader) throw std::runtime_error("Scene file "+filename+" has no camera or shader");
+      camera=Lcamera;
+      shader=Lshader;
+      lightList=std::move(LlightList);
+      objects=Lobjects;
+      lightPicks=LlightPicks;
+      photonMap=LphotonMap;
+      toneMap=LtoneMap;
+    }
+    /** Fingerprint the scene, for telling whether a checkpoint or RenderJournal belongs to it. This is a
+     * SceneWriter::fingerprint() of everything save() would write, so any change to an object, pigment,
+     * shader, light, camera, or setting which would be saved changes it, along with the image size, pixel format,
+     * and trace settings. Like save(), the scene is prepared first, so the objects are hashed with their combined
+     * transformations as they are at this moment.
+     * @param width Width of image in pixels
+     * @param height Height of image in pixels
+     * @return Fingerprint
+     * @throws std::runtime_error if an object in the scene is of a class not registered with SceneTypes
+     */
+    uint64_t fingerprint(int width, int height) {
+      prepareRender();
+      SceneWriter out;
+      write(out);
+      out.put(int32_t(width));
+      out.put(int32_t(height));
+      out.put(int32_t(pixdepth));
+      out.put(uint64_t(sizeof(pixtype)));
+      out.put(int32_t(maxTraceLevel));
+      out.put(adcBailout);
+      out.put(russianRoulette);
+      return out.fingerprint();
+    }
+    /** Render the scene tile by tile, keeping a checkpoint so that if the process is killed, running
+     * the same render again picks up where it left off. Each finished tile is saved with a TileCheckpoint
+     * named `checkpoint`, and tiles already in a checkpoint with the same fingerprint() and image size are loaded
+     * instead of rendered. The checkpoint is kept after the render finishes, so that the image can be loaded again
+     * if the process is killed before the image is saved, so delete it afterward:
+     *
+     *      auto pixbuf=scene.render(16384,8192,"big",64);
+     *      pixbuf.write("big.png");
+     *      TileCheckpoint::discard("big");
+     *
+     * @param width Width of image in pixels
+     * @param height Height of image in pixels
+     * @param checkpoint Name of checkpoint, to which `.journal` and `.partial` are added to make the file names
+     * @param tileSize Width and height of each tile in pixels
+     * @return Pixel buffer
+     */
+    PixelBuffer<pixdepth,pixtype> render(int width, int height, const std::string& checkpoint, int tileSize=64) {
+      TileCheckpoint tiles(checkpoint,width,height,tileSize,pixdepth*sizeof(pixtype),fingerprint(width,height));
+      auto pixbuf = PixelBuffer<pixdepth,pixtype>(width,height);
+      tiles.load(pixbuf);
+      pixelSpacing=1.0/width;
+      RayBatch batch;
+      std::vector<double> t;
+      std::vector<Observer<Primitive>> hit;
+      std::vector<RayColor> colors;
+      for(size_t tile=0;tile<tiles.tiles();tile++) {
+        if(tiles.done(tile)) continue;
+        TraceScope span("tile","render","tile",int64_t(tile));
+        int col0, row0, cols, rows;
+        tiles.rect(tile,col0,row0,cols,rows);
+        camera->projectTile((col0+0.5)/width-0.5,(row0+0.5)/height-0.5,pixelSpacing,1.0/height,cols,rows,batch);
+        intersectCameraBatch(batch,t,hit);
+        colors.resize(cols);
+        for(int row=row0;row<row0+rows;row++) {
+          for(int col=col0;col<col0+cols;col++) {
+            double x=(col+0.5)/width-0.5;
+            double y=(row+0.5)/height-0.5;
+            size_t i=size_t(row-row0)*cols+(col-col0);
+            colors[col-col0]=shadeCameraRay(batch[i],x,y,t[i],hit[i]);
+          }
+          recordRow(pixbuf,col0,row,cols,colors.data());
+        }
+        tiles.save(pixbuf,tile);
+      }
+      return pixbuf;
+    }
+    /** Trace the camera rays of an image without keeping the result. This is useful to fill caches,
+     * such as the IrradianceCache of a RadiosityShader, before the final render. Like POV-Ray
+     * `pretrace_start` and `pretrace_end`, it is best to pretrace at one or more resolutions well below the final one.
+     *
+     *      scene.pretrace(width/8,height/8);
+     *      scene.pretrace(width/4,height/4);
+     *      auto pixbuf=scene.render(width,height);
+     *
+     * @param width Width of pretrace image in pixels
+     * @param height Height of pretrace image in pixels
+     */
+    void pretrace(int width, int height) {
+      prepareRender();
+      TraceScope span("pretrace","render","width",width);
+      pixelSpacing=1.0/width;
+      RayBatch batch;
+      std::vector<double> t;
+      std::vector<Observer<Primitive>> hit;
+      for (int row = 0; row < height; row++) {
+        double y = (double(row) + 0.5) / height-0.5;
+        camera->projectBatch(0.5/width-0.5, y, pixelSpacing, width, batch);
+        intersectCameraBatch(batch, t, hit);
+        for (int col = 0; col < width; col++) {
+          double x = (double(col) + 0.5) / width - 0.5;
+          shadeCameraRay(batch[col], x, y, t[col], hit[col]);
+        }
+      }
+    }
+    /** Render passes with a path tracer, instead of the shaders. Each pass adds one path per pixel
+     * to the frame. The scene is prepared for rendering before the first pass into a frame, so if
+     * anything in the scene changes between calls, clear the frame first. Call resolve() to get an image of the
+     * frame so far, and PathTracer::samplesPerSecond() to see how fast it is going.
+     *
+     *      AccumulationFrame frame(width,height);
+     *      PathTracer pathTracer;
+     *      while(frame.passes()<256) {
+     *        scene.renderProgressive(pathTracer,frame,16);
+     *        save(scene.resolve(frame));
+     *      }
+     *
+     * @param integrator Path tracer to render with
+     * @param frame Frame to add passes to
+     * @param passes Number of passes to add
+     */
+    void renderProgressive(PathTracer& integrator, AccumulationFrame& frame, int passes=1) {
+      if(frame.passes()==0) {
+        prepareRender();
+        integrator.prepareRender(lightList);
+      }
+      for(int i=0;i<passes;i++) integrator.renderPass(*camera,objects,lightList,frame);
+    }
+    /** Sharpen the guides of a frame rendered with a path tracer at the edges of lights seen directly, before
+     * passing it to a Denoiser. See PathTracer::refineGuides().
+     *
+     *      scene.renderProgressive(pathTracer,frame,4);
+     *      scene.refineGuides(pathTracer,frame);
+     *      auto pixbuf=scene.resolve(denoiser.denoise(frame));
+     *
+     * @param integrator Path tracer the frame was rendered with
+     * @param frame Frame to add guides to, after its passes
+     * @param rays Number of camera rays for each pixel along an edge
+     */
+    void refineGuides(const PathTracer& integrator, AccumulationFrame& frame, int rays=64) {
+      integrator.refineGuides(*camera,objects,frame,rays);
+    }
+    /** Render passes with the shaders, jittering the camera ray within each pixel. Each pass adds one ray
+     * per pixel to the frame, along with the features of the surface it hit, so that the frame can be
+     * passed to a Denoiser. This is useful when the shaders themselves are noisy, such as with
+     * soft shadows from area lights or lightPicks. Each ray is also given a random time within the shutter
+     * interval, so moving objects are motion blurred. As with renderProgressive(PathTracer&,AccumulationFrame&,int),
+     * the scene is prepared before the first pass into a frame.
+     *
+     * @param frame Frame to add passes to
+     * @param passes Number of passes to add
+     */
+    void renderProgressive(AccumulationFrame& frame, int passes=1) {
+      if(frame.passes()==0) prepareRender();
+      int width=frame.width(), height=frame.height();
+      pixelSpacing=1.0/width;
+      std::uniform_real_distribution<double> uniform(0,1);
+      for(int i=0;i<passes;i++) {
+        //Seeds of a Lehmer generator such as minstd_rand give sequences which are multiples of each other,
+        //so that some pixels would get nearly the same jitter and time in every pass. mt19937 scrambles its seed.
+        std::mt19937 rng(uint32_t(frame.passes()+1));
+        for (int row = 0; row < height; row++) {
+          for (int col = 0; col < width; col++) {
+            double x = (col + uniform(rng)) / width - 0.5;
+            double y = (row + uniform(rng)) / height - 0.5;
+            Ray ray = camera->project(x, y, uniform(rng));
+            GuideSample guide;
+            RayColor color=renderCameraRay(ray, x, y, &guide);
+            frame.add(col, row, color, guide);
+          }
+        }
+        frame.endPass();
+      }
+    }
+    /** Convert the current state of an accumulation frame to a pixel buffer
+     * @param frame Frame to convert
+     * @return Pixel buffer
+     */
+    PixelBuffer<pixdepth,pixtype> resolve(const AccumulationFrame& frame) {
+      auto pixbuf = PixelBuffer<pixdepth,pixtype>(frame.width(),frame.height());
+      std::vector<RayColor> colors(frame.width());
+      for(int row=0;row<frame.height();row++) {
+        for(int col=0;col<frame.width();col++) colors[col]=frame.pixel(col,row);
+        recordRow(pixbuf,0,row,frame.width(),colors.data());
+      }
+      return pixbuf;
+    }
+    /** Render passes with the shaders into a high dynamic range frame. The first pass into a frame traces
+     * the center of each pixel at time zero, the same rays as render(int,int). Later passes jitter the ray within
+     * the pixel and the shutter interval, so the frame converges to an antialiased and motion blurred image.
+     * A tiled frame is rendered one tile at a time. As with renderProgressive(), the scene is prepared before
+     * the first pass into a frame.
+     *
+     *      FrameBuffer frame(width,height,16);
+     *      scene.render(frame,16);
+     *      scene.toneMap.curve=ToneMap::Curve::Filmic;
+     *      auto pixbuf=scene.resolve(frame);
+     *
+     * @param frame Frame to add passes to
+     * @param passes Number of passes to add
+     */
+    void render(FrameBuffer& frame, int passes=1) {
+      if(frame.passes()==0) prepareRender();
+      int width=frame.width(), height=frame.height();
+      int tileW=frame.tileSize()>0?frame.tileSize():width;
+      int tileH=frame.tileSize()>0?frame.tileSize():1;
+      pixelSpacing=1.0/width;
+      std::uniform_real_distribution<double> uniform(0,1);
+      RayBatch batch;
+      std::vector<double> t;
+      std::vector<Observer<Primitive>> hit;
+      for(int i=0;i<passes;i++) {
+        TraceScope passSpan("pass","render","pass",frame.passes());
+        bool centers=frame.passes()==0;
+        std::mt19937 rng(uint32_t(frame.passes()+1));
+        for(int row0=0;row0<height;row0+=tileH) for(int col0=0;col0<width;col0+=tileW) {
+          TraceScope tileSpan("tile","render","tile",int64_t(row0/tileH)*((width+tileW-1)/tileW)+col0/tileW);
+          int cols=std::min(tileW,width-col0), rows=std::min(tileH,height-row0);
+          if(centers) {
+            camera->projectTile((col0+0.5)/width-0.5,(row0+0.5)/height-0.5,pixelSpacing,1.0/height,cols,rows,batch);
+            intersectCameraBatch(batch,t,hit);
+          }
+          for(int row=row0;row<row0+rows;row++) for(int col=col0;col<col0+cols;col++) {
+            if(centers) {
+              double x=(col+0.5)/width-0.5;
+              double y=(row+0.5)/height-0.5;
+              size_t ray=size_t(row-row0)*cols+(col-col0);
+              frame.add(col,row,shadeCameraRay(batch[ray],x,y,t[ray],hit[ray]));
+            } else {
+              double x=(col+uniform(rng))/width-0.5;
+              double y=(row+uniform(rng))/height-0.5;
+              Ray ray=camera->project(x,y,uniform(rng));
+              frame.add(col,row,renderCameraRay(ray,x,y));
+            }
+          }
+        }
+        frame.endPass();
+      }
+    }
+    /** Convert the current state of a high dynamic range frame to a pixel buffer, using toneMap
+     * @param frame Frame to convert
+     * @param threads Number of threads to convert with, or 0 to use all hardware threads
+     * @return Pixel buffer
+     */
+    PixelBuffer<pixdepth,pixtype> resolve(const FrameBuffer& frame, int threads=0) const {
+      return frame.resolve<pixdepth,pixtype>(toneMap,threads);
+    }
+    /** \copydoc Tracer::traceRay()
+     *
+     * This is used for secondary rays, which don't have a footprint, so pigments are
+     * sampled at full detail.
+     */
+    virtual RayColor traceRay(const Ray& ray, const TraceState& state, double* hitT) const override {
+      double t;
+      Observer<Primitive> finalObject=objects.intersect(ray, t);
+      if(hitT) *hitT=finalObject?t:std::numeric_limits<double>::infinity();
+      if(!finalObject) return RayColor::Zero();
+      return shadeHit(ray, t, *finalObject, state, 0);
+    }
     RayColor trace(double x, double y, bool& hit) {
       Ray ray = camera->project(x, y);
       double t;
       Observer<Primitive> finalObject=objects.intersect(ray, t);
       if(finalObject) {
-        Position r = ray(t);
         hit = true;
-        return shader->shade(*finalObject, objects, lightList, r, ray.v.normalized(), finalObject->normal(r));
+        return shadeHit(ray, t, *finalObject, TraceState{*this,1,1.0,ray.time}, footprint(ray,x,y,t,*finalObject));
       } else {
         hit=false;
         return RayColor();
@@ -0,0 +1,449 @@
+/* KwanTrace - C++ Ray Tracing Library
+Copyright (C) 2021 by kwan3217
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef KWANTRACE_SCENEFILE_H
+#define KWANTRACE_SCENEFILE_H
+
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <memory>
+#include <memory_resource>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <typeindex>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace kwantrace {
+  /** Registry of the classes which can be saved in a scene file, by name. Each class is registered once,
+   * right after it is defined, with a line like
+   *
+   *     inline const bool sphereRegistered=SceneTypes::add<Sphere>("Sphere");
+   *
+   * The name is what is stored in the file, so it must never change once files have been written with it.
+   * A class must be default-constructible, and must override `write()` and `read()` to save and load any
+   * fields of its own, after calling the same method of its superclass. Your own Primitive, pigment, light,
+   * or shader subclass is saved the same way, as long as it is registered before a scene using it is saved or loaded.
+   *
+   * Each class hierarchy names its root class with a `SceneBase` typedef, such as Transformable for objects,
+   * pigments, and cameras. References in a file are checked against the hierarchy they should be in.
+   */
+  class SceneTypes {
+  private:
+    /** Get the factories for one class hierarchy
+     * @tparam Base Root class of the hierarchy
+     * @return Map from class name to a function which creates an object of that class from a memory resource
+     */
+    template<typename Base>
+    static std::map<std::string,std::function<std::shared_ptr<Base>(std::pmr::memory_resource*)>>& factories() {
+      static std::map<std::string,std::function<std::shared_ptr<Base>(std::pmr::memory_resource*)>> result;
+      return result;
+    }
+    /** Get the names of all registered classes @return Map from class to name */
+    static std::map<std::type_index,std::string>& names() {
+      static std::map<std::type_index,std::string> result;
+      return result;
+    }
+  public:
+    /** Register a class
+     * @tparam T Class to register
+     * @param name Name to store in files for objects of this class
+     * @return True, so that the result can initialize a variable at namespace scope
+     */
+    template<typename T>
+    static bool add(const std::string& name) {
+      names()[std::type_index(typeid(T))]=name;
+      factories<typename T::SceneBase>()[name]=[](std::pmr::memory_resource* arena) {
+        auto result=allocate<T>(arena);
+        if constexpr (requires {result->setArena(arena);}) result->setArena(arena);
+        return std::shared_ptr<typename T::SceneBase>(result);
+      };
+      return true;
+    }
+    /** Get the name of a registered class
+     * @param type Class, usually `typeid(*object)`
+     * @return Name of class
+     * @throws std::runtime_error if the class isn't registered
+     */
+    static const std::string& name(const std::type_info& type) {
+      auto it=names().find(std::type_index(type));
+      if(it==names().end()) throw std::runtime_error(std::string("Can't save an object of unregistered class ")+type.name());
+      return it->second;
+    }
+    /** Create an object of a registered class
+     * @tparam Base Root class of the hierarchy the class should be in
+     * @param name Name of class
+     * @param arena Memory resource to allocate from, or nullptr to use the heap
+     * @return New object, or nullptr if there is no class of that name in the hierarchy
+     */
+    template<typename Base>
+    static std::shared_ptr<Base> make(const std::string& name, std::pmr::memory_resource* arena) {
+      auto it=factories<Base>().find(name);
+      return it==factories<Base>().end()?nullptr:it->second(arena);
+    }
+  };
+
+  /** Builds a scene file. See SceneReader for the layout. Objects are referred to with object(), and each object is
+   * written once however many things refer to it, so shared pigments and shaders stay shared when loaded.
+   */
+  class SceneWriter {
+  private:
+    /** Object waiting to be written */
+    struct Pending {
+      uint64_t index;             ///< Index in the object table
+      std::function<void()> write;///< Function which writes the record of the object
+    };
+    std::vector<uint8_t> data;             ///< Everything after the header, starting with the root record
+    std::vector<uint64_t> table;           ///< Object table, four words for each object: type, offset, size, reserved
+    std::vector<std::string> typeNames;    ///< Names of classes used in the file
+    std::map<std::string,uint32_t> typeIndex; ///< Index of each name in typeNames
+    std::map<const void*,uint64_t> objectIndex;   ///< Index of each object already referred to
+    std::deque<Pending> pending;           ///< Objects referred to but not written yet
+    /** Pad the data with zeros to a multiple of a given size
+     * @param alignment Alignment in bytes
+     */
+    void align(size_t alignment) {data.resize((data.size()+alignment-1)/alignment*alignment,0);}
+    /** Write every object referred to so far, and the objects they refer to */
+    void flush() {
+      while(!pending.empty()) {
+        Pending next=std::move(pending.front());
+        pending.pop_front();
+        align(8);
+        uint64_t start=data.size();
+        next.write();
+        table[next.index*4+1]=headerSize+start;
+        table[next.index*4+2]=data.size()-start;
+      }
+    }
+  public:
+    static const constexpr char magic[8]={'K','W','S','C','N','0','0','1'}; ///< File format identifier
+    static const constexpr uint32_t version=1;       ///< Version of the layout of the records written by this code
+    static const constexpr size_t headerSize=64;     ///< Size of the file header
+    static const constexpr size_t arrayAlignment=64; ///< Alignment of arrays within the file, from its start
+    /** Write bytes @param p First byte @param size Number of bytes */
+    void put(const void* p, size_t size) {
+      const uint8_t* b=static_cast<const uint8_t*>(p);
+      data.insert(data.end(),b,b+size);
+    }
+    /** Write a value
+     * @param v Number, enum, or Eigen matrix such as a Position, ObjectColor, or Eigen::Matrix4d, whose coefficients are written in order
+     */
+    template<typename T>
+    void put(const T& v) {
+      if constexpr (std::is_arithmetic_v<T> || std::is_enum_v<T>) {
+        put(&v,sizeof(v));
+      } else {
+        put(v.data(),sizeof(*v.data())*v.size());
+      }
+    }
+    /** Write a string @param s String, written as its length then its characters */
+    void put(const std::string& s) {
+      put(uint64_t(s.size()));
+      put(s.data(),s.size());
+    }
+    /** Write an array, aligned so that SceneReader::array() can use it straight out of the file
+     * @param p First element
+     * @param n Number of elements
+     */
+    template<typename T>
+    void array(const T* p, size_t n) {
+      static_assert(std::is_trivially_copyable_v<T>,"Only plain data can be written as an array");
+      put(uint64_t(n));
+      align(arrayAlignment);
+      put(p,n*sizeof(T));
+    }
+    /** Write a reference to an object. The object itself is written later, once.
+     * @param p Object, which must be of a registered class, or nullptr
+     */
+    template<typename T>
+    void object(const std::shared_ptr<T>& p) {
+      if(!p) {
+        put(~uint64_t(0));
+        return;
+      }
+      //The most derived object, so that one object referred to through different classes is still written once
+      const void* key;
+      if constexpr (std::is_polymorphic_v<T>) key=dynamic_cast<const void*>(p.get()); else key=p.get();
+      auto it=objectIndex.find(key);
+      if(it==objectIndex.end()) {
+        const std::string& name=SceneTypes::name(typeid(*p));
+        auto type=typeIndex.try_emplace(name,uint32_t(typeNames.size())).first->second;
+        if(type==typeNames.size()) typeNames.push_back(name);
+        uint64_t index=table.size()/4;
+        table.insert(table.end(),{type,0,0,0});
+        it=objectIndex.emplace(key,index).first;
+        pending.push_back({index,[this,p]{p->write(*this);}});
+      }
+      put(it->second);
+    }
+    /** Write a list of references to objects @param list Objects */
+    template<typename T>
+    void objects(const std::vector<std::shared_ptr<T>>& list) {
+      put(uint64_t(list.size()));
+      for(auto&& p:list) object(p);
+    }
+    /** Write every object referred to so far, and the objects they refer to, then hash everything written,
+     * along with the class of each object. Two writers with the same fingerprint would save the same file, so
+     * this is a hash of the content of whatever was written, such as for a key of things built from it.
+     * @return Fingerprint
+     */
+    uint64_t fingerprint() {
+      flush();
+      Fingerprint f;
+      f.add(data.data(),data.size());
+      for(auto&& name:typeNames) {
+        f.add(name.size());
+        f.add(name.data(),name.size());
+      }
+      f.add(table.data(),table.size()*sizeof(uint64_t));
+      return f.value();
+    }
+    /** Write every object referred to so far, and the objects they refer to, then save the file. Everything
+     * written before this is the root record.
+     * @param filename Name of file to write
+     * @throws std::runtime_error if the file can't be written
+     */
+    void save(const std::string& filename) {
+      uint64_t rootSize=data.size();
+      flush();
+      align(8);
+      uint64_t typeOffset=headerSize+data.size();
+      put(uint64_t(typeNames.size()));
+      for(auto&& name:typeNames) put(name);
+      align(8);
+      uint64_t tableOffset=headerSize+data.size();
+      put(table.data(),table.size()*sizeof(uint64_t));
+      uint64_t header[7]={version,headerSize+rootSize,typeOffset,tableOffset,table.size()/4,headerSize+data.size(),0};
+      std::ofstream out(filename,std::ios::binary|std::ios::trunc);
+      out.write(magic,sizeof(magic));
+      out.write(reinterpret_cast<const char*>(header),sizeof(header));
+      out.write(reinterpret_cast<const char*>(data.data()),std::streamsize(data.size()));
+      if(!out) throw std::runtime_error("Can't write scene file "+filename);
+    }
+  };
+
+  /** Reads a scene file written by SceneWriter. The file is mapped read-only and shared, so processes which load
+   * the same scene share its pages, and large arrays such as baked pattern lattices are used right out of the mapping
+   * without being copied. Everything is checked against the size of the file, so a truncated or corrupt file throws
+   * an exception rather than reading past the end of the mapping.
+   *
+   * The file is laid out as
+   *
+   *   * A header of 64 bytes: the magic `KWSCN001`, then seven 64-bit words: the version, the end of the root record,
+   *     the offsets of the type list and the object table, the number of objects, the size of the file, and a spare.
+   *   * The root record, which starts right after the header. Scene::save() writes the scene settings here.
+   *   * The record of each object, each aligned to 8 bytes. Arrays within records are aligned to 64 bytes from the
+   *     start of the file.
+   *   * The type list: the number of class names, then each name.
+   *   * The object table: for each object, four 64-bit words: the index of its class name, and the offset, size, and
+   *     a spare.
+   *
+   * Each record is a sequence of plain values in the order the class writes them. References to other objects are
+   * their index in the object table, or all ones for nullptr.
+   */
+  class SceneReader {
+  private:
+    /** Mapping of the whole file, shared by everything which uses arrays in it */
+    struct Mapping {
+      void* data=nullptr; ///< Start of mapping
+      size_t size=0;      ///< Size of mapping
+      ~Mapping() {if(data) ::munmap(data,size);} ///< Release the mapping
+    };
+    /** An object which has been read, or is being read */
+    struct Loaded {
+      std::shared_ptr<void> object;           ///< Object, or nullptr if not read yet
+      std::type_index base=typeid(void);      ///< Root class of the hierarchy it was read as
+      bool finished=false;                    ///< False while its record is being read
+    };
+    std::string filename;               ///< Name of file, for error messages
+    std::shared_ptr<Mapping> mapping;   ///< Mapping of the file
+    const uint8_t* base=nullptr;        ///< Start of the file
+    size_t pos=0;                       ///< Offset of next byte to read
+    size_t end=0;                       ///< End of the record being read
+    uint64_t _version=0;                ///< Version of the file
+    std::vector<std::string> typeNames; ///< Names of classes used in the file
+    std::vector<uint64_t> table;        ///< Object table, four words for each object
+    std::vector<Loaded> loaded;         ///< Objects read so far
+    std::pmr::memory_resource* arena;   ///< Memory resource to create objects from
+    /** Report a corrupt file @throws std::runtime_error always */
+    [[noreturn]] void corrupt() const {throw std::runtime_error("Scene file "+filename+" is corrupt");}
+    /** Check that bytes are inside the record being read @param size Number of bytes from pos */
+    void need(uint64_t size) const {if(size>end-pos) corrupt();}
+  public:
+    /** Map a scene file and read its header and tables. The reader is then at the start of the root record.
+     * @param Lfilename Name of file
+     * @param Larena Memory resource to create objects from, or nullptr to use the heap
+     * @throws std::runtime_error if the file can't be read, isn't a scene file, is from a newer version, or is corrupt
+     */
+    explicit SceneReader(const std::string& Lfilename, std::pmr::memory_resource* Larena=nullptr):filename(Lfilename),mapping(std::make_shared<Mapping>()),arena(Larena) {
+      int fd=::open(filename.c_str(),O_RDONLY);
+      if(fd<0) throw std::runtime_error("Can't open scene file "+filename);
+      struct stat st;
+      if(::fstat(fd,&st)<0 || size_t(st.st_size)<SceneWriter::headerSize) {
+        ::close(fd);
+        throw std::runtime_error("Not a scene file: "+filename);
+      }
+      void* m=::mmap(nullptr,st.st_size,PROT_READ,MAP_SHARED,fd,0);
+      ::close(fd);
+      if(m==MAP_FAILED) throw std::runtime_error("Can't map scene file "+filename);
+      mapping->data=m;
+      mapping->size=st.st_size;
+      base=static_cast<const uint8_t*>(m);
+      if(std::memcmp(base,SceneWriter::magic,sizeof(SceneWriter::magic))!=0) throw std::runtime_error("Not a scene file: "+filename);
+      uint64_t header[7];
+      std::memcpy(header,base+sizeof(SceneWriter::magic),sizeof(header));
+      _version=header[0];
+      if(_version>SceneWriter::version) throw std::runtime_error("Scene file "+filename+" is from a newer version");
+      uint64_t rootEnd=header[1], typeOffset=header[2], tableOffset=header[3], count=header[4];
+      if(header[5]!=mapping->size) corrupt();
+      //Read the type list
+      pos=typeOffset;
+      end=mapping->size;
+      if(pos<SceneWriter::headerSize || pos>end) corrupt();
+      uint64_t types;
+      get(types);
+      if(types>end) corrupt();
+      typeNames.resize(types);
+      for(auto&& name:typeNames) get(name);
+      //Read the object table
+      pos=tableOffset;
+      if(pos<SceneWriter::headerSize || pos>end || count>(end-pos)/32) corrupt();
+      table.resize(count*4);
+      get(table.data(),count*32);
+      for(uint64_t i=0;i<count;i++) {
+        uint64_t offset=table[i*4+1], size=table[i*4+2];
+        if(table[i*4]>=types || offset<SceneWriter::headerSize || offset>typeOffset || size>typeOffset-offset) corrupt();
+      }
+      loaded.resize(count);
+      //Start at the root record
+      if(rootEnd<SceneWriter::headerSize || rootEnd>typeOffset) corrupt();
+      pos=SceneWriter::headerSize;
+      end=rootEnd;
+    }
+    uint64_t version() const {return _version;} ///< Get the version of the file, for reading older layouts @return version
+    /** Get a handle which keeps the mapping of the file alive, for objects which use arrays from it
+     * @return Handle to the mapping */
+    std::shared_ptr<const void> owner() const {return mapping;}
+    /** Read bytes @param p Where to put them @param size Number of bytes */
+    void get(void* p, size_t size) {
+      need(size);
+      std::memcpy(p,base+pos,size);
+      pos+=size;
+    }
+    /** Read a value written by SceneWriter::put()
+     * @param[out] v Number, enum, or Eigen matrix
+     */
+    template<typename T>
+    void get(T& v) {
+      if constexpr (std::is_arithmetic_v<T> || std::is_enum_v<T>) {
+        get(&v,sizeof(v));
+      } else {
+        get(v.data(),sizeof(*v.data())*v.size());
+      }
+    }
+    /** Read a string @param[out] s String */
+    void get(std::string& s) {
+      uint64_t size;
+      get(size);
+      need(size);
+      s.assign(reinterpret_cast<const char*>(base+pos),size);
+      pos+=size;
+    }
+    /** Read an array without copying it
+     * @param[out] n Number of elements
+     * @return Pointer to the first element, in the mapping of the file. It is valid as long as the reader or a
+     *   handle from owner() is.
+     */
+    template<typename T>
+    const T* array(size_t& n) {
+      static_assert(std::is_trivially_copyable_v<T>,"Only plain data can be read as an array");
+      uint64_t count;
+      get(count);
+      size_t start=(pos+SceneWriter::arrayAlignment-1)/SceneWriter::arrayAlignment*SceneWriter::arrayAlignment;
+      if(start>end || count>(end-start)/sizeof(T)) corrupt();
+      pos=start+count*sizeof(T);
+      n=count;
+      return reinterpret_cast<const T*>(base+start);
+    }
+    /** Read an array into a vector @param[out] v Vector to fill */
+    template<typename T>
+    void array(std::vector<T>& v) {
+      size_t n;
+      const T* p=array<T>(n);
+      v.assign(p,p+n);
+    }
+    /** Read a reference to an object, reading the object itself the first time it is referred to
+     * @param[out] p Object, or nullptr
+     * @throws std::runtime_error if the reference is bad, the object is of a class that isn't registered, or isn't a T
+     */
+    template<typename T>
+    void object(std::shared_ptr<T>& p) {
+      using Base=typename T::SceneBase;
+      uint64_t index;
+      get(index);
+      if(index==~uint64_t(0)) {
+        p=nullptr;
+        return;
+      }
+      if(index>=loaded.size()) corrupt();
+      Loaded& entry=loaded[index];
+      if(!entry.object) {
+        const std::string& name=typeNames[table[index*4]];
+        std::shared_ptr<Base> object=SceneTypes::make<Base>(name,arena);
+        if(!object) throw std::runtime_error("Scene file "+filename+" has an object of unknown class "+name);
+        entry.object=object;
+        entry.base=typeid(Base);
+        size_t savePos=pos, saveEnd=end;
+        pos=table[index*4+1];
+        end=pos+table[index*4+2];
+        object->read(*this);
+        pos=savePos;
+        end=saveEnd;
+        entry.finished=true;
+      } else if(!entry.finished) {
+        //An object which refers to itself, directly or not
+        corrupt();
+      }
+      if(entry.base!=typeid(Base)) corrupt();
+      if constexpr (std::is_same_v<T,Base>) {
+        p=std::static_pointer_cast<Base>(entry.object);
+      } else {
+        p=std::dynamic_pointer_cast<T>(std::static_pointer_cast<Base>(entry.object));
+      }
+      if(!p) corrupt();
+    }
+    /** Read a list of references to objects @param[out] list Objects */
+    template<typename T>
+    void objects(std::vector<std::shared_ptr<T>>& list) {
+      uint64_t n;
+      get(n);
+      if(n>(end-pos)/8) corrupt();
+      list.resize(n);
+      for(auto&& p:list) object(p);
+    }
+  };
+}
+
+#endif //KWANTRACE_SCENEFILE_H
@@ -19,41 +19,286 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #ifndef KWANTRACE_SHADER_H
 #define KWANTRACE_SHADER_H
 
+#include <array>
+#include <random>
+
 namespace kwantrace {
-  /** Represents a shading model. A shading model is handed the
-   * object that was hit, all objects in the scene (most likely
+  class Tracer;
+  /** State of a ray being traced, passed down to shaders so that they can spawn secondary rays. */
+  struct TraceState {
+    const Tracer& tracer; ///< Tracer to send secondary rays to
+    int level;            ///< Trace level of this ray, 1 for camera rays
+    double weight;        ///< Product of the coefficients of all the surfaces between this ray and the camera,
+                          ///< IE the most that this ray can contribute to the pixel
+    double time=0;        ///< Time within the shutter interval of the camera ray this came from. Secondary
+                          ///< and shadow rays are traced at the same time, so that they see the scene as it was when hit.
+    /** Trace a secondary ray spawned at the current hit. See Tracer::traceSecondary()
+     * @param[in] ray Secondary ray in world space
+     * @param[in] coefficient Fraction of the secondary ray color that the shader will use
+     * @param[out] t If not nullptr, set to the ray parameter of the hit, or infinity if there wasn't one
+     * @return Color of the secondary ray
+     */
+    RayColor spawn(const Ray& ray, double coefficient, double* t=nullptr) const;
+  };
+
+  /** Something which can trace rays through a scene, such as the Scene itself. This also
+   * holds the limits which keep recursive rays from multiplying without bound:
+   *
+   *    * No ray is traced deeper than maxTraceLevel, like POV-Ray `max_trace_level`
+   *    * A ray whose weight falls below adcBailout is dropped, like POV-Ray `adc_bailout`. With
+   *      the default of 1/255, dropped rays could not have changed an 8-bit pixel anyway.
+   *    * If russianRoulette is set, a ray below adcBailout instead survives with probability
+   *      proportional to its weight, and its color is scaled up to compensate. This keeps the image
+   *      unbiased on average at the cost of some noise, while still bounding the work per pixel.
+   */
+  class Tracer {
+  public:
+    int maxTraceLevel=5;        ///< Deepest trace level to follow. Camera rays are level 1
+    double adcBailout=1.0/255;  ///< Minimum ray weight worth tracing
+    bool russianRoulette=false; ///< If true, rays below adcBailout are randomly dropped rather than always dropped
+    virtual ~Tracer()=default;  ///< Allow subclasses
+    /** Trace a ray through the scene. Implementations intersect the ray with the scene and
+     * shade the hit, if any.
+     * @param[in] ray Ray in world space
+     * @param[in] state Trace level and weight of this ray
+     * @param[out] t If not nullptr, set to the ray parameter of the hit, or infinity if there wasn't one
+     * @return Color of the ray
+     */
+    virtual RayColor traceRay(const Ray& ray, const TraceState& state, double* t) const=0;
+    /** Trace a secondary ray, applying the trace level and weight limits.
+     * @param[in] ray Secondary ray in world space
+     * @param[in] parent State of the ray which hit the surface spawning this one
+     * @param[in] coefficient Fraction of the secondary ray color that the shader will use
+     * @param[out] t If not nullptr, set to the ray parameter of the hit, or infinity if there wasn't one
+     *           or the ray was dropped
+     * @return Color of the secondary ray, or black if it was dropped
+     */
+    RayColor traceSecondary(const Ray& ray, const TraceState& parent, double coefficient, double* t=nullptr) const {
+      if(t) *t=std::numeric_limits<double>::infinity();
+      TraceState state{*this,parent.level+1,parent.weight*coefficient,parent.time};
+      if(state.level>maxTraceLevel) return RayColor::Zero();
+      double scale=1;
+      if(state.weight<adcBailout) {
+        if(!russianRoulette) return RayColor::Zero();
+        thread_local std::minstd_rand rng;
+        double survive=state.weight/adcBailout;
+        if(std::uniform_real_distribution<double>(0,1)(rng)>=survive) return RayColor::Zero();
+        scale=1/survive;
+        state.weight=adcBailout;
+      }
+      Ray timed=ray;
+      timed.time=parent.time;
+      return scale*traceRay(timed,state,t);
+    }
+  };
+
+  inline RayColor TraceState::spawn(const Ray& ray, double coefficient, double* t) const {
+    return tracer.traceSecondary(ray,*this,coefficient,t);
+  }
+
+  /** Everything a shader needs to know about one ray hitting one surface. This is built once
+   * per hit and handed to every shader in a CompositeShader stack, so that any work which more
+   * than one shader needs is only done once at each point. The pigment is evaluated
+   * before the context is built, and the direction and visibility of each light are worked out
+   * the first time any shader asks for them, then remembered for the rest of the shaders.
+   *
+   * Shaders see the lights through a list of slots, from 0 to lightCount()-1. Normally there
+   * is one slot for each light in the scene, each with a weight of 1. If the scene has a LightTree,
+   * the slots instead hold a few lights picked at random from the tree, and each slot has a weight
+   * which makes the sum of weight times contribution over the slots an unbiased estimate of the
+   * sum over all lights. Either way, a shader just sums the weighted contribution over the slots.
+   * The same lights are picked for every shader at a given point.
+   *
+   * A context refers to the hit and the scene, so it must not outlive the call to Shader::shade().
+   */
+  class ShadingContext {
+  public:
+    const Renderable& object;          ///< Object being shaded
+    const Renderable& scene;           ///< A composite object containing all objects in the scene
+    const LightList& lightList;        ///< All the lights in the scene
+    const Position r;                  ///< Position of intersection
+    const Direction v;                 ///< Direction of incoming ray, normalized
+    const Direction n;                 ///< Normal vector, normalized
+    const Observer<ObjectColor> objectColor; ///< Intrinsic color of the object at this point, or nullptr if the object has no pigment
+    const TraceState& trace;           ///< State of the ray which hit this point, used to spawn secondary rays
+  private:
+    /** What is known about one light slot from this point */
+    struct LightSample {
+      size_t light=0;        ///< Index of light in lightList
+      double weight=1;       ///< Weight of this slot, see lightWeight()
+      bool hasRay=false;     ///< True if ray and direction have been calculated
+      bool hasVisible=false; ///< True if visible has been calculated
+      Ray ray;               ///< Ray from this point to the light, see Light::rayTo()
+      Direction direction;   ///< Unit vector from this point towards the light
+      double visible=0;      ///< Fraction of the light which is visible from this point, see Light::amountVisible()
+    };
+    static const constexpr size_t inlineLights=8; ///< Number of slots that can be remembered without allocating
+    Observer<LightTree> lightTree;  ///< Tree to pick lights from, or nullptr to use every light
+    size_t lightPicks;              ///< Number of lights to pick from the tree
+    mutable bool filled=false;      ///< True once the slots have been filled
+    mutable size_t slots=0;         ///< Number of slots in use
+    mutable std::array<LightSample,inlineLights> inlineSamples;  ///< Storage for the first few slots
+    mutable std::unique_ptr<LightSample[]> extraSamples;         ///< Storage for all slots, if there are too many for inlineSamples
+    /** Decide which light goes in each slot. This is done the first time any shader asks about
+     * lights, so a shader stack which doesn't use lights doesn't pay for picking them. */
+    void fill() const {
+      filled=true;
+      size_t capacity=lightTree?lightPicks:lightList.size();
+      if(capacity>inlineLights) extraSamples=std::make_unique<LightSample[]>(capacity);
+      LightSample* samples=extraSamples?extraSamples.get():inlineSamples.data();
+      if(!lightTree) {
+        for(slots=0;slots<lightList.size();slots++) samples[slots].light=slots;
+        return;
+      }
+      thread_local std::minstd_rand rng;
+      std::uniform_real_distribution<double> uniform(0,1);
+      for(size_t k=0;k<lightPicks;k++) {
+        double pdf;
+        int light=lightTree->sample(r,n,uniform(rng),pdf);
+        if(light<0) continue; //No light can reach this point, so this pick contributes nothing
+        double weight=1.0/(double(lightPicks)*pdf);
+        //If a light is picked twice, just give its slot both weights rather than casting another shadow ray
+        size_t j=0;
+        while(j<slots && samples[j].light!=size_t(light)) j++;
+        if(j<slots) {
+          samples[j].weight+=weight;
+        } else {
+          samples[slots].light=size_t(light);
+          samples[slots].weight=weight;
+          slots++;
+        }
+      }
+    }
+    /** Get the remembered data for a slot, calculating the ray if it hasn't been already
+     * @param k Slot number
+     * @return Reference to remembered data */
+    LightSample& sample(size_t k) const {
+      if(!filled) fill();
+      LightSample& result=(extraSamples?extraSamples.get():inlineSamples.data())[k];
+      if(!result.hasRay) {
+        result.ray=lightList[result.light]->rayTo(r);
+        result.ray.time=trace.time;
+        result.direction=static_cast<Direction>(result.ray.v.normalized());
+        result.hasRay=true;
+      }
+      return result;
+    }
+  public:
+    /** Construct a shading context
+     *
+     * @param[in] Lobject Object being shaded
+     * @param[in] Lscene A composite object containing all objects in the scene
+     * @param[in] LlightList all the lights in the scene
+     * @param[in] Lr Position of intersection
+     * @param[in] Lv Direction of incoming ray, must be normalized
+     * @param[in] Ln Normal vector, must be normalized
+     * @param[in] LobjectColor Intrinsic color of the object at this point, or nullptr if
+     *            the object has no pigment
+     * @param[in] Ltrace State of the ray which hit this point
+     * @param[in] LlightTree Tree built over LlightList to pick lights from, or nullptr to use every light
+     * @param[in] LlightPicks Number of lights to pick from the tree, which is the most shadow rays
+     *            that will be cast at this point
+     */
+    ShadingContext(
+      const Renderable& Lobject,
+      const Renderable& Lscene,
+      const LightList& LlightList,
+      const Position& Lr,
+      const Direction& Lv,
+      const Direction& Ln,
+      Observer<ObjectColor> LobjectColor,
+      const TraceState& Ltrace,
+      Observer<LightTree> LlightTree=nullptr,
+      size_t LlightPicks=0
+    ):object(Lobject),scene(Lscene),lightList(LlightList),r(Lr),v(Lv),n(Ln),objectColor(LobjectColor),trace(Ltrace),
+      lightTree(LlightTree),lightPicks(LlightPicks) {}
+    /** Get the number of light slots at this point @return Number of slots */
+    size_t lightCount() const {
+      if(!filled) fill();
+      return slots;
+    }
+    /** Get the light in a slot
+     * @param k Slot number
+     * @return Reference to light */
+    const Light& light(size_t k) const {return *lightList[sample(k).light];}
+    /** Get the weight of a slot. This is 1 when every light has its own slot. When lights
+     * are picked from a tree, it is one over the number of picks times the probability of
+     * picking this light, summed over each time it was picked.
+     * @param k Slot number
+     * @return Weight to multiply the contribution of this light by */
+    double lightWeight(size_t k) const {return sample(k).weight;}
+    /** Get the ray from this point to the light in a slot. See Light::rayTo()
+     * @param k Slot number
+     * @return Ray, with t=1 at the light */
+    const Ray& lightRay(size_t k) const {return sample(k).ray;}
+    /** Get the direction from this point to the light in a slot
+     * @param k Slot number
+     * @return Unit vector towards the light */
+    const Direction& lightDirection(size_t k) const {return sample(k).direction;}
+    /** Get the amount of the light in a slot which is visible from this point. The first call for each slot
+     * casts the shadow ray, and later calls from any shader return the same answer.
+     * See Light::amountVisible()
+     * @param k Slot number
+     * @return Fraction of light which is visible */
+    double lightVisible(size_t k) const {
+      LightSample& s=sample(k);
+      if(!s.hasVisible) {
+        s.visible=lightList[s.light]->amountVisible(scene,s.ray);
+        s.hasVisible=true;
+      }
+      return s.visible;
+    }
+  };
+
+  /** Represents a shading model. A shading model is handed a ShadingContext
+   * describing the hit: the object that was hit, all objects in the scene (most likely
    * as a Composite, note that the object that was hit will be
    * in all objects as well), all lights in the scene, the normal
-   * at the intersection, the position of the intersection, and
-   * the direction of the ray at the intersection.
+   * at the intersection, the position of the intersection, the
+   * direction of the ray at the intersection, and the color of the object there.
    *
    * Subclasses will use this data to implement various shading models.
    */
+  /** One direction in which a surface passes light on without scattering it, such as mirror
+   * reflection or refraction. See Shader::specularLobes() */
+  struct SpecularLobe {
+    Direction d;     ///< Direction light leaves the surface, normalized
+    RayColor weight; ///< Fraction of the light arriving which leaves in this direction, per channel
+  };
+
   class Shader {
   public:
     /** Calculate the shade at this point
      *
-     * @param[in] object Object being shaded
-     * @param[in] scene A composite object containing all objects in the scene
-     * @param[in] lightList all the lights in the scene
-     * @param[in] r Position of intersection
-     * @param[in] v Direction of incoming ray, must be normalized
-     * @param[in] n Normal vector, must be normalized
+     * @param[in] context Description of the hit. Anything expensive in here, such as
+     *            light visibility, is shared with the other shaders run at the same point.
      * @return Color of this ray. This is still a bit of a fuzzy concept, but the R, G, and B colors
      * of the first ray (from the camera) is used to color the pixel in the pixel buffer.
      */
-    virtual RayColor shade(
-      const Renderable& object,
-      const Renderable& scene,
-      const LightList& lightList,
-      const Position& r,
-      const Direction& v,
-      const Direction& n
-    )const=0;
+    virtual RayColor shade(const ShadingContext& context) const=0;
+    /** List the directions in which this shader passes light on unscattered. This is what lets a
+     * PhotonMap follow light through mirrors and lenses. The shader should
+     * use the same directions and weights as the secondary rays it traces in shade(). The default
+     * has none, which is right for shaders that only scatter light diffusely or not at all.
+     *
+     * @param[in] v Direction of incoming light, normalized
+     * @param[in] n Surface normal, normalized
+     * @param[in] objectColor Intrinsic color of the object at this point, or nullptr if the object has no pigment
+     * @param[in,out] lobes List to add lobes to
+     */
+    virtual void specularLobes(const Direction& v, const Direction& n, Observer<ObjectColor> objectColor, std::vector<SpecularLobe>& lobes) const {}
+    /** Check if specularLobes() might return anything for this shader @return True if it might */
+    virtual bool isSpecular() const {return false;}
     /** Prepare for a render. Default implementation doesn't do anything.
      * Subclasses might want to do something. */
     virtual void prepareRender() {};
     virtual ~Shader()=default; ///< Allow there to be subclasses
+    typedef Shader SceneBase; ///< Root of the hierarchy in scene files, see SceneTypes
+    /** Write this shader to a scene file. Shaders with no settings don't need to override this.
+     * @param out Scene file being written */
+    virtual void write(SceneWriter& out) const {}
+    /** Read this shader from a scene file @param in Scene file being read */
+    virtual void read(SceneReader& in) {}
   };
 
   /** Represents faked ambient light.
@@ -75,18 +320,10 @@ namespace kwantrace {
    */
   class AmbientShader:public Shader {
   public:
-    virtual RayColor shade(
-            const Renderable& object,
-            const Renderable& scene,
-            const LightList& lightList,
-            const Position& r,
-            const Direction& v,
-            const Direction& n
-    ) const override {
+    virtual RayColor shade(const ShadingContext& context) const override {
       RayColor result=RayColor::Zero();
-      ObjectColor objectColor;
-      if(object.evalPigment(r,objectColor)) {
-        result=0.1 * objectColor.head<3>();
+      if(context.objectColor) {
+        result=0.1 * context.objectColor->head<3>();
       }
       return result;
     }
@@ -145,8 +382,11 @@ namespace kwantrace {
      * In order to calculate the Lambertian reflectance, we need to know the
      * angle between each light and the local normal. We also need to know
      * whether a given light is blocked. In order to do each of these things,
-     * we do the following for each light:
-     *    * Construct a ray from the current intersection to the light
+     * we do the following for each light slot in the ShadingContext:
+     *    * Get the direction from the current intersection to the light
+     *    * Determine the angle between the light and the normal. If the
+     *      light is behind the surface, it contributes exactly zero color,
+     *      and we don't need to cast a shadow ray at all.
      *    * Determine if the light is visible. The Light object returns
      *      a floating-point number anticipating non-point-lights,
      *      but a point light returns either 1.0 (not blocked) or
@@ -154,30 +394,22 @@ namespace kwantrace {
      *    * If the visibility is 0.0, the light is blocked and
      *      contributes exactly zero color.
      *    * Otherwise:
-     *        * determine the angle between the light and the normal
      *        * Run the Lambertian model to calculate the reflectance
      *        * Scale the reflectance by the color of the light, the visiblity,
-     *           and the intrinsic color at this point.
-     * The diffuse shade is the vector sum of all of the lights.
+     *           the weight of the slot, and the intrinsic color at this point.
+     * Both the direction and the visibility come from the ShadingContext, so
+     * if any other shader at this point needs them, they are only worked out once.
+     * The diffuse shade is the vector sum over all of the slots.
      */
-    virtual RayColor shade(
-            const Renderable& object,
-            const Renderable& scene,
-            const LightList& lightList,
-            const Position& r,
-            const Direction& v,
-            const Direction& n
-    ) const override {
+    virtual RayColor shade(const ShadingContext& context) const override {
       RayColor result=RayColor::Zero();
-      ObjectColor objectColor;
-      if(object.evalPigment(r,objectColor)) {
-        for(auto&& light:lightList) {
-          Ray r_light=light->rayTo(r);
-          double lightVisible=light->amountVisible(scene,r_light);
-          if(lightVisible>0) {
-            double dot=n.dot(r_light.v.normalized());
-            if(dot>0) {
-              result+=(dot*objectColor.array()*light->color.array()).matrix().head<3>();
+      if(context.objectColor) {
+        for(size_t k=0;k<context.lightCount();k++) {
+          double dot=context.n.dot(context.lightDirection(k));
+          if(dot>0) {
+            double lightVisible=context.lightVisible(k);
+            if(lightVisible>0) {
+              result+=(context.lightWeight(k)*lightVisible*dot*context.objectColor->array()*context.light(k).color.array()).matrix().head<3>();
             }
           }
         }
@@ -186,6 +418,112 @@ namespace kwantrace {
     }
   };
 
+  /** Represents mirror reflection, like POV-Ray `reflection`. A reflected ray is
+   * traced from the hit point, and a fixed fraction of its color is added.
+   *
+   * Each reflection multiplies the ray weight by the reflection amount, so in a hall
+   * of mirrors the rays fade below Tracer::adcBailout after a few bounces, even if
+   * the trace level limit is much higher.
+   */
+  class ReflectionShader:public Shader {
+  private:
+    double amount; ///< Fraction of reflected light
+  public:
+    /** Construct a reflection shader
+     * @param Lamount Fraction of reflected light, 1.0 for a perfect mirror
+     */
+    ReflectionShader(double Lamount=1.0):amount(Lamount) {}
+    /** \copydoc Shader::write() */
+    virtual void write(SceneWriter& out) const override {out.put(amount);}
+    /** \copydoc Shader::read() */
+    virtual void read(SceneReader& in) override {in.get(amount);}
+    /** \copydoc Shader::shade()
+     *
+     * The reflected direction is \f$\vec{v}-2(\vec{v}\cdot\hat{n})\hat{n}\f$. The reflected
+     * ray is advanced a small distance to keep it from hitting the same surface, see the
+     * Ugly Light Hack in Light::rayTo().
+     */
+    virtual RayColor shade(const ShadingContext& context) const override {
+      if(amount<=0) return RayColor::Zero();
+      const Direction& v=context.v;
+      const Direction& n=context.n;
+      Direction d=static_cast<Direction>(v-2*v.dot(n)*n);
+      return amount*context.trace.spawn(Ray(context.r,d)+Light::initialDist,amount);
+    }
+    /** \copydoc Shader::specularLobes() */
+    virtual void specularLobes(const Direction& v, const Direction& n, Observer<ObjectColor>, std::vector<SpecularLobe>& lobes) const override {
+      if(amount>0) lobes.push_back({static_cast<Direction>(v-2*v.dot(n)*n),amount*RayColor::Ones()});
+    }
+    /** \copydoc Shader::isSpecular() */
+    virtual bool isSpecular() const override {return amount>0;}
+  };
+
+  /** Represents refraction through a transparent surface. The amount of light transmitted
+   * comes from the filter and transmit channels of the pigment, like in POV-Ray: transmitted
+   * light passes through unchanged, while filtered light is tinted by the pigment color.
+   *
+   * All objects using this shader have the same index of refraction. If the ray is leaving
+   * the object (moving along the normal) the ratio is inverted, and if there is total internal
+   * reflection the ray is reflected instead.
+   */
+  class RefractionShader:public Shader {
+  private:
+    double ior; ///< Index of refraction of the inside of the object relative to the outside
+    /** Find the refracted direction and color of light passing through the surface
+     * @param[in] v Direction of incoming light, normalized
+     * @param[in] n Surface normal, normalized
+     * @param[in] objectColor Intrinsic color of the object at this point
+     * @param[out] d Direction of refracted light, or reflected if there is total internal reflection
+     * @param[out] tint Fraction of light passed through, per channel
+     * @return False if the surface doesn't pass any light
+     */
+    bool refract(const Direction& v, const Direction& n, const ObjectColor& objectColor, Direction& d, RayColor& tint) const {
+      double filter=objectColor[3];
+      double transmit=objectColor[4];
+      if(filter+transmit<=0) return false;
+      Direction nn=n;
+      double cosi=-v.dot(n);
+      double eta=1/ior;
+      if(cosi<0) {
+        nn=static_cast<Direction>(-n);
+        cosi=-cosi;
+        eta=ior;
+      }
+      double k=1-eta*eta*(1-cosi*cosi);
+      d=static_cast<Direction>(k<0?(v-2*v.dot(n)*n).eval():(eta*v+(eta*cosi-std::sqrt(k))*nn).eval());
+      tint=(transmit*RayColor::Ones()+filter*objectColor.head<3>());
+      return true;
+    }
+  public:
+    /** Construct a refraction shader
+     * @param Lior Index of refraction, like POV-Ray `ior`. 1.0 means light passes straight through.
+     */
+    RefractionShader(double Lior=1.5):ior(Lior) {}
+    /** \copydoc Shader::write() */
+    virtual void write(SceneWriter& out) const override {out.put(ior);}
+    /** \copydoc Shader::read() */
+    virtual void read(SceneReader& in) override {in.get(ior);}
+    /** \copydoc Shader::shade()
+     *
+     * The refracted direction is found with the vector form of Snell's law.
+     */
+    virtual RayColor shade(const ShadingContext& context) const override {
+      if(!context.objectColor) return RayColor::Zero();
+      Direction d;
+      RayColor tint;
+      if(!refract(context.v,context.n,*context.objectColor,d,tint)) return RayColor::Zero();
+      return (tint.array()*context.trace.spawn(Ray(context.r,d)+Light::initialDist,tint.maxCoeff()).array()).matrix();
+    }
+    /** \copydoc Shader::specularLobes() */
+    virtual void specularLobes(const Direction& v, const Direction& n, Observer<ObjectColor> objectColor, std::vector<SpecularLobe>& lobes) const override {
+      if(!objectColor) return;
+      SpecularLobe lobe;
+      if(refract(v,n,*objectColor,lobe.d,lobe.weight)) lobes.push_back(lobe);
+    }
+    /** \copydoc Shader::isSpecular() */
+    virtual bool isSpecular() const override {return true;}
+  };
+
   /** Represents a list of shaders. This makes it cleaner to separate each
    *  of the shading models, then run them all consecutively and add them up.
    */
@@ -198,7 +536,7 @@ namespace kwantrace {
      */
     virtual void prepareRender() override {
       Shader::prepareRender();
-      for(auto shader:shaderList) {
+      for(auto&& shader:shaderList) {
         shader->prepareRender();
       }
     };
@@ -211,25 +549,40 @@ namespace kwantrace {
       shaderList.push_back(shader);
       return shader;
     }
+    /** \copydoc Shader::write() */
+    virtual void write(SceneWriter& out) const override {out.objects(shaderList);}
+    /** \copydoc Shader::read()
+     *
+     * This replaces the list, including any shaders a subclass added when it was constructed. */
+    virtual void read(SceneReader& in) override {in.objects(shaderList);}
     /** \copydoc Shader::shade()
      *
      * This implementation runs each child shader in turn and adds the
-     * results together.
+     * results together. All children see the same context, so a light which
+     * is checked for visibility by one child isn't checked again by the next.
      */
-    virtual RayColor shade(
-            const Renderable& object,
-            const Renderable& scene,
-            const LightList& lightList,
-            const Position& r,
-            const Direction& v,
-            const Direction& n
-    ) const override {
+    virtual RayColor shade(const ShadingContext& context) const override {
       RayColor result=RayColor::Zero();
-      for(auto shader:shaderList) {
-        result+=shader->shade(object,scene,lightList,r,v,n);
+      for(auto&& shader:shaderList) {
+        result+=shader->shade(context);
       }
       return result;
     }
+    /** \copydoc Shader::specularLobes()
+     *
+     * This collects the lobes of all the children. */
+    virtual void specularLobes(const Direction& v, const Direction& n, Observer<ObjectColor> objectColor, std::vector<SpecularLobe>& lobes) const override {
+      for(auto&& shader:shaderList) {
+        shader->specularLobes(v,n,objectColor,lobes);
+      }
+    }
+    /** \copydoc Shader::isSpecular() */
+    virtual bool isSpecular() const override {
+      for(auto&& shader:shaderList) {
+        if(shader->isSpecular()) return true;
+      }
+      return false;
+    }
   };
 
   /** A specialization of the CompositeShader that is intended to fully emulate the
@@ -242,6 +595,17 @@ namespace kwantrace {
       add(std::make_shared<DiffuseShader>());
     }
   };
+
+  inline const bool ambientShaderRegistered=SceneTypes::add<AmbientShader>("AmbientShader"); ///< Lets ambient shaders be saved in scene files
+  inline const bool diffuseShaderRegistered=SceneTypes::add<DiffuseShader>("DiffuseShader"); ///< Lets diffuse shaders be saved in scene files
+  inline const bool reflectionShaderRegistered=SceneTypes::add<ReflectionShader>("ReflectionShader"); ///< Lets reflection shaders be saved in scene files
+  inline const bool refractionShaderRegistered=SceneTypes::add<RefractionShader>("RefractionShader"); ///< Lets refraction shaders be saved in scene files
+  inline const bool compositeShaderRegistered=SceneTypes::add<CompositeShader>("CompositeShader"); ///< Lets composite shaders be saved in scene files
+  inline const bool povrayShaderRegistered=SceneTypes::add<POVRayShader>("POVRayShader"); ///< Lets POV-Ray shaders be saved in scene files
+
+  inline void Renderable::prepareShader() {
+    shader->prepareRender();
+  }
 }
 
 #endif //KWANTRACE_SHADER_H
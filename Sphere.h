@@ -116,6 +116,46 @@ namespace kwantrace {
       t = (t1 < t2) ? t1 : t2;
       return true;
     }
+    /** \copydoc Primitive::intersectLocalBatch()
+     *
+     * This is intersectLocal() as a CpuDispatch kernel, with the chain of if blocks turned into selects so that
+     * the loops vectorize. The square roots are taken in a loop of their own, which stays scalar, between the loops
+     * for the discriminant and the roots. The dot products are summed in the same order as Eigen does, so each ray
+     * gets the same answer to the bit.
+     */
+    virtual void intersectLocalBatch(const RayBatch& raysLocal, double* t) const override {
+      auto kernel=[](size_t n, const double* __restrict x0, const double* __restrict y0, const double* __restrict z0,
+                     const double* __restrict vx, const double* __restrict vy, const double* __restrict vz,
+                     double* __restrict t) KWANTRACE_KERNEL {
+        const double miss=std::numeric_limits<double>::infinity();
+        constexpr size_t chunk=64;
+        double a[chunk],b[chunk],c[chunk],d[chunk],root[chunk];
+        for(size_t i0=0;i0<n;i0+=chunk) {
+          size_t m=std::min(chunk,n-i0);
+          for(size_t j=0;j<m;j++) {
+            size_t i=i0+j;
+            a[j] = vx[i]*vx[i] + vy[i]*vy[i] + vz[i]*vz[i];
+            b[j] = 2 * (x0[i]*vx[i] + y0[i]*vy[i] + z0[i]*vz[i]);
+            c[j] = x0[i]*x0[i] + y0[i]*y0[i] + z0[i]*z0[i] - 1;
+            d[j] = b[j] * b[j] - 4 * a[j] * c[j];
+          }
+          //Misses are thrown away below, so don't let them take the slow path which sets errno
+          for(size_t j=0;j<m;j++) root[j]=sqrt(std::max(d[j],0.0));
+          for(size_t j=0;j<m;j++) {
+            double q = -(b[j] + (b[j] > 0 ? 1 : -1) * root[j]) / 2;
+            double t1 = q / a[j];
+            double t2 = c[j] / q;
+            double nearest = (t1 < t2) ? t1 : t2;
+            nearest = (t1 < 0) ? ((t2 > 0) ? t2 : miss) : (t2 < 0) ? ((t1 > 0) ? t1 : miss) : nearest;
+            t[i0+j] = (d[j] < 0) ? miss : nearest;
+          }
+        }
+      };
+      CpuDispatch::run([&]() KWANTRACE_KERNEL {
+        kernel(raysLocal.size(),raysLocal.x0.data(),raysLocal.y0.data(),raysLocal.z0.data(),
+               raysLocal.vx.data(),raysLocal.vy.data(),raysLocal.vz.data(),t);
+      });
+    }
 
     /** Normal vector of surface. This shows why we like to work in body coordinates.
      * In this frame, the surface is perpendicular to the radius vector, so we can
@@ -141,6 +181,30 @@ namespace kwantrace {
       return pointLocal.norm() < 1;
     }
 
+    /** \copydoc Renderable::boundingSphere()
+     *
+     * The unit sphere is stretched by at most the largest singular value of the
+     * transformation, so that is the radius of the bound.
+     *
+     * If the sphere moves, the center follows straight lines between the motion keys, and the
+     * stretch never exceeds the largest at any key, so a sphere around the spheres at each
+     * key with the largest radius bounds the whole path swept during the shutter interval.
+     */
+    virtual bool boundingSphere(Position& center, double& radius) const override {
+      center=Position(Mwb.col(3).head<3>());
+      radius=Eigen::JacobiSVD<Eigen::Matrix3d>(Mwb.topLeftCorner<3,3>()).singularValues()[0];
+      if(!moving()) return true;
+      double sweptRadius=radius;
+      for(auto&& key:getMotionKeys()) {
+        sweptRadius=std::max(sweptRadius,Eigen::JacobiSVD<Eigen::Matrix3d>(key.scaling).singularValues()[0]);
+      }
+      radius=sweptRadius;
+      for(auto&& key:getMotionKeys()) {
+        mergeSphere(center,radius,Position(key.translation),sweptRadius);
+      }
+      return true;
+    }
+
     /** Calculate the UV coordinates on a sphere. In this case, we are
      * going to return the latitude and longitude. The polar axis is
      * the Z axis, with north being in the +Z direction. Longitude will
@@ -155,10 +219,11 @@ namespace kwantrace {
      */
     static Eigen::Vector2d uvLocal(const Position &point) {
       double lon = atan2(point.y(), point.x());
-      if (lon < 0) lon += EIGEN_PI;
+      if (lon < 0) lon += 2 * EIGEN_PI;
       double lat = asin(point.z() / point.norm());
       return Eigen::Vector2d(lon / (2 * EIGEN_PI), (lat / EIGEN_PI) + 0.5);
     }
   };
+  inline const bool sphereRegistered=SceneTypes::add<Sphere>("Sphere"); ///< Lets spheres be saved in scene files
 }
 #endif //KWANTRACE_SPHERE_H
@@ -0,0 +1,143 @@
+/* KwanTrace - C++ Ray Tracing Library
+Copyright (C) 2021 by kwan3217
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef KWANTRACE_STRUCTURECACHE_H
+#define KWANTRACE_STRUCTURECACHE_H
+
+#include <cinttypes>
+#include <cstdio>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <system_error>
+#include <type_traits>
+#include <unistd.h>
+
+namespace kwantrace {
+  /** Directory of structures built at prepareRender(), such as the kd-tree of a PhotonMap, kept between runs
+   * so that a scene which hasn't changed doesn't have to build them again.
+   *
+   * Each structure is one array, stored under a name and a key. The key is a hash of everything
+   * the structure was built from, usually a SceneWriter::fingerprint() of the objects, lights, and settings, so a
+   * structure built from a different scene is never found, and a change to the scene just makes a new entry.
+   * Old entries aren't removed, so delete the directory now and then to reclaim the space.
+   *
+   * Each entry is a scene file (see SceneReader) whose root record holds the key, the size of an element,
+   * a hash of the array, and the array itself. The array is used straight out of the shared read-only mapping
+   * of the file, so loading it takes time only in proportion to hashing it, and processes rendering the same scene
+   * share its pages. An entry which is truncated, corrupt, or from some other key or element type is treated
+   * as missing, so it is built again and replaced. Entries are written to a temporary file and renamed
+   * into place, so a render killed while storing never leaves half an entry behind.
+   */
+  class StructureCache {
+  private:
+    std::string directory; ///< Directory to keep entries in
+  public:
+    static const constexpr uint32_t version=1; ///< Version of the layout of an entry
+    /** Construct a cache. The directory is created when the first entry is stored.
+     * @param Ldirectory Directory to keep entries in
+     */
+    explicit StructureCache(const std::string& Ldirectory):directory(Ldirectory) {}
+    /** Get the name of the file for an entry
+     * @param name Name of the kind of structure, such as "photons"
+     * @param key Hash of everything the structure is built from
+     * @return Name of file
+     */
+    std::string path(const std::string& name, uint64_t key) const {
+      char hex[17];
+      std::snprintf(hex,sizeof(hex),"%016" PRIx64,key);
+      return (std::filesystem::path(directory)/(name+"-"+hex+".kwc")).string();
+    }
+    /** Look up an entry
+     * @tparam T Type of element. It is read back as the bytes which were stored, so it must be plain data,
+     *   such as a struct of numbers and fixed-size Eigen vectors.
+     * @param[in] name Name of the kind of structure
+     * @param[in] key Hash of everything the structure is built from
+     * @param[out] data First element, pointing into the mapping of the entry
+     * @param[out] n Number of elements
+     * @param[out] owner Keeps the entry mapped. Hold it as long as data is used.
+     * @return True if a good entry was found. If not, the outputs are left alone.
+     */
+    template<typename T>
+    bool load(const std::string& name, uint64_t key, const T*& data, size_t& n, std::shared_ptr<const void>& owner) const {
+      static_assert(std::is_standard_layout_v<T>,"Only plain data can be cached");
+      std::string filename=path(name,key);
+      std::error_code ec;
+      if(!std::filesystem::exists(filename,ec)) return false;
+      try {
+        SceneReader in(filename);
+        uint32_t Lversion;
+        uint64_t Lkey, elementSize, hash;
+        in.get(Lversion);
+        in.get(Lkey);
+        in.get(elementSize);
+        in.get(hash);
+        size_t bytes;
+        const uint8_t* p=in.array<uint8_t>(bytes);
+        if(Lversion!=version || Lkey!=key || elementSize!=sizeof(T) || bytes%sizeof(T)!=0) return false;
+        Fingerprint f;
+        f.add(p,bytes);
+        if(f.value()!=hash) return false;
+        data=reinterpret_cast<const T*>(p);
+        n=bytes/sizeof(T);
+        owner=in.owner();
+        return true;
+      } catch(std::runtime_error&) {
+        return false;
+      }
+    }
+    /** Store an entry, replacing any entry with the same name and key
+     * @tparam T Type of element, see load()
+     * @param name Name of the kind of structure
+     * @param key Hash of everything the structure is built from
+     * @param data First element
+     * @param n Number of elements
+     * @return True if stored. A cache which can't be written is not an error, since the structure
+     *   can always be built again, so this just returns false.
+     */
+    template<typename T>
+    bool store(const std::string& name, uint64_t key, const T* data, size_t n) const {
+      static_assert(std::is_standard_layout_v<T>,"Only plain data can be cached");
+      std::string filename=path(name,key);
+      std::string temp=filename+"."+std::to_string(::getpid())+".tmp";
+      std::error_code ec;
+      std::filesystem::create_directories(directory,ec);
+      try {
+        const uint8_t* p=reinterpret_cast<const uint8_t*>(data);
+        Fingerprint f;
+        f.add(p,n*sizeof(T));
+        SceneWriter out;
+        out.put(version);
+        out.put(key);
+        out.put(uint64_t(sizeof(T)));
+        out.put(f.value());
+        out.array(p,n*sizeof(T));
+        out.save(temp);
+      } catch(std::runtime_error&) {
+        std::filesystem::remove(temp,ec);
+        return false;
+      }
+      std::filesystem::rename(temp,filename,ec);
+      if(!ec) return true;
+      std::filesystem::remove(temp,ec);
+      return false;
+    }
+  };
+}
+
+#endif //KWANTRACE_STRUCTURECACHE_H
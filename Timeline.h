@@ -0,0 +1,256 @@
+/* KwanTrace - C++ Ray Tracing Library
+Copyright (C) 2021 by kwan3217
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef KWANTRACE_TIMELINE_H
+#define KWANTRACE_TIMELINE_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+namespace kwantrace {
+  /** One span of time recorded by a TraceScope */
+  struct TraceEvent {
+    const char* name;     ///< What was being done, a string literal
+    const char* category; ///< Kind of work, a string literal such as `scene`, `render`, `build`, or `io`
+    const char* argName;  ///< Name of the number attached to the span, such as `row`, or nullptr if there isn't one
+    int64_t arg;          ///< Number attached to the span
+    uint64_t begin;       ///< Start, in nanoseconds since the timeline started
+    uint64_t end;         ///< End, in nanoseconds since the timeline started
+    uint32_t thread;      ///< Number of the thread which recorded the span
+  };
+
+  /** Record of what each thread was doing when, for finding out where the time in a slow frame goes.
+   * Recording is off until enable() is called. Spans are then recorded with TraceScope, and
+   * write() saves them as a [Chrome trace](https://docs.google.com/document/d/1CvAClvFfyA5R-PhYUmn5OOQtYMH4h6I0nSsKchNAySU),
+   * which can be opened in [Perfetto](https://ui.perfetto.dev) or `chrome://tracing`.
+   *
+   *     Timeline::enable();
+   *     auto pixbuf=scene.render(width,height);
+   *     pixbuf.write("image.png");
+   *     Timeline::write("trace.json");
+   *
+   * Each thread records into a ring of its own, without any lock, so recording doesn't make threads
+   * wait for each other. When a ring is full, its oldest spans are overwritten. When a thread exits, its ring is
+   * handed to the next new thread, so the many short-lived worker threads of a render don't each need one. Threads
+   * are numbered in the order they first record, and can be given names with nameThread().
+   *
+   * When recording is off, a TraceScope costs one relaxed atomic load.
+   */
+  class Timeline {
+  private:
+    /** Spans recorded by one thread at a time */
+    struct Ring {
+      std::unique_ptr<TraceEvent[]> events; ///< Storage for the spans
+      size_t capacity;                      ///< Number of spans which fit
+      std::atomic<uint64_t> written{0};     ///< Number of spans ever written. The next goes at written%capacity.
+      /** Construct a ring @param Lcapacity Number of spans which fit */
+      explicit Ring(size_t Lcapacity):events(new TraceEvent[Lcapacity]),capacity(Lcapacity) {}
+    };
+    /** Everything shared by all threads */
+    struct State {
+      std::atomic<bool> enabled{false};         ///< True while recording
+      std::atomic<uint32_t> nextThread{0};      ///< Number of the next thread to record
+      std::chrono::steady_clock::time_point origin=std::chrono::steady_clock::now(); ///< Start of the timeline
+      std::mutex mutex;                         ///< Guards everything below
+      size_t capacity=65536;                    ///< Number of spans in each new ring
+      std::vector<std::unique_ptr<Ring>> rings; ///< Every ring
+      std::vector<Ring*> spare;                 ///< Rings not held by any thread
+      std::map<uint32_t,std::string> threadNames; ///< Names given to threads
+    };
+    /** Get the shared state @return State */
+    static State& state() {
+      static State _state;
+      return _state;
+    }
+    /** Ring and number of the current thread. The ring is handed back when the thread exits. */
+    struct Local {
+      Ring* ring=nullptr; ///< Ring of this thread, or nullptr until it first records
+      uint32_t thread;    ///< Number of this thread
+      Local():thread(state().nextThread++) {}
+      ~Local() {
+        if(!ring) return;
+        std::lock_guard<std::mutex> lock(state().mutex);
+        state().spare.push_back(ring);
+      }
+    };
+    /** Get the ring and number of the current thread @return Local state */
+    static Local& local() {
+      thread_local Local _local;
+      return _local;
+    }
+    /** Quote a string for JSON @param s String @return Quoted string */
+    static std::string quote(const std::string& s) {
+      std::string result="\"";
+      for(char c:s) {
+        if(c=='"' || c=='\\') {
+          result+='\\';
+          result+=c;
+        } else if((unsigned char)c<0x20) {
+          char hex[8];
+          std::snprintf(hex,sizeof(hex),"\\u%04x",c);
+          result+=hex;
+        } else {
+          result+=c;
+        }
+      }
+      return result+"\"";
+    }
+  public:
+    /** Start or stop recording. Spans which are open when recording starts aren't recorded.
+     * @param on True to record
+     */
+    static void enable(bool on=true) {state().enabled.store(on,std::memory_order_relaxed);}
+    /** Check if recording is on @return True if recording */
+    static bool enabled() {return state().enabled.load(std::memory_order_relaxed);}
+    /** Set the number of spans each thread keeps. This only applies to threads which haven't recorded yet, so
+     * call it before enable(). Each span takes 56 bytes.
+     * @param spans Number of spans
+     */
+    static void setCapacity(size_t spans) {
+      std::lock_guard<std::mutex> lock(state().mutex);
+      state().capacity=std::max<size_t>(spans,1);
+    }
+    /** Get the time on the timeline @return Nanoseconds since the timeline started */
+    static uint64_t now() {
+      return uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now()-state().origin).count());
+    }
+    /** Record a span on the current thread. This is usually done by TraceScope.
+     * @param name What was being done, a string literal
+     * @param category Kind of work, a string literal
+     * @param begin Start, from now()
+     * @param end End, from now()
+     * @param argName Name of the number attached to the span, a string literal, or nullptr for none
+     * @param arg Number attached to the span
+     */
+    static void record(const char* name, const char* category, uint64_t begin, uint64_t end, const char* argName=nullptr, int64_t arg=0) {
+      Local& l=local();
+      if(!l.ring) {
+        std::lock_guard<std::mutex> lock(state().mutex);
+        if(state().spare.empty()) {
+          state().rings.push_back(std::make_unique<Ring>(state().capacity));
+          l.ring=state().rings.back().get();
+        } else {
+          l.ring=state().spare.back();
+          state().spare.pop_back();
+        }
+      }
+      Ring& ring=*l.ring;
+      uint64_t i=ring.written.load(std::memory_order_relaxed);
+      ring.events[i%ring.capacity]={name,category,argName,arg,begin,end,l.thread};
+      ring.written.store(i+1,std::memory_order_release);
+    }
+    /** Name the current thread in the timeline @param name Name, such as `image writer` */
+    static void nameThread(const std::string& name) {
+      uint32_t thread=local().thread;
+      std::lock_guard<std::mutex> lock(state().mutex);
+      state().threadNames[thread]=name;
+    }
+    /** Throw away every span recorded so far. Call this while no thread is recording. */
+    static void clear() {
+      std::lock_guard<std::mutex> lock(state().mutex);
+      for(auto&& ring:state().rings) ring->written.store(0,std::memory_order_relaxed);
+    }
+    /** Save every span recorded so far as Chrome trace JSON. Call this while no thread is recording, such as
+     * between frames, or spans being written at the same time may come out garbled.
+     * @param filename Name of file to write
+     * @throws std::runtime_error if the file can't be written
+     */
+    static void write(const std::string& filename) {
+      std::vector<TraceEvent> events;
+      std::map<uint32_t,std::string> names;
+      uint64_t dropped=0;
+      {
+        std::lock_guard<std::mutex> lock(state().mutex);
+        for(auto&& ring:state().rings) {
+          uint64_t written=ring->written.load(std::memory_order_acquire);
+          uint64_t n=std::min<uint64_t>(written,ring->capacity);
+          dropped+=written-n;
+          for(uint64_t i=written-n;i<written;i++) events.push_back(ring->events[i%ring->capacity]);
+        }
+        names=state().threadNames;
+      }
+      std::sort(events.begin(),events.end(),[](const TraceEvent& a, const TraceEvent& b){return a.begin<b.begin;});
+      std::ofstream out(filename,std::ios::trunc);
+      long pid=long(::getpid());
+      char buf[128];
+      out<<"{\"traceEvents\":[\n";
+      bool first=true;
+      for(auto&& [thread,name]:names) {
+        out<<(first?"":",\n")<<"{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":"<<pid<<",\"tid\":"<<thread
+           <<",\"args\":{\"name\":"<<quote(name)<<"}}";
+        first=false;
+      }
+      for(auto&& e:events) {
+        std::snprintf(buf,sizeof(buf),"\"ts\":%.3f,\"dur\":%.3f",e.begin/1e3,(e.end-e.begin)/1e3);
+        out<<(first?"":",\n")<<"{\"name\":"<<quote(e.name)<<",\"cat\":"<<quote(e.category)<<",\"ph\":\"X\","<<buf
+           <<",\"pid\":"<<pid<<",\"tid\":"<<e.thread;
+        if(e.argName) out<<",\"args\":{"<<quote(e.argName)<<":"<<e.arg<<"}";
+        out<<"}";
+        first=false;
+      }
+      out<<"\n],\"displayTimeUnit\":\"ms\",\"otherData\":{\"dropped\":"<<dropped<<"}}\n";
+      if(!out) throw std::runtime_error("Can't write trace "+filename);
+    }
+  };
+
+  /** Records the time from its construction to its destruction as a span in the Timeline, if recording is on.
+   *
+   *     void prepareRender() {
+   *       TraceScope span("prepareRender","scene");
+   *       ...
+   *     }
+   */
+  class TraceScope {
+  private:
+    const char* name;    ///< What is being done
+    const char* category;///< Kind of work
+    const char* argName; ///< Name of the number attached to the span, or nullptr
+    int64_t arg;         ///< Number attached to the span
+    uint64_t begin=0;    ///< Start of the span
+    bool active;         ///< True if recording was on at the start of the span
+  public:
+    /** Start a span
+     * @param Lname What is being done, a string literal
+     * @param Lcategory Kind of work, a string literal such as `scene`, `render`, `build`, or `io`
+     * @param LargName Name of a number to attach to the span, a string literal such as `row`, or nullptr for none
+     * @param Larg Number to attach to the span
+     */
+    TraceScope(const char* Lname, const char* Lcategory, const char* LargName=nullptr, int64_t Larg=0):
+      name(Lname),category(Lcategory),argName(LargName),arg(Larg),active(Timeline::enabled()) {
+      if(active) begin=Timeline::now();
+    }
+    /** End the span */
+    ~TraceScope() {
+      if(active) Timeline::record(name,category,begin,Timeline::now(),argName,arg);
+    }
+    TraceScope(const TraceScope&)=delete;            ///< Not copyable, since it is one span
+    TraceScope& operator=(const TraceScope&)=delete; ///< Not copyable, since it is one span
+  };
+}
+
+#endif //KWANTRACE_TIMELINE_H
@@ -43,8 +43,27 @@ namespace kwantrace {
    * possible, to save as much time effort during the render. This makes sense, because the render will be
    * called literally millions of times. You may chain literally any number of transformations, and only pay
    * the cost at prepareRender(). During the render, the cost of 0, 1, or 1000 transformations are all the same.
+   *
+   * For motion blur, any of the transformations may have keyframes over the shutter interval (see
+   * ScalarTransformation::key()). If any do, prepareRender() also samples the combined transformation
+   * at each keyframe, and motionSteps times between each pair of them, and splits each sample into translation,
+   * rotation, and scaling. MwbAt() and MbwAt() then blend the two samples around any time, linearly for
+   * translation and scaling and spherically for rotation, so that a spinning object sweeps through an arc rather
+   * than shrinking through the middle of it. Mwb and Mbw are the transformation at shutter open.
+   *
+   *     auto spin=object->rotateZ(0);
+   *     spin->keyd(0,0);
+   *     spin->keyd(1,90);
    */
   class Transformable {
+  public:
+    /** Combined transformation at one instant, split into parts which can be blended separately */
+    struct MotionKey {
+      double time;                  ///< Time of this sample within the shutter interval
+      Eigen::Vector3d translation;  ///< Translation part
+      Eigen::Quaterniond rotation;  ///< Rotation part
+      Eigen::Matrix3d scaling;      ///< Scaling (and shearing) part, applied before the rotation
+    };
   private:
     /** Combine transformations in the transformation list. In terms of physical transformations, it is as if
      * the the transforms in the list are performed in order.
@@ -53,35 +72,202 @@ namespace kwantrace {
      * matrices, and then combined by matrix multiplication with the transformations in order from the right.
      * This is the traditional way to combine matrices, and is required if you are then going to use M*v
      * to transform a column vector.
+     * @param time Time within the shutter interval to combine the transformations at
      * @return Matrix representing the combination of all transformations performed in order.
      */
-    Eigen::Matrix4d combine() const {
+    Eigen::Matrix4d combine(double time) const {
       Eigen::Matrix4d result{Eigen::Matrix4d::Identity()};
       for (auto&& trans:transformList) {
-        result = trans->matrix() * result;
+        result = trans->matrix(time) * result;
       }
       return result;
     }
+    /** Sample the combined transformation at a time and add it to the motion keys
+     * @param time Time within the shutter interval
+     */
+    void addMotionKey(double time) {
+      Eigen::Affine3d M(combine(time));
+      Eigen::Matrix3d R, S;
+      M.computeRotationScaling(&R,&S);
+      Eigen::Quaterniond q(R);
+      //Keep neighboring quaternions in the same hemisphere so that slerp goes the short way
+      if(!motionKeys.empty() && motionKeys.back().rotation.dot(q)<0) q.coeffs()=-q.coeffs();
+      motionKeys.push_back({time,M.translation(),q,S});
+    }
+    /** Find the motion keys around a time, and how far between them the time is
+     * @param time Time within the shutter interval
+     * @param[out] a Fraction of the way from the returned key to the next one
+     * @return Index of the key at or before the time
+     */
+    size_t findMotionKey(double time, double& a) const {
+      if(time<=motionKeys.front().time) {a=0; return 0;}
+      if(time>=motionKeys.back().time) {a=1; return motionKeys.size()-2;}
+      size_t i=std::upper_bound(motionKeys.begin(),motionKeys.end(),time,[](double t, const MotionKey& key){return t<key.time;})-motionKeys.begin()-1;
+      a=(time-motionKeys[i].time)/(motionKeys[i+1].time-motionKeys[i].time);
+      return i;
+    }
+    /** Blend the motion keys at a time
+     * @param time Time within the shutter interval
+     * @param[out] T Translation
+     * @param[out] R Rotation
+     * @param[out] S Scaling
+     */
+    void blendMotion(double time, Eigen::Vector3d& T, Eigen::Matrix3d& R, Eigen::Matrix3d& S) const {
+      double a;
+      size_t i=findMotionKey(time,a);
+      const MotionKey& k0=motionKeys[i];
+      const MotionKey& k1=motionKeys[i+1];
+      T=k0.translation+(k1.translation-k0.translation)*a;
+      R=k0.rotation.slerp(a,k1.rotation).toRotationMatrix();
+      S=k0.scaling+(k1.scaling-k0.scaling)*a;
+    }
+    /** Samples of the combined transformation over the shutter interval, sorted by time, or empty if nothing moves */
+    std::vector<MotionKey> motionKeys;
     /** List of pointers to physical transformations to be performed, in order. The transformations themselves
      * can be changed through their pointer, but prepareRender must be called to actually apply the transformation
      */
     TransformList transformList;
+  protected:
+    /** Memory resource that transformations (and for subclasses, children and pigments) created
+     * through the convenience functions are allocated from, or nullptr to use the heap. This
+     * does not own the resource -- it is normally the arena of the Scene this object belongs to.
+     */
+    std::pmr::memory_resource* arena=nullptr;
   public:
     Eigen::Matrix4d Mwb; ///< World-from-body transformation matrix, only valid between a call to prepareRender and any changes to any transforms in the list
     Eigen::Matrix4d Mbw; ///< Body-from-world transformation matrix, only valid between a call to prepareRender and any changes to any transforms in the list
     Eigen::Matrix4d MwbN;///< World-from-body transformation matrix for surface normals, only valid between a call to prepareRender and any changes to any transforms in the list
+    int motionSteps=4;   ///< Number of samples of the motion between each pair of keyframes. More follow curved paths, such as from rotation about a point other than the center, more closely.
+    typedef Transformable SceneBase; ///< Root of the hierarchy in scene files, see SceneTypes
     virtual ~Transformable()=default; ///< Allow there to be subclasses
+    /** Write this object to a scene file. Only valid after prepareRender()
+     *
+     * \internal The transformation list isn't written. Instead, the combined transformation is written,
+     * either as a matrix or as the motion keys if the object moves, so that an object with a long list of
+     * transformations takes no longer to prepare once loaded than one with none.
+     * @param out Scene file being written
+     */
+    virtual void write(SceneWriter& out) const {
+      out.put(Mwb);
+      out.put(uint64_t(motionKeys.size()));
+      for(auto&& key:motionKeys) {
+        Eigen::Matrix4d M=Eigen::Matrix4d::Identity();
+        M.topLeftCorner<3,3>()=key.rotation.toRotationMatrix()*key.scaling;
+        M.topRightCorner<3,1>()=key.translation;
+        out.put(key.time);
+        out.put(M);
+      }
+    }
+    /** Read this object from a scene file. The transformation list is replaced with one MatrixTransformation
+     * holding the combined transformation that was written.
+     * @param in Scene file being read
+     */
+    virtual void read(SceneReader& in) {
+      Eigen::Matrix4d M;
+      in.get(M);
+      auto combined=allocate<MatrixTransformation>(arena,M);
+      uint64_t keys;
+      in.get(keys);
+      for(uint64_t i=0;i<keys;i++) {
+        double time;
+        in.get(time);
+        in.get(M);
+        combined->key(time,M);
+      }
+      //The keys already are the samples of the motion, so there is no need to sample between them
+      if(keys>0) motionSteps=1;
+      transformList.clear();
+      transformList.push_back(combined);
+    }
     /** Prepare for rendering
      *
      * \internal This is done by calling combine() to combine all of the transformations, and
-     *    then computing ancillary matrices Mwb, Mbw, and MwbN, which will also be needed.
+     *    then computing ancillary matrices Mwb, Mbw, and MwbN, which will also be needed. If any
+     *    transformation has keyframes, the motion keys are sampled as well.
      */
     virtual void prepareRender() {
-      Mwb = combine();
+      Mwb = combine(0);
       Mbw = Mwb.inverse();
       MwbN = Mbw.transpose();
+      motionKeys.clear();
+      std::vector<double> times;
+      for (auto&& trans:transformList) trans->keyTimes(times);
+      if(times.empty()) return;
+      times.push_back(0);
+      times.push_back(1);
+      std::sort(times.begin(),times.end());
+      times.erase(std::unique(times.begin(),times.end()),times.end());
+      int steps=std::max(1,motionSteps);
+      for(size_t i=0;i+1<times.size();i++) {
+        if(times[i+1]<=0 || times[i]>=1) continue;
+        double t0=std::max(0.0,times[i]), t1=std::min(1.0,times[i+1]);
+        for(int j=0;j<steps;j++) addMotionKey(t0+(t1-t0)*j/steps);
+      }
+      addMotionKey(1);
+    }
+    /** Check if this object moves during the shutter interval. Only valid after prepareRender()
+     * @return True if any of the transformations have keyframes
+     */
+    bool moving() const {return !motionKeys.empty();}
+    /** Get the samples of the motion over the shutter interval. Only valid after prepareRender()
+     * @return Motion keys sorted by time, or an empty list if the object doesn't move
+     */
+    const std::vector<MotionKey>& getMotionKeys() const {return motionKeys;}
+    /** Get the world-from-body transformation at a time within the shutter interval
+     * @param time Time from 0 at shutter open to 1 at shutter close
+     * @return Transformation matrix, the same as Mwb if the object doesn't move
+     */
+    Eigen::Matrix4d MwbAt(double time) const {
+      if(!moving()) return Mwb;
+      Eigen::Vector3d T;
+      Eigen::Matrix3d R, S;
+      blendMotion(time,T,R,S);
+      Eigen::Matrix4d result=Eigen::Matrix4d::Identity();
+      result.topLeftCorner<3,3>()=R*S;
+      result.topRightCorner<3,1>()=T;
+      return result;
+    }
+    /** Get the body-from-world transformation at a time within the shutter interval.
+     * This inverts the blended parts separately, which is cheaper than inverting MwbAt().
+     * @param time Time from 0 at shutter open to 1 at shutter close
+     * @return Transformation matrix, the same as Mbw if the object doesn't move
+     */
+    Eigen::Matrix4d MbwAt(double time) const {
+      if(!moving()) return Mbw;
+      Eigen::Vector3d T;
+      Eigen::Matrix3d R, S;
+      blendMotion(time,T,R,S);
+      Eigen::Matrix4d result=Eigen::Matrix4d::Identity();
+      Eigen::Matrix3d inv=S.inverse()*R.transpose();
+      result.topLeftCorner<3,3>()=inv;
+      result.topRightCorner<3,1>()=-inv*T;
+      return result;
     }
 
+    /** Set the memory resource to allocate new transformations from.
+     *
+     * @param Larena Memory resource, or nullptr to use the heap. Anything allocated from
+     *   the resource must not outlive it.
+     */
+    virtual void setArena(std::pmr::memory_resource* Larena) {arena=Larena;}
+    /** Get the memory resource that new transformations are allocated from
+     * @return Memory resource, or nullptr if using the heap
+     */
+    std::pmr::memory_resource* getArena() const {return arena;}
+    /** Create a new object from the same memory resource as this object. If the new object
+     * is itself Transformable, it inherits the resource, so that anything it creates later
+     * comes from the same place.
+     *
+     * @tparam T Type of object to create
+     * @param args Arguments forwarded to the constructor
+     * @return Pointer to the new object
+     */
+    template<typename T, typename ... Args>
+    std::shared_ptr<T> make(Args&&... args) const {
+      auto result=allocate<T>(arena,std::forward<Args>(args)...);
+      if constexpr (std::is_base_of_v<Transformable,T>) result->setArena(arena);
+      return result;
+    }
     /** Add a transformation to the list
      *
      * @param[in] transform A transformation
@@ -99,7 +285,7 @@ namespace kwantrace {
      *   must be called in order to make the changes active.
      */
     std::shared_ptr<Translation> translate(Position point) {
-      auto result=std::make_shared<Translation>(point);
+      auto result=allocate<Translation>(arena,point);
       add(result);
       return result;
     }
@@ -122,7 +308,7 @@ namespace kwantrace {
      * @return pointer to the transformation
      */
     std::shared_ptr<RotateX> rotateX(double angle) {
-      auto result=std::make_shared<RotateX>(deg2rad(angle));
+      auto result=allocate<RotateX>(arena,deg2rad(angle));
       add(result);
       return result;
     }
@@ -133,7 +319,7 @@ namespace kwantrace {
      * @return pointer to the transformation
      */
     std::shared_ptr<RotateY> rotateY(double angle) {
-      auto result=std::make_shared<RotateY>(deg2rad(angle));
+      auto result=allocate<RotateY>(arena,deg2rad(angle));
       add(result);
       return result;
     }
@@ -144,7 +330,7 @@ namespace kwantrace {
      * @return pointer to the transformation
      */
     std::shared_ptr<RotateZ> rotateZ(double angle) {
-      std::shared_ptr<RotateZ> result=std::make_shared<RotateZ>(deg2rad(angle));
+      std::shared_ptr<RotateZ> result=allocate<RotateZ>(arena,deg2rad(angle));
       add(result);
       return result;
     }
@@ -158,7 +344,7 @@ namespace kwantrace {
      * @return pointer to the transformation
      */
     std::shared_ptr<Scaling> scale(double x, double y, double z) {
-      auto result=std::make_shared<Scaling>(x,y,z);
+      auto result=allocate<Scaling>(arena,x,y,z);
       add(result);
       return result;
     }
@@ -169,7 +355,7 @@ namespace kwantrace {
      * @return pointer to the transformation
      */
     std::shared_ptr<UniformScaling> scale(double s) {
-      auto result=std::make_shared<UniformScaling>(s);
+      auto result=allocate<UniformScaling>(arena,s);
       add(result);
       return result;
     }
@@ -180,7 +366,7 @@ namespace kwantrace {
      * @return pointer to the transformation
      */
     std::shared_ptr<Scaling> scale(Eigen::Vector3d amount) {
-      auto result=std::make_shared<Scaling>(amount);
+      auto result=allocate<Scaling>(arena,amount);
       add(result);
       return result;
     }
@@ -200,7 +386,7 @@ namespace kwantrace {
       const Direction& t_b=Direction( 0, 1, 0),
       const Direction& t_r=Direction( 0, 0,-1)
     ) {
-      auto result=std::make_shared<LocationLookat>(location,look_at,p_b,t_b,t_r);
+      auto result=allocate<LocationLookat>(arena,location,look_at,p_b,t_b,t_r);
       add(result);
       return result;
     }
@@ -19,6 +19,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #ifndef KWANTRACE_TRANSFORMATION_H
 #define KWANTRACE_TRANSFORMATION_H
 
+#include <algorithm>
 #include <iostream>
 
 namespace kwantrace {
@@ -44,6 +45,17 @@ namespace kwantrace {
      * @return Matrix representing the transformation
      */
     virtual Eigen::Matrix4d matrix() const = 0;
+    /** Construct the matrix for this transformation at a given time within the shutter interval,
+     * for motion blur. The default is a transformation which doesn't move.
+     * @param time Time from 0 at shutter open to 1 at shutter close
+     * @return Matrix representing the transformation at that time
+     */
+    virtual Eigen::Matrix4d matrix(double time) const {return matrix();}
+    /** Add the times of the keyframes of this transformation to a list. A transformation
+     * which doesn't move has none.
+     * @param[in,out] times List to add to
+     */
+    virtual void keyTimes(std::vector<double>& times) const {}
     /** Prepare the transformation for render. At this point, the
      *  properties of the transformation are set for the frame, but
      *  haven't been used yet. This is the time to set up caches, etc.
@@ -53,10 +65,54 @@ namespace kwantrace {
     virtual ~Transformation()=default; ///<Allow there to be subclasses
   };
 
-  /** Transformation with a scalar parameter */
+  /** Linearly interpolate between keyframes
+   * @tparam T Type of keyframe value
+   * @param keys Keyframes, sorted by time. Must not be empty.
+   * @param time Time to interpolate at. Before the first key or after the last, the value is held.
+   * @return Interpolated value
+   */
+  template<typename T>
+  T interpolateKeys(const std::vector<std::pair<double,T>>& keys, double time) {
+    if(time<=keys.front().first) return keys.front().second;
+    if(time>=keys.back().first) return keys.back().second;
+    auto next=std::upper_bound(keys.begin(),keys.end(),time,[](double t, const std::pair<double,T>& key){return t<key.first;});
+    auto prev=next-1;
+    double a=(time-prev->first)/(next->first-prev->first);
+    return T(prev->second+(next->second-prev->second)*a);
+  }
+
+  /** Insert a keyframe, replacing any already at the same time
+   * @tparam T Type of keyframe value
+   * @param keys Keyframes, sorted by time
+   * @param time Time of new keyframe
+   * @param value Value at new keyframe
+   */
+  template<typename T>
+  void insertKey(std::vector<std::pair<double,T>>& keys, double time, const T& value) {
+    auto it=std::lower_bound(keys.begin(),keys.end(),time,[](const std::pair<double,T>& key, double t){return key.first<t;});
+    if(it!=keys.end() && it->first==time) {
+      it->second=value;
+    } else {
+      keys.insert(it,{time,value});
+    }
+  }
+
+  /** Transformation with a scalar parameter.
+   *
+   * For motion blur, the parameter can instead be given keyframes with key(). Times run from 0 at shutter open
+   * to 1 at shutter close, and the parameter is linearly interpolated between them. Once a transformation has
+   * keyframes, they take the place of the plain parameter.
+   */
   class ScalarTransformation:public Transformation {
   private:
     double _amount; ///< Parameter value.
+    std::vector<std::pair<double,double>> keys; ///< Keyframes of the parameter, sorted by time, or empty if it doesn't move
+  protected:
+    /** Construct the matrix for a given parameter value
+     * @param amount Parameter value
+     * @return Matrix representing the transformation
+     */
+    virtual Eigen::Matrix4d calc(double amount) const=0;
   public:
     /** Construct a new transformation with a scalar parameter.
      *
@@ -65,12 +121,33 @@ namespace kwantrace {
     ScalarTransformation(double Lamount=0):_amount(Lamount) {};
     double get() const {return _amount;}                  ///< Get the parameter. @return Parameter value
     void set(double Lamount) {_amount=Lamount;}           ///< Set the parameter. @param[in] Lamount new parameter value
+    /** Get the parameter at a time within the shutter interval
+     * @param time Time from 0 at shutter open to 1 at shutter close
+     * @return Parameter value interpolated from the keyframes, or the plain parameter if there are none */
+    double get(double time) const {return keys.empty()?_amount:interpolateKeys(keys,time);}
+    /** Set a keyframe of the parameter
+     * @param time Time from 0 at shutter open to 1 at shutter close
+     * @param Lamount Parameter value at that time */
+    void key(double time, double Lamount) {insertKey(keys,time,Lamount);}
+    void clearKeys() {keys.clear();} ///< Remove all keyframes, so the plain parameter is used again
+    virtual Eigen::Matrix4d matrix() const override {return calc(get(0));}
+    virtual Eigen::Matrix4d matrix(double time) const override {return calc(get(time));}
+    virtual void keyTimes(std::vector<double>& times) const override {
+      if(keys.size()>1) for(auto&& key:keys) times.push_back(key.first);
+    }
   };
 
   /** Transformation with a vector parameter. */
   class VectorTransformation:public Transformation {
   private:
     Eigen::Vector3d _amount; ///< Vector parameter for transform
+    std::vector<std::pair<double,Eigen::Vector3d>> keys; ///< Keyframes of the parameter, sorted by time, or empty if it doesn't move
+  protected:
+    /** Construct the matrix for a given parameter value
+     * @param amount Parameter value
+     * @return Matrix representing the transformation
+     */
+    virtual Eigen::Matrix4d calc(const Eigen::Vector3d& amount) const=0;
   public:
     /**
      * Initialize a vector transformation.
@@ -92,19 +169,34 @@ namespace kwantrace {
       void setZ(double Lz) {_amount.z()=Lz;}  ///< Set the Z component of the parameter @param[in] Lz value of Z component
     Eigen::Vector3d getV() const {return _amount;} ///< Get a copy of the parameter @return copy of the parameter
                void setV(const Eigen::Vector3d Lamount) {_amount=Lamount;} ///< Set the parameter @param[in] Lamount New value of the parameter
+    /** Get the parameter at a time within the shutter interval
+     * @param time Time from 0 at shutter open to 1 at shutter close
+     * @return Parameter value interpolated from the keyframes, or the plain parameter if there are none */
+    Eigen::Vector3d getV(double time) const {return keys.empty()?_amount:interpolateKeys(keys,time);}
+    /** Set a keyframe of the parameter. See ScalarTransformation::key()
+     * @param time Time from 0 at shutter open to 1 at shutter close
+     * @param Lamount Parameter value at that time */
+    void key(double time, const Eigen::Vector3d& Lamount) {insertKey(keys,time,Lamount);}
+    void clearKeys() {keys.clear();} ///< Remove all keyframes, so the plain parameter is used again
+    virtual Eigen::Matrix4d matrix() const override {return calc(getV(0));}
+    virtual Eigen::Matrix4d matrix(double time) const override {return calc(getV(time));}
+    virtual void keyTimes(std::vector<double>& times) const override {
+      if(keys.size()>1) for(auto&& key:keys) times.push_back(key.first);
+    }
   };
 
   /** Represent a translation. The vector represents the coordinates of origin of the body frame, in the world frame. */
   class Translation:public VectorTransformation {
-  public:
-    using VectorTransformation::VectorTransformation;
-    virtual Eigen::Matrix4d matrix() const override {
+  protected:
+    virtual Eigen::Matrix4d calc(const Eigen::Vector3d& amount) const override {
       Eigen::Matrix4d result=Eigen::Matrix4d::Identity();
-      result(0,3)=getX();
-      result(1,3)=getY();
-      result(2,3)=getZ();
+      result(0,3)=amount.x();
+      result(1,3)=amount.y();
+      result(2,3)=amount.z();
       return result;
     }
+  public:
+    using VectorTransformation::VectorTransformation;
   };
 
   /** Represent a non-uniform scaling, IE one that can be different along the three body axes.
@@ -116,30 +208,32 @@ namespace kwantrace {
    *
    */
   class Scaling:public VectorTransformation {
-  public:
-    using VectorTransformation::VectorTransformation;
-    virtual Eigen::Matrix4d matrix() const override {
+  protected:
+    virtual Eigen::Matrix4d calc(const Eigen::Vector3d& amount) const override {
       Eigen::Matrix4d result=Eigen::Matrix4d::Identity();
-      result(0,0)=getX()==0?1:getX();
-      result(1,1)=getY()==0?1:getY();
-      result(2,2)=getZ()==0?1:getZ();
+      result(0,0)=amount.x()==0?1:amount.x();
+      result(1,1)=amount.y()==0?1:amount.y();
+      result(2,2)=amount.z()==0?1:amount.z();
       return result;
     }
+  public:
+    using VectorTransformation::VectorTransformation;
   };
 
   /** Represent a uniform scaling in all directions. You could use
    * a vector Scaling, but then you would have to change all three
    * components of the scaling vector to keep the scaling uniform. */
   class UniformScaling:public ScalarTransformation {
-  public:
-    using ScalarTransformation::ScalarTransformation;
-    virtual Eigen::Matrix4d matrix() const override {
+  protected:
+    virtual Eigen::Matrix4d calc(double amount) const override {
       Eigen::Matrix4d result=Eigen::Matrix4d::Identity();
-      result(0,0)=get()==0?1:get();
-      result(1,1)=get()==0?1:get();
-      result(2,2)=get()==0?1:get();
+      result(0,0)=amount==0?1:amount;
+      result(1,1)=amount==0?1:amount;
+      result(2,2)=amount==0?1:amount;
       return result;
     }
+  public:
+    using ScalarTransformation::ScalarTransformation;
   };
   /** Calculate the rotation matrix around a body axis
    *
@@ -170,6 +264,10 @@ namespace kwantrace {
    */
   template<int axis>
   class RotateScalar:public ScalarTransformation {
+  protected:
+    virtual Eigen::Matrix4d calc(double amount) const override {
+      return rot(axis,amount);
+    }
   public:
     using ScalarTransformation::ScalarTransformation;
     /** Construct a rotation, optionally specifying the angle in degrees
@@ -178,11 +276,9 @@ namespace kwantrace {
      * @param isDegrees If true, Lamount is specified in degrees. Otherwise it is specified in radians.
      */
     RotateScalar(double Lamount, bool isDegrees):ScalarTransformation(isDegrees?deg2rad(Lamount):Lamount) {};
-    virtual Eigen::Matrix4d matrix() const override {
-      return rot(axis,get());
-    }
     double getd() const {return rad2deg(get());}        ///< Get the parameter, assuming it is an angle. @return Parameter angle in degrees
     void setd(double Lamount) {set(deg2rad(Lamount));} ///< Set the parameter, assuming it is an angle. @param[in] Lamount new parameter angle in degrees
+    void keyd(double time, double Lamount) {key(time,deg2rad(Lamount));} ///< Set a keyframe, assuming the parameter is an angle. @param[in] time Time from 0 at shutter open to 1 at shutter close @param[in] Lamount parameter angle in degrees at that time
   };
   typedef RotateScalar<0> RotateX;  ///< Specialized RotateScalar for X axis
   typedef RotateScalar<1> RotateY;  ///< Specialized RotateScalar for Y axis
@@ -200,6 +296,13 @@ namespace kwantrace {
    * This emulates a POV-Ray rotate with a vector parameter (except for being right-handed rotations).
    */
   class RotateVector:public VectorTransformation {
+  protected:
+    virtual Eigen::Matrix4d calc(const Eigen::Vector3d& amount) const override {
+      Eigen::Matrix4d result=rot(0,amount.x());
+      result=rot(1,amount.y())*result;
+      result=rot(2,amount.z())*result;
+      return result;
+    }
   public:
     using VectorTransformation::VectorTransformation;
     /** Construct a RotateVector, optionally specifying the angles in degrees */
@@ -222,12 +325,6 @@ namespace kwantrace {
       isDegrees?deg2rad(Lamount.y()):Lamount.y(),
       isDegrees?deg2rad(Lamount.z()):Lamount.z()) {
     };
-    virtual Eigen::Matrix4d matrix() const override {
-      Eigen::Matrix4d result=rot(0,getX());
-      result=rot(1,getY())*result;
-      result=rot(2,getZ())*result;
-      return result;
-    }
     double getXd() const {return rad2deg(getX());} ///< Get the X component of the rotation in degrees @return value of X component
     void setXd(double Lx) {setX(deg2rad(Lx));}  ///< Set the X component of the rotation in degrees @param[in] Lx value of X component
     double getYd() const {return rad2deg(getY());} ///< Get the Y component of the rotation in degrees @return value of Y component
@@ -238,6 +335,50 @@ namespace kwantrace {
     void setVd(const Eigen::Vector3d Lamount) {setXd(Lamount.x());setYd(Lamount.y());setZd(Lamount.z());} ///< Set the parameter @param[in] Lamount New value of the parameter in degrees
   };
 
+  /** Transformation given directly as a matrix. A scene file stores the combined transformation of each
+   * object this way, rather than the list of transformations it was built from.
+   *
+   * For motion blur, the matrix can instead be given keyframes with key(). Between keyframes, the translation
+   * and scaling are interpolated linearly and the rotation along the shortest arc, the same way Transformable
+   * blends its motion keys, so the motion keys of an object are reproduced exactly.
+   */
+  class MatrixTransformation:public Transformation {
+  private:
+    Eigen::Matrix4d M; ///< Matrix
+    std::vector<std::pair<double,Eigen::Matrix4d>> keys; ///< Keyframes of the matrix, sorted by time, or empty if it doesn't move
+  public:
+    /** Construct a transformation from a matrix
+     * @param LM Matrix. The bottom row should be 0,0,0,1.
+     */
+    MatrixTransformation(const Eigen::Matrix4d& LM=Eigen::Matrix4d::Identity()):M(LM) {}
+    /** Set a keyframe of the matrix. See ScalarTransformation::key()
+     * @param time Time from 0 at shutter open to 1 at shutter close
+     * @param LM Matrix at that time */
+    void key(double time, const Eigen::Matrix4d& LM) {insertKey(keys,time,LM);}
+    virtual Eigen::Matrix4d matrix() const override {return matrix(0);}
+    virtual Eigen::Matrix4d matrix(double time) const override {
+      if(keys.empty()) return M;
+      if(time<=keys.front().first) return keys.front().second;
+      if(time>=keys.back().first) return keys.back().second;
+      auto next=std::upper_bound(keys.begin(),keys.end(),time,[](double t, const std::pair<double,Eigen::Matrix4d>& key){return t<key.first;});
+      auto prev=next-1;
+      double a=(time-prev->first)/(next->first-prev->first);
+      Eigen::Affine3d M0(prev->second), M1(next->second);
+      Eigen::Matrix3d R0, S0, R1, S1;
+      M0.computeRotationScaling(&R0,&S0);
+      M1.computeRotationScaling(&R1,&S1);
+      Eigen::Quaterniond q0(R0), q1(R1);
+      if(q0.dot(q1)<0) q1.coeffs()=-q1.coeffs();
+      Eigen::Matrix4d result=Eigen::Matrix4d::Identity();
+      result.topLeftCorner<3,3>()=q0.slerp(a,q1).toRotationMatrix()*(S0+(S1-S0)*a);
+      result.topRightCorner<3,1>()=M0.translation()+(M1.translation()-M0.translation())*a;
+      return result;
+    }
+    virtual void keyTimes(std::vector<double>& times) const override {
+      if(keys.size()>1) for(auto&& key:keys) times.push_back(key.first);
+    }
+  };
+
   /** Represent the Point-Toward transformation. This rotates an object such that
    * p_b in the body frame points at p_r in the world frame, and t_b in the body frame is towards
    * t_r in the world frame.
@@ -535,8 +676,10 @@ namespace kwantrace {
       const Direction& t_b= Direction(0, 1, 0),
       const Direction& t_r = Direction(0, 0, -1)
     ) {
-      Eigen::Matrix4d result= PointToward::calc(p_b, Direction(look_at - location), t_b, t_r); //Use point-toward to point at the target
-      result=Translation::calc(location)*result; //Translate back to location
+      Eigen::Matrix4d result= PointToward::calcPointToward(p_b, Direction(look_at - location), t_b, t_r); //Use point-toward to point at the target
+      Eigen::Matrix4d T=Eigen::Matrix4d::Identity();
+      T.block<3,1>(0,3)=location;
+      result=T*result; //Translate back to location
       return result;
     }
     Eigen::Matrix4d matrix() const override {
@@ -0,0 +1,278 @@
+/* KwanTrace - C++ Ray Tracing Library
+Copyright (C) 2021 by kwan3217
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef KWANTRACE_VIDEOOUTPUT_H
+#define KWANTRACE_VIDEOOUTPUT_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+#include <pthread.h>
+#include <signal.h>
+
+namespace kwantrace {
+  /** Writes an animation as one uncompressed stream, to a file, a FIFO, standard output, or straight into
+   * an encoder started as a child process, so that no frame ever lands on disk as a separate image.
+   * Frames are converted and written on the background thread of an ImageWriter, in order,
+   * while the next frame renders.
+   *
+   *     VideoStream video("|ffmpeg -y -i - -c:v libx264 -crf 18 anim.mp4",width,height,30);
+   *     for(int i=0;i<frames;i++) {
+   *       ...move things...
+   *       video.write(scene.render(width,height));
+   *     }
+   *     video.flush();
+   *
+   * YUV4MPEG2 streams use BT.709 coefficients with limited (16-235) range, which is what encoders
+   * assume for HD video. The 4:2:0 chroma is taken from the average of each 2x2 block of pixels, centered
+   * between them as the C420jpeg tag says. Each row is converted with plain loops over float rows
+   * which the compiler vectorizes when optimizing.
+   *
+   * The target is opened for writing in the constructor, and a FIFO blocks there until the
+   * reader opens the other end. If the reader goes away early, as an encoder does when it fails, the next
+   * write is reported as an exception from write() or flush() rather than killing the renderer with SIGPIPE.
+   */
+  class VideoStream {
+  public:
+    /** Layout of the stream */
+    enum class Format {
+      Y4M420, ///< YUV4MPEG2 with 4:2:0 chroma, which every encoder reads and most video uses
+      Y4M444, ///< YUV4MPEG2 with full resolution chroma
+      RawRGB  ///< Headerless 8-bit RGB frames, for `ffmpeg -f rawvideo -pix_fmt rgb24 -s WxH -r fps -i -`
+    };
+  private:
+    /** Blocks SIGPIPE on the calling thread while in scope, so that writing to a pipe or FIFO with no reader
+     * fails with EPIPE instead of killing the process, the way MSG_NOSIGNAL does for RenderServer. A SIGPIPE
+     * raised meanwhile is discarded before the old signal mask comes back.
+     */
+    class SigpipeGuard {
+    private:
+      sigset_t pipeSet; ///< Just SIGPIPE
+      sigset_t oldSet;  ///< Signal mask of the thread before
+    public:
+      SigpipeGuard() {
+        sigemptyset(&pipeSet);
+        sigaddset(&pipeSet,SIGPIPE);
+        pthread_sigmask(SIG_BLOCK,&pipeSet,&oldSet);
+      }
+      ~SigpipeGuard() {
+        if(sigismember(&oldSet,SIGPIPE)) return;
+        const timespec now{0,0};
+        while(sigtimedwait(&pipeSet,nullptr,&now)==SIGPIPE) {}
+        pthread_sigmask(SIG_SETMASK,&oldSet,nullptr);
+      }
+      SigpipeGuard(const SigpipeGuard&)=delete;
+      SigpipeGuard& operator=(const SigpipeGuard&)=delete;
+    };
+    /** Closes whichever kind of stream was opened */
+    struct Closer {
+      bool pipe; ///< True if the stream came from popen()
+      void operator()(std::FILE* f) const {
+        SigpipeGuard guard;
+        if(pipe) pclose(f); else if(f!=stdout) std::fclose(f); else std::fflush(f);
+      }
+    };
+    std::string target;  ///< Where the stream goes, for error messages
+    int width;           ///< Width of each frame in pixels
+    int height;          ///< Height of each frame in pixels
+    Format format;       ///< Layout of the stream
+    std::unique_ptr<std::FILE,Closer> file; ///< Stream being written
+    std::vector<uint8_t> frameBytes;        ///< Converted frame, only touched by the writer thread
+    ImageWriter writer;  ///< Background thread which converts and writes frames in order
+    /** Write bytes to the stream
+     * @param data First byte
+     * @param size Number of bytes
+     */
+    void put(const void* data, size_t size) {
+      SigpipeGuard guard;
+      if(std::fwrite(data,1,size,file.get())!=size) throw std::runtime_error("Can't write video stream "+target);
+    }
+    /** Convert rows of a frame to BT.709 limited range YCbCr. The chroma of each output sample is the
+     * average of a block of blockW x blockH pixels, which is the same as converting each pixel and averaging,
+     * since the conversion is linear.
+     * @tparam pixdepth Number of channels in the frame
+     * @tparam pixtype Type of one channel
+     * @param pixbuf Frame
+     * @param blockW Width of the block each chroma sample covers, 1 or 2
+     * @param blockH Height of the block each chroma sample covers, 1 or 2
+     * @param out Planes of Y, then Cb, then Cr
+     */
+    template<int pixdepth, typename pixtype>
+    void toYUV(const PixelBuffer<pixdepth,pixtype>& pixbuf, int blockW, int blockH, uint8_t* out) const {
+      static_assert(pixdepth==1 || pixdepth>=3,"Video frames must be gray or have at least red, green, and blue channels");
+      const float unit=std::is_floating_point_v<pixtype>?1.0f:1.0f/float(std::numeric_limits<pixtype>::max());
+      const int cw=(width+blockW-1)/blockW, ch=(height+blockH-1)/blockH;
+      uint8_t* planeY=out;
+      uint8_t* planeU=planeY+size_t(width)*height;
+      uint8_t* planeV=planeU+size_t(cw)*ch;
+      std::vector<float> r(width), g(width), b(width), sr(cw), sg(cw), sb(cw), q(std::max(width,cw));
+      const pixtype* pixels=pixbuf.get();
+      //Clamp after the arithmetic with a quiet compare, so that the loop vectorizes, as in ToneMap::apply()
+      auto quantize=[&](int n, uint8_t* dst) KWANTRACE_KERNEL {
+        for(int i=0;i<n;i++) {
+          float x=q[i]+0.5f;
+          x=std::isgreater(x,0.0f)?x:0.0f;
+          dst[i]=uint8_t(std::isless(x,255.0f)?x:255.0f);
+        }
+      };
+      CpuDispatch::run([&]() KWANTRACE_KERNEL {
+        for(int crow=0;crow<ch;crow++) {
+          std::fill(sr.begin(),sr.end(),0.0f);
+          std::fill(sg.begin(),sg.end(),0.0f);
+          std::fill(sb.begin(),sb.end(),0.0f);
+          for(int dy=0;dy<blockH;dy++) {
+            //Odd heights repeat the last row into the last block
+            int row=std::min(crow*blockH+dy,height-1);
+            const pixtype* src=pixels+size_t(row)*width*pixdepth;
+            for(int col=0;col<width;col++) {
+              r[col]=float(src[col*pixdepth])*unit;
+              g[col]=float(src[col*pixdepth+(pixdepth==1?0:1)])*unit;
+              b[col]=float(src[col*pixdepth+(pixdepth==1?0:2)])*unit;
+            }
+            if(row==crow*blockH+dy) {
+              for(int col=0;col<width;col++) q[col]=16.0f+219.0f*(0.2126f*r[col]+0.7152f*g[col]+0.0722f*b[col]);
+              quantize(width,planeY+size_t(row)*width);
+            }
+            if(blockW==1) {
+              for(int c=0;c<cw;c++) {
+                sr[c]+=r[c];
+                sg[c]+=g[c];
+                sb[c]+=b[c];
+              }
+            } else {
+              int pairs=width/2;
+              for(int c=0;c<pairs;c++) {
+                sr[c]+=r[2*c]+r[2*c+1];
+                sg[c]+=g[2*c]+g[2*c+1];
+                sb[c]+=b[2*c]+b[2*c+1];
+              }
+              //Odd widths repeat the last column into the last block
+              if(pairs<cw) {
+                sr[pairs]+=2*r[width-1];
+                sg[pairs]+=2*g[width-1];
+                sb[pairs]+=2*b[width-1];
+              }
+            }
+          }
+          const float k=224.0f/float(blockW*blockH);
+          for(int c=0;c<cw;c++) q[c]=128.0f+k*(-0.1146f*sr[c]-0.3854f*sg[c]+0.5f*sb[c]);
+          quantize(cw,planeU+size_t(crow)*cw);
+          for(int c=0;c<cw;c++) q[c]=128.0f+k*(0.5f*sr[c]-0.4542f*sg[c]-0.0458f*sb[c]);
+          quantize(cw,planeV+size_t(crow)*cw);
+        }
+      });
+    }
+    /** Convert a frame to 8-bit RGB
+     * @tparam pixdepth Number of channels in the frame
+     * @tparam pixtype Type of one channel
+     * @param pixbuf Frame
+     * @param out Pixels, three bytes each
+     */
+    template<int pixdepth, typename pixtype>
+    void toRGB(const PixelBuffer<pixdepth,pixtype>& pixbuf, uint8_t* out) const {
+      const pixtype* pixels=pixbuf.get();
+      size_t n=size_t(width)*height;
+      for(size_t p=0;p<n;p++) for(int c=0;c<3;c++) {
+        pixtype v=pixels[p*pixdepth+(pixdepth==1?0:c)];
+        if constexpr (std::is_same_v<pixtype,uint8_t>) {
+          out[p*3+c]=v;
+        } else if constexpr (std::is_floating_point_v<pixtype>) {
+          out[p*3+c]=uint8_t(std::clamp(float(v),0.0f,1.0f)*255.0f+0.5f);
+        } else {
+          out[p*3+c]=uint8_t(uint32_t(v)*255/std::numeric_limits<pixtype>::max());
+        }
+      }
+    }
+  public:
+    /** Open a stream and write its header
+     * @param Ltarget Where to write. `-` is standard output, a name starting with `|` is a command to start
+     *   with its standard input connected to the stream, and anything else is a file or FIFO to open.
+     * @param Lwidth Width of each frame in pixels
+     * @param Lheight Height of each frame in pixels
+     * @param fps Frame rate, written into the header of YUV4MPEG2 streams
+     * @param Lformat Layout of the stream
+     * @param capacity Most frames to hold waiting to be written, not counting the one being written
+     */
+    VideoStream(const std::string& Ltarget, int Lwidth, int Lheight, int fps=30, Format Lformat=Format::Y4M420, size_t capacity=2):
+      target(Ltarget),width(Lwidth),height(Lheight),format(Lformat),writer(capacity) {
+      if(target=="-") {
+        file=std::unique_ptr<std::FILE,Closer>(stdout,Closer{false});
+      } else if(!target.empty() && target[0]=='|') {
+        file=std::unique_ptr<std::FILE,Closer>(popen(target.c_str()+1,"w"),Closer{true});
+      } else {
+        file=std::unique_ptr<std::FILE,Closer>(std::fopen(target.c_str(),"wb"),Closer{false});
+      }
+      if(!file) throw std::runtime_error("Can't open video stream "+target);
+      if(format!=Format::RawRGB) {
+        std::string header="YUV4MPEG2 W"+std::to_string(width)+" H"+std::to_string(height)+" F"+std::to_string(fps)+
+                           ":1 Ip A1:1 "+(format==Format::Y4M420?"C420jpeg":"C444")+" XCOLORRANGE=LIMITED\n";
+        put(header.data(),header.size());
+      }
+    }
+    VideoStream(const VideoStream&)=delete;            ///< Not copyable, since it owns a stream and a thread
+    VideoStream& operator=(const VideoStream&)=delete; ///< Not copyable, since it owns a stream and a thread
+    /** Write all queued frames, then close the stream. Failures are ignored here; call flush() first to see them. */
+    ~VideoStream() {
+      try {
+        writer.flush();
+      } catch(...) {}
+    }
+    /** Queue a frame to be converted and written. The buffer is moved into the queue, so there is no copy.
+     * @param pixbuf Frame to write, the same size as the stream
+     */
+    template<int pixdepth, typename pixtype>
+    void write(PixelBuffer<pixdepth,pixtype>&& pixbuf) {
+      if(pixbuf.width()!=width || pixbuf.height()!=height) {
+        throw std::runtime_error("Frame is "+std::to_string(pixbuf.width())+"x"+std::to_string(pixbuf.height())+
+                                 " but video stream "+target+" is "+std::to_string(width)+"x"+std::to_string(height));
+      }
+      auto frame=std::make_shared<PixelBuffer<pixdepth,pixtype>>(std::move(pixbuf));
+      writer.post([this,frame] {
+        TraceScope span("write video frame","io");
+        size_t pixels=size_t(width)*height;
+        if(format==Format::RawRGB) {
+          frameBytes.resize(pixels*3);
+          toRGB(*frame,frameBytes.data());
+        } else {
+          static const char tag[]="FRAME\n";
+          put(tag,sizeof(tag)-1);
+          int block=format==Format::Y4M420?2:1;
+          frameBytes.resize(pixels+2*size_t((width+block-1)/block)*((height+block-1)/block));
+          toYUV(*frame,block,block,frameBytes.data());
+        }
+        put(frameBytes.data(),frameBytes.size());
+      });
+    }
+    /** Wait until every queued frame has been written and pushed out of the stream buffer */
+    void flush() {
+      writer.post([this] {
+        SigpipeGuard guard;
+        if(std::fflush(file.get())!=0) throw std::runtime_error("Can't write video stream "+target);
+      });
+      writer.flush();
+    }
+  };
+}
+
+#endif //KWANTRACE_VIDEOOUTPUT_H
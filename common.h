@@ -32,6 +32,23 @@ namespace kwantrace {
    */
   template<typename T>
   using Observer= const T*;
+  /** Allocate a new shared object, optionally from a memory resource. If an arena is given, the
+   * object and its reference-count control block are placed next to each other in the arena, and
+   * the memory is only given back when the arena itself is released. Otherwise this is just std::make_shared.
+   *
+   * @tparam T Type of object to construct
+   * @param arena Memory resource to allocate from, or nullptr to allocate from the heap
+   * @param args Arguments forwarded to the constructor of T
+   * @return Shared pointer to the new object
+   */
+  template<typename T, typename ... Args>
+  std::shared_ptr<T> allocate(std::pmr::memory_resource* arena, Args&&... args) {
+    if(arena) {
+      return std::allocate_shared<T>(std::pmr::polymorphic_allocator<T>(arena),std::forward<Args>(args)...);
+    } else {
+      return std::make_shared<T>(std::forward<Args>(args)...);
+    }
+  }
   const double pi=3.1415926535897932; ///< Circle constant
 
   inline double deg2rad(double deg) { return deg * pi / 180.0; } ///<Convert degrees to radians @param deg measure in degrees @return same measure in radians
@@ -203,5 +220,36 @@ namespace kwantrace {
     return deextend(M * extend(v,N));
   }
 
+  /** 64-bit FNV-1a hash, for fingerprinting a scene, such as so that a checkpoint from a different scene isn't resumed,
+   * or a structure built for a different scene isn't loaded from a StructureCache */
+  class Fingerprint {
+  private:
+    uint64_t h=14695981039346656037ull; ///< Hash so far
+  public:
+    /** Add bytes to the hash
+     * @param data First byte
+     * @param size Number of bytes
+     */
+    void add(const void* data, size_t size) {
+      const uint8_t* p=static_cast<const uint8_t*>(data);
+      for(size_t i=0;i<size;i++) {
+        h^=p[i];
+        h*=1099511628211ull;
+      }
+    }
+    /** Add a value to the hash
+     * @param v Number, or Eigen vector such as a Position or color, whose components are added as doubles
+     */
+    template<typename T>
+    void add(const T& v) {
+      if constexpr (std::is_arithmetic_v<T>) {
+        add(&v,sizeof(v));
+      } else {
+        for(Eigen::Index i=0;i<v.size();i++) add(double(v[i]));
+      }
+    }
+    uint64_t value() const {return h;} ///< Get the hash @return hash of everything added so far
+  };
+
 }
 #endif //KWANTRACE_COMMON_H
@@ -9,13 +9,31 @@
 
 //KwanTrace library, ordered from lower-level to higher-level.
 #include "common.h"
+#include "CpuDispatch.h"
+#include "Timeline.h"
+#include "SceneFile.h"
+#include "StructureCache.h"
 #include "Transformation.h"
 #include "Ray.h"
 #include "Renderable.h"
 #include "Composite.h"
+#include "ImageMap.h"
+#include "Pattern.h"
 #include "Light.h"
+#include "AreaLight.h"
+#include "LightTree.h"
 #include "Shader.h"
+#include "Radiosity.h"
 #include "Camera.h"
+#include "PathTracer.h"
+#include "Photon.h"
+#include "Denoiser.h"
+#include "ImageOutput.h"
+#include "FrameBuffer.h"
+#include "Aov.h"
+#include "VideoOutput.h"
+#include "Checkpoint.h"
 #include "Scene.h"
+#include "RenderServer.h"
 
 #endif //KWANTRACE_KWANTRACE_H
@@ -16,37 +16,53 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
 
 */
-#include <fstream>
 #include "kwantrace.h"
 #include "Composite.h"
 
-int main() {
-  kwantrace::PointToward::exercisePointToward();
+/** Render an animation. With no arguments, each frame is written to Frames/ as a PNG. With an argument,
+ * the frames are streamed as YUV4MPEG2 to that target instead, as in VideoStream, for instance
+ *
+ *     kwantrace - | ffmpeg -i - -c:v libx264 anim.mp4
+ *
+ * With `--serve SOCKET`, the scene is kept prepared and rendered on request instead, as in RenderServer,
+ * with the angle of the groups in degrees as parameter `spin` and the camera as `camera`.
+ *
+ * The instruction set level of the vector kernels is picked for the host, and can be lowered by setting
+ * `KWANTRACE_ISA`, as in CpuDispatch. Setting `KWANTRACE_TRACE` to a file name records a Timeline of the
+ * render, and saves it to that file at the end.
+ */
+int main(int argc, char** argv) {
   const int width=1920;
   const int height=1080;
+  fprintf(stderr,"Using %s kernels\n",kwantrace::CpuDispatch::report().c_str());
+  const char* traceFile=std::getenv("KWANTRACE_TRACE");
+  if(traceFile) {
+    kwantrace::Timeline::enable();
+    kwantrace::Timeline::nameThread("main");
+  }
 
   kwantrace::Scene<> scene;
-  auto camera=scene.set(std::make_shared<kwantrace::PerspectiveCamera>(width,height));
-  camera->locationLookat(kwantrace::Position(-5,5,2),kwantrace::Position(5,0,2));
+  auto camera=scene.set<kwantrace::PerspectiveCamera>(width,height);
+  auto cameraLookat=camera->locationLookat(kwantrace::Position(-5,5,2),kwantrace::Position(5,0,2));
 
-  auto shader=scene.set(std::make_shared<kwantrace::POVRayShader>());
+  auto shader=scene.set<kwantrace::POVRayShader>();
 
-  auto plane=scene.add(std::make_shared<kwantrace::Plane>());
+  auto plane=scene.add<kwantrace::Plane>();
   plane->translate(0,0,-1);
-  plane->setPigment(std::make_shared<kwantrace::ConstantColor>(1, 1, 0));
+  plane->setPigment<kwantrace::ConstantColor>(1, 1, 0);
 
-  auto buildgroup=[](double r, double g, double b) {
-    auto group=std::make_shared<kwantrace::Union>();
-    auto sphere1= group->add(std::make_shared<kwantrace::Sphere>());
+  auto buildgroup=[&scene](double r, double g, double b) {
+    auto group=scene.make<kwantrace::Union>();
+    auto sphere1= group->add<kwantrace::Sphere>();
     sphere1->scale(0.5);
     sphere1->translate(0,0.5,0);
-    auto sphere2= group->add(std::make_shared<kwantrace::Sphere>());
+    auto sphere2= group->add<kwantrace::Sphere>();
     sphere2->scale(0.25);
     sphere2->translate(0,-0.25,0);
-    auto sphere3= group->add(std::make_shared<kwantrace::Sphere>());
+    auto sphere3= group->add<kwantrace::Sphere>();
     sphere3->scale(0.25);
     sphere3->translate(0,0.5,0.5);
-    group->setPigment(std::make_shared<kwantrace::ConstantColor>(r, g, b));
+    group->setPigment<kwantrace::ConstantColor>(r, g, b);
     return group;
   };
   auto groupX=scene.add(buildgroup(1,0,0));
@@ -61,24 +77,48 @@ int main() {
 
   kwantrace::ObjectColor white;
   white<<1,1,1,0,0;
-  auto light1=scene.add(std::make_shared<kwantrace::Light>(kwantrace::Position(-20,-20,20),white));
+  auto light1=scene.add<kwantrace::Light>(kwantrace::Position(-20,-20,20),white);
+
+  if(argc>2 && std::string(argv[1])=="--serve") {
+    kwantrace::RenderServer<> server(scene,argv[2]);
+    server.expose("spin",1,[&](const std::vector<double>& v) {
+      groupXRotate->setd(v[0]);
+      groupYRotate->setd(v[0]);
+      groupZRotate->setd(v[0]);
+    });
+    server.expose("camera",cameraLookat,kwantrace::SceneChange::Camera);
+    server.run();
+    return 0;
+  }
 
+  kwantrace::ImageWriter writer;
+  std::unique_ptr<kwantrace::VideoStream> video;
+  std::unique_ptr<kwantrace::RenderJournal> journal;
+  if(argc>1) {
+    video=std::make_unique<kwantrace::VideoStream>(argv[1],width,height,30);
+  } else {
+    //Frames already written by an earlier run that was killed are skipped
+    journal=std::make_unique<kwantrace::RenderJournal>("Frames/journal",scene.fingerprint(width,height),100);
+  }
   for(int i=0;i<100;i++) {
+    if(journal && journal->done(i)) continue;
+    kwantrace::TraceScope span("frame","scene","frame",i);
     groupXRotate->setd(i*3.6);
     groupYRotate->setd(i*3.6);
     groupZRotate->setd(i*3.6);
-    auto pixbuf = scene.render(width, height);
-    std::ofstream ouf;
-    char oufn[20];
-    sprintf(oufn,"Frames/image%02d.ppm",i);
-    ouf.open(oufn, std::ios::out | std::ios::trunc);
-    ouf << "P6" << std::endl;
-    ouf << width << " " << height << std::endl;
-    ouf << 255 << std::endl;
-    ouf.close();
-    FILE *oufb = fopen(oufn, "ab");
-    fwrite(pixbuf.get(), width * 3, height, oufb);
-    fclose(oufb);
-    printf("Finished frame %d of 100\n",i);
+    if(video) {
+      video->write(scene.render(width, height));
+    } else {
+      char oufn[32];
+      snprintf(oufn,sizeof(oufn),"Frames/image%02d.png",i);
+      writer.write(scene.render(width, height),oufn);
+      writer.post([&journal,i]{journal->mark(i);});
+    }
+    //Progress goes to stderr, since stdout may be carrying the video
+    fprintf(stderr,"Finished frame %d of 100\n",i);
   }
+  writer.flush();
+  if(video) video->flush();
+  if(journal) journal->remove();
+  if(traceFile) kwantrace::Timeline::write(traceFile);
 }
@@ -7,6 +7,7 @@
 
 //System headers that are used in many places
 #include <memory> //for smart pointers
+#include <memory_resource> //for scene arenas
 #include <vector> //for collections
 
 //Eigen library, used in many places